@@ -0,0 +1,85 @@
+#!/bin/sh
+
+# Compare the compression codecs gmond can use on its tcp_accept_channel
+# (see "compression" in gmond.conf(5)) on a real XML dump.
+#
+# Usage: compression_bench.sh [host [port]]
+#        compression_bench.sh -f dump.xml
+#
+# Without -f the dump is fetched from a running gmond or gmetad
+# (default localhost:8649).  For each codec and level the script reports
+# the compressed size, the ratio and the CPU time needed to compress and
+# decompress the dump ROUNDS times (default 20).  Codecs whose command
+# line tool is not installed are skipped.
+
+ROUNDS=${ROUNDS:-20}
+TMPDIR=${TMPDIR:-/tmp}
+DUMP=$TMPDIR/gm_bench.$$.xml
+OUT=$TMPDIR/gm_bench.$$.out
+
+cleanup() {
+  rm -f "$DUMP" "$OUT"
+}
+trap cleanup EXIT
+
+if [ "$1" = "-f" ]
+then
+  [ -r "$2" ] || { echo "Cannot read $2"; exit 1; }
+  cp "$2" "$DUMP"
+else
+  HOST=${1:-localhost}
+  PORT=${2:-8649}
+  nc "$HOST" "$PORT" < /dev/null > "$DUMP"
+fi
+
+SIZE=`wc -c < "$DUMP"`
+if [ "$SIZE" -eq 0 ]
+then
+  echo "Empty dump, nothing to compare"
+  exit 1
+fi
+
+# CPU seconds (user + sys) used by ROUNDS runs of "$@", taken from the
+# children line of the shell's "times" builtin
+cputime() {
+  sh -c "i=0; while [ \$i -lt $ROUNDS ]; do $* > /dev/null; i=\`expr \$i + 1\`; done; times" \
+    | tail -1 | sed 's/[ms]/ /g' \
+    | awk '{ printf "%.3f", $1 * 60 + $2 + $3 * 60 + $4 }'
+}
+
+printf "Dump: %d bytes, %d rounds\n\n" "$SIZE" "$ROUNDS"
+printf "%-6s %5s %10s %8s %10s %10s\n" codec level bytes ratio comp_cpu decomp_cpu
+
+bench() {
+  codec=$1; level=$2; comp=$3; decomp=$4
+  $comp < "$DUMP" > "$OUT" || return
+  csize=`wc -c < "$OUT"`
+  ctime=`cputime "$comp < $DUMP"`
+  dtime=`cputime "$decomp < $OUT"`
+  printf "%-6s %5s %10d %8.1f %10s %10s\n" "$codec" "$level" "$csize" \
+    `echo "$SIZE $csize" | awk '{ print $1 / $2 }'` "$ctime" "$dtime"
+}
+
+if command -v gzip > /dev/null
+then
+  for level in 1 6 9
+  do
+    bench gzip $level "gzip -c -$level" "gzip -dc"
+  done
+fi
+
+if command -v zstd > /dev/null
+then
+  for level in 1 3 9 19
+  do
+    bench zstd $level "zstd -q -c -$level" "zstd -q -dc"
+  done
+fi
+
+if command -v lz4 > /dev/null
+then
+  for level in 1 9
+  do
+    bench lz4 $level "lz4 -q -c -$level" "lz4 -q -dc"
+  done
+fi
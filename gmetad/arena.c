@@ -0,0 +1,268 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "gmetad.h"
+#include "arena.h"
+
+/* Scratch comes off the end of the current block.  The blocks after it
+ * are always empty; when the current block is full we go on to the next
+ * one that fits, or add one, so once an arena has seen its largest
+ * document it only reuses blocks.
+ *
+ * The Expat side keeps freed blocks in lists by power of two size, with
+ * a header that says which arena and list a block goes back to.  Expat
+ * has no user pointer for its allocator, so the arena to allocate from
+ * is the one arena_bind() gave the thread.  Blocks above the largest
+ * size go to malloc() directly. */
+
+#define ARENA_ALIGN 16
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+#define POOL_MIN_SHIFT 5                /* 32 bytes. */
+#define POOL_CLASSES 16                 /* Up to 1MB. */
+#define POOL_LARGE POOL_CLASSES
+#define POOL_SIZE(c) ((size_t) 1 << (POOL_MIN_SHIFT + (c)))
+
+struct arena_block
+   {
+      struct arena_block *next;
+      size_t size;
+      size_t used;
+   };
+
+#define BLOCK_DATA(b) ((char *) (b) + ALIGN_UP(sizeof(struct arena_block)))
+
+typedef union
+   {
+      struct
+         {
+            arena_t *owner;
+            int class;
+         }
+      h;
+      char align[ARENA_ALIGN];
+   }
+pool_header_t;
+
+struct arena
+   {
+      size_t block_size;
+      struct arena_block *blocks;
+      struct arena_block *current;
+      pool_header_t *free[POOL_CLASSES];
+   };
+
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+static void
+arena_key_init(void)
+{
+   pthread_key_create(&arena_key, NULL);
+}
+
+arena_t *
+arena_create(size_t block_size)
+{
+   arena_t *arena;
+
+   arena = calloc(1, sizeof(*arena));
+   if (!arena)
+      return NULL;
+   arena->block_size = block_size;
+   return arena;
+}
+
+void
+arena_destroy(arena_t *arena)
+{
+   struct arena_block *b, *next;
+   pool_header_t *p, *pnext;
+   int i;
+
+   if (!arena)
+      return;
+   for (b = arena->blocks; b; b = next)
+      {
+         next = b->next;
+         free(b);
+      }
+   for (i = 0; i < POOL_CLASSES; i++)
+      for (p = arena->free[i]; p; p = pnext)
+         {
+            pnext = *(pool_header_t **) (p + 1);
+            free(p);
+         }
+   free(arena);
+}
+
+void *
+arena_alloc(arena_t *arena, size_t size)
+{
+   struct arena_block *b, *last = NULL;
+   void *p;
+
+   size = ALIGN_UP(size);
+   for (b = arena->current; b; b = b->next)
+      {
+         if (b->size - b->used >= size)
+            break;
+         last = b;
+      }
+   if (!b)
+      {
+         b = malloc(ALIGN_UP(sizeof(*b)) + (size > arena->block_size ?
+                                            size : arena->block_size));
+         if (!b)
+            err_quit("Out of memory for parse scratch");
+         b->next = NULL;
+         b->size = size > arena->block_size ? size : arena->block_size;
+         b->used = 0;
+         if (last)
+            last->next = b;
+         else
+            arena->blocks = b;
+      }
+   arena->current = b;
+   p = BLOCK_DATA(b) + b->used;
+   b->used += size;
+   return p;
+}
+
+char *
+arena_strdup(arena_t *arena, const char *s)
+{
+   size_t len = strlen(s) + 1;
+
+   return memcpy(arena_alloc(arena, len), s, len);
+}
+
+arena_mark_t
+arena_mark(arena_t *arena)
+{
+   arena_mark_t mark;
+
+   mark.block = arena->current;
+   mark.used = arena->current ? arena->current->used : 0;
+   return mark;
+}
+
+void
+arena_release(arena_t *arena, arena_mark_t mark)
+{
+   struct arena_block *b;
+
+   if (!mark.block)
+      {
+         arena_reset(arena);
+         return;
+      }
+   for (b = mark.block->next; b; b = b->next)
+      b->used = 0;
+   mark.block->used = mark.used;
+   arena->current = mark.block;
+}
+
+void
+arena_reset(arena_t *arena)
+{
+   struct arena_block *b;
+
+   for (b = arena->blocks; b; b = b->next)
+      b->used = 0;
+   arena->current = arena->blocks;
+}
+
+void
+arena_bind(arena_t *arena)
+{
+   pthread_once(&arena_key_once, arena_key_init);
+   pthread_setspecific(arena_key, arena);
+}
+
+static int
+pool_class(size_t size)
+{
+   int c;
+
+   for (c = 0; c < POOL_CLASSES; c++)
+      if (size <= POOL_SIZE(c))
+         return c;
+   return POOL_LARGE;
+}
+
+static void *
+pool_malloc(size_t size)
+{
+   arena_t *arena;
+   pool_header_t *p;
+   int c;
+
+   pthread_once(&arena_key_once, arena_key_init);
+   arena = pthread_getspecific(arena_key);
+   c = arena ? pool_class(size) : POOL_LARGE;
+
+   if (c < POOL_LARGE && arena->free[c])
+      {
+         p = arena->free[c];
+         arena->free[c] = *(pool_header_t **) (p + 1);
+         return p + 1;
+      }
+
+   p = malloc(sizeof(*p) + (c < POOL_LARGE ? POOL_SIZE(c) : size));
+   if (!p)
+      return NULL;
+   p->h.owner = arena;
+   p->h.class = c;
+   return p + 1;
+}
+
+static void
+pool_free(void *ptr)
+{
+   pool_header_t *p;
+
+   if (!ptr)
+      return;
+   p = (pool_header_t *) ptr - 1;
+   if (p->h.class == POOL_LARGE)
+      {
+         free(p);
+         return;
+      }
+   *(pool_header_t **) ptr = p->h.owner->free[p->h.class];
+   p->h.owner->free[p->h.class] = p;
+}
+
+static void *
+pool_realloc(void *ptr, size_t size)
+{
+   pool_header_t *p;
+   void *q;
+
+   if (!ptr)
+      return pool_malloc(size);
+   p = (pool_header_t *) ptr - 1;
+   if (p->h.class == POOL_LARGE)
+      {
+         p = realloc(p, sizeof(*p) + size);
+         return p ? p + 1 : NULL;
+      }
+   if (size <= POOL_SIZE(p->h.class))
+      return ptr;
+
+   q = pool_malloc(size);
+   if (!q)
+      return NULL;
+   memcpy(q, ptr, POOL_SIZE(p->h.class));
+   pool_free(ptr);
+   return q;
+}
+
+const XML_Memory_Handling_Suite arena_expat_memory =
+   { pool_malloc, pool_realloc, pool_free };
@@ -0,0 +1,43 @@
+#ifndef ARENA_H
+#define ARENA_H 1
+
+#include <stddef.h>
+#include <expat.h>
+
+/* The memory a thread parses its documents with, which it keeps from one
+ * document to the next, so that after the first few polls ingestion no
+ * longer goes to malloc() and a long running gmetad does not fragment
+ * the heap with short lived blocks.  There are two parts:
+ *
+ * - scratch for one document (names, METRIC_DEF templates), taken off
+ *   the end of a few large blocks and given back all at once;
+ * - free lists by size for the Expat parsers the thread reuses, which
+ *   free and allocate again as they are reset. */
+typedef struct arena arena_t;
+
+typedef struct
+   {
+      struct arena_block *block;
+      size_t used;
+   }
+arena_mark_t;
+
+arena_t *arena_create(size_t block_size);
+void arena_destroy(arena_t *arena);
+
+/* Scratch that lasts until the next arena_reset() or arena_release()
+ * before it.  Out of memory is fatal. */
+void *arena_alloc(arena_t *arena, size_t size);
+char *arena_strdup(arena_t *arena, const char *s);
+
+/* Gives back everything allocated since arena_mark(), or all of it. */
+arena_mark_t arena_mark(arena_t *arena);
+void arena_release(arena_t *arena, arena_mark_t mark);
+void arena_reset(arena_t *arena);
+
+/* Makes the parsers this thread creates with arena_expat_memory take
+ * their memory from arena.  Without one they use malloc(). */
+void arena_bind(arena_t *arena);
+extern const XML_Memory_Handling_Suite arena_expat_memory;
+
+#endif
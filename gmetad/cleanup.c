@@ -29,6 +29,7 @@
 
 #include "ganglia.h"
 #include "gmetad.h"
+#include "metric_index.h"
 
 #include "conf.h"
 #include "cmdline.h"
@@ -104,6 +105,8 @@ cleanup_node ( datum_t *key, datum_t *val, void *arg )
                            cleanup_metric, (void*)&cleanup)) {
 
       if (cleanup.key) {
+         if (node->indexed)
+            metric_index_remove(node->indexed, (char*) cleanup.key->data);
          cleanup.hashval = hashval(cleanup.key, node->metrics);
          rv=hash_delete(cleanup.key, node->metrics);
          if (rv) datum_free(rv);
@@ -166,6 +169,8 @@ cleanup_source ( datum_t *key, datum_t *val, void *arg )
          
          node = (Host_t *) cleanup.val->data;
          hash_destroy(node->metrics);
+         if (node->indexed)
+            metric_index_remove_host(node->indexed);
          
          cleanup.hashval = hashval(cleanup.key, source->authority);
          rv=hash_delete(cleanup.key, source->authority);
@@ -5,12 +5,43 @@
 #include "llist.h"
 
 #define MAX_RRAS 32
+#define MAX_SINKS 8
+
+/* Where write_rrds keeps metric values. */
+#define STORAGE_RRD  0
+#define STORAGE_TSDB 1
+
+/* What a sink does with a value when its queue is full. */
+typedef enum
+   {
+      SINK_BLOCK,
+      SINK_DROP,
+      SINK_SAMPLE
+   }
+sink_policy_t;
+
+/* A "sink" line; zero (or -1 for policy) keeps the sink's default. */
+typedef struct
+   {
+      char *name;
+      int queue_size;
+      int policy;
+      int threads;
+      int sample;
+   }
+sink_config_t;
+
 typedef struct
    {
       char *gridname;
       int xml_port;
       int interactive_port;
       int server_threads;
+      int server_max_clients;
+      int server_idle_timeout;
+      int server_output_limit;
+      int parse_threads;
+      int fast_xml;
       int umask;
       llist_entry *trusted_hosts;
       llist_entry *unsummarized_metrics;
@@ -18,6 +49,13 @@ typedef struct
       int should_setuid;
       char *setuid_username;
       char *rrd_rootdir;
+      int storage;
+      char *tsdb_rootdir;
+      int rrd_cache_flush;
+      int rrd_cache_values;
+      char *rrd_journal_dir;
+      int skip_stale_samples;
+      int sample_timestamps;
       char *carbon_server;
       int carbon_port;
       int carbon_timeout;
@@ -30,6 +68,11 @@ typedef struct
       char *RRAs[MAX_RRAS];
       int case_sensitive_hostnames;
       int shortest_step;
+      int compact_xml;
+      int metric_index;
+      int history_samples;
+      sink_config_t sinks[MAX_SINKS];
+      int num_sinks;
 } gmetad_config_t;
 
 int get_gmetad_config(char *conffile);
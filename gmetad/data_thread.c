@@ -6,7 +6,7 @@
 #include <sys/time.h>
 #include <gmetad.h>
 #include <string.h>
-#include <zlib.h>
+#include "gm_compress.h"
 
 #include <apr_time.h>
 
@@ -31,6 +31,7 @@ data_thread ( void *arg )
    /* This will grow as needed */
    unsigned int buf_size = 1024, read_index, read_available;
    struct pollfd struct_poll;
+   gm_codec_t codec;
    apr_time_t start, end;
    apr_interval_time_t sleep_time, elapsed;
    double random_factor;
@@ -132,13 +133,15 @@ data_thread ( void *arg )
                         {
                            if( (read_index + 1024) > buf_size )
                               {
-                                 /* We need to malloc more space for the data */
-                                 buf = realloc( buf, buf_size+1024 );
+                                 /* We need to malloc more space for the data.
+                                  * Doubling keeps large dumps from being copied
+                                  * over and over again. */
+                                 buf = realloc( buf, buf_size*2 );
                                  if(!buf)
                                     {
                                        err_quit("data_thread() unable to malloc enough room for [%s] XML", d->name);
                                     }
-                                 buf_size+=1024;
+                                 buf_size*=2;
                               }
                            if(ioctl(sock->sockfd, FIONREAD, &read_available) == -1)
                            {
@@ -147,7 +150,8 @@ data_thread ( void *arg )
                                  d->dead = 1;
                                  goto take_a_break;
                            }
-                           read_available = read_available > 1023 ? 1023 : read_available;
+                           if (read_available > buf_size - read_index - 1)
+                              read_available = buf_size - read_index - 1;
                            bytes_read = read(sock->sockfd, buf+read_index, read_available);
                            if (bytes_read < 0)
                               {
@@ -191,96 +195,35 @@ data_thread ( void *arg )
                   }
             }
 
-         /* These are the gzip header magic numbers, per RFC 1952 section 2.3.1 */
-         if(read_index > 2 && (unsigned char)buf[0] == 0x1f && (unsigned char)buf[1] == 0x8b)
-	   {
-	     /* Uncompress the buffer */
-	     int ret;
-	     z_stream strm;
-	     char * uncompressed;
-	     unsigned int write_index = 0;
-
-	     if( get_debug_msg_level() > 1 )
-	       {
-		 err_msg("GZIP compressed data for [%s] data source, %d bytes", d->name, read_index);
-	       }
-
-	     uncompressed = malloc(buf_size);
-	     if( !uncompressed )
-	       {
-		 err_quit("data_thread() unable to malloc enough room for [%s] GZIP", d->name);
-	       }
-
-	     strm.zalloc = NULL;
-	     strm.zfree = NULL;
-	     strm.opaque = NULL;
-	     strm.next_in  = (Bytef *)buf;
-	     strm.avail_in = read_index;
-
-	     /* Initialize the stream, 15 and 16 are magic numbers (gzip and max window size) */
-	     ret = inflateInit2(&strm, 15 + 16);
-	     if( ret != Z_OK )
-	       {
-		 err_msg("InflateInitError! for [%s] data source, failed to call inflateInit", d->name);
-		 d->dead = 1;
-
-		 free(buf);
-		 buf = uncompressed;
-		 goto take_a_break;
-	       }
-
-	     while (1)
-	       {
-		 /* Create more buffer space if needed */
-		 if ( (write_index + 2048) > buf_size)
-		   {
-		     buf_size += 2048;
-		     uncompressed = realloc(uncompressed, buf_size);
-		     if(!uncompressed)
-		       {
-			 err_quit("data_thread() unable to realloc enough room for [%s] GZIP", d->name) ;
-		       }
-		   }
-
-		 /* Do the inflate */
-		 strm.next_out  = (Bytef *)(uncompressed + write_index);
-		 strm.avail_out = buf_size - write_index - 1;
-
-		 ret = inflate(&strm, Z_FINISH);
-		 write_index = strm.total_out;
+         /* gzip, zstd and lz4 streams are told apart by their magic numbers */
+         codec = gm_codec_detect(buf, read_index);
+         if (codec != GM_CODEC_NONE)
+            {
+               char *uncompressed;
+               size_t uncompressed_len;
+               const char *errstr;
 
-		 if (ret == Z_OK || ret == Z_BUF_ERROR)
-		   {
-		     /* These are normal - just continue on */
-		     continue;
-		   }
-		 else if( ret == Z_STREAM_END )
-		   {
-		     /* We have finished, set things up for the XML parser */
-		     free (buf);
-		     buf = uncompressed;
-		     read_index = write_index;
-		     if(get_debug_msg_level() > 1)
-		       {
-			 err_msg("Uncompressed to %d bytes", read_index);
-		       }
-		     break;
-		   }
-		 else
-		   {
-		     /* Oh dear, something bad */
-		     inflateEnd(&strm);
+               if( get_debug_msg_level() > 1 )
+                  {
+                     err_msg("%s compressed data for [%s] data source, %d bytes", gm_codec_to_cstr(codec), d->name, read_index);
+                  }
 
-		     err_msg("InflateError! for [%s] data source, failed to call inflate (%s)", d->name, zError(ret));
-		     d->dead = 1;
+               if (gm_decompress(codec, buf, read_index, &uncompressed, &uncompressed_len, &errstr))
+                  {
+                     err_msg("Decompression error for [%s] data source (%s)", d->name, errstr);
+                     d->dead = 1;
+                     goto take_a_break;
+                  }
 
-		     free(buf);
-		     buf = uncompressed;
-		     goto take_a_break;
-		   }
-	       }
-	     inflateEnd(&strm);
-	   }
+               free(buf);
+               buf = uncompressed;
+               buf_size = uncompressed_len + 1;
+               read_index = uncompressed_len;
+               if(get_debug_msg_level() > 1)
+                  {
+                     err_msg("Uncompressed to %d bytes", read_index);
+                  }
+            }
 
          buf[read_index] = '\0';
 
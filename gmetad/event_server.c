@@ -0,0 +1,1148 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <sys/uio.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include "gmetad.h"
+#include "gm_compress.h"
+
+/* An event driven replacement for the blocking server threads.
+ *
+ * A single thread owns every client socket.  It accepts connections,
+ * reads the interactive request line and writes queued output, all
+ * without blocking.  Parsed requests are handed to a small pool of
+ * workers, which walk the tree and append the report to the client's
+ * output queue (xml_print() does this when client->conn is set).  A slow
+ * client therefore ties up memory instead of a thread.
+ *
+ * The output queued across all clients is bounded by server_output_limit.
+ * Workers never wait for it, since they hold tree locks while they write:
+ * above the limit, a client with more than its share of it unsent loses
+ * the rest of its report and the connection.
+ * server_max_clients bounds the number of open connections (further ones
+ * wait in the listen backlog) and server_idle_timeout closes clients that
+ * neither send a request nor read their data.
+ *
+ * The interactive port speaks HTTP/1.1 as well as the bare path protocol.
+ * HTTP connections stay open for further (and pipelined) requests, the
+ * report is compressed when the client accepts gzip or deflate, and the
+ * body is delimited by Content-Length when the whole report fits into
+ * one output chunk, by chunked transfer coding otherwise.
+ */
+
+#ifdef HAVE_SYS_EPOLL_H
+
+extern g_tcp_socket *server_socket;
+extern g_tcp_socket *interactive_socket;
+
+extern gmetad_config_t gmetad_config;
+
+extern int client_trusted (client_t *client, char *remote_ip);
+extern int serve_request (client_t *client, char *request, int interactive,
+                          const char *remote_ip);
+
+#define OUT_CHUNK_SIZE 16384
+/* Room for the HTTP response header and a chunk size line. */
+#define CHUNK_PREFIX_SIZE 320
+/* The request line and HTTP headers must fit in here. */
+#define INBUF_SIZE 8192
+#define MAX_EVENTS 256
+
+/* A chunk goes out as prefix, data and, for chunked transfer coding, a
+ * trailing CRLF. */
+struct out_chunk
+   {
+      struct out_chunk *next;
+      size_t len;       /* Bytes of data filled in. */
+      size_t off;       /* Bytes of prefix, data and suffix already sent. */
+      size_t prefixlen;
+      unsigned int framed:1;
+      unsigned int suffix:1;
+      char prefix[CHUNK_PREFIX_SIZE];
+      char data[OUT_CHUNK_SIZE];
+   };
+
+typedef enum
+   {
+      CONN_READING, /* Waiting for the request line. */
+      CONN_BUSY,    /* A worker is writing the report. */
+      CONN_DONE     /* The report is complete, sending what is left. */
+   }
+conn_state_t;
+
+/* How the end of a response is signalled. */
+typedef enum
+   {
+      FRAME_NONE,    /* Not HTTP; we close the connection. */
+      FRAME_CLOSE,   /* HTTP, but we close the connection. */
+      FRAME_LENGTH,  /* Content-Length. */
+      FRAME_CHUNKED  /* Transfer-Encoding: chunked. */
+   }
+framing_t;
+
+/* The lock protects the state, flags and output queue, which are shared
+ * between the event thread and a worker.  The socket, the timestamps and
+ * the list pointers belong to the event thread alone. */
+struct event_conn
+   {
+      pthread_mutex_t lock;
+      int fd;
+      int interactive;
+      conn_state_t state;
+      unsigned int dead:1;        /* Closed; the worker should give up. */
+      unsigned int on_ready:1;    /* Queued for the event thread. */
+      unsigned int polling_out:1; /* Waiting for the socket to drain. */
+      unsigned int failed:1;      /* serve_request() gave up. */
+      unsigned int keepalive:1;   /* Read another request afterwards. */
+      unsigned int header_done:1; /* The response header is queued. */
+      unsigned int ended:1;       /* The end of the response is queued. */
+      unsigned int overrun:1;     /* Over its output share; no more output. */
+      int http;                   /* 10 or 11 for HTTP/1.x requests. */
+      framing_t framing;
+      gm_codec_t codec;           /* Content-Encoding of the response. */
+      gm_compressor_t *compressor; /* Used by the worker only. */
+      struct out_chunk *head, *tail;
+      size_t queued;
+      time_t last_activity;
+      client_t client;
+      char remote_ip[16];
+      char request[REQUESTLEN + 1];
+      char in[INBUF_SIZE];        /* Unparsed input, maybe pipelined. */
+      int inlen;
+      struct event_conn *prev, *next; /* All open connections. */
+      struct event_conn *link;        /* Job queue or ready list. */
+   };
+
+struct listener
+   {
+      g_tcp_socket *socket;
+      int interactive;
+   };
+
+static struct listener listeners[2];
+static int epfd = -1;
+static int wake_pipe[2];
+
+/* Only touched by the event thread. */
+static struct event_conn *conns;
+static unsigned int nconns;
+static int accepting;
+/* Released during this round of events, freed after it.  Events for
+ * them may still be pending in the current batch. */
+static struct event_conn *graveyard;
+
+/* Parsed requests waiting for a worker. */
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static struct event_conn *job_head, *job_tail;
+
+/* Connections with new output or a finished report. */
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct event_conn *ready_head;
+
+/* Output queued across all connections, and what each connection may
+ * keep queued once that is over the limit. */
+static pthread_mutex_t pressure_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t queued_total, queued_limit, queued_share;
+
+
+static int
+set_nonblocking(int fd)
+{
+   int flags = fcntl(fd, F_GETFL, 0);
+   if (flags < 0)
+      return -1;
+   return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void
+wake_event_thread(void)
+{
+   int rval;
+   /* A full pipe already guarantees a wakeup. */
+   SYS_CALL(rval, write(wake_pipe[1], "", 1));
+}
+
+static void
+output_drained(size_t len)
+{
+   if (!len)
+      return;
+
+   pthread_mutex_lock(&pressure_lock);
+   queued_total -= len;
+   pthread_mutex_unlock(&pressure_lock);
+}
+
+/* Called by a worker that has just queued len bytes for a connection
+ * that now has own bytes unsent.  Returns nonzero if the server as a
+ * whole has too much unsent output and this connection more than its
+ * share of it.  The worker may hold tree locks, so it must not wait for
+ * the output to drain. */
+static int
+output_queued(size_t len, size_t own)
+{
+   int over;
+
+   pthread_mutex_lock(&pressure_lock);
+   queued_total += len;
+   over = queued_limit && queued_total > queued_limit && own > queued_share;
+   pthread_mutex_unlock(&pressure_lock);
+   return over;
+}
+
+/* Hands the connection to the event thread.  Call with conn->lock held. */
+static void
+conn_notify(struct event_conn *conn)
+{
+   if (conn->on_ready || conn->polling_out)
+      return;
+
+   conn->on_ready = 1;
+   pthread_mutex_lock(&ready_lock);
+   conn->link = ready_head;
+   ready_head = conn;
+   pthread_mutex_unlock(&ready_lock);
+   wake_event_thread();
+}
+
+static struct out_chunk *
+chunk_new(struct event_conn *conn)
+{
+   struct out_chunk *c = malloc(sizeof(struct out_chunk));
+
+   if (!c)
+      return NULL;
+   c->next = NULL;
+   c->len = c->off = c->prefixlen = 0;
+   c->framed = c->suffix = 0;
+   if (conn->tail)
+      conn->tail->next = c;
+   else
+      conn->head = c;
+   conn->tail = c;
+   return c;
+}
+
+/* Appends to the output queue.  The event thread is only told about
+ * full chunks (and the end of the report), so a fast client is not
+ * woken up for every line. */
+static int
+queue_append(void *arg, const char *buf, size_t len)
+{
+   struct event_conn *conn = (struct event_conn *) arg;
+   struct out_chunk *c;
+   size_t n, added = 0;
+   int rval = 0, filled = 0;
+
+   pthread_mutex_lock(&conn->lock);
+   if (conn->dead || conn->overrun)
+      {
+         pthread_mutex_unlock(&conn->lock);
+         return 1;
+      }
+
+   while (len)
+      {
+         c = conn->tail;
+         if (!c || c->len == OUT_CHUNK_SIZE)
+            {
+               filled |= (c != NULL);
+               c = chunk_new(conn);
+               if (!c)
+                  {
+                     err_msg("event_conn_write() unable to queue output for %s",
+                             conn->remote_ip);
+                     rval = 1;
+                     break;
+                  }
+            }
+         n = OUT_CHUNK_SIZE - c->len;
+         if (n > len)
+            n = len;
+         memcpy(c->data + c->len, buf, n);
+         c->len += n;
+         buf += n;
+         len -= n;
+         added += n;
+      }
+   conn->queued += added;
+   if (output_queued(added, conn->queued))
+      {
+         /* The worker stops at this error and the event thread closes
+          * the connection without sending the rest. */
+         err_msg("event_server dropping the report for %s: %lu bytes unsent "
+                 "with server_output_limit reached", conn->remote_ip,
+                 (unsigned long) conn->queued);
+         conn->overrun = 1;
+         rval = 1;
+      }
+   if (filled)
+      conn_notify(conn);
+   pthread_mutex_unlock(&conn->lock);
+
+   return rval;
+}
+
+/* xml_print() lands here for clients of the event server. */
+int
+event_conn_write(struct event_conn *conn, const char *buf, size_t len)
+{
+   if (conn->compressor)
+      return gm_compressor_write(conn->compressor, buf, len, queue_append, conn) != 0;
+   return queue_append(conn, buf, len);
+}
+
+static void
+set_events(int fd, void *ptr, uint32_t events)
+{
+   struct epoll_event ev;
+
+   ev.events = events;
+   ev.data.ptr = ptr;
+   if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev))
+      err_ret("event_server epoll_ctl(MOD) error");
+}
+
+static void
+set_accepting(int on)
+{
+   int i;
+
+   if (accepting == on)
+      return;
+   accepting = on;
+   for (i = 0; i < 2; i++)
+      set_events(listeners[i].socket->sockfd, &listeners[i], on ? EPOLLIN : 0);
+   if (!on)
+      debug_msg("event_server reached server_max_clients (%d), not accepting",
+                gmetad_config.server_max_clients);
+}
+
+static void
+conn_release(struct event_conn *conn)
+{
+   if (conn->prev)
+      conn->prev->next = conn->next;
+   else
+      conns = conn->next;
+   if (conn->next)
+      conn->next->prev = conn->prev;
+
+   conn->link = graveyard;
+   graveyard = conn;
+}
+
+static void
+bury_released(void)
+{
+   struct event_conn *conn;
+
+   while ((conn = graveyard))
+      {
+         graveyard = conn->link;
+         if (conn->client.defs)
+            hash_destroy(conn->client.defs);
+         pthread_mutex_destroy(&conn->lock);
+         free(conn);
+      }
+}
+
+/* Closes the socket and drops unsent output.  The connection itself goes
+ * away once neither a worker nor the ready list refers to it any more. */
+static void
+conn_close(struct event_conn *conn)
+{
+   struct out_chunk *c;
+   size_t dropped;
+   int release;
+
+   pthread_mutex_lock(&conn->lock);
+   conn->dead = 1;
+   conn->polling_out = 0;
+   if (conn->fd >= 0)
+      {
+         epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+         close(conn->fd);
+         conn->fd = -1;
+         nconns--;
+      }
+   while ((c = conn->head))
+      {
+         conn->head = c->next;
+         free(c);
+      }
+   conn->tail = NULL;
+   dropped = conn->queued;
+   conn->queued = 0;
+   release = conn->state != CONN_BUSY && !conn->on_ready;
+   pthread_mutex_unlock(&conn->lock);
+
+   output_drained(dropped);
+   if (release)
+      conn_release(conn);
+
+   if (nconns < gmetad_config.server_max_clients)
+      set_accepting(1);
+}
+
+static void
+conn_dispatch(struct event_conn *conn)
+{
+   if (conn->codec != GM_CODEC_NONE)
+      {
+         conn->compressor = gm_compressor_new(conn->codec, GM_CODEC_DEFAULT_LEVEL);
+         if (!conn->compressor)
+            conn->codec = GM_CODEC_NONE;
+      }
+
+   pthread_mutex_lock(&conn->lock);
+   conn->state = CONN_BUSY;
+   pthread_mutex_unlock(&conn->lock);
+
+   /* Only errors and hangups until there is output. */
+   set_events(conn->fd, conn, 0);
+
+   pthread_mutex_lock(&job_lock);
+   conn->link = NULL;
+   if (job_tail)
+      job_tail->link = conn;
+   else
+      job_head = conn;
+   job_tail = conn;
+   pthread_cond_signal(&job_cond);
+   pthread_mutex_unlock(&job_lock);
+}
+
+static int
+http_header(struct event_conn *conn, char *buf, size_t body)
+{
+   int len;
+
+   len = snprintf(buf, CHUNK_PREFIX_SIZE, "HTTP/1.%d 200 OK\r\n"
+                  "Server: gmetad/" GANGLIA_VERSION_FULL "\r\n"
+                  "Content-Type: application/xml\r\n"
+                  "Vary: Accept-Encoding\r\n",
+                  conn->http == 11);
+   if (conn->codec != GM_CODEC_NONE)
+      len += snprintf(buf + len, CHUNK_PREFIX_SIZE - len,
+                      "Content-Encoding: %s\r\n", gm_codec_to_cstr(conn->codec));
+   if (conn->framing == FRAME_LENGTH)
+      len += snprintf(buf + len, CHUNK_PREFIX_SIZE - len,
+                      "Content-Length: %lu\r\n", (unsigned long) body);
+   else if (conn->framing == FRAME_CHUNKED)
+      len += snprintf(buf + len, CHUNK_PREFIX_SIZE - len,
+                      "Transfer-Encoding: chunked\r\n");
+   if (!conn->keepalive)
+      len += snprintf(buf + len, CHUNK_PREFIX_SIZE - len, "Connection: close\r\n");
+   else if (conn->http == 10)
+      len += snprintf(buf + len, CHUNK_PREFIX_SIZE - len, "Connection: keep-alive\r\n");
+   len += snprintf(buf + len, CHUNK_PREFIX_SIZE - len, "\r\n");
+   return len;
+}
+
+/* Puts the HTTP header and chunk framing around the output that is ready
+ * to go.  The framing is decided when the first chunk is: a report that
+ * is complete by then gets a Content-Length.  Call with conn->lock held. */
+static int
+http_frame(struct event_conn *conn)
+{
+   struct out_chunk *c;
+   int done = conn->state == CONN_DONE;
+   size_t body = 0;
+
+   if (!conn->http || conn->ended)
+      return 0;
+   if (!done && (!conn->head || conn->head == conn->tail))
+      return 0;
+   if (!conn->head && !chunk_new(conn))
+      return 1;
+
+   if (!conn->header_done)
+      {
+         if (done)
+            {
+               conn->framing = FRAME_LENGTH;
+               for (c = conn->head; c; c = c->next)
+                  body += c->len;
+            }
+         else if (conn->keepalive && conn->http == 11)
+            conn->framing = FRAME_CHUNKED;
+         else
+            {
+               conn->framing = FRAME_CLOSE;
+               conn->keepalive = 0;
+            }
+         conn->head->prefixlen = http_header(conn, conn->head->prefix, body);
+         conn->header_done = 1;
+      }
+
+   if (conn->framing == FRAME_CHUNKED)
+      {
+         for (c = conn->head; c && (c != conn->tail || done); c = c->next)
+            {
+               if (c->framed)
+                  continue;
+               c->framed = 1;
+               if (c->len)
+                  {
+                     c->prefixlen += sprintf(c->prefix + c->prefixlen, "%lx\r\n",
+                                             (unsigned long) c->len);
+                     c->suffix = 1;
+                  }
+            }
+         if (done)
+            {
+               c = chunk_new(conn);
+               if (!c)
+                  return 1;
+               c->prefixlen = sprintf(c->prefix, "0\r\n\r\n");
+               c->framed = 1;
+            }
+      }
+   conn->ended = done;
+   return 0;
+}
+
+static int
+chunk_iov(struct out_chunk *c, struct iovec *iov)
+{
+   char *base[3];
+   size_t len[3], off = c->off;
+   int i, n = 0;
+
+   base[0] = c->prefix;
+   len[0] = c->prefixlen;
+   base[1] = c->data;
+   len[1] = c->len;
+   base[2] = "\r\n";
+   len[2] = c->suffix ? 2 : 0;
+
+   for (i = 0; i < 3; i++)
+      {
+         if (off >= len[i])
+            {
+               off -= len[i];
+               continue;
+            }
+         iov[n].iov_base = base[i] + off;
+         iov[n].iov_len = len[i] - off;
+         off = 0;
+         n++;
+      }
+   return n;
+}
+
+static void conn_parse(struct event_conn *conn, int eof, time_t now);
+
+/* Gets the connection ready for the next request of a persistent
+ * HTTP connection. */
+static void
+conn_next_request(struct event_conn *conn, time_t now)
+{
+   pthread_mutex_lock(&conn->lock);
+   conn->state = CONN_READING;
+   conn->polling_out = 0;
+   conn->header_done = conn->ended = 0;
+   conn->framing = FRAME_NONE;
+   pthread_mutex_unlock(&conn->lock);
+
+   conn->last_activity = now;
+   set_events(conn->fd, conn, EPOLLIN);
+
+   /* A pipelined request may be waiting already. */
+   if (conn->inlen)
+      conn_parse(conn, 0, now);
+}
+
+/* Sends as much queued output as the socket takes. */
+static void
+conn_flush(struct event_conn *conn, time_t now)
+{
+   struct out_chunk *c;
+   struct iovec iov[3];
+   size_t sent = 0;
+   int rval, n, done = 0, next = 0;
+
+   pthread_mutex_lock(&conn->lock);
+   if (conn->state == CONN_DONE && conn->failed)
+      done = 1;
+   else if (http_frame(conn))
+      {
+         err_msg("event_server unable to frame the response for %s", conn->remote_ip);
+         done = 1;
+      }
+
+   while (!done && !conn->dead && (c = conn->head)
+          && (c != conn->tail || conn->state == CONN_DONE)
+          && (!conn->http || conn->header_done))
+      {
+         n = chunk_iov(c, iov);
+         if (n)
+            {
+               SYS_CALL(rval, writev(conn->fd, iov, n));
+               if (rval < 0)
+                  {
+                     if (errno != EAGAIN && errno != EWOULDBLOCK)
+                        {
+                           debug_msg("event_server write() to %s failed: %s",
+                                     conn->remote_ip, strerror(errno));
+                           done = 1;
+                        }
+                     break;
+                  }
+               c->off += rval;
+               conn->last_activity = now;
+               if (c->off < c->prefixlen + c->len + (c->suffix ? 2 : 0))
+                  continue;
+            }
+         conn->head = c->next;
+         if (!conn->head)
+            conn->tail = NULL;
+         sent += c->len;
+         free(c);
+      }
+   conn->queued -= sent;
+
+   if (conn->dead)
+      done = 1;
+   else if (done)
+      ;
+   else if (conn->head && (conn->head != conn->tail || conn->state == CONN_DONE))
+      {
+         /* The socket is full. */
+         if (!conn->polling_out)
+            {
+               conn->polling_out = 1;
+               set_events(conn->fd, conn, EPOLLOUT);
+            }
+      }
+   else if (conn->state == CONN_DONE)
+      {
+         if (conn->keepalive)
+            next = 1;
+         else
+            done = 1;
+      }
+   else if (conn->polling_out)
+      {
+         /* The worker notifies us again when it has more. */
+         conn->polling_out = 0;
+         set_events(conn->fd, conn, 0);
+      }
+   pthread_mutex_unlock(&conn->lock);
+
+   output_drained(sent);
+   if (done)
+      conn_close(conn);
+   else if (next)
+      conn_next_request(conn, now);
+}
+
+/* Returns 10 or 11 if line is an HTTP/1.x GET request, 0 otherwise. */
+static int
+http_version(const char *line, size_t len)
+{
+   if (len < 12 || memcmp(line, "GET ", 4))
+      return 0;
+   if (!memcmp(line + len - 9, " HTTP/1.1", 9))
+      return 11;
+   if (!memcmp(line + len - 9, " HTTP/1.0", 9))
+      return 10;
+   return 0;
+}
+
+/* Returns nonzero if the comma separated header value lists token
+ * without a q=0 weight. */
+static int
+header_has_token(const char *value, size_t len, const char *token)
+{
+   const char *p = value, *end = value + len, *next, *semi;
+   size_t toklen = strlen(token), n;
+
+   while (p < end)
+      {
+         next = memchr(p, ',', end - p);
+         if (!next)
+            next = end;
+         while (p < next && (*p == ' ' || *p == '\t'))
+            p++;
+         semi = memchr(p, ';', next - p);
+         n = (semi ? semi : next) - p;
+         while (n && (p[n - 1] == ' ' || p[n - 1] == '\t'))
+            n--;
+         if (n == toklen && !strncasecmp(p, token, n))
+            {
+               if (semi)
+                  {
+                     const char *q = semi + 1;
+                     while (q < next && (*q == ' ' || *q == '\t'))
+                        q++;
+                     if (next - q >= 2 && !strncasecmp(q, "q=", 2)
+                         && strtod(q + 2, NULL) <= 0)
+                        return 0;
+                  }
+               return 1;
+            }
+         p = next + 1;
+      }
+   return 0;
+}
+
+static void
+http_headers(struct event_conn *conn, const char *p, const char *end)
+{
+   const char *eol, *value;
+   int close = 0, keepalive = 0, gzip = 0, deflate = 0;
+   size_t namelen, len;
+
+   for (; p < end; p = eol + 1)
+      {
+         eol = memchr(p, '\n', end - p);
+         if (!eol)
+            eol = end;
+         value = memchr(p, ':', eol - p);
+         if (!value)
+            continue;
+         namelen = value - p;
+         value++;
+         len = eol - value;
+         if (len && value[len - 1] == '\r')
+            len--;
+
+         if (namelen == 10 && !strncasecmp(p, "Connection", 10))
+            {
+               close |= header_has_token(value, len, "close");
+               keepalive |= header_has_token(value, len, "keep-alive");
+            }
+         else if (namelen == 15 && !strncasecmp(p, "Accept-Encoding", 15))
+            {
+               gzip |= header_has_token(value, len, "gzip")
+                  || header_has_token(value, len, "*");
+               deflate |= header_has_token(value, len, "deflate");
+            }
+      }
+
+   conn->keepalive = !close && (conn->http == 11 || keepalive);
+   if (gzip)
+      conn->codec = GM_CODEC_GZIP;
+   else if (deflate)
+      conn->codec = GM_CODEC_DEFLATE;
+   else
+      conn->codec = GM_CODEC_NONE;
+}
+
+/* Looks for a complete request at the start of the input buffer and
+ * hands it to a worker.  The bare protocol is a single line; an HTTP
+ * request line is followed by headers up to an empty line. */
+static void
+conn_parse(struct event_conn *conn, int eof, time_t now)
+{
+   char *in = conn->in, *end = conn->in + conn->inlen;
+   char *eol, *cr, *p, *hdr_end = NULL;
+   size_t linelen, consumed;
+
+   eol = memchr(in, '\n', conn->inlen);
+   cr = memchr(in, '\r', conn->inlen);
+   if (cr && (!eol || cr < eol))
+      eol = cr;
+
+   if (!eol)
+      {
+         /* Like readline(), take what we have at EOF. */
+         if (eof && conn->inlen && !http_version(in, conn->inlen))
+            eol = end;
+         else if (eof || conn->inlen >= REQUESTLEN)
+            {
+               if (conn->inlen)
+                  err_msg("server_thread() could not read request from %s", conn->remote_ip);
+               conn_close(conn);
+            }
+         if (!eol)
+            return;
+      }
+
+   linelen = eol - in;
+   if (linelen > REQUESTLEN)
+      {
+         err_msg("server_thread() could not read request from %s", conn->remote_ip);
+         conn_close(conn);
+         return;
+      }
+
+   conn->http = http_version(in, linelen);
+   if (conn->http)
+      {
+         /* Find the empty line that ends the headers. */
+         p = eol;
+         while (p < end)
+            {
+               if (*p == '\r' && p + 1 < end && p[1] == '\n')
+                  p += 2;
+               else
+                  p++;
+               if (p < end && (*p == '\r' || *p == '\n'))
+                  {
+                     hdr_end = p;
+                     break;
+                  }
+               p = memchr(p, '\n', end - p);
+               if (!p)
+                  break;
+            }
+         if (!hdr_end || (*hdr_end == '\r' && hdr_end + 1 == end))
+            {
+               if (eof || conn->inlen == INBUF_SIZE)
+                  {
+                     err_msg("server_thread() could not read request from %s", conn->remote_ip);
+                     conn_close(conn);
+                  }
+               return;
+            }
+         http_headers(conn, eol, hdr_end);
+         consumed = hdr_end - in + (*hdr_end == '\r' ? 2 : 1);
+      }
+   else
+      {
+         /* The bare protocol answers one request and closes. */
+         conn->keepalive = 0;
+         conn->codec = GM_CODEC_NONE;
+         consumed = conn->inlen;
+      }
+
+   memcpy(conn->request, in, linelen);
+   conn->request[linelen] = 0;
+   conn->inlen -= consumed;
+   memmove(in, in + consumed, conn->inlen);
+
+   conn->failed = 0;
+   conn_dispatch(conn);
+}
+
+/* Reads the interactive request. */
+static void
+conn_read(struct event_conn *conn, time_t now)
+{
+   int rval;
+
+   SYS_CALL(rval, read(conn->fd, conn->in + conn->inlen, INBUF_SIZE - conn->inlen));
+   if (rval < 0)
+      {
+         if (errno != EAGAIN && errno != EWOULDBLOCK)
+            conn_close(conn);
+         return;
+      }
+   conn->last_activity = now;
+   conn->inlen += rval;
+
+   conn_parse(conn, rval == 0, now);
+}
+
+static void
+accept_clients(struct listener *l, time_t now)
+{
+   struct event_conn *conn;
+   struct epoll_event ev;
+   struct sockaddr_in addr;
+   socklen_t len;
+   int fd;
+
+   while (accepting)
+      {
+         if (nconns >= gmetad_config.server_max_clients)
+            {
+               set_accepting(0);
+               break;
+            }
+
+         len = sizeof(addr);
+         SYS_CALL(fd, accept(l->socket->sockfd, (struct sockaddr *) &addr, &len));
+         if (fd < 0)
+            {
+               if (errno != EAGAIN && errno != EWOULDBLOCK)
+                  err_ret("event_server accept() error");
+               break;
+            }
+
+         conn = calloc(1, sizeof(struct event_conn));
+         if (!conn)
+            {
+               err_msg("event_server unable to malloc client data");
+               close(fd);
+               break;
+            }
+         pthread_mutex_init(&conn->lock, NULL);
+         conn->fd = fd;
+         conn->interactive = l->interactive;
+         conn->state = CONN_READING;
+         conn->last_activity = now;
+         conn->client.fd = fd;
+         conn->client.conn = conn;
+         conn->client.addr = addr;
+         conn->client.valid = client_trusted(&conn->client, conn->remote_ip);
+
+         if (!conn->client.valid || set_nonblocking(fd))
+            {
+               debug_msg("server_thread() %s tried to connect and is not a trusted host",
+                         conn->remote_ip);
+               close(fd);
+               pthread_mutex_destroy(&conn->lock);
+               free(conn);
+               continue;
+            }
+
+         ev.events = conn->interactive ? EPOLLIN : 0;
+         ev.data.ptr = conn;
+         if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev))
+            {
+               err_ret("event_server epoll_ctl(ADD) error");
+               close(fd);
+               pthread_mutex_destroy(&conn->lock);
+               free(conn);
+               continue;
+            }
+
+         conn->next = conns;
+         if (conns)
+            conns->prev = conn;
+         conns = conn;
+         nconns++;
+
+         /* The xml_port has nothing to read. */
+         if (!conn->interactive)
+            conn_dispatch(conn);
+      }
+}
+
+static void
+process_ready(time_t now)
+{
+   struct event_conn *list, *conn;
+   char drain[256];
+   int rval, release;
+
+   SYS_CALL(rval, read(wake_pipe[0], drain, sizeof(drain)));
+
+   pthread_mutex_lock(&ready_lock);
+   list = ready_head;
+   ready_head = NULL;
+   pthread_mutex_unlock(&ready_lock);
+
+   while ((conn = list))
+      {
+         list = conn->link;
+
+         pthread_mutex_lock(&conn->lock);
+         conn->on_ready = 0;
+         release = conn->dead && conn->state != CONN_BUSY;
+         pthread_mutex_unlock(&conn->lock);
+
+         if (release)
+            conn_release(conn);
+         else if (conn->fd >= 0)
+            conn_flush(conn, now);
+      }
+}
+
+static void
+close_idle_clients(time_t now)
+{
+   struct event_conn *conn, *next;
+   int idle;
+
+   if (gmetad_config.server_idle_timeout <= 0)
+      return;
+
+   for (conn = conns; conn; conn = next)
+      {
+         next = conn->next;
+         if (conn->fd < 0 || now - conn->last_activity < gmetad_config.server_idle_timeout)
+            continue;
+
+         /* Clients waiting on a worker are not idle. */
+         pthread_mutex_lock(&conn->lock);
+         idle = conn->state == CONN_READING || conn->polling_out;
+         pthread_mutex_unlock(&conn->lock);
+
+         if (idle)
+            {
+               debug_msg("event_server closing idle connection from %s", conn->remote_ip);
+               conn_close(conn);
+            }
+      }
+}
+
+static void *
+event_worker(void *arg)
+{
+   struct event_conn *conn;
+   int rval;
+
+   for (;;)
+      {
+         pthread_mutex_lock(&job_lock);
+         while (!job_head)
+            pthread_cond_wait(&job_cond, &job_lock);
+         conn = job_head;
+         job_head = conn->link;
+         if (!job_head)
+            job_tail = NULL;
+         pthread_mutex_unlock(&job_lock);
+
+         rval = serve_request(&conn->client, conn->request, conn->interactive,
+                              conn->remote_ip);
+
+         if (conn->compressor)
+            {
+               if (!rval && gm_compressor_finish(conn->compressor, queue_append, conn))
+                  rval = 1;
+               gm_compressor_free(conn->compressor);
+               conn->compressor = NULL;
+            }
+
+         pthread_mutex_lock(&conn->lock);
+         conn->state = CONN_DONE;
+         conn->failed = rval != 0 || conn->overrun;
+         conn_notify(conn);
+         pthread_mutex_unlock(&conn->lock);
+      }
+   return NULL;
+}
+
+static void *
+event_thread(void *arg)
+{
+   struct epoll_event events[MAX_EVENTS];
+   struct event_conn *conn;
+   time_t now, last_scan = 0;
+   int i, n;
+
+   for (;;)
+      {
+         n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+         if (n < 0 && errno != EINTR)
+            err_ret("event_server epoll_wait() error");
+         now = time(NULL);
+
+         for (i = 0; i < n; i++)
+            {
+               void *ptr = events[i].data.ptr;
+
+               if (ptr == &listeners[0] || ptr == &listeners[1])
+                  {
+                     accept_clients((struct listener *) ptr, now);
+                     continue;
+                  }
+               if (ptr == wake_pipe)
+                  {
+                     process_ready(now);
+                     continue;
+                  }
+
+               conn = (struct event_conn *) ptr;
+               if (conn->fd < 0)
+                  continue;
+               if (events[i].events & (EPOLLERR | EPOLLHUP))
+                  conn_close(conn);
+               else if (events[i].events & EPOLLOUT)
+                  conn_flush(conn, now);
+               else if (events[i].events & EPOLLIN)
+                  conn_read(conn, now);
+            }
+
+         if (now != last_scan)
+            {
+               close_idle_clients(now);
+               last_scan = now;
+            }
+         bury_released();
+      }
+   return NULL;
+}
+
+/* Returns 0 if the event server is up, nonzero if the caller should
+ * fall back to server_thread(). */
+int
+event_server_start(gmetad_config_t *c)
+{
+   pthread_t pid;
+   pthread_attr_t attr;
+   struct epoll_event ev;
+   int i;
+
+   epfd = epoll_create(1024);
+   if (epfd < 0)
+      {
+         err_ret("event_server epoll_create() error");
+         return 1;
+      }
+   if (pipe(wake_pipe) || set_nonblocking(wake_pipe[0]) || set_nonblocking(wake_pipe[1]))
+      {
+         err_ret("event_server pipe() error");
+         close(epfd);
+         return 1;
+      }
+
+   listeners[0].socket = server_socket;
+   listeners[0].interactive = 0;
+   listeners[1].socket = interactive_socket;
+   listeners[1].interactive = 1;
+   accepting = 1;
+
+   for (i = 0; i < 2; i++)
+      {
+         if (set_nonblocking(listeners[i].socket->sockfd))
+            err_quit("event_server unable to make the listening socket non-blocking");
+         ev.events = EPOLLIN;
+         ev.data.ptr = &listeners[i];
+         if (epoll_ctl(epfd, EPOLL_CTL_ADD, listeners[i].socket->sockfd, &ev))
+            err_quit("event_server epoll_ctl(ADD) error on a listening socket");
+      }
+   ev.events = EPOLLIN;
+   ev.data.ptr = wake_pipe;
+   if (epoll_ctl(epfd, EPOLL_CTL_ADD, wake_pipe[0], &ev))
+      err_quit("event_server epoll_ctl(ADD) error on the wakeup pipe");
+
+   queued_limit = (size_t) c->server_output_limit * 1024 * 1024;
+   queued_share = queued_limit / (c->server_max_clients > 0 ? c->server_max_clients : 1);
+
+   pthread_attr_init( &attr );
+   pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+
+   for (i = 0; i < c->server_threads; i++)
+      pthread_create(&pid, &attr, event_worker, NULL);
+   pthread_create(&pid, &attr, event_thread, NULL);
+
+   debug_msg("event server started with %d worker threads", c->server_threads);
+   return 0;
+}
+
+#else /* HAVE_SYS_EPOLL_H */
+
+int
+event_conn_write(struct event_conn *conn, const char *buf, size_t len)
+{
+   return 1;
+}
+
+int
+event_server_start(gmetad_config_t *c)
+{
+   return 1;
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
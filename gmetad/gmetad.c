@@ -16,6 +16,8 @@
 #include "update_pidfile.h"
 
 #include "rrd_helpers.h"
+#include "sink.h"
+#include "gm_number.h"
 
 #define METADATA_SLEEP_RANDOMIZE 5.0
 #define METADATA_MINIMUM_SLEEP 1
@@ -34,6 +36,7 @@ pthread_mutex_t  server_interactive_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 extern void *data_thread ( void *arg );
 extern void* server_thread(void *);
+extern int event_server_start(gmetad_config_t *c);
 extern int parse_config_file ( char *config_file );
 extern int number_of_datasources ( char *config_file );
 extern struct type_tag* in_type_list (char *, unsigned int);
@@ -128,92 +131,257 @@ zero_out_summary(datum_t *key, datum_t *val, void *arg)
 }
 
 
-/* Sums the metric summaries from all data sources. */
-static int
-sum_metrics(datum_t *key, datum_t *val, void *arg)
+/* The root summary is kept up to date a source at a time.  Each source
+ * remembers, in its root_share, what it last added to the root summary
+ * for every metric.  When the source finishes a cycle it adds the
+ * difference between its new sums and those, so the root summary costs
+ * work in proportion to what changed rather than a pass over every
+ * metric of every source, and the root lock is only held meanwhile. */
+
+#define SHARE_HASH_MIN 256
+
+typedef struct share_entry
+   {
+      struct share_entry *next;
+      double val;
+      uint32_t num;
+      unsigned int cycle;   /* The last cycle the source had the metric. */
+      char name[1];
+   }
+share_entry_t;
+
+struct root_share
+   {
+      pthread_mutex_t lock;   /* Against retract_dead_source(). */
+      share_entry_t **table;
+      unsigned int size;
+      unsigned int count;
+      unsigned int cycle;
+      uint32_t hosts_up;
+      uint32_t hosts_down;
+   };
+
+typedef struct
+   {
+      struct root_share *share;
+      Metric_t *metric;      /* The source's, as a template for a new one. */
+      size_t size;
+      double val;
+      uint32_t num;
+   }
+share_delta_t;
+
+struct root_share *
+root_share_new(void)
 {
-   datum_t *hash_datum, *rdatum;
-   Metric_t *rootmetric, *metric;
-   char *type;
-   struct type_tag *tt;
-   int do_sum = 1;
+   struct root_share *share = calloc(1, sizeof(*share));
 
-   metric = (Metric_t *) val->data;
-   type = getfield(metric->strings, metric->type);
+   if (!share)
+      return NULL;
+   pthread_mutex_init(&share->lock, NULL);
+   return share;
+}
+
+static unsigned int
+share_hash(const char *s)
+{
+   unsigned int h = 2166136261u;
 
-   hash_datum = hash_lookup(key, root.metric_summary);
-   if (!hash_datum)
+   while (*s)
       {
-         hash_datum = datum_new((char*) metric, val->size);
-         do_sum = 0;
+         h ^= (unsigned char) *s++;
+         h *= 16777619;
       }
-   rootmetric = (Metric_t*) hash_datum->data;
+   return h;
+}
 
-   if (do_sum)
+static share_entry_t *
+share_entry(struct root_share *share, const char *name)
+{
+   share_entry_t *e, *next, **table;
+   unsigned int h, i, size;
+
+   if (share->count >= share->size)
       {
-         tt = in_type_list(type, strlen(type));
-         if (!tt) {
-            datum_free(hash_datum);
-            return 0;
-	 }
-
-         /* We sum everything in double to properly combine integer sources
-            (3.0) with float sources (3.1).  This also avoids wraparound
-            errors: for example memory KB exceeding 4TB. */
-         switch (tt->type)
-            {
-               case INT:
-               case UINT:
-               case FLOAT:
-                  rootmetric->val.d += metric->val.d;
-                  break;
-               default:
-                  break;
-            }
-         rootmetric->num += metric->num;
+         size = share->size ? share->size * 2 : SHARE_HASH_MIN;
+         table = calloc(size, sizeof(*table));
+         if (!table)
+            return NULL;
+         for (i = 0; i < share->size; i++)
+            for (e = share->table[i]; e; e = next)
+               {
+                  next = e->next;
+                  h = share_hash(e->name) & (size - 1);
+                  e->next = table[h];
+                  table[h] = e;
+               }
+         free(share->table);
+         share->table = table;
+         share->size = size;
       }
 
-   rdatum = hash_insert(key, hash_datum, root.metric_summary);
-
-   datum_free(hash_datum);
+   h = share_hash(name) & (share->size - 1);
+   for (e = share->table[h]; e; e = e->next)
+      if (!strcmp(e->name, name))
+         return e;
+
+   e = calloc(1, sizeof(*e) + strlen(name));
+   if (!e)
+      return NULL;
+   strcpy(e->name, name);
+   e->next = share->table[h];
+   share->table[h] = e;
+   share->count++;
+   return e;
+}
 
-   if (!rdatum)
-      return 1;
-   else
-      return 0;
+/* Adds a difference to the root's copy of a metric, in place. */
+static int
+apply_delta(datum_t *key, datum_t *val, void *arg)
+{
+   share_delta_t *d = (share_delta_t *) arg;
+   Metric_t *rootmetric = (Metric_t *) val->data;
+
+   rootmetric->val.d += d->val;
+   rootmetric->num += d->num;
+   /* Don't leave rounding residue once no host has the metric. */
+   if (!rootmetric->num)
+      rootmetric->val.d = 0;
+   return 0;
 }
 
+/* Changes the root summary of metric name by d.  Called with
+ * root.sum_finished held. */
+static void
+root_summary_add(const char *name, share_delta_t *d)
+{
+   datum_t key, val;
+   Metric_t *rootmetric;
+
+   key.data = (void *) name;
+   key.size = strlen(name) + 1;
+   if (hash_update(&key, root.metric_summary, apply_delta, d) >= 0 || !d->metric)
+      return;
+
+   /* New to the root: start from the source's metric. */
+   rootmetric = malloc(d->size);
+   if (!rootmetric)
+      return;
+   memcpy(rootmetric, d->metric, d->size);
+   rootmetric->val.d = d->val;
+   rootmetric->num = d->num;
+   val.data = rootmetric;
+   val.size = d->size;
+   if (!hash_insert(&key, &val, root.metric_summary))
+      err_msg("Could not insert %s into the root summary", name);
+   free(rootmetric);
+}
 
-/* Sums the metric summaries from all data sources. */
 static int
-do_root_summary( datum_t *key, datum_t *val, void *arg )
+publish_metric(datum_t *key, datum_t *val, void *arg)
 {
-   Source_t *source = (Source_t*) val->data;
-   int rc;
-   llist_entry *le;
+   share_delta_t *d = (share_delta_t *) arg;
+   Metric_t *metric = (Metric_t *) val->data;
+   share_entry_t *e;
 
-   /* We skip dead sources. */
-   if (source->ds->dead)
+   e = share_entry(d->share, (char *) key->data);
+   if (!e)
       return 0;
-
-   /* We skip metrics not to be summarized. */
-   if (llist_search(&(gmetad_config.unsummarized_metrics), (void *)key->data, llist_strncmp, &le) == 0)
+   e->cycle = d->share->cycle;
+   if (metric->val.d == e->val && metric->num == e->num)
       return 0;
 
-   /* Need to be sure the source has a complete sum for its metrics. */
-   pthread_mutex_lock(source->sum_finished);
+   d->metric = metric;
+   d->size = val->size;
+   d->val = metric->val.d - e->val;
+   d->num = metric->num - e->num;
+   root_summary_add((char *) key->data, d);
+   e->val = metric->val.d;
+   e->num = metric->num;
+   return 0;
+}
+
+/* Takes back what a source added for the metrics it no longer has, or
+ * for all of them. */
+static void
+share_retract(struct root_share *share, int all)
+{
+   share_entry_t *e, **ep;
+   share_delta_t d;
+   unsigned int i;
+
+   memset(&d, 0, sizeof(d));
+   for (i = 0; i < share->size; i++)
+      for (ep = &share->table[i]; (e = *ep); )
+         {
+            if (!all && e->cycle == share->cycle)
+               {
+                  ep = &e->next;
+                  continue;
+               }
+            d.val = -e->val;
+            d.num = -e->num;
+            if (d.val || d.num)
+               root_summary_add(e->name, &d);
+            *ep = e->next;
+            share->count--;
+            free(e);
+         }
+
+   root.hosts_up -= share->hosts_up;
+   root.hosts_down -= share->hosts_down;
+   share->hosts_up = share->hosts_down = 0;
+}
+
+/* Brings the root summary up to date with a source that has finished a
+ * cycle.  Called with the source's sum_finished held. */
+void
+root_summary_publish(Source_t *source)
+{
+   struct root_share *share = source->share;
+   share_delta_t d;
+
+   if (!share)
+      return;
+   memset(&d, 0, sizeof(d));
+   d.share = share;
 
-   /* We know that all these metrics are numeric. */
-   rc = hash_foreach(source->metric_summary, sum_metrics, arg);
+   pthread_mutex_lock(&share->lock);
+   pthread_mutex_lock(root.sum_finished);
+   share->cycle++;
+   hash_foreach(source->metric_summary, publish_metric, &d);
+   share_retract(share, 0);
 
-   /* Update the top level root source */
    root.hosts_up += source->hosts_up;
    root.hosts_down += source->hosts_down;
+   share->hosts_up = source->hosts_up;
+   share->hosts_down = source->hosts_down;
+   pthread_mutex_unlock(root.sum_finished);
+   pthread_mutex_unlock(&share->lock);
+}
+
+/* A dead source no longer counts towards the root summary; it is added
+ * back the next time it reports. */
+static int
+retract_dead_source( datum_t *key, datum_t *val, void *arg )
+{
+   Source_t *source = (Source_t*) val->data;
+   struct root_share *share = source->share;
 
-   /* summary completed for source */
-   pthread_mutex_unlock(source->sum_finished);
+   if (!source->ds->dead || !share)
+      return 0;
 
-   return rc;
+   pthread_mutex_lock(&share->lock);
+   if (share->count || share->hosts_up || share->hosts_down)
+      {
+         debug_msg("Taking dead source %s out of the root summary",
+                   (char *) key->data);
+         pthread_mutex_lock(root.sum_finished);
+         share_retract(share, 1);
+         pthread_mutex_unlock(root.sum_finished);
+      }
+   pthread_mutex_unlock(&share->lock);
+   return 0;
 }
 
 
@@ -224,7 +392,6 @@ write_root_summary(datum_t *key, datum_t *val, void *arg)
    char sum[256];
    char num[256];
    Metric_t *metric;
-   int rc;
    struct type_tag *tt;
    llist_entry *le;
 
@@ -244,7 +411,7 @@ write_root_summary(datum_t *key, datum_t *val, void *arg)
 
    /* We log all our sums in double which does not suffer from
       wraparound errors: for example memory KB exceeding 4TB. -twitham */
-   sprintf(sum, "%.5f", metric->val.d);
+   gm_format_fixed(sum, sizeof(sum), metric->val.d, 5);
 
    sprintf(num, "%u", metric->num);
 
@@ -256,11 +423,7 @@ write_root_summary(datum_t *key, datum_t *val, void *arg)
 
    debug_msg("Writing Root Summary data for metric %s", name);
 
-   rc = write_data_to_rrd( NULL, NULL, name, sum, num, 15, 0, metric->slope);
-   if (rc)
-      {
-         err_msg("Unable to write meta data for metric %s to RRD", name);
-      }
+   sink_submit( NULL, NULL, name, sum, num, 15, 0, metric->slope, 0);
    return 0;
 }
 
@@ -270,6 +433,7 @@ int
 main ( int argc, char *argv[] )
 {
    struct stat struct_stat;
+   const char *rootdir;
    pthread_t pid;
    pthread_attr_t attr;
    int i, num_sources;
@@ -352,7 +516,7 @@ main ( int argc, char *argv[] )
        update_pidfile (args_info.pid_file_arg);
      }
 
-   /* The rrd_rootdir must be writable by the gmetad process */
+   /* The rrd_rootdir (or tsdb_rootdir) must be writable by the gmetad process */
    if( c->should_setuid )
       {
          if(! (pw = getpwnam(c->setuid_username)))
@@ -380,17 +544,18 @@ main ( int argc, char *argv[] )
 
    if( gmetad_config.write_rrds )
       {
-         if( stat( c->rrd_rootdir, &struct_stat ) )
+         rootdir = c->storage == STORAGE_TSDB ? c->tsdb_rootdir : c->rrd_rootdir;
+         if( stat( rootdir, &struct_stat ) )
             {
-                err_sys("Please make sure that %s exists", c->rrd_rootdir);
+                err_sys("Please make sure that %s exists", rootdir);
             }
          if ( struct_stat.st_uid != gmetad_uid )
             {
-                err_quit("Please make sure that %s is owned by %s", c->rrd_rootdir, gmetad_username);
+                err_quit("Please make sure that %s is owned by %s", rootdir, gmetad_username);
             }
          if (! (struct_stat.st_mode & S_IWUSR) )
             {
-                err_quit("Please make sure %s has WRITE permission for %s", gmetad_username, c->rrd_rootdir);
+                err_quit("Please make sure %s has WRITE permission for %s", gmetad_username, rootdir);
             }
       }
 
@@ -407,6 +572,11 @@ main ( int argc, char *argv[] )
       }
 #endif /* WITH_MEMCACHED */
 
+   /* The threads that write RRDs and forward metrics. */
+   if (c->write_rrds == 1 && c->storage == STORAGE_RRD && c->rrd_cache_flush)
+      rrd_cache_start();
+   sink_start(c);
+
    server_socket = g_tcp_socket_server_new( c->xml_port );
    if (server_socket == NULL)
       {
@@ -429,13 +599,16 @@ main ( int argc, char *argv[] )
    pthread_attr_init( &attr );
    pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
 
-   /* Spin off the non-interactive server threads. (Half as many as interactive). */
-   for (i=0; i < c->server_threads/2; i++)
-      pthread_create(&pid, &attr, server_thread, (void*) 0);
+   if (event_server_start(c))
+      {
+         /* Spin off the non-interactive server threads. (Half as many as interactive). */
+         for (i=0; i < c->server_threads/2; i++)
+            pthread_create(&pid, &attr, server_thread, (void*) 0);
 
-   /* Spin off the interactive server threads. */
-   for (i=0; i < c->server_threads; i++)
-      pthread_create(&pid, &attr, server_thread, (void*) 1);
+         /* Spin off the interactive server threads. */
+         for (i=0; i < c->server_threads; i++)
+            pthread_create(&pid, &attr, server_thread, (void*) 1);
+      }
 
    hash_foreach( sources, spin_off_the_data_threads, NULL );
 
@@ -456,19 +629,9 @@ main ( int argc, char *argv[] )
             sleep_time += apr_time_from_sec(METADATA_MINIMUM_SLEEP);
          apr_sleep(sleep_time);
 
-         /* Need to be sure root is locked while doing summary */
-         pthread_mutex_lock(root.sum_finished);
-
-         /* Flush the old values */
-         hash_foreach(root.metric_summary, zero_out_summary, NULL);
-         root.hosts_up = 0;
-         root.hosts_down = 0;
-
-         /* Sum the new values */
-         hash_foreach(root.authority, do_root_summary, NULL );
-
-         /* summary completed */
-         pthread_mutex_unlock(root.sum_finished);
+         /* The sources keep the root summary up to date as they report;
+          * all that is left is to take out the ones that have died. */
+         hash_foreach(root.authority, retract_dead_source, NULL);
 
          /* Save them to RRD */
          hash_foreach(root.metric_summary, write_root_summary, NULL);
@@ -75,7 +75,10 @@ typedef enum
       NUM_TAG,
       EXTRA_DATA_TAG,
       EXTRA_ELEMENT_TAG,
-      TAGS_TAG
+      TAGS_TAG,
+      METRIC_DEF_TAG,
+      DEF_TAG,
+      ID_TAG
    }
 xml_tag_t;
 
@@ -130,14 +133,81 @@ typedef union
    }
 metric_val_t;
 
+/* The longest request line we accept on the interactive port */
+#define REQUESTLEN 2048
+
+struct event_conn;
+struct index_host;
+
+/* The most names, globs or predicates in one query parameter */
+#define MAX_QUERY_TERMS 16
+
+typedef enum
+   {
+      QUERY_EQ,
+      QUERY_NE,
+      QUERY_LT,
+      QUERY_LE,
+      QUERY_GT,
+      QUERY_GE
+   }
+query_op_t;
+
+/* where=metric:op:value selects hosts whose metric compares true. */
+typedef struct
+   {
+      const char *metric;
+      query_op_t op;
+      const char *str;
+      double value;
+      int numeric;
+   }
+query_pred_t;
+
+struct top_item;
+
+/* The selection asked for in the interactive port's query string, e.g.
+ * /?metrics=load_*,cpu_idle&hosts=web*&where=load_one:gt:2&limit=10.
+ * The names point into buf. */
+typedef struct
+   {
+      const char *metrics[MAX_QUERY_TERMS];
+      int nmetrics;
+      const char *hosts[MAX_QUERY_TERMS];
+      int nhosts;
+      query_pred_t where[MAX_QUERY_TERMS];
+      int nwhere;
+      const char *index[MAX_QUERY_TERMS]; /* Answer from the metric index. */
+      int nindex;
+      const char *history[MAX_QUERY_TERMS]; /* Recent values, likewise. */
+      int nhistory;
+      unsigned int since; /* Oldest history to report. */
+      const char *stats;  /* Report gmetad's own counters instead. */
+      int limit;    /* Most hosts to report, 0 for all. */
+      int reported; /* Hosts reported so far. */
+      const char *sort; /* Report hosts by this metric (top= or bottom=). */
+      int sort_desc;
+      struct top_item *top; /* The hosts a sorted query reports, in order. */
+      int ntop;
+      char buf[REQUESTLEN + 1];
+   }
+query_t;
+
 typedef struct
    {
       int fd;
+      struct event_conn *conn; /* Set when the event server queues our output. */
       unsigned int valid:1;
       unsigned int http:1;
+      unsigned int compact:1; /* Use the compact XML dialect. */
+      unsigned int selective:1; /* The query below applies. */
       struct sockaddr_in addr;
       filter_type_t filter;
       struct timeval now;
+      hash_t *defs;  /* METRIC_DEF IDs of the cluster being reported, keyed
+                        by metric signature. */
+      unsigned int ndefs;
+      query_t query;
    }
 client_t;
 
@@ -169,6 +239,7 @@ typedef struct
       short int authority_ptr; /* An authority URL. */
       hash_t *metric_summary;
       pthread_mutex_t *sum_finished; /* A lock held during summarization. */
+      struct root_share *share; /* What we add to the root summary. */
       data_source_list_t *ds;
       uint32_t hosts_up;
       uint32_t hosts_down;
@@ -198,6 +269,7 @@ typedef struct
       short int tags;
       uint32_t reported;
       uint32_t started;
+      struct index_host *indexed; /* Our record in the metric index. */
       short int stringslen;
       char strings[GMETAD_FRAMESIZE];
    }
@@ -228,6 +300,8 @@ typedef struct
       uint32_t tn;
       uint32_t tmax;
       uint32_t dmax;
+      uint32_t sampled;   /* Source time of the value last sent to the sinks, */
+      uint32_t submitted; /* and the source's clock when it was sent. */
       short int slope;
       short int source;
       short int ednameslen;
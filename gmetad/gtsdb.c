@@ -0,0 +1,92 @@
+/* gtsdb: reads values back out of the store gmetad writes with
+ * "storage tsdb", for graphing and for moving them elsewhere. */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tsdb.h"
+
+static void
+usage(const char *prog)
+{
+   fprintf(stderr,
+           "usage: %s [-c] [-l level] [-s start] [-e end] rootdir source [host/metric]\n"
+           "\n"
+           "Prints the values of one series, or of every series of the source\n"
+           "when none is given, one per line as \"series time value\".\n"
+           "\n"
+           "  -c        print comma separated values instead\n"
+           "  -l level  the consolidation level, 0 for the values as written\n"
+           "            (default 0); level n follows the nth RRA\n"
+           "  -s start  unix time of the first value (default a day ago)\n"
+           "  -e end    unix time past the last value (default now)\n"
+           "\n"
+           "Use %s for the source of the grid summary.\n",
+           prog, TSDB_ROOT_SOURCE);
+   exit(1);
+}
+
+static int
+print_point(const char *key, uint32_t t, double val, void *arg)
+{
+   if (*(int *) arg)
+      printf("%s,%u,%.*g\n", key, t, 17, val);
+   else
+      printf("%s %u %.*g\n", key, t, 17, val);
+   return ferror(stdout);
+}
+
+int
+main(int argc, char *argv[])
+{
+   uint32_t end = time(NULL);
+   uint32_t start = end - 86400;
+   int level = 0, csv = 0;
+   long n;
+   int opt;
+
+   while ((opt = getopt(argc, argv, "cl:s:e:h")) != -1)
+      {
+         switch (opt)
+            {
+            case 'c':
+               csv = 1;
+               break;
+            case 'l':
+               level = atoi(optarg);
+               break;
+            case 's':
+               start = strtoul(optarg, NULL, 10);
+               break;
+            case 'e':
+               end = strtoul(optarg, NULL, 10);
+               break;
+            default:
+               usage(argv[0]);
+            }
+      }
+   if (argc - optind < 2 || argc - optind > 3 || level < 0)
+      usage(argv[0]);
+
+   n = tsdb_fetch(argv[optind], argv[optind + 1],
+                  argc - optind == 3 ? argv[optind + 2] : NULL,
+                  level, start, end, print_point, &csv);
+   if (n < 0)
+      {
+         fprintf(stderr, "%s: there is no level %d of %s in %s\n", argv[0],
+                 level, argv[optind + 1], argv[optind]);
+         return 1;
+      }
+   if (fflush(stdout))
+      {
+         perror(argv[0]);
+         return 1;
+      }
+   return 0;
+}
@@ -0,0 +1,400 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "history.h"
+
+/* Recent samples are kept the way time series databases keep them in
+ * memory: each block starts with a full timestamp and value, and every
+ * later sample stores the delta of its timestamp delta and the XOR of its
+ * value with the previous one.  Metrics that report on a fixed period with
+ * slowly changing values take a bit or two for the timestamp and a few
+ * bits for the value, instead of twelve bytes.
+ *
+ * A block cannot drop its first sample, so the ring holds whole blocks and
+ * one more than the requested number of samples needs; the oldest block
+ * goes once the newest one fills.
+ */
+
+struct history_block
+   {
+      unsigned char *bits;
+      uint32_t nbits;
+      uint32_t size;   /* Bytes allocated. */
+      unsigned int n;  /* Samples. */
+   };
+
+struct history
+   {
+      unsigned int samples;
+      unsigned int block_samples;
+      unsigned int nblocks;
+      unsigned int head;   /* The oldest block. */
+      unsigned int count;  /* Blocks in use. */
+
+      /* The encoder state at the end of the newest block. */
+      uint32_t t;
+      int64_t delta;
+      uint64_t v;
+      int lead;            /* Of the last XOR window, -1 for none. */
+      int trail;
+
+      struct history_block blocks[1];
+   };
+
+struct bit_reader
+   {
+      const unsigned char *bits;
+      uint32_t pos;
+      uint32_t nbits;
+   };
+
+
+static int
+put_bits(struct history_block *b, uint64_t val, int n)
+{
+   unsigned char *bits;
+   uint32_t size;
+   int i;
+
+   if (b->nbits + n > b->size * 8)
+      {
+         size = b->size ? b->size * 2 : 16;
+         bits = realloc(b->bits, size);
+         if (!bits)
+            return 1;
+         memset(bits + b->size, 0, size - b->size);
+         b->bits = bits;
+         b->size = size;
+      }
+
+   for (i = n - 1; i >= 0; i--, b->nbits++)
+      if ((val >> i) & 1)
+         b->bits[b->nbits >> 3] |= 0x80 >> (b->nbits & 7);
+   return 0;
+}
+
+static uint64_t
+get_bits(struct bit_reader *r, int n)
+{
+   uint64_t val = 0;
+
+   for (; n > 0; n--, r->pos++)
+      {
+         val <<= 1;
+         if (r->pos < r->nbits)
+            val |= (r->bits[r->pos >> 3] >> (7 - (r->pos & 7))) & 1;
+      }
+   return val;
+}
+
+static uint64_t
+double_bits(double d)
+{
+   uint64_t v;
+
+   memcpy(&v, &d, sizeof(v));
+   return v;
+}
+
+static double
+bits_double(uint64_t v)
+{
+   double d;
+
+   memcpy(&d, &v, sizeof(d));
+   return d;
+}
+
+static int
+leading_zeros(uint64_t x)
+{
+   int n = 0;
+
+   while (!(x & ((uint64_t) 1 << 63)))
+      {
+         x <<= 1;
+         n++;
+      }
+   return n;
+}
+
+static int
+trailing_zeros(uint64_t x)
+{
+   int n = 0;
+
+   while (!(x & 1))
+      {
+         x >>= 1;
+         n++;
+      }
+   return n;
+}
+
+
+history_t *
+history_new(unsigned int samples)
+{
+   history_t *h;
+   unsigned int block, nblocks;
+
+   if (!samples)
+      return NULL;
+
+   block = samples < HISTORY_BLOCK ? samples : HISTORY_BLOCK;
+   nblocks = (samples + block - 1) / block + 1;
+
+   h = calloc(1, sizeof(*h) + (nblocks - 1) * sizeof(struct history_block));
+   if (!h)
+      return NULL;
+   h->samples = samples;
+   h->block_samples = block;
+   h->nblocks = nblocks;
+   return h;
+}
+
+void
+history_free(history_t *h)
+{
+   unsigned int i;
+
+   if (!h)
+      return;
+   for (i = 0; i < h->nblocks; i++)
+      free(h->blocks[i].bits);
+   free(h);
+}
+
+history_t *
+history_copy(const history_t *h)
+{
+   size_t size = sizeof(*h) + (h->nblocks - 1) * sizeof(struct history_block);
+   history_t *c;
+   struct history_block *b;
+   unsigned int i;
+
+   c = malloc(size);
+   if (!c)
+      return NULL;
+   memcpy(c, h, size);
+
+   for (i = 0; i < c->nblocks; i++)
+      {
+         b = &c->blocks[i];
+         if (!b->bits)
+            continue;
+         b->size = (b->nbits + 7) / 8;
+         b->bits = malloc(b->size ? b->size : 1);
+         if (!b->bits)
+            {
+               while (i--)
+                  free(c->blocks[i].bits);
+               free(c);
+               return NULL;
+            }
+         memcpy(b->bits, h->blocks[i].bits, b->size);
+      }
+   return c;
+}
+
+
+static struct history_block *
+history_start_block(history_t *h)
+{
+   struct history_block *b;
+
+   if (h->count == h->nblocks)
+      {
+         /* Recycle the oldest block. */
+         b = &h->blocks[h->head];
+         h->head = (h->head + 1) % h->nblocks;
+         b->nbits = 0;
+         b->n = 0;
+         if (b->bits)
+            memset(b->bits, 0, b->size);
+         return b;
+      }
+
+   if (h->count)
+      {
+         /* The newest block is full and will not grow again. */
+         b = &h->blocks[(h->head + h->count - 1) % h->nblocks];
+         if (b->size > (b->nbits + 7) / 8 + 1)
+            {
+               unsigned char *bits = realloc(b->bits, (b->nbits + 7) / 8 + 1);
+               if (bits)
+                  {
+                     b->bits = bits;
+                     b->size = (b->nbits + 7) / 8 + 1;
+                  }
+            }
+      }
+   return &h->blocks[(h->head + h->count++) % h->nblocks];
+}
+
+void
+history_add(history_t *h, uint32_t t, double val)
+{
+   struct history_block *b;
+   uint64_t v, x;
+   int64_t delta, dod;
+   int lead, trail, rc;
+
+   if (!h)
+      return;
+
+   b = h->count ? &h->blocks[(h->head + h->count - 1) % h->nblocks] : NULL;
+   if (b && t <= h->t)
+      return;
+
+   v = double_bits(val);
+
+   if (!b || b->n == h->block_samples)
+      {
+         b = history_start_block(h);
+         if (put_bits(b, t, 32) || put_bits(b, v, 64))
+            {
+               b->nbits = b->n = 0;
+               return;
+            }
+         b->n = 1;
+         h->t = t;
+         h->delta = 0;
+         h->v = v;
+         h->lead = -1;
+         return;
+      }
+
+   delta = (int64_t) t - h->t;
+   dod = delta - h->delta;
+   if (dod == 0)
+      rc = put_bits(b, 0, 1);
+   else if (dod >= -63 && dod <= 64)
+      rc = put_bits(b, 2, 2) || put_bits(b, (uint64_t) (dod + 63), 7);
+   else if (dod >= -255 && dod <= 256)
+      rc = put_bits(b, 6, 3) || put_bits(b, (uint64_t) (dod + 255), 9);
+   else if (dod >= -2047 && dod <= 2048)
+      rc = put_bits(b, 14, 4) || put_bits(b, (uint64_t) (dod + 2047), 12);
+   else
+      rc = put_bits(b, 15, 4) || put_bits(b, (uint32_t) delta, 32);
+
+   x = v ^ h->v;
+   if (rc)
+      ;
+   else if (!x)
+      rc = put_bits(b, 0, 1);
+   else
+      {
+         lead = leading_zeros(x);
+         trail = trailing_zeros(x);
+         if (lead > 31)
+            lead = 31;
+
+         if (h->lead >= 0 && lead >= h->lead && trail >= h->trail)
+            {
+               /* Fits the previous window. */
+               rc = put_bits(b, 2, 2)
+                  || put_bits(b, x >> h->trail, 64 - h->lead - h->trail);
+            }
+         else
+            {
+               rc = put_bits(b, 3, 2) || put_bits(b, lead, 5)
+                  || put_bits(b, (64 - lead - trail) & 63, 6)
+                  || put_bits(b, x >> trail, 64 - lead - trail);
+               h->lead = lead;
+               h->trail = trail;
+            }
+      }
+   if (rc)
+      return;
+
+   b->n++;
+   h->t = t;
+   h->delta = delta;
+   h->v = v;
+}
+
+
+unsigned int
+history_count(const history_t *h)
+{
+   unsigned int i, n = 0;
+
+   for (i = 0; h && i < h->count; i++)
+      n += h->blocks[(h->head + i) % h->nblocks].n;
+   return n;
+}
+
+unsigned int
+history_read(const history_t *h, uint32_t since, uint32_t *t, double *val)
+{
+   const struct history_block *b;
+   struct bit_reader r;
+   unsigned int i, j, n = 0, first;
+   uint32_t ts;
+   int64_t delta, dod;
+   uint64_t v, x;
+   int lead = 0, len = 0;
+
+   for (i = 0; h && i < h->count; i++)
+      {
+         b = &h->blocks[(h->head + i) % h->nblocks];
+         if (!b->n)
+            continue;
+
+         r.bits = b->bits;
+         r.pos = 0;
+         r.nbits = b->nbits;
+         ts = (uint32_t) get_bits(&r, 32);
+         v = get_bits(&r, 64);
+         delta = 0;
+         t[n] = ts;
+         val[n++] = bits_double(v);
+
+         for (j = 1; j < b->n; j++)
+            {
+               if (!get_bits(&r, 1))
+                  dod = 0;
+               else if (!get_bits(&r, 1))
+                  dod = (int64_t) get_bits(&r, 7) - 63;
+               else if (!get_bits(&r, 1))
+                  dod = (int64_t) get_bits(&r, 9) - 255;
+               else if (!get_bits(&r, 1))
+                  dod = (int64_t) get_bits(&r, 12) - 2047;
+               else
+                  dod = (int64_t) get_bits(&r, 32) - delta;
+               delta += dod;
+               ts += delta;
+
+               if (get_bits(&r, 1))
+                  {
+                     if (get_bits(&r, 1))
+                        {
+                           lead = (int) get_bits(&r, 5);
+                           len = (int) get_bits(&r, 6);
+                           if (!len)
+                              len = 64;
+                        }
+                     x = get_bits(&r, len) << (64 - lead - len);
+                     v ^= x;
+                  }
+               t[n] = ts;
+               val[n++] = bits_double(v);
+            }
+      }
+
+   /* Keep the requested number of samples, and none older than since. */
+   first = n > (h ? h->samples : 0) ? n - h->samples : 0;
+   while (first < n && t[first] < since)
+      first++;
+   if (first)
+      {
+         memmove(t, t + first, (n - first) * sizeof(*t));
+         memmove(val, val + first, (n - first) * sizeof(*val));
+      }
+   return n - first;
+}
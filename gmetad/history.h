@@ -0,0 +1,29 @@
+#ifndef HISTORY_H
+#define HISTORY_H 1
+
+#include <stdint.h>
+
+/* The recent samples of one metric on one host, compressed in blocks of
+ * up to HISTORY_BLOCK samples. */
+typedef struct history history_t;
+
+#define HISTORY_BLOCK 64
+
+history_t *history_new(unsigned int samples);
+void history_free(history_t *h);
+history_t *history_copy(const history_t *h);
+
+/* Appends a sample.  Samples not newer than the last one are dropped,
+ * since an unchanged metric keeps its reported time. */
+void history_add(history_t *h, uint32_t t, double val);
+
+/* The number of samples held, which history_read() needs room for. */
+unsigned int history_count(const history_t *h);
+
+/* Decodes the most recent samples no older than since, oldest first,
+ * keeping at most the number history_new() was asked for.  Returns the
+ * number of samples stored in t and val. */
+unsigned int history_read(const history_t *h, uint32_t since, uint32_t *t,
+                          double *val);
+
+#endif
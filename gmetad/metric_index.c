@@ -0,0 +1,495 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "gmetad.h"
+#include "metric_index.h"
+#include "history.h"
+
+extern gmetad_config_t gmetad_config;
+
+/* An inverted index from metric name to the latest value of that metric
+ * on every host, for "cpu_idle on all hosts" queries that would otherwise
+ * walk every host hash in the tree.
+ *
+ * Each metric is a series: a contiguous array of (host, value, reported)
+ * entries plus an open addressing table from host to array position, so
+ * an update is one probe and a query is one linear scan.  Series and host
+ * records are never freed.  The series table is read locked for lookups
+ * and write locked only to add a metric; each series has its own mutex,
+ * so data threads updating different metrics do not contend.
+ *
+ * With history_samples set, each entry also keeps its recent values in a
+ * compressed ring, in an array parallel to the entries.
+ */
+
+#define SERIES_TABLE_SIZE 1024
+#define HOST_TABLE_SIZE 4096
+#define SLOTS_MIN 64
+
+typedef struct
+   {
+      char *name;
+      char type[32];
+      char units[32];
+      pthread_mutex_t lock;
+      index_entry_t *entries;
+      history_t **history; /* Parallel to entries, if history is kept. */
+      unsigned int n;
+      unsigned int size;
+      unsigned int *slots; /* Position in entries + 1, 0 if empty. */
+      unsigned int mask;   /* Number of slots - 1. */
+   }
+series_t;
+
+static pthread_rwlock_t series_lock = PTHREAD_RWLOCK_INITIALIZER;
+static series_t **series_table;
+static unsigned int series_mask;
+static unsigned int series_count;
+
+static pthread_mutex_t host_lock = PTHREAD_MUTEX_INITIALIZER;
+static index_host_t **host_table;
+static unsigned int host_mask;
+static unsigned int host_count;
+
+
+/* FNV-1a */
+static unsigned int
+hash_str(const char *s, unsigned int h)
+{
+   while (*s)
+      {
+         h ^= (unsigned char) *s++;
+         h *= 16777619;
+      }
+   return h;
+}
+
+static unsigned int
+hash_host(const index_host_t *host)
+{
+   return (unsigned int) (((uintptr_t) host >> 4) * 2654435761u);
+}
+
+
+/* Returns the slot holding host, or the empty slot where it belongs. */
+static unsigned int
+slot_find(series_t *s, const index_host_t *host)
+{
+   unsigned int i;
+
+   for (i = hash_host(host) & s->mask; s->slots[i]; i = (i + 1) & s->mask)
+      if (s->entries[s->slots[i] - 1].host == host)
+         break;
+   return i;
+}
+
+static int
+slots_grow(series_t *s)
+{
+   unsigned int *old = s->slots;
+   unsigned int i, mask = s->mask;
+
+   s->mask = mask ? mask * 2 + 1 : SLOTS_MIN - 1;
+   s->slots = calloc(s->mask + 1, sizeof(unsigned int));
+   if (!s->slots)
+      {
+         s->slots = old;
+         s->mask = mask;
+         return 1;
+      }
+   for (i = 0; i < s->n; i++)
+      s->slots[slot_find(s, s->entries[i].host)] = i + 1;
+   free(old);
+   return 0;
+}
+
+/* Empties slot i, moving later entries of its probe chain back so
+ * lookups need no tombstones. */
+static void
+slot_delete(series_t *s, unsigned int i)
+{
+   unsigned int j, k;
+
+   for (;;)
+      {
+         s->slots[i] = 0;
+         for (j = i;;)
+            {
+               j = (j + 1) & s->mask;
+               if (!s->slots[j])
+                  return;
+               k = hash_host(s->entries[s->slots[j] - 1].host) & s->mask;
+               /* Leave it if its home slot lies cyclically in (i, j]. */
+               if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                  continue;
+               s->slots[i] = s->slots[j];
+               i = j;
+               break;
+            }
+      }
+}
+
+static int
+series_grow(series_t *s)
+{
+   unsigned int size = s->size ? s->size * 2 : SLOTS_MIN;
+   index_entry_t *e;
+   history_t **h;
+
+   e = realloc(s->entries, size * sizeof(*e));
+   if (!e)
+      return 1;
+   s->entries = e;
+
+   if (gmetad_config.history_samples)
+      {
+         h = realloc(s->history, size * sizeof(*h));
+         if (!h)
+            return 1;
+         memset(h + s->size, 0, (size - s->size) * sizeof(*h));
+         s->history = h;
+      }
+   s->size = size;
+   return 0;
+}
+
+static void
+series_remove(series_t *s, const index_host_t *host)
+{
+   unsigned int i, pos, last;
+
+   if (!s->n)
+      return;
+   i = slot_find(s, host);
+   if (!s->slots[i])
+      return;
+   pos = s->slots[i] - 1;
+   slot_delete(s, i);
+
+   /* Keep the array dense by moving the last entry into the hole. */
+   last = --s->n;
+   if (s->history)
+      {
+         history_free(s->history[pos]);
+         s->history[pos] = s->history[last];
+         s->history[last] = NULL;
+      }
+   if (pos != last)
+      {
+         s->entries[pos] = s->entries[last];
+         s->slots[slot_find(s, s->entries[pos].host)] = pos + 1;
+      }
+}
+
+
+static series_t *
+series_lookup(const char *metric)
+{
+   unsigned int i;
+
+   if (!series_table)
+      return NULL;
+   for (i = hash_str(metric, 2166136261u) & series_mask; series_table[i];
+        i = (i + 1) & series_mask)
+      if (!strcmp(series_table[i]->name, metric))
+         return series_table[i];
+   return NULL;
+}
+
+static int
+series_table_grow(void)
+{
+   series_t **old = series_table;
+   unsigned int i, j, size = series_mask + 1;
+
+   series_table = calloc(old ? size * 2 : SERIES_TABLE_SIZE,
+                         sizeof(series_t *));
+   if (!series_table)
+      {
+         series_table = old;
+         return 1;
+      }
+   series_mask = old ? size * 2 - 1 : SERIES_TABLE_SIZE - 1;
+   for (i = 0; old && i < size; i++)
+      {
+         if (!old[i])
+            continue;
+         for (j = hash_str(old[i]->name, 2166136261u) & series_mask;
+              series_table[j]; j = (j + 1) & series_mask)
+            ;
+         series_table[j] = old[i];
+      }
+   free(old);
+   return 0;
+}
+
+static series_t *
+series_get(const char *metric, const char *type, const char *units)
+{
+   series_t *s;
+   unsigned int i;
+
+   pthread_rwlock_rdlock(&series_lock);
+   s = series_lookup(metric);
+   pthread_rwlock_unlock(&series_lock);
+   if (s)
+      return s;
+
+   pthread_rwlock_wrlock(&series_lock);
+   s = series_lookup(metric);
+   if (s)
+      goto done;
+
+   if ((series_count + 1) * 4 > (series_table ? series_mask + 1 : 0) * 3
+       && series_table_grow())
+      goto done;
+
+   s = calloc(1, sizeof(*s));
+   if (!s || !(s->name = strdup(metric)))
+      {
+         err_msg("Could not index metric %s", metric);
+         free(s);
+         s = NULL;
+         goto done;
+      }
+   strncpy(s->type, type, sizeof(s->type) - 1);
+   strncpy(s->units, units, sizeof(s->units) - 1);
+   pthread_mutex_init(&s->lock, NULL);
+
+   for (i = hash_str(metric, 2166136261u) & series_mask; series_table[i];
+        i = (i + 1) & series_mask)
+      ;
+   series_table[i] = s;
+   series_count++;
+
+ done:
+   pthread_rwlock_unlock(&series_lock);
+   return s;
+}
+
+
+static unsigned int
+host_hash(const char *source, const char *host)
+{
+   return hash_str(host, hash_str(source, 2166136261u) * 16777619);
+}
+
+static int
+host_table_grow(void)
+{
+   index_host_t **old = host_table;
+   unsigned int i, j, size = host_mask + 1;
+
+   host_table = calloc(old ? size * 2 : HOST_TABLE_SIZE,
+                       sizeof(index_host_t *));
+   if (!host_table)
+      {
+         host_table = old;
+         return 1;
+      }
+   host_mask = old ? size * 2 - 1 : HOST_TABLE_SIZE - 1;
+   for (i = 0; old && i < size; i++)
+      {
+         if (!old[i])
+            continue;
+         for (j = host_hash(old[i]->source, old[i]->name) & host_mask;
+              host_table[j]; j = (j + 1) & host_mask)
+            ;
+         host_table[j] = old[i];
+      }
+   free(old);
+   return 0;
+}
+
+index_host_t *
+metric_index_host(const char *source, const char *host)
+{
+   index_host_t *h = NULL;
+   size_t slen, hlen;
+   unsigned int i;
+   char *p;
+
+   pthread_mutex_lock(&host_lock);
+
+   if ((host_count + 1) * 4 > (host_table ? host_mask + 1 : 0) * 3
+       && host_table_grow())
+      goto done;
+
+   for (i = host_hash(source, host) & host_mask; host_table[i];
+        i = (i + 1) & host_mask)
+      {
+         h = host_table[i];
+         if (!strcmp(h->name, host) && !strcmp(h->source, source))
+            goto done;
+      }
+
+   /* The names live in the same allocation as the record. */
+   slen = strlen(source) + 1;
+   hlen = strlen(host) + 1;
+   h = malloc(sizeof(*h) + slen + hlen);
+   if (!h)
+      {
+         err_msg("Could not index host %s", host);
+         goto done;
+      }
+   p = (char *) (h + 1);
+   memcpy(p, source, slen);
+   memcpy(p + slen, host, hlen);
+   h->source = p;
+   h->name = p + slen;
+
+   host_table[i] = h;
+   host_count++;
+
+ done:
+   pthread_mutex_unlock(&host_lock);
+   return h;
+}
+
+
+void
+metric_index_update(const index_host_t *host, const char *metric,
+                    const char *type, const char *units, double val,
+                    uint32_t reported)
+{
+   series_t *s;
+   index_entry_t *e;
+   history_t **h;
+   unsigned int i;
+
+   s = series_get(metric, type, units);
+   if (!s)
+      return;
+
+   pthread_mutex_lock(&s->lock);
+
+   if (!s->slots || (s->n + 1) * 4 > (s->mask + 1) * 3)
+      {
+         if (slots_grow(s))
+            goto fail;
+      }
+
+   i = slot_find(s, host);
+   if (!s->slots[i])
+      {
+         if (s->n == s->size && series_grow(s))
+            goto fail;
+         s->entries[s->n].host = host;
+         s->entries[s->n].reported = 0;
+         s->slots[i] = ++s->n;
+      }
+
+   e = &s->entries[s->slots[i] - 1];
+   if (s->history)
+      {
+         /* The reported time comes from TN, so it can wobble by a second
+          * between polls of the same sample. */
+         h = &s->history[s->slots[i] - 1];
+         if (!*h)
+            *h = history_new(gmetad_config.history_samples);
+         if (reported > e->reported + 1)
+            history_add(*h, reported, val);
+      }
+   e->val = val;
+   e->reported = reported;
+   pthread_mutex_unlock(&s->lock);
+   return;
+
+ fail:
+   pthread_mutex_unlock(&s->lock);
+   err_msg("Could not index metric %s for host %s", metric, host->name);
+}
+
+
+void
+metric_index_remove(const index_host_t *host, const char *metric)
+{
+   series_t *s;
+
+   pthread_rwlock_rdlock(&series_lock);
+   s = series_lookup(metric);
+   pthread_rwlock_unlock(&series_lock);
+   if (!s)
+      return;
+
+   pthread_mutex_lock(&s->lock);
+   series_remove(s, host);
+   pthread_mutex_unlock(&s->lock);
+}
+
+
+void
+metric_index_remove_host(const index_host_t *host)
+{
+   unsigned int i;
+   series_t *s;
+
+   pthread_rwlock_rdlock(&series_lock);
+   for (i = 0; series_table && i <= series_mask; i++)
+      {
+         s = series_table[i];
+         if (!s)
+            continue;
+         pthread_mutex_lock(&s->lock);
+         series_remove(s, host);
+         pthread_mutex_unlock(&s->lock);
+      }
+   pthread_rwlock_unlock(&series_lock);
+}
+
+
+int
+metric_index_snapshot(const char *metric, index_entry_t **entries,
+                      char *type, char *units)
+{
+   series_t *s;
+   int n;
+
+   pthread_rwlock_rdlock(&series_lock);
+   s = series_lookup(metric);
+   pthread_rwlock_unlock(&series_lock);
+   if (!s)
+      return -1;
+
+   pthread_mutex_lock(&s->lock);
+   n = s->n;
+   *entries = malloc((n ? n : 1) * sizeof(index_entry_t));
+   if (!*entries)
+      n = -1;
+   else
+      memcpy(*entries, s->entries, n * sizeof(index_entry_t));
+   strcpy(type, s->type);
+   strcpy(units, s->units);
+   pthread_mutex_unlock(&s->lock);
+   return n;
+}
+
+
+history_t *
+metric_index_history(const index_host_t *host, const char *metric)
+{
+   history_t *h = NULL;
+   series_t *s;
+   unsigned int i;
+
+   pthread_rwlock_rdlock(&series_lock);
+   s = series_lookup(metric);
+   pthread_rwlock_unlock(&series_lock);
+   if (!s)
+      return NULL;
+
+   pthread_mutex_lock(&s->lock);
+   if (s->history && s->n)
+      {
+         i = slot_find(s, host);
+         if (s->slots[i] && s->history[s->slots[i] - 1])
+            h = history_copy(s->history[s->slots[i] - 1]);
+      }
+   pthread_mutex_unlock(&s->lock);
+   return h;
+}
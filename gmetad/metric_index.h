@@ -0,0 +1,47 @@
+#ifndef METRIC_INDEX_H
+#define METRIC_INDEX_H 1
+
+#include <stdint.h>
+
+#include "history.h"
+
+/* A host as the metric index knows it.  Host records are never freed, so
+ * a pointer to one stays a valid reference even after cleanup deletes the
+ * host from the tree. */
+typedef struct index_host
+   {
+      const char *source;
+      const char *name;
+   }
+index_host_t;
+
+/* One host's latest value of a metric. */
+typedef struct
+   {
+      const index_host_t *host;
+      double val;
+      uint32_t reported;
+   }
+index_entry_t;
+
+/* Returns the record for host in source, creating it on first use. */
+index_host_t *metric_index_host(const char *source, const char *host);
+
+void metric_index_update(const index_host_t *host, const char *metric,
+                         const char *type, const char *units, double val,
+                         uint32_t reported);
+void metric_index_remove(const index_host_t *host, const char *metric);
+void metric_index_remove_host(const index_host_t *host);
+
+/* Copies the entries of metric into a malloc'ed array, so a slow client
+ * never holds up the data threads.  Returns the number of entries, or -1
+ * if the metric is not indexed.  type and units point to at least
+ * 32 bytes. */
+int metric_index_snapshot(const char *metric, index_entry_t **entries,
+                          char *type, char *units);
+
+/* Returns a copy of the recent values of metric on host, which the caller
+ * frees with history_free(), or NULL if no history is kept for it. */
+history_t *metric_index_history(const index_host_t *host, const char *metric);
+
+#endif
@@ -2,12 +2,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <pthread.h>
 #include <expat.h>
 #include <ganglia.h>
 #include "gmetad.h"
-#include "rrd_helpers.h"
+#include "sink.h"
+#include "metric_index.h"
+#include "xml_scan.h"
+#include "arena.h"
+#include "gm_number.h"
 
 extern int zero_out_summary(datum_t *key, datum_t *val, void *arg);
+extern struct root_share *root_share_new(void);
+extern void root_summary_publish(Source_t *source);
 extern char* getfield(char *buf, short int index);
 
 extern struct xml_tag *in_xml_list (const char *, unsigned int);
@@ -50,6 +57,22 @@ typedef struct
       hash_t *root;     /* The root authority table (contains our data
                            sources). */ 
       struct timeval now;
+      Metric_t **defs;  /* The METRIC_DEF templates of the current cluster,
+                           indexed by ID (compact dialect). */
+      int ndefs;
+      int defs_size;
+      Metric_t *curdef; /* The METRIC_DEF we are inside of, if any. */
+      int compact;      /* True once we have seen a METRIC_DEF. */
+      int presummed;    /* True if the gmond of this cluster has sent its
+                           summary (HOSTS SOURCE="gmond"), so we do not
+                           sum its hosts ourselves. */
+      char *summary_metric; /* The name of that summary's METRICS we are
+                               in, if any. */
+      struct xml_tag **attr_tags;  /* From xml_scan, for the element we are
+                                      in the start handler of, or NULL. */
+      long *attr_nums;
+      arena_t *arena;   /* Scratch for the names and METRIC_DEFs above,
+                           given back at the end of the document. */
 }
 xmldata_t;
 
@@ -62,13 +85,44 @@ authority_mode(xmldata_t *xmldata)
 }
 
 
+/* The xml_tag of the attribute attr[i], which xml_scan may have looked up
+ * for us. */
+static struct xml_tag *
+attr_tag(xmldata_t *xmldata, const char **attr, int i)
+{
+   if (xmldata->attr_tags)
+      return xmldata->attr_tags[i / 2];
+   return in_xml_list(attr[i], strlen(attr[i]));
+}
+
+
+/* The value of attr[i] as atoi() and strtoul() read it, or as xml_scan
+ * already has when it is a small plain number. */
+static int
+attr_atoi(xmldata_t *xmldata, const char **attr, int i)
+{
+   if (xmldata->attr_nums && xmldata->attr_nums[i / 2] >= 0)
+      return xmldata->attr_nums[i / 2];
+   return atoi(attr[i+1]);
+}
+
+static unsigned long
+attr_strtoul(xmldata_t *xmldata, const char **attr, int i)
+{
+   if (xmldata->attr_nums && xmldata->attr_nums[i / 2] >= 0)
+      return xmldata->attr_nums[i / 2];
+   return strtoul(attr[i+1], (char **) NULL, 10);
+}
+
+
    
 /* Populates a Metric_t structure from a list of XML metric attribute strings.
  * We need the type string here because we cannot be sure it comes before
  * the metric value in the attribute list.
  */
 static void
-fillmetric(const char** attr, Metric_t *metric, const char* type)
+fillmetric(xmldata_t *xmldata, const char** attr, Metric_t *metric,
+           const char* type)
 {
    int i;
    /* INV: always points to the next free byte in metric.strings buffer. */
@@ -83,7 +137,7 @@ fillmetric(const char** attr, Metric_t *metric, const char* type)
    for(i = 0; attr[i] ; i+=2)
       {
          /* Only process the XML tags that gmetad is interested in */
-         xt = in_xml_list (attr[i], strlen(attr[i]));
+         xt = attr_tag(xmldata, attr, i);
          if (!xt)
             continue;
 
@@ -102,8 +156,7 @@ fillmetric(const char** attr, Metric_t *metric, const char* type)
                         case TIMESTAMP:
                         case UINT:
                         case FLOAT:
-                           metric->val.d = (double)
-                                   strtod(metricval, (char**) NULL);
+                           metric->val.d = gm_strtod(metricval, NULL);
                            p = strrchr(metricval, '.');
                            if (p) metric->precision = (short int) strlen(p+1);
                            break;
@@ -120,13 +173,13 @@ fillmetric(const char** attr, Metric_t *metric, const char* type)
                   metric->units = addstring(metric->strings, &edge, attr[i+1]);
                   break;
                case TN_TAG:
-                  metric->tn = atoi(attr[i+1]);
+                  metric->tn = attr_atoi(xmldata, attr, i);
                   break;
                case TMAX_TAG:
-                  metric->tmax = atoi(attr[i+1]);
+                  metric->tmax = attr_atoi(xmldata, attr, i);
                   break;
                case DMAX_TAG:
-                  metric->dmax = atoi(attr[i+1]);
+                  metric->dmax = attr_atoi(xmldata, attr, i);
                   break;
                case SLOPE_TAG:
                   metric->slope = addstring(metric->strings, &edge, attr[i+1]);
@@ -135,7 +188,7 @@ fillmetric(const char** attr, Metric_t *metric, const char* type)
                   metric->source = addstring(metric->strings, &edge, attr[i+1]);
                   break;
                case NUM_TAG:
-                  metric->num = atoi(attr[i+1]);
+                  metric->num = attr_atoi(xmldata, attr, i);
                   break;
                default:
                   break;
@@ -148,12 +201,118 @@ fillmetric(const char** attr, Metric_t *metric, const char* type)
 }
 
 
+/* Populates a Metric_t structure from a METRIC_DEF template and the
+ * attributes of a compact METRIC element, which only carries VAL and TN.
+ */
+static void
+filldefmetric(xmldata_t *xmldata, const char** attr, Metric_t *metric,
+              Metric_t *def)
+{
+   int i;
+   /* INV: always points to the next free byte in metric.strings buffer. */
+   int edge;
+   struct type_tag *tt;
+   struct xml_tag *xt;
+   char *type, *metricval, *p;
+
+   memcpy(metric, def, sizeof(*def) - GMETAD_FRAMESIZE + def->stringslen);
+   edge = metric->stringslen;
+   type = getfield(def->strings, def->type);
+
+   for(i = 0; attr[i] ; i+=2)
+      {
+         xt = attr_tag(xmldata, attr, i);
+         if (!xt)
+            continue;
+
+         switch( xt->tag )
+            {
+               case VAL_TAG:
+                  metricval = (char*) attr[i+1];
+
+                  tt = in_type_list(type, strlen(type));
+                  if (!tt) return;
+
+                  switch (tt->type)
+                     {
+                        case INT:
+                        case TIMESTAMP:
+                        case UINT:
+                        case FLOAT:
+                           metric->val.d = gm_strtod(metricval, NULL);
+                           p = strrchr(metricval, '.');
+                           if (p) metric->precision = (short int) strlen(p+1);
+                           break;
+                        case STRING:
+                           break;
+                     }
+                  metric->valstr = addstring(metric->strings, &edge, metricval);
+                  break;
+               case TN_TAG:
+                  metric->tn = attr_atoi(xmldata, attr, i);
+                  break;
+               default:
+                  break;
+            }
+      }
+   metric->stringslen = edge;
+}
+
+
+/* Returns the METRIC_DEF template with the given ID in the current cluster. */
+static Metric_t *
+lookup_def(xmldata_t *xmldata, const char *id)
+{
+   char *end;
+   long i;
+
+   i = strtol(id, &end, 10);
+   if (*end || i < 0 || i >= xmldata->ndefs)
+      return NULL;
+
+   return xmldata->defs[i];
+}
+
+
+/* Adds an extra element to a summary metric unless it is already there.
+ * We do not add every SPOOF_HOST element to the summary table: if the same
+ * metric is SPOOF'd on more than ~MAX_EXTRA_ELEMENTS hosts then its summary
+ * table is destroyed.
+ */
+static void
+summary_add_extra_element(Metric_t *sum_metric, const char *new_name,
+                          const char *new_value)
+{
+   int i, edge;
+
+   if ( strlen(new_name) == 10 && !strcasecmp(new_name, SPOOF_HOST) )
+      return;
+
+   for (i = 0; i < sum_metric->ednameslen; i++)
+      {
+         char *chk_name = getfield(sum_metric->strings, sum_metric->ednames[i]);
+         char *chk_value = getfield(sum_metric->strings, sum_metric->edvalues[i]);
+
+         /* If the name and value already exists, skip adding the strings. */
+         if (!strcasecmp(chk_name, new_name) && !strcasecmp(chk_value, new_value))
+            return;
+      }
+
+   if (sum_metric->ednameslen >= MAX_EXTRA_ELEMENTS)
+      return;
+
+   edge = sum_metric->stringslen;
+   sum_metric->ednames[sum_metric->ednameslen++] = addstring(sum_metric->strings, &edge, new_name);
+   sum_metric->edvalues[sum_metric->edvalueslen++] = addstring(sum_metric->strings, &edge, new_value);
+   sum_metric->stringslen = edge;
+}
+
+
 static int
 startElement_GRID(void *data, const char *el, const char **attr)
 {
    xmldata_t *xmldata = (xmldata_t *)data;
    struct xml_tag *xt;
-   datum_t *hash_datum = NULL;
    datum_t hashkey;
    const char *name = NULL;
    int edge;
@@ -170,15 +329,14 @@ startElement_GRID(void *data, const char *el, const char **attr)
          /* Get name for hash key */
          for(i = 0; attr[i]; i+=2)
             {
-               xt = in_xml_list (attr[i], strlen(attr[i]));
+               xt = attr_tag(xmldata, attr, i);
                if (!xt) continue;
 
                if (xt->tag == NAME_TAG)
                   {
                      name = attr[i+1];
-                     xmldata->sourcename = 
-                             realloc(xmldata->sourcename, strlen(name)+1);
-                     strcpy(xmldata->sourcename, name);
+                     xmldata->sourcename = arena_strdup(xmldata->arena,
+                                                        name);
                      hashkey.data = (void*) name;
                      hashkey.size =  strlen(name) + 1;
                   }
@@ -187,8 +345,8 @@ startElement_GRID(void *data, const char *el, const char **attr)
          source = &(xmldata->source);
 
          /* Query the hash table for this cluster */
-         hash_datum = hash_lookup(&hashkey, xmldata->root);
-         if (!hash_datum)  
+         if (hash_fetch(&hashkey, xmldata->root, source,
+                        sizeof(*source)) < 0)
             {  /* New Cluster */
                memset((void*) source, 0, sizeof(*source));
 
@@ -204,6 +362,7 @@ startElement_GRID(void *data, const char *el, const char **attr)
                      return 1;
                   }
                source->ds = xmldata->ds;
+               source->share = root_share_new();
 
                /* Initialize the partial sum lock */
                source->sum_finished = (pthread_mutex_t *) 
@@ -215,10 +374,7 @@ startElement_GRID(void *data, const char *el, const char **attr)
                pthread_mutex_lock(source->sum_finished);
             }
          else
-            {  /* Found Cluster. Put into our Source buffer in xmldata. */
-               memcpy(source, hash_datum->data, hash_datum->size);
-               datum_free(hash_datum);
-
+            {  /* Found Cluster, now in our Source buffer in xmldata. */
                /* Grab the "partial sum" mutex until we are finished
                 * summarizing. Needs to be done asap.*/
                pthread_mutex_lock(source->sum_finished);
@@ -235,7 +391,7 @@ startElement_GRID(void *data, const char *el, const char **attr)
          /* Fill in grid attributes. */
          for(i = 0; attr[i]; i+=2)
             {
-               xt = in_xml_list(attr[i], strlen(attr[i]));
+               xt = attr_tag(xmldata, attr, i);
                if (!xt)
                   continue;
 
@@ -246,8 +402,7 @@ startElement_GRID(void *data, const char *el, const char **attr)
                                         &edge, attr[i+1]);
                         break;
                      case LOCALTIME_TAG:
-                        source->localtime = strtoul(attr[i+1], 
-                                        (char **) NULL, 10);
+                        source->localtime = attr_strtoul(xmldata, attr, i);
                         break;
                      default:
                         break;
@@ -269,36 +424,38 @@ startElement_CLUSTER(void *data, const char *el, const char **attr)
 {
    xmldata_t *xmldata = (xmldata_t *)data;
    struct xml_tag *xt;
-   datum_t *hash_datum = NULL;
    datum_t hashkey;
    const char *name = NULL;
    int edge;
    int i;
    Source_t *source;
 
+   /* METRIC_DEF IDs are scoped to their cluster. */
+   xmldata->ndefs = 0;
+
    /* Get name for hash key */
    for(i = 0; attr[i]; i+=2)
       {
-         xt = in_xml_list (attr[i], strlen(attr[i]));
+         xt = attr_tag(xmldata, attr, i);
          if (!xt) continue;
 
          if (xt->tag == NAME_TAG)
             name = attr[i+1];
       }
 
+   xmldata->presummed = 0;
+
    /* Only keep cluster details if we are the authority on this cluster. */
    if (!authority_mode(xmldata))
       return 0;
 
    source = &(xmldata->source);
    
-   xmldata->sourcename = realloc(xmldata->sourcename, strlen(name)+1);
-   strcpy(xmldata->sourcename, name);
+   xmldata->sourcename = arena_strdup(xmldata->arena, name);
    hashkey.data = (void*) name;
    hashkey.size =  strlen(name) + 1;
 
-   hash_datum = hash_lookup(&hashkey, xmldata->root);
-   if (!hash_datum)
+   if (hash_fetch(&hashkey, xmldata->root, source, sizeof(*source)) < 0)
       {
          memset((void*) source, 0, sizeof(*source));
          
@@ -323,6 +480,7 @@ startElement_CLUSTER(void *data, const char *el, const char **attr)
                return 1;
             }
          source->ds = xmldata->ds;
+         source->share = root_share_new();
          
          /* Initialize the partial sum lock */
          source->sum_finished = (pthread_mutex_t *) 
@@ -334,9 +492,6 @@ startElement_CLUSTER(void *data, const char *el, const char **attr)
       }
    else
       {
-         memcpy(source, hash_datum->data, hash_datum->size);
-         datum_free(hash_datum);
-
          /* We need this lock before zeroing metric sums. */
          pthread_mutex_lock(source->sum_finished);
 
@@ -355,7 +510,7 @@ startElement_CLUSTER(void *data, const char *el, const char **attr)
    /* Fill in cluster attributes. */
    for(i = 0; attr[i]; i+=2)
       {
-         xt = in_xml_list (attr[i], strlen(attr[i]));
+         xt = attr_tag(xmldata, attr, i);
          if (!xt)
             continue;
 
@@ -372,8 +527,7 @@ startElement_CLUSTER(void *data, const char *el, const char **attr)
                   source->url = addstring(source->strings, &edge, attr[i+1]);
                   break;
                case LOCALTIME_TAG:
-                  source->localtime = strtoul(attr[i+1],
-                                (char **) NULL, 10);
+                  source->localtime = attr_strtoul(xmldata, attr, i);
                   break;
                default:
                   break;
@@ -388,7 +542,6 @@ static int
 startElement_HOST(void *data, const char *el, const char **attr)
 {
    xmldata_t *xmldata = (xmldata_t *)data;
-   datum_t *hash_datum = NULL;
    datum_t *rdatum;
    datum_t hashkey, hashval;
    struct xml_tag *xt;
@@ -404,15 +557,15 @@ startElement_HOST(void *data, const char *el, const char **attr)
    /* Check if the host is up. */
    for (i = 0; attr[i]; i+=2)
       {
-         xt = in_xml_list (attr[i], strlen(attr[i]));
+         xt = attr_tag(xmldata, attr, i);
          if (!xt) continue;
 
          if (xt->tag == REPORTED_TAG)
-            reported = strtoul(attr[i+1], (char **)NULL, 10);
+            reported = attr_strtoul(xmldata, attr, i);
          else if (xt->tag == TN_TAG)
-            tn = atoi(attr[i+1]);
+            tn = attr_atoi(xmldata, attr, i);
          else if (xt->tag == TMAX_TAG)
-            tmax = atoi(attr[i+1]);
+            tmax = attr_atoi(xmldata, attr, i);
          else if (xt->tag == NAME_TAG)
             name = attr[i+1];
       }
@@ -424,7 +577,9 @@ startElement_HOST(void *data, const char *el, const char **attr)
       abs(xmldata->source.localtime - reported) < 60 :
       tn < tmax * 4;
 
-   if (xmldata->host_alive)
+   if (xmldata->presummed)
+      ;
+   else if (xmldata->host_alive)
       xmldata->source.hosts_up++;
    else
       xmldata->source.hosts_down++;
@@ -438,8 +593,7 @@ startElement_HOST(void *data, const char *el, const char **attr)
    /* Use node Name for hash key (Query processing
     * requires a name key).
     */
-   xmldata->hostname = realloc(xmldata->hostname, strlen(name)+1);
-   strcpy(xmldata->hostname, name);
+   xmldata->hostname = arena_strdup(xmldata->arena, name);
 
    /* Convert name to lower case - host names can't be
     * case sensitive
@@ -452,8 +606,8 @@ startElement_HOST(void *data, const char *el, const char **attr)
    hashkey.size =  strlen(name) + 1;
 
    hosts = xmldata->source.authority;
-   hash_datum = hash_lookup (&hashkey, hosts);
-   if (!hash_datum)
+   /* Copy any stored host data into our Host buffer in xmldata. */
+   if (hash_fetch(&hashkey, hosts, host, sizeof(*host)) < 0)
       {
          memset((void*) host, 0, sizeof(*host));
 
@@ -469,12 +623,9 @@ startElement_HOST(void *data, const char *el, const char **attr)
                err_msg("Could not create metric hash for host %s", name);
                return 1;
             }
-      }
-   else
-      {
-         /* Copy the stored host data into our Host buffer in xmldata. */
-         memcpy(host, hash_datum->data, hash_datum->size);
-         datum_free(hash_datum);
+
+         if (gmetad_config.metric_index)
+            host->indexed = metric_index_host(xmldata->sourcename, name);
       }
 
    /* Edge has the same invariant as in fillmetric(). */
@@ -494,7 +645,7 @@ startElement_HOST(void *data, const char *el, const char **attr)
    /* We will store this host in the cluster's authority table. */
    for(i = 0; attr[i]; i+=2)
       {
-         xt = in_xml_list (attr[i], strlen(attr[i]));
+         xt = attr_tag(xmldata, attr, i);
          if (!xt) continue;
 
          switch( xt->tag )
@@ -503,7 +654,7 @@ startElement_HOST(void *data, const char *el, const char **attr)
                   host->ip = addstring(host->strings, &edge, attr[i+1]);
                   break;
                case DMAX_TAG:
-                  host->dmax = strtoul(attr[i+1], (char **)NULL, 10);
+                  host->dmax = attr_strtoul(xmldata, attr, i);
                   break;
                case LOCATION_TAG:
                   host->location = addstring(host->strings, &edge, attr[i+1]);
@@ -512,7 +663,7 @@ startElement_HOST(void *data, const char *el, const char **attr)
 		  host->tags = addstring(host->strings, &edge, attr[i+1]);
 		  break;
                case STARTED_TAG:
-                  host->started = strtoul(attr[i+1], (char **)NULL, 10);
+                  host->started = attr_strtoul(xmldata, attr, i);
                   break;
                default:
                   break;
@@ -541,34 +692,144 @@ startElement_HOSTS(void *data, const char *el, const char **attr)
    int i;
    struct xml_tag *xt;
 
+   /* A gmond that summarizes its cluster sends this before its hosts. */
+   for(i = 0; attr[i]; i+=2)
+      {
+         xt = attr_tag(xmldata, attr, i);
+         if (xt && xt->tag == SOURCE_TAG && !strcmp(attr[i+1], "gmond"))
+            xmldata->presummed = 1;
+      }
+
    /* In non-scalable mode, we do not process summary data. */
-   if (!gmetad_config.scalable_mode) return 0;
+   if (!gmetad_config.scalable_mode && !xmldata->presummed) return 0;
 
    /* Add up/down hosts to this grid summary */
    for(i = 0; attr[i]; i+=2)
       {
-         xt = in_xml_list (attr[i], strlen(attr[i]));
+         xt = attr_tag(xmldata, attr, i);
          if (!xt)
             continue;
 
          switch( xt->tag )
             {
                case UP_TAG:
-                  xmldata->source.hosts_up += strtoul(attr[i+1], 
-                                  (char **) NULL, 10);
+                  xmldata->source.hosts_up += attr_strtoul(xmldata, attr, i);
                   break;
                case DOWN_TAG:
-                  xmldata->source.hosts_down += strtoul(attr[i+1], 
-                                  (char **) NULL, 10);
+                  xmldata->source.hosts_down += attr_strtoul(xmldata, attr, i);
+                  break;
+               default:
+                  break;
+            }
+      }
+   return 0;
+}
+
+
+/* Saves a METRIC_DEF template for the compact METRIC elements that follow
+ * in this cluster. Its EXTRA_ELEMENTs are added to the template as well.
+ */
+static int
+startElement_METRIC_DEF(void *data, const char *el, const char **attr)
+{
+   xmldata_t *xmldata = (xmldata_t *)data;
+   struct xml_tag *xt;
+   const char *name = NULL;
+   const char *type = NULL;
+   const char *id = NULL;
+   int i, edge;
+   Metric_t *def, **defs;
+
+   xmldata->compact = 1;
+
+   for(i = 0; attr[i]; i+=2)
+      {
+         xt = attr_tag(xmldata, attr, i);
+         if (!xt) continue;
+
+         switch (xt->tag)
+            {
+               case ID_TAG:
+                  id = attr[i+1];
+                  break;
+               case NAME_TAG:
+                  name = attr[i+1];
+                  break;
+               case TYPE_TAG:
+                  type = attr[i+1];
                   break;
                default:
                   break;
             }
       }
+
+   if (!id || !name || !type || atoi(id) != xmldata->ndefs)
+      {
+         err_msg("Process XML (%s): bad METRIC_DEF %s", xmldata->ds->name,
+                 name ? name : "");
+         return 1;
+      }
+
+   if (xmldata->ndefs == xmldata->defs_size)
+      {
+         xmldata->defs_size = xmldata->defs_size ? xmldata->defs_size * 2 :
+                 DEFAULT_METRICSIZE;
+         defs = arena_alloc(xmldata->arena,
+                 xmldata->defs_size * sizeof(Metric_t *));
+         for (i = 0; i < xmldata->defs_size; i++)
+            defs[i] = i < xmldata->ndefs ? xmldata->defs[i] : NULL;
+         xmldata->defs = defs;
+      }
+   if (!xmldata->defs[xmldata->ndefs])
+      xmldata->defs[xmldata->ndefs] = arena_alloc(xmldata->arena,
+                                                  sizeof(Metric_t));
+   def = xmldata->defs[xmldata->ndefs++];
+
+   memset((void*) def, 0, sizeof(*def));
+   fillmetric(xmldata, attr, def, type);
+
+   def->id = METRIC_NODE;
+   def->report_start = metric_report_start;
+   def->report_end = metric_report_end;
+   def->valstr = -1;
+
+   edge = def->stringslen;
+   def->name = addstring(def->strings, &edge, name);
+   def->stringslen = edge;
+
+   xmldata->curdef = def;
    return 0;
 }
 
 
+/* Whether the sinks already have this value of a metric, which gmond
+ * has not heard again since the last poll: same sample time (give or
+ * take a second of rounding between TN and the source's clock) and same
+ * value.  An old value is still sent again every few steps, unless it
+ * goes out with its own timestamp, so that the RRD heartbeat of eight
+ * steps does not lapse into unknown data. */
+static int
+stale_sample(xmldata_t *xmldata, datum_t *hashkey, Metric_t *metric,
+             const char *metricval, uint32_t sampled)
+{
+   Metric_t old;
+   int stale;
+
+   if (hash_fetch(hashkey, xmldata->host.metrics, &old, sizeof(old)) < 0)
+      return 0;
+   stale = old.submitted && sampled <= old.sampled + 1
+      && !strcmp(getfield(old.strings, old.valstr), metricval)
+      && (gmetad_config.sample_timestamps
+          || xmldata->source.localtime - old.submitted
+             < 4 * xmldata->ds->step);
+   if (stale)
+      {
+         metric->sampled = old.sampled;
+         metric->submitted = old.submitted;
+      }
+   return stale;
+}
+
 static int
 startElement_METRIC(void *data, const char *el, const char **attr)
 {
@@ -576,23 +837,24 @@ startElement_METRIC(void *data, const char *el, const char **attr)
    ganglia_slope_t slope = GANGLIA_SLOPE_UNSPECIFIED;
    struct xml_tag *xt;
    struct type_tag *tt;
-   datum_t *hash_datum = NULL;
    datum_t *rdatum;
    datum_t hashkey, hashval;
    const char *name = NULL;
    const char *metricval = NULL;
    const char *type = NULL;
    int do_summary;
-   int i, edge, carbon_ret;
+   int i, j, edge;
+   uint32_t sampled;
    hash_t *summary;
    Metric_t *metric;
+   Metric_t *def = NULL;
 
    if (!xmldata->host_alive ) return 0;
 
    /* Get name for hash key, and val/type for summaries. */
    for(i = 0; attr[i]; i+=2)
       {
-         xt = in_xml_list(attr[i], strlen(attr[i]));
+         xt = attr_tag(xmldata, attr, i);
          if (!xt) continue;
 
          switch (xt->tag)
@@ -610,11 +872,31 @@ startElement_METRIC(void *data, const char *el, const char **attr)
                   break;
                case SLOPE_TAG:
                   slope = cstr_to_slope(attr[i+1]);
+                  break;
+               case DEF_TAG:
+                  def = lookup_def(xmldata, attr[i+1]);
+                  if (!def)
+                     {
+                        err_msg("Process XML (%s): unknown METRIC_DEF %s",
+                                xmldata->ds->name, attr[i+1]);
+                        return 0;
+                     }
+                  break;
                default:
                   break;
             }
       }
 
+   /* A compact METRIC takes everything but its value from the METRIC_DEF. */
+   if (def)
+      {
+         name = getfield(def->strings, def->name);
+         hashkey.data = (void*) name;
+         hashkey.size =  strlen(name) + 1;
+         type = getfield(def->strings, def->type);
+         slope = cstr_to_slope(getfield(def->strings, def->slope));
+      }
+
    metric = &(xmldata->metric);
    memset((void*) metric, 0, sizeof(*metric));
 
@@ -631,35 +913,44 @@ startElement_METRIC(void *data, const char *el, const char **attr)
       {
          /* Save the data to a round robin database if the data source is alive
           */
-         fillmetric(attr, metric, type);
+         if (def)
+            filldefmetric(xmldata, attr, metric, def);
+         else
+            fillmetric(xmldata, attr, metric, type);
 	 if (metric->dmax && metric->tn > metric->dmax)
             return 0;
 
          if (do_summary && !xmldata->ds->dead && !xmldata->rval)
             {
-                  debug_msg("Updating host %s, metric %s", 
-                                  xmldata->hostname, name);
-                  if ( gmetad_config.write_rrds == 1 )
-                     xmldata->rval = write_data_to_rrd(xmldata->sourcename,
-                        xmldata->hostname, name, metricval, NULL,
-                        xmldata->ds->step, xmldata->source.localtime, slope);
-		  if (gmetad_config.carbon_server) // if the user has specified a carbon server, send the metric to carbon as well
-                     carbon_ret=write_data_to_carbon(xmldata->sourcename, xmldata->hostname, name, metricval,xmldata->source.localtime);
-#ifdef WITH_MEMCACHED
-		  if (gmetad_config.memcached_parameters) {
-                     int mc_ret=write_data_to_memcached(xmldata->sourcename, xmldata->hostname, name, metricval, xmldata->source.localtime, metric->dmax);
-		  }
-
-#endif /* WITH_MEMCACHED */
+               sampled = xmldata->source.localtime - metric->tn;
+               if (gmetad_config.skip_stale_samples
+                   && stale_sample(xmldata, &hashkey, metric, metricval,
+                                   sampled))
+                  sink_skip();
+               else
+                  {
+                     debug_msg("Updating host %s, metric %s", 
+                                     xmldata->hostname, name);
+                     /* RRD, carbon and memcached, on their own threads. */
+                     sink_submit(xmldata->sourcename, xmldata->hostname, name,
+                        metricval, NULL, xmldata->ds->step,
+                        gmetad_config.sample_timestamps ? sampled :
+                        xmldata->source.localtime, slope, metric->dmax);
+                     metric->sampled = sampled;
+                     metric->submitted = xmldata->source.localtime;
+                  }
             }
          metric->id = METRIC_NODE;
          metric->report_start = metric_report_start;
          metric->report_end = metric_report_end;
 
 
-         edge = metric->stringslen;
-         metric->name = addstring(metric->strings, &edge, name);
-         metric->stringslen = edge;
+         if (!def)
+            {
+               edge = metric->stringslen;
+               metric->name = addstring(metric->strings, &edge, name);
+               metric->stringslen = edge;
+            }
 
          /* Set local idea of T0. */
          metric->t0 = xmldata->now;
@@ -675,27 +966,46 @@ startElement_METRIC(void *data, const char *el, const char **attr)
             {
                err_msg("Could not insert %s metric", name);
             }
+         else if (do_summary && xmldata->host.indexed)
+            metric_index_update(xmldata->host.indexed, name, type,
+               getfield(metric->strings, metric->units), metric->val.d,
+               metric->t0.tv_sec);
       }
 
-   /* Always update summary for numeric metrics. */
-   if (do_summary)
+   /* Always update summary for numeric metrics, unless gmond has. */
+   if (do_summary && !xmldata->presummed)
       {
          summary = xmldata->source.metric_summary;
-         hash_datum = hash_lookup(&hashkey, summary);
-         if (!hash_datum)
+         if (hash_fetch(&hashkey, summary, &xmldata->metric,
+                        sizeof(xmldata->metric)) < 0)
             {
                if (!authority_mode(xmldata))
                   {
                      metric = &(xmldata->metric);
                      memset((void*) metric, 0, sizeof(*metric));
-                     fillmetric(attr, metric, type);
+                     if (def)
+                        filldefmetric(xmldata, attr, metric, def);
+                     else
+                        fillmetric(xmldata, attr, metric, type);
                   }
                /* else we have already filled in the metric above. */
+
+               if (def)
+                  {
+                     /* Keep the template's extra data, minus SPOOF_HOST. */
+                     for (i = j = 0; i < metric->ednameslen; i++)
+                        {
+                           if (!strcasecmp(getfield(metric->strings,
+                                 metric->ednames[i]), SPOOF_HOST))
+                              continue;
+                           metric->ednames[j] = metric->ednames[i];
+                           metric->edvalues[j++] = metric->edvalues[i];
+                        }
+                     metric->ednameslen = metric->edvalueslen = j;
+                  }
             }
          else
             {
-               memcpy(&xmldata->metric, hash_datum->data, hash_datum->size);
-               datum_free(hash_datum);
                metric = &(xmldata->metric);
 
                switch (tt->type)
@@ -703,12 +1013,19 @@ startElement_METRIC(void *data, const char *el, const char **attr)
                      case INT:
                      case UINT:
                      case FLOAT:
-                        metric->val.d += (double)
-                                strtod(metricval, (char**) NULL);
+                        metric->val.d += gm_strtod(metricval, NULL);
                         break;
                      default:
                         break;
                   }
+
+               if (def)
+                  {
+                     for (i = 0; i < def->ednameslen; i++)
+                        summary_add_extra_element(metric,
+                           getfield(def->strings, def->ednames[i]),
+                           getfield(def->strings, def->edvalues[i]));
+                  }
             }
 
          metric->num++;
@@ -747,7 +1064,64 @@ startElement_EXTRA_ELEMENT (void *data, const char *el, const char **attr)
     char *name = getfield(xmldata->metric.strings, xmldata->metric.name);
     datum_t *rdatum;
     datum_t hashkey, hashval;
-    datum_t *hash_datum = NULL;
+
+    /* Extra data of a METRIC_DEF belongs to the template. */
+    if (xmldata->curdef)
+    {
+        Metric_t *def = xmldata->curdef;
+
+        name_off = value_off = -1;
+        for(i = 0; attr[i]; i+=2)
+        {
+            xt = attr_tag(xmldata, attr, i);
+            if (!xt)
+                continue;
+            if (xt->tag == NAME_TAG)
+                name_off = i;
+            else if (xt->tag == VAL_TAG)
+                value_off = i;
+        }
+        if (name_off < 0 || value_off < 0 || def->ednameslen >= MAX_EXTRA_ELEMENTS)
+            return 0;
+
+        edge = def->stringslen;
+        def->ednames[def->ednameslen++] = addstring(def->strings, &edge, attr[name_off+1]);
+        def->edvalues[def->edvalueslen++] = addstring(def->strings, &edge, attr[value_off+1]);
+        def->stringslen = edge;
+        return 0;
+    }
+
+    /* Extra data of a gmond's summary belongs to the summary. */
+    if (xmldata->summary_metric)
+    {
+        hashkey.data = (void*) xmldata->summary_metric;
+        hashkey.size = strlen(xmldata->summary_metric) + 1;
+        if (hash_fetch(&hashkey, xmldata->source.metric_summary, &metric,
+                       sizeof(metric)) < 0)
+            return 0;
+
+        name_off = value_off = -1;
+        for(i = 0; attr[i]; i+=2)
+        {
+            xt = attr_tag(xmldata, attr, i);
+            if (!xt)
+                continue;
+            if (xt->tag == NAME_TAG)
+                name_off = i;
+            else if (xt->tag == VAL_TAG)
+                value_off = i;
+        }
+        if (name_off < 0 || value_off < 0)
+            return 0;
+
+        summary_add_extra_element(&metric, attr[name_off+1], attr[value_off+1]);
+        hashval.size = sizeof(metric) - GMETAD_FRAMESIZE + metric.stringslen;
+        hashval.data = (void*) &metric;
+        rdatum = hash_insert(&hashkey, &hashval, xmldata->source.metric_summary);
+        if (!rdatum)
+            err_msg("Could not insert summary %s metric", xmldata->summary_metric);
+        return 0;
+    }
     
     if (!xmldata->host_alive) 
         return 0;
@@ -759,12 +1133,9 @@ startElement_EXTRA_ELEMENT (void *data, const char *el, const char **attr)
     hashkey.data = (void*) name;
     hashkey.size =  strlen(name) + 1;
     
-    hash_datum = hash_lookup (&hashkey, xmldata->host.metrics);
-    if (!hash_datum) 
+    if (hash_fetch(&hashkey, xmldata->host.metrics, &metric,
+                   sizeof(metric)) < 0)
         return 0;
-    
-    memcpy(&metric, hash_datum->data, hash_datum->size);
-    datum_free(hash_datum);
 
     /* Check to make sure that we don't try to add more
         extra elements than the array can handle.
@@ -781,7 +1152,7 @@ startElement_EXTRA_ELEMENT (void *data, const char *el, const char **attr)
     name_off = value_off = -1;
     for(i = 0; attr[i]; i+=2)
     {
-        xt = in_xml_list(attr[i], strlen(attr[i]));
+        xt = attr_tag(xmldata, attr, i);
         if (!xt) 
             continue;
         switch (xt->tag)
@@ -825,38 +1196,11 @@ startElement_EXTRA_ELEMENT (void *data, const char *el, const char **attr)
             hash_t *summary = xmldata->source.metric_summary;
             Metric_t sum_metric;
 
-            /* do not add every SPOOF_HOST element to the summary table.
-               if the same metric is SPOOF'd on more than ~MAX_EXTRA_ELEMENTS hosts
-               then its summary table is destroyed.
-             */
-            if ( strlen(new_name) == 10 && !strcasecmp(new_name, SPOOF_HOST) )
-                return 0;
-
             /* only update summary if metric is in hash */
-            hash_datum = hash_lookup(&hashkey, summary);
-
-            if (hash_datum) {
-                int found = FALSE;
+            if (hash_fetch(&hashkey, summary, &sum_metric,
+                           sizeof(sum_metric)) >= 0) {
 
-                memcpy(&sum_metric, hash_datum->data, hash_datum->size);
-                datum_free(hash_datum);
-
-                for (i = 0; i < sum_metric.ednameslen; i++) {
-                    char *chk_name = getfield(sum_metric.strings, sum_metric.ednames[i]);
-                    char *chk_value = getfield(sum_metric.strings, sum_metric.edvalues[i]);
-
-                    /* If the name and value already exists, skip adding the strings. */
-                    if (!strcasecmp(chk_name, new_name) && !strcasecmp(chk_value, new_value)) {
-                        found = TRUE;
-                        break;
-                    }
-                }
-                if (!found) {
-                    edge = sum_metric.stringslen;
-                    sum_metric.ednames[sum_metric.ednameslen++] = addstring(sum_metric.strings, &edge, new_name);
-                    sum_metric.edvalues[sum_metric.edvalueslen++] = addstring(sum_metric.strings, &edge, new_value);
-                    sum_metric.stringslen = edge;
-                }
+                summary_add_extra_element(&sum_metric, new_name, new_value);
 
                 /* Trim graph display sum_metric at (352, 208) now or when in startElement_EXTRA_ELEMENT
 metric structure to the correct length. Tricky. */
@@ -880,7 +1224,6 @@ startElement_METRICS(void *data, const char *el, const char **attr)
    xmldata_t *xmldata = (xmldata_t *)data;
    struct xml_tag *xt;
    struct type_tag *tt;
-   datum_t *hash_datum = NULL;
    datum_t *rdatum;
    datum_t hashkey, hashval;
    const char *name = NULL;
@@ -891,13 +1234,13 @@ startElement_METRICS(void *data, const char *el, const char **attr)
    hash_t *summary;
    Metric_t *metric;
 
-   /* In non-scalable mode, we do not process summary data. */
-   if (!gmetad_config.scalable_mode) return 0;
+   /* In non-scalable mode, we only process the summary of a gmond. */
+   if (!gmetad_config.scalable_mode && !xmldata->presummed) return 0;
    
    /* Get name for hash key, and val/type for summaries. */
    for(i = 0; attr[i]; i+=2)
       {
-         xt = in_xml_list(attr[i], strlen(attr[i]));
+         xt = attr_tag(xmldata, attr, i);
          if (!xt) continue;
 
          switch (xt->tag)
@@ -921,17 +1264,15 @@ startElement_METRICS(void *data, const char *el, const char **attr)
       }
 
    summary = xmldata->source.metric_summary;
-   hash_datum = hash_lookup(&hashkey, summary);
-   if (!hash_datum)
+   if (hash_fetch(&hashkey, summary, &xmldata->metric,
+                  sizeof(xmldata->metric)) < 0)
       {
          metric = &(xmldata->metric);
          memset((void*) metric, 0, sizeof(*metric));
-         fillmetric(attr, metric, type);
+         fillmetric(xmldata, attr, metric, type);
       }
    else
       {
-         memcpy(&xmldata->metric, hash_datum->data, hash_datum->size);
-         datum_free(hash_datum);
          metric = &(xmldata->metric);
 
          tt = in_type_list(type, strlen(type));
@@ -941,8 +1282,7 @@ startElement_METRICS(void *data, const char *el, const char **attr)
                   case INT:
                   case UINT:
                   case FLOAT:
-                     metric->val.d += (double)
-                             strtod(metricval, (char**) NULL);
+                     metric->val.d += gm_strtod(metricval, NULL);
                      break;
                   default:
                      break;
@@ -960,6 +1300,8 @@ startElement_METRICS(void *data, const char *el, const char **attr)
       err_msg("Could not insert %s metric", name);
       return 1;
    }
+   if (xmldata->presummed)
+      xmldata->summary_metric = arena_strdup(xmldata->arena, name);
    return 0;
 }
 
@@ -971,10 +1313,12 @@ startElement_GANGLIA_XML(void *data, const char *el, const char **attr)
    struct xml_tag *xt;
    int i;
 
+   xmldata->ndefs = 0;
+
    for(i = 0; attr[i] ; i+=2)
       {
          /* Only process the XML tags that gmetad is interested in */
-         if( !( xt = in_xml_list ( (char *)attr[i], strlen(attr[i]))) )
+         if( !( xt = attr_tag(xmldata, attr, i)) )
             continue;
 
          if (xt->tag == VERSION_TAG)
@@ -1001,15 +1345,10 @@ startElement_GANGLIA_XML(void *data, const char *el, const char **attr)
  * maintainability.
  */
 static void
-start (void *data, const char *el, const char **attr)
+start_tag (void *data, struct xml_tag *xt, const char *el, const char **attr)
 {
-   struct xml_tag *xt;
    int rc;
 
-   xt = in_xml_list ((char *) el, strlen(el));
-   if (!xt)
-      return;
-
    switch( xt->tag )
       {
          case GRID_TAG:
@@ -1036,6 +1375,10 @@ start (void *data, const char *el, const char **attr)
             rc = startElement_METRICS(data, el, attr);
             break;
 
+         case METRIC_DEF_TAG:
+            rc = startElement_METRIC_DEF(data, el, attr);
+            break;
+
          case GANGLIA_XML_TAG:
             rc = startElement_GANGLIA_XML(data, el, attr);
             break;
@@ -1056,6 +1399,33 @@ start (void *data, const char *el, const char **attr)
 }
 
 
+static void
+start (void *data, const char *el, const char **attr)
+{
+   struct xml_tag *xt;
+
+   xt = in_xml_list ((char *) el, strlen(el));
+   if (!xt)
+      return;
+   start_tag(data, xt, el, attr);
+}
+
+
+/* xml_scan hands us the attribute tags and numbers it has. */
+static void
+fast_start (void *data, struct xml_tag *xt, const char *el, const char **attr,
+            struct xml_tag **tags, long *nums)
+{
+   xmldata_t *xmldata = (xmldata_t *) data;
+
+   xmldata->attr_tags = tags;
+   xmldata->attr_nums = nums;
+   start_tag(data, xt, el, attr);
+   xmldata->attr_tags = NULL;
+   xmldata->attr_nums = NULL;
+}
+
+
 
 /* Write a metric summary value to the RRD database. */
 static int
@@ -1088,10 +1458,11 @@ finish_processing_source(datum_t *key, datum_t *val, void *arg)
       {
          case INT:
          case UINT:
-            sprintf(sum, "%.f", metric->val.d);
+            gm_format_fixed(sum, sizeof(sum), metric->val.d, 0);
             break;
          case FLOAT:
-            sprintf(sum, "%.*f", (int) metric->precision, metric->val.d);
+            gm_format_fixed(sum, sizeof(sum), metric->val.d,
+                            metric->precision);
             break;
          default:
             break;
@@ -1106,10 +1477,9 @@ finish_processing_source(datum_t *key, datum_t *val, void *arg)
        debug_msg("Writing Summary data for source %s, metric %s",
                  xmldata->sourcename, name);
 
-       xmldata->rval = write_data_to_rrd(xmldata->sourcename, NULL, name,
-                                         sum, num, xmldata->ds->step,
-                                         xmldata->source.localtime,
-                                         cstr_to_slope(getfield(metric->strings, metric->slope)));
+       sink_submit(xmldata->sourcename, NULL, name, sum, num,
+                   xmldata->ds->step, xmldata->source.localtime,
+                   cstr_to_slope(getfield(metric->strings, metric->slope)), 0);
      }
 
    return xmldata->rval;
@@ -1139,6 +1509,9 @@ endElement_GRID(void *data, const char *el)
          source = &xmldata->source;
          summary = xmldata->source.metric_summary;
 
+         /* Our sums are complete: bring the root summary up to date. */
+         root_summary_publish(source);
+
          /* Release the partial sum mutex */
          pthread_mutex_unlock(source->sum_finished);
 
@@ -1171,12 +1544,17 @@ endElement_CLUSTER(void *data, const char *el)
    hash_t *summary;
    Source_t *source;
 
+   xmldata->presummed = 0;
+
    /* Only keep info on sources we are an authority on. */
    if (authority_mode(xmldata))
       {
          source = &xmldata->source;
          summary = xmldata->source.metric_summary;
 
+         /* Our sums are complete: bring the root summary up to date. */
+         root_summary_publish(source);
+
          /* Release the partial sum mutex */
          pthread_mutex_unlock(source->sum_finished);
 
@@ -1201,14 +1579,10 @@ endElement_CLUSTER(void *data, const char *el)
 
 
 static void
-end (void *data, const char *el)
+end_tag (void *data, struct xml_tag *xt, const char *el)
 {
-   struct xml_tag *xt;
    int rc;
 
-   if(! (xt = in_xml_list((char*) el, strlen(el))) )
-      return;
-
    switch ( xt->tag )
       {
          case GRID_TAG:
@@ -1219,6 +1593,14 @@ end (void *data, const char *el)
             rc = endElement_CLUSTER(data, el);
             break;
 
+         case METRIC_DEF_TAG:
+            ((xmldata_t *) data)->curdef = NULL;
+            break;
+
+         case METRICS_TAG:
+            ((xmldata_t *) data)->summary_metric = NULL;
+            break;
+
          default:
                break;
       }
@@ -1226,12 +1608,556 @@ end (void *data, const char *el)
 }
 
 
-/* Starts the Expat parser on the XML tree from this data source. */
+static void
+end (void *data, const char *el)
+{
+   struct xml_tag *xt;
+
+   if(! (xt = in_xml_list((char*) el, strlen(el))) )
+      return;
+   end_tag(data, xt, el);
+}
+
+
+/* What a thread keeps from one document to the next, so that once it has
+ * parsed a few its parsing no longer goes to malloc().  Each data source
+ * has a thread of its own, and the parse threads have one each. */
+typedef struct
+   {
+      arena_t *arena;
+      xml_scan_t *scan;         /* For whole documents. */
+      xml_scan_t *chunk_scan;   /* For chunks (parse_threads), which a data
+                                   thread parses in the middle of its own
+                                   document. */
+   }
+parse_state_t;
+
+/* Enough scratch for the names and METRIC_DEFs of most documents. */
+#define PARSE_ARENA_BLOCK (64 * 1024)
+
+static pthread_key_t parse_state_key;
+static pthread_once_t parse_state_once = PTHREAD_ONCE_INIT;
+
+static void
+parse_state_free(void *arg)
+{
+   parse_state_t *state = (parse_state_t *) arg;
+
+   if (state->scan)
+      xml_scan_free(state->scan);
+   if (state->chunk_scan)
+      xml_scan_free(state->chunk_scan);
+   arena_destroy(state->arena);
+   free(state);
+}
+
+static void
+parse_state_init(void)
+{
+   pthread_key_create(&parse_state_key, parse_state_free);
+}
+
+/* Returns this thread's parse state, made on first use. */
+static parse_state_t *
+parse_state(void)
+{
+   parse_state_t *state;
+
+   pthread_once(&parse_state_once, parse_state_init);
+   state = (parse_state_t *) pthread_getspecific(parse_state_key);
+   if (state)
+      return state;
+
+   state = calloc(1, sizeof(*state));
+   if (!state)
+      return NULL;
+   state->arena = arena_create(PARSE_ARENA_BLOCK);
+   if (state->arena)
+      {
+         arena_bind(state->arena);
+         state->scan = xml_scan_create(start, end, fast_start, end_tag,
+                                       &arena_expat_memory);
+         state->chunk_scan = xml_scan_create(start, end, fast_start, end_tag,
+                                             &arena_expat_memory);
+      }
+   if (!state->scan || !state->chunk_scan)
+      {
+         arena_bind(NULL);
+         parse_state_free(state);
+         return NULL;
+      }
+   pthread_setspecific(parse_state_key, state);
+   return state;
+}
+
+
+/* Parallel parsing of large dumps (parse_threads).
+ *
+ * A dump of a grid is mostly a long run of sibling CLUSTER (and, in
+ * scalable mode, nested GRID) elements.  split_dump() finds those runs
+ * and cuts them into chunks of whole elements.  The data source's thread
+ * parses the rest of the dump, the outline, with its own parser as
+ * usual; when it reaches a run it hands the run's chunks to the parse
+ * threads, helps parse them and waits for them before going on.  Each
+ * chunk is parsed as a document of its own: the dump's prolog (so the
+ * encoding and DTD are the same), then the chunk inside a <PIECES>
+ * element that our handlers ignore.
+ *
+ * Clusters we are the authority on are sources of their own, so their
+ * chunks need nothing more.  Clusters and grids inside the GRID we are
+ * the authority on only add to that grid's summary and host counts: each
+ * chunk adds up its own, and they are merged into the grid's in order
+ * once the run is done.
+ */
+
+/* Dumps smaller than this are parsed on one thread. */
+#define PARSE_SPLIT_MIN (1024 * 1024)
+/* The smallest chunk worth a parser of its own. */
+#define PARSE_CHUNK_MIN (64 * 1024)
+/* split_dump() gives up on outlines nested deeper than this. */
+#define PARSE_MAX_DEPTH 32
+
+#define PIECES_START "<PIECES>"
+#define PIECES_END "</PIECES>"
+
+typedef struct
+   {
+      size_t start;     /* The chunk is buf[start, end). */
+      size_t end;
+      int run;          /* Chunks of the same run are siblings. */
+      xmldata_t xmldata;
+   }
+parse_chunk_t;
+
+typedef struct parse_batch
+   {
+      const char *buf;
+      size_t prolog_len;
+      parse_chunk_t *chunks;
+      int nchunks;
+      int next;         /* The next chunk to hand out. */
+      int done;
+      pthread_cond_t finished;
+      struct parse_batch *next_batch;
+   }
+parse_batch_t;
+
+static pthread_mutex_t parse_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t parse_work = PTHREAD_COND_INITIALIZER;
+/* Batches with chunks left to hand out. */
+static parse_batch_t *parse_queue;
+static pthread_once_t parse_once = PTHREAD_ONCE_INIT;
+
+enum { OUTLINE_OTHER, OUTLINE_GANGLIA_XML, OUTLINE_GRID };
+
+/* Whether the tag name at p is name. */
+static int
+tag_is(const char *p, const char *end, const char *name)
+{
+   size_t n = strlen(name);
+
+   if ((size_t) (end - p) <= n || memcmp(p, name, n))
+      return 0;
+   p += n;
+   return *p == '>' || *p == '/' || *p == ' ' || *p == '\t' || *p == '\r'
+      || *p == '\n';
+}
+
+/* Steps over the element at p, which starts with a name tag.  Only tags
+ * of the same name need a look, since elements of other names cannot end
+ * it. */
+static const char *
+skip_element(const char *p, const char *end, const char *name)
+{
+   int kind, nested = 0;
+
+   p = xml_scan_skip_markup(p, end, &kind);
+   if (!p || kind == XML_SCAN_EMPTY)
+      return p;
+
+   while ((p = memchr(p, '<', end - p)))
+      {
+         if (end - p > 2 && p[1] == '/' && tag_is(p + 2, end, name))
+            {
+               if (!nested--)
+                  return xml_scan_skip_markup(p, end, &kind);
+            }
+         else if (tag_is(p + 1, end, name))
+            {
+               p = xml_scan_skip_markup(p, end, &kind);
+               if (!p)
+                  return NULL;
+               if (kind == XML_SCAN_START)
+                  nested++;
+               continue;
+            }
+         p++;
+      }
+   return NULL;
+}
+
+/* Finds the runs of CLUSTER and GRID elements in buf that can be parsed
+ * apart from the rest, and cuts them into chunks of about chunk_size.
+ * Returns the number of chunks, or 0 if the dump is not worth splitting
+ * (or is not well formed enough to split). */
+static int
+split_dump(arena_t *arena, const char *buf, size_t len, size_t chunk_size,
+           size_t *prolog_len, parse_chunk_t **chunks)
+{
+   const char *p = buf, *end = buf + len, *q;
+   char outline[PARSE_MAX_DEPTH];
+   const char *name;
+   parse_chunk_t *c = NULL, *grown;
+   int depth = 0, grids = 0, others = 0;
+   int n = 0, size = 0, run = 0, in_run = 0;
+   int kind;
+
+   *prolog_len = 0;
+   while ((p = memchr(p, '<', end - p)))
+      {
+         name = NULL;
+         if (depth > 0 && !others && end - p > 1)
+            {
+               if (tag_is(p + 1, end, "CLUSTER"))
+                  name = "CLUSTER";
+               else if (gmetad_config.scalable_mode && grids > 0
+                        && tag_is(p + 1, end, "GRID"))
+                  name = "GRID";
+            }
+
+         if (name)
+            {
+               q = skip_element(p, end, name);
+               if (!q)
+                  goto fail;
+
+               if (!in_run || c[n - 1].end - c[n - 1].start >= chunk_size)
+                  {
+                     if (n == size)
+                        {
+                           size = size ? size * 2 : 64;
+                           grown = arena_alloc(arena, size * sizeof(*c));
+                           if (n)
+                              memcpy(grown, c, n * sizeof(*c));
+                           c = grown;
+                        }
+                     c[n].start = p - buf;
+                     c[n].run = run;
+                     n++;
+                  }
+               c[n - 1].end = q - buf;
+               in_run = 1;
+               p = q;
+               continue;
+            }
+
+         /* Anything else belongs to the outline, and ends a run. */
+         if (in_run)
+            {
+               in_run = 0;
+               run++;
+            }
+         q = xml_scan_skip_markup(p, end, &kind);
+         if (!q)
+            goto fail;
+
+         if (kind == XML_SCAN_START)
+            {
+               if (depth == 0)
+                  *prolog_len = p - buf;
+               if (depth == PARSE_MAX_DEPTH)
+                  goto fail;
+               if (tag_is(p + 1, end, "GANGLIA_XML"))
+                  outline[depth] = OUTLINE_GANGLIA_XML;
+               else if (tag_is(p + 1, end, "GRID"))
+                  {
+                     outline[depth] = OUTLINE_GRID;
+                     grids++;
+                  }
+               else
+                  {
+                     outline[depth] = OUTLINE_OTHER;
+                     others++;
+                  }
+               depth++;
+            }
+         else if (kind == XML_SCAN_END)
+            {
+               if (depth == 0)
+                  goto fail;
+               depth--;
+               if (outline[depth] == OUTLINE_GRID)
+                  grids--;
+               else if (outline[depth] == OUTLINE_OTHER)
+                  others--;
+            }
+         p = q;
+      }
+   if (depth || n < 2)
+      goto fail;
+
+   *chunks = c;
+   return n;
+
+ fail:
+   return 0;
+}
+
+
+static void
+parse_chunk(parse_batch_t *batch, parse_chunk_t *chunk)
+{
+   xmldata_t *xmldata = &chunk->xmldata;
+   parse_state_t *state;
+   xml_scan_t *xml_parser;
+   arena_mark_t mark;
+
+   state = parse_state();
+   if (!state || !xml_scan_reset(state->chunk_scan, gmetad_config.fast_xml,
+                                 xmldata))
+      {
+         err_msg("Process XML: unable to create XML parser");
+         xmldata->rval = 1;
+         return;
+      }
+   xml_parser = state->chunk_scan;
+
+   /* Nothing the chunk's handlers allocate is needed once it is parsed,
+    * and a data thread's own document may have scratch below it. */
+   mark = arena_mark(state->arena);
+   xmldata->arena = state->arena;
+
+   if (!xml_scan_parse(xml_parser, batch->buf, batch->prolog_len, 0)
+       || !xml_scan_parse(xml_parser, PIECES_START, strlen(PIECES_START), 0)
+       || !xml_scan_parse(xml_parser, batch->buf + chunk->start,
+                          chunk->end - chunk->start, 0)
+       || !xml_scan_parse(xml_parser, PIECES_END, strlen(PIECES_END), 1))
+      {
+         err_msg ("Process XML (%s): XML_ParseBuffer() error at byte %ld:\n%s\n",
+                  xmldata->ds->name,
+                  (long) (chunk->start + xml_scan_byte_index(xml_parser)
+                          - batch->prolog_len - strlen(PIECES_START)),
+                  xml_scan_error(xml_parser));
+         xmldata->rval = 1;
+      }
+   arena_release(state->arena, mark);
+}
+
+/* Takes the next chunk of batch and parses it.  Called with parse_mutex
+ * held, and returns with it held. */
+static void
+parse_next_chunk(parse_batch_t *batch)
+{
+   parse_batch_t **b;
+   parse_chunk_t *chunk;
+
+   chunk = &batch->chunks[batch->next++];
+   if (batch->next == batch->nchunks)
+      {
+         for (b = &parse_queue; *b != batch; b = &(*b)->next_batch)
+            ;
+         *b = batch->next_batch;
+      }
+   pthread_mutex_unlock(&parse_mutex);
+
+   parse_chunk(batch, chunk);
+
+   pthread_mutex_lock(&parse_mutex);
+   if (++batch->done == batch->nchunks)
+      pthread_cond_signal(&batch->finished);
+}
+
+static void *
+parse_thread(void *arg)
+{
+   pthread_mutex_lock(&parse_mutex);
+   for (;;)
+      {
+         while (!parse_queue)
+            pthread_cond_wait(&parse_work, &parse_mutex);
+         parse_next_chunk(parse_queue);
+      }
+   return NULL;
+}
+
+static void
+parse_start(void)
+{
+   pthread_attr_t attr;
+   pthread_t pid;
+   int i;
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   for (i = 0; i < gmetad_config.parse_threads; i++)
+      pthread_create(&pid, &attr, parse_thread, NULL);
+   pthread_attr_destroy(&attr);
+}
+
+
+/* Adds a chunk's summary of a metric to the grid's, as if its elements
+ * had been parsed right into the grid's. */
+static int
+merge_summary(datum_t *key, datum_t *val, void *arg)
+{
+   xmldata_t **pair = (xmldata_t **) arg;
+   xmldata_t *xmldata = pair[0], *piece = pair[1];
+   Metric_t *chunk_metric = (Metric_t *) val->data;
+   Metric_t *metric;
+   datum_t *rdatum;
+   datum_t hashval;
+   struct type_tag *tt;
+   char *type;
+   int i;
+
+   if (hash_fetch(key, xmldata->source.metric_summary, &xmldata->metric,
+                  sizeof(xmldata->metric)) < 0)
+      {
+         rdatum = hash_insert(key, val, xmldata->source.metric_summary);
+         if (!rdatum) err_msg("Could not insert %s metric", (char *) key->data);
+         return 0;
+      }
+
+   metric = &(xmldata->metric);
+
+   type = getfield(metric->strings, metric->type);
+   tt = in_type_list(type, strlen(type));
+   if (tt && (tt->type == INT || tt->type == UINT || tt->type == FLOAT))
+      metric->val.d += chunk_metric->val.d;
+   metric->num += chunk_metric->num;
+
+   /* Only compact METRICs add their template's extra data to a summary
+    * that already has the metric. */
+   if (piece->compact)
+      {
+         for (i = 0; i < chunk_metric->ednameslen; i++)
+            summary_add_extra_element(metric,
+               getfield(chunk_metric->strings, chunk_metric->ednames[i]),
+               getfield(chunk_metric->strings, chunk_metric->edvalues[i]));
+      }
+   metric->t0 = xmldata->now;
+
+   hashval.size = sizeof(*metric) - GMETAD_FRAMESIZE + metric->stringslen;
+   hashval.data = (void*) metric;
+   rdatum = hash_insert(key, &hashval, xmldata->source.metric_summary);
+   if (!rdatum) err_msg("Could not insert %s metric", (char *) key->data);
+   return 0;
+}
+
+/* Parses the n chunks of a run, which sits where the parser of xmldata
+ * has got to in the outline, and brings xmldata up to date with them. */
+static void
+parse_run(xmldata_t *xmldata, const char *buf, size_t prolog_len,
+          parse_chunk_t *chunks, int n)
+{
+   parse_batch_t batch;
+   xmldata_t *pair[2];
+   int i;
+
+   for (i = 0; i < n; i++)
+      {
+         xmldata_t *piece = &chunks[i].xmldata;
+
+         memset(piece, 0, sizeof(*piece));
+         piece->old = xmldata->old;
+         piece->ds = xmldata->ds;
+         piece->grid_depth = xmldata->grid_depth;
+         piece->root = xmldata->root;
+         piece->now = xmldata->now;
+
+         /* Inside the grid we are the authority on, a chunk sums into a
+          * summary of its own. */
+         if (!authority_mode(xmldata))
+            {
+               memcpy(&piece->source, &xmldata->source,
+                      sizeof(xmldata->source));
+               piece->source.hosts_up = 0;
+               piece->source.hosts_down = 0;
+               piece->source.metric_summary = hash_create(DEFAULT_METRICSIZE);
+               if (!piece->source.metric_summary)
+                  {
+                     err_msg("Could not create summary hash for source %s",
+                             xmldata->sourcename);
+                     n = i;
+                     xmldata->rval = 1;
+                     break;
+                  }
+            }
+      }
+
+   memset(&batch, 0, sizeof(batch));
+   batch.buf = buf;
+   batch.prolog_len = prolog_len;
+   batch.chunks = chunks;
+   batch.nchunks = n;
+   pthread_cond_init(&batch.finished, NULL);
+
+   pthread_once(&parse_once, parse_start);
+
+   pthread_mutex_lock(&parse_mutex);
+   if (n)
+      {
+         batch.next_batch = parse_queue;
+         parse_queue = &batch;
+         pthread_cond_broadcast(&parse_work);
+      }
+   /* We help with our own batch rather than wait idle. */
+   while (batch.next < batch.nchunks)
+      parse_next_chunk(&batch);
+   while (batch.done < batch.nchunks)
+      pthread_cond_wait(&batch.finished, &parse_mutex);
+   pthread_mutex_unlock(&parse_mutex);
+   pthread_cond_destroy(&batch.finished);
+
+   pair[0] = xmldata;
+   for (i = 0; i < n; i++)
+      {
+         xmldata_t *piece = &chunks[i].xmldata;
+
+         if (!authority_mode(xmldata))
+            {
+               xmldata->source.hosts_up += piece->source.hosts_up;
+               xmldata->source.hosts_down += piece->source.hosts_down;
+               pair[1] = piece;
+               hash_foreach(piece->source.metric_summary, merge_summary, pair);
+               hash_destroy(piece->source.metric_summary);
+            }
+         if (piece->rval)
+            xmldata->rval = 1;
+      }
+}
+
+/* Parses buf, which split_dump() has cut into n chunks, with the help of
+ * the parse threads.  Returns what XML_Parse() does on the outline. */
+static int
+parse_split(xml_scan_t *xml_parser, xmldata_t *xmldata, const char *buf,
+            size_t len, size_t prolog_len, parse_chunk_t *chunks, int n)
+{
+   size_t pos = 0;
+   int i, j;
+
+   for (i = 0; i < n; i = j)
+      {
+         for (j = i; j < n && chunks[j].run == chunks[i].run; j++)
+            ;
+         if (!xml_scan_parse(xml_parser, buf + pos, chunks[i].start - pos, 0))
+            return 0;
+         parse_run(xmldata, buf, prolog_len, chunks + i, j - i);
+         pos = chunks[j - 1].end;
+      }
+   return xml_scan_parse(xml_parser, buf + pos, len - pos, 1);
+}
+
+
+/* Starts the parser on the XML tree from this data source. */
 int
 process_xml(data_source_list_t *d, char *buf)
 {
-   int rval;
-   XML_Parser xml_parser;
+   int rval, n = 0;
+   size_t len, prolog_len, chunk_size;
+   parse_chunk_t *chunks = NULL;
+   parse_state_t *state;
+   xml_scan_t *xml_parser;
    xmldata_t xmldata;
 
    memset( &xmldata, 0, sizeof( xmldata ));
@@ -1244,34 +2170,46 @@ process_xml(data_source_list_t *d, char *buf)
    
    gettimeofday(&xmldata.now, NULL);
 
-   xml_parser = XML_ParserCreate (NULL);
-   if (! xml_parser)
+   state = parse_state();
+   if (!state || !xml_scan_reset(state->scan, gmetad_config.fast_xml,
+                                 &xmldata))
       {
          err_msg("Process XML: unable to create XML parser");
          return 1;
       }
+   xml_parser = state->scan;
+   xmldata.arena = state->arena;
 
-   XML_SetElementHandler (xml_parser, start, end);
-   XML_SetUserData (xml_parser, &xmldata);
+   len = strlen(buf);
+   if (gmetad_config.parse_threads > 0 && len >= PARSE_SPLIT_MIN)
+      {
+         /* A few chunks for every thread, so they finish about together. */
+         chunk_size = len / (4 * (gmetad_config.parse_threads + 1));
+         if (chunk_size < PARSE_CHUNK_MIN)
+            chunk_size = PARSE_CHUNK_MIN;
+         n = split_dump(state->arena, buf, len, chunk_size, &prolog_len,
+                        &chunks);
+      }
 
-   rval = XML_Parse( xml_parser, buf, strlen(buf), 1 );
+   if (n)
+      {
+         debug_msg("[%s] parsing %lu bytes in %d chunks", d->name,
+                   (unsigned long) len, n);
+         rval = parse_split(xml_parser, &xmldata, buf, len, prolog_len,
+                            chunks, n);
+      }
+   else
+      rval = xml_scan_parse( xml_parser, buf, len, 1 );
    if(! rval )
       {
          err_msg ("Process XML (%s): XML_ParseBuffer() error at line %d:\n%s\n",
                          d->name,
-                         (int) XML_GetCurrentLineNumber (xml_parser),
-                         XML_ErrorString (XML_GetErrorCode (xml_parser)));
+                         xml_scan_line (xml_parser),
+                         xml_scan_error (xml_parser));
          xmldata.rval = 1;
       }
 
-   /* Free memory that might have been allocated in xmldata */
-   if (xmldata.sourcename)
-      free(xmldata.sourcename);
-
-   if (xmldata.hostname)
-      free(xmldata.hostname);
-
-   XML_ParserFree(xml_parser);
+   /* Give back the scratch of this document, keeping it for the next. */
+   arena_reset(state->arena);
    return xmldata.rval;
 }
-
@@ -6,7 +6,11 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <rrd.h>
+#ifdef HAVE_RRD_FORMAT_H
+#include <rrd_format.h>
+#endif
 #include <gmetad.h>
 #include <errno.h>
 #include <pthread.h>
@@ -23,7 +27,7 @@
 
 #include "rrd_helpers.h"
 
-#define PATHSIZE 4096
+#define PATHSIZE (CARBON_MSGSIZE - 1)
 extern gmetad_config_t gmetad_config;
 
 pthread_mutex_t rrd_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -155,6 +159,954 @@ RRD_create( char *rrd, int summary, unsigned int step,
 }
 
 
+/* Appends an update string to a buffer of NUL separated ones. */
+static int
+values_append(char **buf, size_t *len, size_t *size, const char *val)
+{
+   size_t n = strlen(val) + 1;
+   char *p;
+
+   if (*len + n > *size)
+      {
+         p = realloc(*buf, *size ? *size * 2 + n : 64 + n);
+         if (!p)
+            return 1;
+         *buf = p;
+         *size = *size ? *size * 2 + n : 64 + n;
+      }
+   memcpy(*buf + *len, val, n);
+   *len += n;
+   return 0;
+}
+
+/* Writes n values, oldest first, in argv[2] on to rrd in one update.
+ * argv[0] and argv[1] are for rrd_update's use.  Call with rrd_mutex
+ * held. */
+static void
+RRD_update_values( char *rrd, char **argv, unsigned int n )
+{
+   time_t last;
+   unsigned int skip;
+
+   argv[0] = "dummy";
+   argv[1] = rrd;
+   optind=0; opterr=0;
+   rrd_clear_error();
+   rrd_update(n + 2, argv);
+   if (!rrd_test_error())
+      return;
+
+   /* After a journal replay, the oldest values may already be in the
+    * RRD; librrd stops at the first of them. */
+   last = rrd_last_r(rrd);
+   for (skip = 0; last > 0 && skip < n
+           && strtoul(argv[skip + 2], NULL, 10) <= (unsigned long) last;
+        skip++)
+      ;
+   if (skip && skip < n)
+      {
+         argv[skip] = "dummy";
+         argv[skip + 1] = rrd;
+         optind=0; opterr=0;
+         rrd_clear_error();
+         rrd_update(n - skip + 2, argv + skip);
+      }
+   if (skip < n && rrd_test_error())
+      err_msg("RRD_update (%s): %s", rrd, rrd_get_error());
+}
+
+
+/* Creating RRDs.  A new RRD is written out in full, every row of every
+ * RRA, so creating thousands of them at once (a new cluster, a new batch
+ * of gmetrics) used to hold up the data threads for minutes.  Missing
+ * RRDs now go on a queue for a thread of their own, and their values
+ * wait with them until the file is in place.
+ *
+ * Where librrd's file layout is known (rrd_format.h), the creator makes
+ * one template RRD for each step, DS type and host or summary layout, and
+ * keeps it in memory.  A new RRD is a copy of its template with the times
+ * in the header set as rrd_create would set them, written to a
+ * preallocated file and renamed into place. */
+
+#define CREATE_HASH 4096
+
+typedef struct rrd_create_req
+   {
+      struct rrd_create_req *next;          /* In the hash chain. */
+      struct rrd_create_req *next_queued;
+      char *path;
+      unsigned int step;
+      int summary;
+      ganglia_slope_t slope;
+      unsigned int last;   /* Time of the newest value. */
+      unsigned int n;      /* Values waiting in buf. */
+      char *buf;
+      size_t len;
+      size_t size;
+   }
+rrd_create_req_t;
+
+typedef struct rrd_template
+   {
+      struct rrd_template *next;
+      unsigned int step;
+      int summary;
+      ganglia_slope_t slope;
+      char *data;          /* NULL if the template cannot be used. */
+      size_t size;
+      size_t header;       /* Bytes before the first row. */
+   }
+rrd_template_t;
+
+static pthread_mutex_t create_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t create_wanted = PTHREAD_COND_INITIALIZER;
+static pthread_once_t create_once = PTHREAD_ONCE_INIT;
+static rrd_create_req_t *create_hash[CREATE_HASH];
+static rrd_create_req_t *create_head, *create_tail;
+static rrd_template_t *templates;   /* The creator's alone. */
+
+static unsigned int
+path_hash(const char *s)
+{
+   unsigned int h = 2166136261u;
+
+   while (*s)
+      {
+         h ^= (unsigned char) *s++;
+         h *= 16777619;
+      }
+   return h;
+}
+
+#ifdef HAVE_RRD_FORMAT_H
+/* Checks that a fresh RRD is laid out the way this file expects, and
+ * returns the size of its header, or 0. */
+static size_t
+template_header(const char *data, size_t size, unsigned int step,
+                int summary)
+{
+   const stat_head_t *sh = (const stat_head_t *) data;
+   const rra_def_t *rra;
+   size_t header, rows = 0;
+   unsigned long i;
+
+   if (size < sizeof(*sh) || strcmp(sh->cookie, RRD_COOKIE)
+       || strcmp(sh->version, RRD_VERSION3) || sh->float_cookie != FLOAT_COOKIE
+       || sh->ds_cnt != (summary ? 2 : 1) || sh->pdp_step != step
+       || sh->rra_cnt != (unsigned long) gmetad_config.num_RRAs)
+      return 0;
+   header = sizeof(*sh) + sh->ds_cnt * sizeof(ds_def_t)
+      + sh->rra_cnt * sizeof(rra_def_t);
+   if (size < header)
+      return 0;
+   rra = (const rra_def_t *) (data + sizeof(*sh)
+                              + sh->ds_cnt * sizeof(ds_def_t));
+   for (i = 0; i < sh->rra_cnt; i++)
+      {
+         /* The Holt-Winters RRAs keep state of their own. */
+         if (strcmp(rra[i].cf_nam, "AVERAGE") && strcmp(rra[i].cf_nam, "MIN")
+             && strcmp(rra[i].cf_nam, "MAX") && strcmp(rra[i].cf_nam, "LAST"))
+            return 0;
+         if (!rra[i].pdp_cnt)
+            return 0;
+         rows += rra[i].row_cnt;
+      }
+   header += sizeof(live_head_t) + sh->ds_cnt * sizeof(pdp_prep_t)
+      + sh->rra_cnt * sh->ds_cnt * sizeof(cdp_prep_t)
+      + sh->rra_cnt * sizeof(rra_ptr_t);
+   if (size != header + rows * sh->ds_cnt * sizeof(rrd_value_t))
+      return 0;
+   return header;
+}
+
+/* Sets the last update time of a copy of a template's header, and the
+ * counts of unknown seconds and PDPs that follow from it, as rrd_create
+ * does. */
+static void
+template_set_time(char *header, time_t last_up)
+{
+   stat_head_t *sh = (stat_head_t *) header;
+   rra_def_t *rra;
+   live_head_t *live;
+   pdp_prep_t *pdp;
+   cdp_prep_t *cdp;
+   unsigned long i, j, unkn_sec;
+
+   rra = (rra_def_t *) (header + sizeof(*sh) + sh->ds_cnt * sizeof(ds_def_t));
+   live = (live_head_t *) (rra + sh->rra_cnt);
+   pdp = (pdp_prep_t *) (live + 1);
+   cdp = (cdp_prep_t *) (pdp + sh->ds_cnt);
+
+   live->last_up = last_up;
+   live->last_up_usec = 0;
+   unkn_sec = last_up % sh->pdp_step;
+   for (j = 0; j < sh->ds_cnt; j++)
+      pdp[j].scratch[PDP_unkn_sec_cnt].u_cnt = unkn_sec;
+   for (i = 0; i < sh->rra_cnt; i++)
+      for (j = 0; j < sh->ds_cnt; j++)
+         cdp[i * sh->ds_cnt + j].scratch[CDP_unkn_pdp_cnt].u_cnt =
+            ((last_up - unkn_sec) % (sh->pdp_step * rra[i].pdp_cnt))
+            / sh->pdp_step;
+}
+#endif /* HAVE_RRD_FORMAT_H */
+
+/* Finds, or makes, the template for an RRD. */
+static rrd_template_t *
+template_get(unsigned int step, int summary, ganglia_slope_t slope)
+{
+   rrd_template_t *t;
+#ifdef HAVE_RRD_FORMAT_H
+   char path[PATHSIZE + 1];
+   struct stat st;
+   int fd;
+#endif
+
+   for (t = templates; t; t = t->next)
+      if (t->step == step && t->summary == summary && t->slope == slope)
+         return t;
+
+   t = calloc(1, sizeof(*t));
+   if (!t)
+      return NULL;
+   t->step = step;
+   t->summary = summary;
+   t->slope = slope;
+   t->next = templates;
+   templates = t;
+
+#ifdef HAVE_RRD_FORMAT_H
+   snprintf(path, sizeof(path), "%s/.template.%u.%d.%d.rrd",
+            gmetad_config.rrd_rootdir, step, summary, (int) slope);
+   if (RRD_create(path, summary, step, time(0), slope))
+      return t;
+   fd = open(path, O_RDONLY);
+   if (fd >= 0 && !fstat(fd, &st) && (t->data = malloc(st.st_size))
+       && read(fd, t->data, st.st_size) == st.st_size)
+      {
+         t->size = st.st_size;
+         t->header = template_header(t->data, t->size, step, summary);
+      }
+   if (fd >= 0)
+      close(fd);
+   unlink(path);
+   if (!t->header)
+      {
+         err_msg("Unable to use %s as a template, creating RRDs one by one",
+                 path);
+         free(t->data);
+         t->data = NULL;
+      }
+#endif
+   return t;
+}
+
+/* Writes a copy of a template to path, to take values from first on. */
+static int
+template_clone(rrd_template_t *t, const char *path, unsigned int first)
+{
+#ifdef HAVE_RRD_FORMAT_H
+   char *header;
+   int fd, err, rval = 1;
+
+   header = malloc(t->header);
+   if (!header)
+      return 1;
+   memcpy(header, t->data, t->header);
+   template_set_time(header, first - 1);
+
+   fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0)
+      {
+         err_msg("Unable to create %s: %s", path, strerror(errno));
+         free(header);
+         return 1;
+      }
+   /* Claim the whole file up front, so it is laid out in one piece.  A
+    * file system that cannot still takes the plain writes below. */
+   err = posix_fallocate(fd, 0, t->size);
+   if (err == ENOSPC)
+      {
+         err_msg("Unable to create %s: %s", path, strerror(err));
+         close(fd);
+         free(header);
+         return 1;
+      }
+   if (err)
+      debug_msg("Unable to preallocate %s: %s", path, strerror(err));
+   /* On disk before the rename, or a crash could leave an empty RRD. */
+   if (write(fd, header, t->header) == (ssize_t) t->header
+       && write(fd, t->data + t->header, t->size - t->header)
+          == (ssize_t) (t->size - t->header)
+       && !fsync(fd))
+      rval = 0;
+   else
+      err_msg("Unable to write %s: %s", path, strerror(errno));
+   if (close(fd))
+      rval = 1;
+   free(header);
+   return rval;
+#else
+   return 1;
+#endif
+}
+
+static void *
+create_thread(void *arg)
+{
+   char tmp[PATHSIZE + 8];
+   rrd_create_req_t *r, **rp;
+   rrd_template_t *t;
+   unsigned int first, created = 0;
+   char **argv = NULL;
+   unsigned int i;
+   char *p;
+   int fd, rval;
+
+   for (;;)
+      {
+         pthread_mutex_lock(&create_mutex);
+         while (!create_head)
+            {
+               if (created)
+                  debug_msg("Created %u RRDs", created);
+               created = 0;
+               pthread_cond_wait(&create_wanted, &create_mutex);
+            }
+         r = create_head;
+         create_head = r->next_queued;
+         if (!create_head)
+            create_tail = NULL;
+         first = r->n ? strtoul(r->buf, NULL, 10) : time(0);
+         pthread_mutex_unlock(&create_mutex);
+
+         /* Build the file aside, so that nothing ever sees half an RRD. */
+         snprintf(tmp, sizeof(tmp), "%s.new", r->path);
+         t = template_get(r->step, r->summary, r->slope);
+         if (t && t->data)
+            rval = template_clone(t, tmp, first);
+         else
+            {
+               rval = RRD_create(tmp, r->summary, r->step, first, r->slope);
+               if (!rval && (fd = open(tmp, O_RDONLY)) >= 0)
+                  {
+                     if (fsync(fd))
+                        {
+                           err_msg("Unable to write %s: %s", tmp,
+                                   strerror(errno));
+                           rval = 1;
+                        }
+                     close(fd);
+                  }
+            }
+
+         /* The values that came meanwhile go in before any that come
+          * after the rename: those wait for rrd_mutex, or find the
+          * request gone and the file there. */
+         pthread_mutex_lock(&create_mutex);
+         pthread_mutex_lock(&rrd_mutex);
+         if (!rval && rename(tmp, r->path))
+            {
+               err_msg("Unable to rename %s: %s", tmp, strerror(errno));
+               rval = 1;
+            }
+         for (rp = &create_hash[path_hash(r->path) % CREATE_HASH]; *rp != r;
+              rp = &(*rp)->next)
+            ;
+         *rp = r->next;
+         pthread_mutex_unlock(&create_mutex);
+
+         if (rval)
+            unlink(tmp);
+         else if ((argv = malloc((r->n + 2) * sizeof(*argv))))
+            {
+               for (i = 0, p = r->buf; i < r->n; i++, p += strlen(p) + 1)
+                  argv[i + 2] = p;
+               RRD_update_values(r->path, argv, r->n);
+               free(argv);
+            }
+         pthread_mutex_unlock(&rrd_mutex);
+         if (!rval)
+            created++;
+
+         free(r->path);
+         free(r->buf);
+         free(r);
+      }
+   return NULL;
+}
+
+static void
+create_start(void)
+{
+   pthread_attr_t attr;
+   pthread_t pid;
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   pthread_create(&pid, &attr, create_thread, NULL);
+   pthread_attr_destroy(&attr);
+}
+
+/* Queues rrd to be created with the n values in vals, if it does not
+ * exist.  Returns 0 if they were queued, nonzero if rrd exists now and
+ * they should be written to it as usual. */
+static int
+RRD_create_queued( const char *rrd, int summary, unsigned int step,
+                   ganglia_slope_t slope, char **vals, unsigned int n )
+{
+   rrd_create_req_t *r;
+   unsigned int h, i, t;
+   struct stat st;
+
+   pthread_once(&create_once, create_start);
+
+   h = path_hash(rrd) % CREATE_HASH;
+   pthread_mutex_lock(&create_mutex);
+   for (r = create_hash[h]; r; r = r->next)
+      if (!strcmp(r->path, rrd))
+         break;
+   if (!r)
+      {
+         if (!stat(rrd, &st))
+            {
+               pthread_mutex_unlock(&create_mutex);
+               return 1;
+            }
+         r = calloc(1, sizeof(*r));
+         if (!r || !(r->path = strdup(rrd)))
+            {
+               free(r);
+               pthread_mutex_unlock(&create_mutex);
+               err_msg("Unable to queue the creation of %s", rrd);
+               return 0;
+            }
+         r->step = step;
+         r->summary = summary;
+         r->slope = slope;
+         r->next = create_hash[h];
+         create_hash[h] = r;
+         if (create_tail)
+            create_tail->next_queued = r;
+         else
+            create_head = r;
+         create_tail = r;
+      }
+
+   for (i = 0; i < n; i++)
+      {
+         /* librrd refuses a time it has already seen. */
+         t = strtoul(vals[i], NULL, 10);
+         if (t <= r->last)
+            continue;
+         if (values_append(&r->buf, &r->len, &r->size, vals[i]))
+            {
+               err_msg("Unable to keep a value for %s", rrd);
+               break;
+            }
+         r->last = t;
+         r->n++;
+      }
+   /* The creator takes a request once it has a value to start from. */
+   if (r->n)
+      pthread_cond_signal(&create_wanted);
+   pthread_mutex_unlock(&create_mutex);
+   return 0;
+}
+
+
+/* The write-behind cache.  With rrd_cache_flush set, updates collect in
+ * memory for each RRD and go to disk together, as one rrd_update of
+ * many values, once the oldest of them is rrd_cache_flush seconds old
+ * (or sooner once more than rrd_cache_values are waiting).  RRD files
+ * see a fraction of the writes; in exchange, graphs lag by up to the
+ * flush interval.
+ *
+ * Every value is also appended to a journal in rrd_journal_dir before it
+ * is cached, so none is lost if gmetad dies: the journal is replayed on
+ * startup.  The journal is started afresh every flush interval, and an
+ * old journal is deleted once every value written before it was closed
+ * has been flushed.  A journal line is "step slope time:sum[:num] path".
+ */
+
+#define CACHE_HASH_MIN 4096
+#define JOURNAL_BUFSIZE 65536
+
+typedef struct rrd_entry
+   {
+      struct rrd_entry *next;       /* In the hash chain. */
+      struct rrd_entry *next_dirty; /* In the flush queue. */
+      char *path;
+      unsigned int step;
+      ganglia_slope_t slope;
+      int summary;
+      int dirty;
+      time_t dirtied;               /* When the oldest value came. */
+      unsigned int last;            /* Time of the newest value. */
+      unsigned int n;               /* Values in buf. */
+      char *buf;                    /* NUL separated update strings. */
+      size_t len;
+      size_t size;
+   }
+rrd_entry_t;
+
+typedef struct rrd_journal
+   {
+      struct rrd_journal *next;
+      char *path;
+      time_t closed;
+   }
+rrd_journal_t;
+
+static int rrd_cache_on;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_pressure = PTHREAD_COND_INITIALIZER;
+static rrd_entry_t **cache_hash;
+static unsigned int cache_hash_size;
+static unsigned int cache_entries;
+static rrd_entry_t *dirty_head, *dirty_tail;
+static unsigned long cache_values;  /* Waiting, over all entries. */
+
+static FILE *journal;
+static char *journal_path;
+static time_t journal_opened;
+static unsigned int journal_seq;
+static rrd_journal_t *old_journals, *old_journals_tail;
+
+static unsigned int
+cache_hash_path(const char *s)
+{
+   unsigned int h = 2166136261u;
+
+   while (*s)
+      {
+         h ^= (unsigned char) *s++;
+         h *= 16777619;
+      }
+   return h;
+}
+
+static void
+cache_rehash(void)
+{
+   unsigned int size = cache_hash_size ? cache_hash_size * 2 : CACHE_HASH_MIN;
+   rrd_entry_t **table = calloc(size, sizeof(*table));
+   rrd_entry_t *e, *next;
+   unsigned int i, h;
+
+   if (!table)
+      return;
+   for (i = 0; i < cache_hash_size; i++)
+      for (e = cache_hash[i]; e; e = next)
+         {
+            next = e->next;
+            h = cache_hash_path(e->path) & (size - 1);
+            e->next = table[h];
+            table[h] = e;
+         }
+   free(cache_hash);
+   cache_hash = table;
+   cache_hash_size = size;
+}
+
+static rrd_entry_t *
+cache_entry(const char *path, unsigned int step, ganglia_slope_t slope,
+            int summary)
+{
+   rrd_entry_t *e;
+   unsigned int h;
+
+   if (cache_entries >= cache_hash_size)
+      cache_rehash();
+   if (!cache_hash)
+      return NULL;
+   h = cache_hash_path(path) & (cache_hash_size - 1);
+   for (e = cache_hash[h]; e; e = e->next)
+      if (!strcmp(e->path, path))
+         return e;
+
+   e = calloc(1, sizeof(*e));
+   if (!e || !(e->path = strdup(path)))
+      {
+         free(e);
+         return NULL;
+      }
+   e->step = step;
+   e->slope = slope;
+   e->summary = summary;
+   e->next = cache_hash[h];
+   cache_hash[h] = e;
+   cache_entries++;
+   return e;
+}
+
+/* Opens a new journal.  The name sorts in the order journals were
+ * started in, for replay. */
+static int
+journal_open(time_t now)
+{
+   char path[PATHSIZE + 1];
+   int fd;
+
+   snprintf(path, sizeof(path), "%s/rrd.journal.%010lu.%06u",
+            gmetad_config.rrd_journal_dir, (unsigned long) now,
+            journal_seq++ % 1000000);
+   fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+   if (fd < 0 || !(journal = fdopen(fd, "a")))
+      {
+         err_msg("Unable to open the RRD journal %s: %s", path,
+                 strerror(errno));
+         if (fd >= 0)
+            close(fd);
+         return 1;
+      }
+   setvbuf(journal, NULL, _IOFBF, JOURNAL_BUFSIZE);
+   journal_path = strdup(path);
+   journal_opened = now;
+   return 0;
+}
+
+/* Closes the journal, to be deleted once its values are flushed. */
+static void
+journal_close(time_t now)
+{
+   rrd_journal_t *j;
+
+   if (!journal)
+      return;
+   fflush(journal);
+   fsync(fileno(journal));
+   fclose(journal);
+   journal = NULL;
+
+   j = calloc(1, sizeof(*j));
+   if (!j)
+      {
+         /* It stays on disk, and is replayed needlessly. */
+         free(journal_path);
+         journal_path = NULL;
+         return;
+      }
+   j->path = journal_path;
+   j->closed = now;
+   if (old_journals_tail)
+      old_journals_tail->next = j;
+   else
+      old_journals = j;
+   old_journals_tail = j;
+   journal_path = NULL;
+}
+
+/* Deletes the old journals whose values have all been flushed.  Every
+ * value still waiting came no later than the head of the flush queue. */
+static void
+journal_expire(void)
+{
+   rrd_journal_t *j;
+
+   while ((j = old_journals) && (!dirty_head || dirty_head->dirtied > j->closed))
+      {
+         unlink(j->path);
+         old_journals = j->next;
+         if (!old_journals)
+            old_journals_tail = NULL;
+         free(j->path);
+         free(j);
+      }
+}
+
+/* Adds a value for rrd to the cache, and to the journal.  Called with
+ * cache_mutex held. */
+static int
+cache_add(const char *rrd, const char *val, unsigned int step,
+          ganglia_slope_t slope, int summary, unsigned int process_time)
+{
+   rrd_entry_t *e;
+
+   e = cache_entry(rrd, step, slope, summary);
+   if (!e)
+      {
+         err_msg("Unable to cache an update of %s", rrd);
+         return 1;
+      }
+   /* librrd refuses a time it has already seen. */
+   if (process_time <= e->last)
+      return 0;
+
+   if (values_append(&e->buf, &e->len, &e->size, val))
+      {
+         err_msg("Unable to cache an update of %s", rrd);
+         return 1;
+      }
+   e->n++;
+   e->last = process_time;
+   cache_values++;
+
+   if (!e->dirty)
+      {
+         e->dirty = 1;
+         e->dirtied = time(0);
+         e->next_dirty = NULL;
+         if (dirty_tail)
+            dirty_tail->next_dirty = e;
+         else
+            dirty_head = e;
+         dirty_tail = e;
+      }
+
+   if (journal)
+      fprintf(journal, "%u %d %s %s\n", step, (int) slope, val, rrd);
+
+   if (cache_values > (unsigned long) gmetad_config.rrd_cache_values)
+      pthread_cond_signal(&cache_pressure);
+   return 0;
+}
+
+static int
+RRD_update_cached( char *rrd, const char *sum, const char *num,
+                   unsigned int step, unsigned int process_time,
+                   ganglia_slope_t slope )
+{
+   char val[128];
+   int rval;
+
+   if (num)
+      snprintf(val, sizeof(val), "%u:%s:%s", process_time, sum, num);
+   else
+      snprintf(val, sizeof(val), "%u:%s", process_time, sum);
+
+   pthread_mutex_lock(&cache_mutex);
+   rval = cache_add(rrd, val, step, slope, num != NULL, process_time);
+   pthread_mutex_unlock(&cache_mutex);
+   return rval;
+}
+
+/* Writes n cached values, oldest first, to rrd in one update, or hands
+ * them to the creator if the RRD is new. */
+static void
+cache_write(rrd_entry_t *e, char *buf, unsigned int n)
+{
+   char **argv;
+   char *p;
+   unsigned int i;
+   struct stat st;
+
+   argv = malloc((n + 2) * sizeof(*argv));
+   if (!argv)
+      {
+         err_msg("Unable to write %u cached values to %s", n, e->path);
+         return;
+      }
+   for (i = 0, p = buf; i < n; i++, p += strlen(p) + 1)
+      argv[i + 2] = p;
+
+   if (!stat(e->path, &st)
+       || RRD_create_queued(e->path, e->summary, e->step, e->slope,
+                            argv + 2, n))
+      {
+         pthread_mutex_lock( &rrd_mutex );
+         RRD_update_values(e->path, argv, n);
+         pthread_mutex_unlock( &rrd_mutex );
+      }
+   free(argv);
+}
+
+/* Takes the entry at the head of the flush queue and writes it out.
+ * Called, and returns, with cache_mutex held. */
+static void
+cache_flush_head(void)
+{
+   rrd_entry_t *e = dirty_head;
+   char *buf = e->buf;
+   unsigned int n = e->n;
+
+   dirty_head = e->next_dirty;
+   if (!dirty_head)
+      dirty_tail = NULL;
+   e->dirty = 0;
+   e->buf = NULL;
+   e->len = e->size = 0;
+   e->n = 0;
+   cache_values -= n;
+
+   /* Values that come meanwhile queue the entry again, behind these. */
+   pthread_mutex_unlock(&cache_mutex);
+   cache_write(e, buf, n);
+   free(buf);
+   pthread_mutex_lock(&cache_mutex);
+}
+
+static void *
+cache_thread(void *arg)
+{
+   unsigned long low_water = gmetad_config.rrd_cache_values / 4 * 3;
+   struct timespec ts;
+   unsigned int flushed;
+   time_t now;
+
+   pthread_mutex_lock(&cache_mutex);
+   for (;;)
+      {
+         ts.tv_sec = time(0) + 1;
+         ts.tv_nsec = 0;
+         pthread_cond_timedwait(&cache_pressure, &cache_mutex, &ts);
+
+         now = time(0);
+         flushed = 0;
+         if (cache_values > (unsigned long) gmetad_config.rrd_cache_values)
+            {
+               debug_msg("RRD cache holds %lu values, flushing the oldest",
+                         cache_values);
+               while (dirty_head && cache_values > low_water)
+                  {
+                     cache_flush_head();
+                     flushed++;
+                  }
+            }
+         while (dirty_head
+                && dirty_head->dirtied + gmetad_config.rrd_cache_flush <= now)
+            {
+               cache_flush_head();
+               flushed++;
+            }
+         if (flushed)
+            debug_msg("Flushed %u cached RRDs, %lu values still cached",
+                      flushed, cache_values);
+
+         if (journal)
+            fflush(journal);
+         if (!journal || now - journal_opened >= gmetad_config.rrd_cache_flush)
+            {
+               journal_close(now);
+               journal_open(now);
+            }
+         journal_expire();
+      }
+   return NULL;
+}
+
+/* Replays an old journal into the cache, which journals the values again. */
+static void
+journal_replay(const char *path)
+{
+   char line[PATHSIZE + 256];
+   char val[128];
+   unsigned int step, lines = 0;
+   int slope, pos;
+   char *rrd, *nl, *p;
+   FILE *f;
+
+   f = fopen(path, "r");
+   if (!f)
+      {
+         err_msg("Unable to replay the RRD journal %s: %s", path,
+                 strerror(errno));
+         return;
+      }
+   while (fgets(line, sizeof(line), f))
+      {
+         nl = strchr(line, '\n');
+         /* A line cut short by a crash is of no use. */
+         if (!nl)
+            continue;
+         *nl = '\0';
+         if (sscanf(line, "%u %d %127s %n", &step, &slope, val, &pos) != 3
+             || !(p = strchr(val, ':')))
+            continue;
+         rrd = line + pos;
+         cache_add(rrd, val, step, (ganglia_slope_t) slope,
+                   strchr(p + 1, ':') != NULL,
+                   strtoul(val, NULL, 10));
+         lines++;
+      }
+   fclose(f);
+   debug_msg("Replayed %u values from %s", lines, path);
+}
+
+static int
+cmp_names(const void *a, const void *b)
+{
+   return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Starts the cache: replays what an earlier gmetad left in the journal,
+ * then writes out cached values in the background. */
+void
+rrd_cache_start(void)
+{
+   char path[PATHSIZE + 1];
+   char **names = NULL, **tmp;
+   unsigned int nnames = 0, i;
+   pthread_attr_t attr;
+   pthread_t pid;
+   struct dirent *d;
+   DIR *dp;
+
+   my_mkdir(gmetad_config.rrd_journal_dir);
+   dp = opendir(gmetad_config.rrd_journal_dir);
+   if (!dp)
+      err_sys("Unable to read the RRD journal directory %s",
+              gmetad_config.rrd_journal_dir);
+   while ((d = readdir(dp)))
+      {
+         if (strncmp(d->d_name, "rrd.journal.", 12))
+            continue;
+         tmp = realloc(names, (nnames + 1) * sizeof(*names));
+         if (!tmp || !(tmp[nnames] = strdup(d->d_name)))
+            err_quit("Unable to allocate the RRD journal list");
+         names = tmp;
+         nnames++;
+      }
+   closedir(dp);
+   if (nnames)
+      qsort(names, nnames, sizeof(*names), cmp_names);
+
+   pthread_mutex_lock(&cache_mutex);
+   if (journal_open(time(0)))
+      err_quit("The RRD cache needs a journal in %s",
+               gmetad_config.rrd_journal_dir);
+   for (i = 0; i < nnames; i++)
+      {
+         snprintf(path, sizeof(path), "%s/%s", gmetad_config.rrd_journal_dir,
+                  names[i]);
+         journal_replay(path);
+      }
+   /* The replayed values are safe in the new journal before the old
+    * ones go. */
+   fflush(journal);
+   fsync(fileno(journal));
+   for (i = 0; i < nnames; i++)
+      {
+         snprintf(path, sizeof(path), "%s/%s", gmetad_config.rrd_journal_dir,
+                  names[i]);
+         unlink(path);
+         free(names[i]);
+      }
+   free(names);
+   rrd_cache_on = 1;
+   pthread_mutex_unlock(&cache_mutex);
+
+   debug_msg("RRD cache: flushing every %d seconds, journal in %s",
+             gmetad_config.rrd_cache_flush, gmetad_config.rrd_journal_dir);
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   pthread_create(&pid, &attr, cache_thread, NULL);
+   pthread_attr_destroy(&attr);
+}
+
+/* Hands the journaled values to the kernel, so they outlive gmetad. */
+void
+rrd_cache_sync(void)
+{
+   if (!rrd_cache_on)
+      return;
+   pthread_mutex_lock(&cache_mutex);
+   if (journal)
+      fflush(journal);
+   pthread_mutex_unlock(&cache_mutex);
+}
+
+
 /* A summary RRD has a "num" and a "sum" DS (datasource) whereas the
    host rrds only have "sum" (since num is always 1) */
 static int
@@ -162,24 +1114,33 @@ push_data_to_rrd( char *rrd, const char *sum, const char *num,
                   unsigned int step, unsigned int process_time,
                   ganglia_slope_t slope)
 {
-   int rval;
    int summary;
    struct stat st;
+   char val[128], *vals[1];
 
    /*  if process_time is undefined, we set it to the current time */
    if (!process_time)
       process_time = time(0);
 
+   if (rrd_cache_on)
+      return RRD_update_cached( rrd, sum, num, step, process_time, slope );
+
    if (num)
       summary=1;
    else
       summary=0;
 
+   /* A new RRD is created in the background, and takes this value once
+    * it is there. */
    if( stat(rrd, &st) )
       {
-         rval = RRD_create( rrd, summary, step, process_time, slope);
-         if( rval )
-            return rval;
+         if (num)
+            snprintf(val, sizeof(val), "%u:%s:%s", process_time, sum, num);
+         else
+            snprintf(val, sizeof(val), "%u:%s", process_time, sum);
+         vals[0] = val;
+         if (!RRD_create_queued( rrd, summary, step, slope, vals, 1 ))
+            return 0;
       }
    return RRD_update( rrd, sum, num, process_time );
 }
@@ -242,7 +1203,7 @@ void init_sockaddr (struct sockaddr_in *name, const char *hostname, uint16_t por
   name->sin_addr = *(struct in_addr *) hostinfo->h_addr;
 }
 
-static int
+int
 push_data_to_carbon( char *graphite_msg)
 {
   int port;
@@ -250,6 +1211,7 @@ push_data_to_carbon( char *graphite_msg)
   struct sockaddr_in server;
   int carbon_timeout ;
   int nbytes;
+  size_t len;
   struct pollfd carbon_struct_poll;
   int poll_rval;
   int fl;
@@ -292,17 +1254,31 @@ push_data_to_carbon( char *graphite_msg)
   /* Send data to the server when the socket becomes ready */
   if( poll_rval < 0 ) {
     debug_msg("carbon proxy:: poll() error");
+    close(carbon_socket);
+    return EXIT_FAILURE;
   } else if ( poll_rval == 0 ) {
     debug_msg("carbon proxy:: Timeout connecting to %s",gmetad_config.carbon_server);
+    close(carbon_socket);
+    return EXIT_FAILURE;
   } else {
     if( carbon_struct_poll.revents & POLLOUT ) {
       /* Ready to send data to the server. */
       debug_msg("carbon proxy:: %s is ready to receive",gmetad_config.carbon_server);
-      nbytes = write (carbon_socket, graphite_msg, strlen(graphite_msg) + 1);
-      if (nbytes < 0) {
-        err_msg("write: %s", strerror(errno));
-        close(carbon_socket);
-        return EXIT_FAILURE;
+      /* The carbon sink sends many lines at once, more than the socket
+       * may take in one write. */
+      len = strlen(graphite_msg) + 1;
+      while (len > 0) {
+        nbytes = write (carbon_socket, graphite_msg, len);
+        if (nbytes < 0 && errno == EAGAIN
+            && poll( &carbon_struct_poll, 1, carbon_timeout ) > 0)
+          continue;
+        if (nbytes < 0) {
+          err_msg("write: %s", strerror(errno));
+          close(carbon_socket);
+          return EXIT_FAILURE;
+        }
+        graphite_msg += nbytes;
+        len -= nbytes;
       }
     } else if ( carbon_struct_poll.revents & POLLHUP ) {
       debug_msg("carbon proxy:: Recvd an RST from %s during transmission",gmetad_config.carbon_server);
@@ -357,13 +1333,15 @@ write_data_to_memcached ( const char *cluster, const char *host, const char *met
 }
 #endif /* WITH_MEMCACHED */
 
+/* Builds the carbon line for a value in graphite_msg, which has room for
+ * CARBON_MSGSIZE bytes. */
 int
-write_data_to_carbon ( const char *source, const char *host, const char *metric, 
-                    const char *sum, unsigned int process_time )
+carbon_message ( char *graphite_msg, const char *source, const char *host,
+                 const char *metric, const char *sum,
+                 unsigned int process_time )
 {
 
 	char s_process_time[15];
-   char graphite_msg[ PATHSIZE + 1 ];
    int i;
 
    /*  if process_time is undefined, we set it to the current time */
@@ -435,5 +1413,15 @@ write_data_to_carbon ( const char *source, const char *host, const char *metric,
 
 	graphite_msg[strlen(graphite_msg)+1] = 0;
 
+   return 0;
+}
+
+int
+write_data_to_carbon ( const char *source, const char *host, const char *metric, 
+                    const char *sum, unsigned int process_time )
+{
+   char graphite_msg[ CARBON_MSGSIZE ];
+
+   carbon_message( graphite_msg, source, host, metric, sum, process_time );
    return push_data_to_carbon( graphite_msg );
 }
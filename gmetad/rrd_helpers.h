@@ -1,5 +1,8 @@
 #include "ganglia.h"
 
+/* Room for a carbon line, and for an RRD path. */
+#define CARBON_MSGSIZE 4097
+
 #ifdef WITH_MEMCACHED
 #include <libmemcached-1.0/memcached.h>
 #include <libmemcachedutil-1.0/util.h>
@@ -10,6 +13,13 @@ write_data_to_rrd ( const char *source, const char *host, const char *metric,
                     const char *sum, const char *num, unsigned int step,
                     unsigned int process_time, ganglia_slope_t slope);
 
+/* The write-behind cache for RRD updates (rrd_cache_flush). */
+void
+rrd_cache_start ( void );
+
+void
+rrd_cache_sync ( void );
+
 #ifdef WITH_MEMCACHED
 int
 write_data_to_memcached ( const char *cluster, const char *host, const char *metric, 
@@ -19,3 +29,11 @@ write_data_to_memcached ( const char *cluster, const char *host, const char *met
 int
 write_data_to_carbon ( const char *source, const char *host, const char *metric, 
                     const char *sum, unsigned int process_time);
+
+int
+carbon_message ( char *graphite_msg, const char *source, const char *host,
+                 const char *metric, const char *sum,
+                 unsigned int process_time );
+
+int
+push_data_to_carbon ( char *graphite_msg );
@@ -10,10 +10,14 @@
 #include <sys/time.h>
 #endif
 #include <string.h>
+#include <fnmatch.h>
 #include "dtd.h"
 #include "gmetad.h"
 #include "my_inet_ntop.h"
+#include "metric_index.h"
+#include "sink.h"
 #include "server_priv.h"
+#include "gm_number.h"
 
 extern g_tcp_socket *server_socket;
 extern pthread_mutex_t  server_socket_mutex;
@@ -26,6 +30,7 @@ extern gmetad_config_t gmetad_config;
 
 extern char* getfield(char *buf, short int index);
 extern struct type_tag* in_type_list (char *, unsigned int);
+extern int event_conn_write(struct event_conn *conn, const char *buf, size_t len);
 
 
 static inline int CHECK_FMT(2, 3)
@@ -47,6 +52,18 @@ xml_print( client_t *client, const char *fmt, ... )
 
    len = strlen(buf);
 
+   if (client->conn)
+      {
+         /* The event server sends it when the socket is writable. */
+         va_end(ap);
+         if (event_conn_write(client->conn, buf, len))
+            {
+               client->valid = 0;
+               return 1;
+            }
+         return 0;
+      }
+
    SYS_CALL( rval, write( client->fd, buf, len)); 
    if ( rval < 0 && rval != len ) 
       {
@@ -71,6 +88,10 @@ metric_summary(datum_t *key, datum_t *val, void *arg)
    struct type_tag *tt;
    int rc,i;
 
+   if (client->selective && client->query.nmetrics
+         && !query_glob(client->query.metrics, client->query.nmetrics, name))
+      return 0;
+
    type = getfield(metric->strings, metric->type);
 
    tt = in_type_list(type, strlen(type));
@@ -83,10 +104,11 @@ metric_summary(datum_t *key, datum_t *val, void *arg)
       {
          case INT:
          case UINT:
-            sprintf(sum, "%.f", metric->val.d);
+            gm_format_fixed(sum, sizeof(sum), metric->val.d, 0);
             break;
          case FLOAT:
-            sprintf(sum, "%.*f", (int) metric->precision, metric->val.d);
+            gm_format_fixed(sum, sizeof(sum), metric->val.d,
+                            metric->precision);
             break;
          default:
             break;
@@ -132,6 +154,135 @@ source_summary(Source_t *source, client_t *client)
 }
 
 
+/* Writes the METRIC_DEF signature of a metric into buf: everything we
+ * report about it except its value and TN. Returns -1 if it does not fit.
+ */
+static int
+metric_signature(char *buf, int len, const char *name, Metric_t *metric)
+{
+   int i, n, off;
+
+   off = snprintf(buf, len, "%s\001%s\001%s\001%u\001%u\001%s\001%s",
+      name, getfield(metric->strings, metric->type),
+      getfield(metric->strings, metric->units),
+      metric->tmax, metric->dmax, getfield(metric->strings, metric->slope),
+      getfield(metric->strings, metric->source));
+   if (off < 0 || off >= len)
+      return -1;
+
+   for (i=0; i<metric->ednameslen; i++)
+      {
+         n = snprintf(buf + off, len - off, "\001%s\001%s",
+                      getfield(metric->strings, metric->ednames[i]),
+                      getfield(metric->strings, metric->edvalues[i]));
+         if (n < 0 || n >= len - off)
+            return -1;
+         off += n;
+      }
+   return off;
+}
+
+
+/* Looks up the METRIC_DEF ID of a metric in the current cluster. */
+static int
+metric_def_id(client_t *client, const char *name, Metric_t *metric,
+              unsigned int *id)
+{
+   char sig[2 * GMETAD_FRAMESIZE];
+   datum_t sigkey, *found;
+
+   if (metric_signature(sig, sizeof(sig), name, metric) < 0)
+      return 0;
+
+   sigkey.data = sig;
+   sigkey.size = strlen(sig) + 1;
+   found = hash_lookup(&sigkey, client->defs);
+   if (!found)
+      return 0;
+
+   memcpy(id, found->data, sizeof(*id));
+   datum_free(found);
+   return 1;
+}
+
+
+static int
+metric_def_report(datum_t *key, datum_t *val, void *arg)
+{
+   client_t *client = (client_t*) arg;
+   char *name = (char*) key->data;
+   Metric_t *metric = (Metric_t*) val->data;
+   char sig[2 * GMETAD_FRAMESIZE];
+   datum_t sigkey, idval, *found;
+   unsigned int id;
+   int rc, i;
+
+   if (metric_signature(sig, sizeof(sig), name, metric) < 0)
+      return 0;   /* Reported in full. */
+
+   sigkey.data = sig;
+   sigkey.size = strlen(sig) + 1;
+   found = hash_lookup(&sigkey, client->defs);
+   if (found)
+      {
+         datum_free(found);
+         return 0;
+      }
+
+   id = client->ndefs++;
+   idval.data = &id;
+   idval.size = sizeof(id);
+   if (!hash_insert(&sigkey, &idval, client->defs))
+      return 1;
+
+   rc=xml_print(client, "<METRIC_DEF ID=\"%u\" NAME=\"%s\" TYPE=\"%s\" "
+      "UNITS=\"%s\" TMAX=\"%u\" DMAX=\"%u\" SLOPE=\"%s\" SOURCE=\"%s\">\n",
+      id, name, getfield(metric->strings, metric->type),
+      getfield(metric->strings, metric->units),
+      metric->tmax, metric->dmax, getfield(metric->strings, metric->slope),
+      getfield(metric->strings, metric->source));
+
+   rc = xml_print(client, "<EXTRA_DATA>\n");
+
+   for (i=0; !rc && i<metric->ednameslen; i++) 
+     {
+       rc=xml_print(client, "<EXTRA_ELEMENT NAME=\"%s\" VAL=\"%s\"/>\n",
+                    getfield(metric->strings, metric->ednames[i]),
+                    getfield(metric->strings, metric->edvalues[i]));
+     }
+
+   rc = xml_print(client, "</EXTRA_DATA>\n");
+   rc = xml_print(client, "</METRIC_DEF>\n");
+   return rc;
+}
+
+
+static int
+host_defs_report(datum_t *key, datum_t *val, void *arg)
+{
+   Host_t *host = (Host_t*) val->data;
+
+   return hash_foreach(host->metrics, metric_def_report, arg);
+}
+
+
+/* Declares the distinct metric metadata of a cluster once, before its
+ * hosts, for the compact dialect. */
+static int
+metric_defs_report(Source_t *source, client_t *client)
+{
+   if (client->defs)
+      hash_destroy(client->defs);
+
+   client->defs = hash_create(DEFAULT_METRICSIZE);
+   if (!client->defs)
+      return 1;
+   client->ndefs = 0;
+
+   return hash_foreach(source->authority, host_defs_report, (void*) client);
+}
+
+
 int
 metric_report_start(Generic_t *self, datum_t *key, client_t *client, void *arg)
 {
@@ -139,6 +290,7 @@ metric_report_start(Generic_t *self, datum_t *key, client_t *client, void *arg)
    char *name = (char*) key->data;
    Metric_t *metric = (Metric_t*) self;
    long tn = 0;
+   unsigned int id;
 
    tn = client->now.tv_sec - metric->t0.tv_sec;
    if (tn<0) tn = 0;
@@ -146,6 +298,12 @@ metric_report_start(Generic_t *self, datum_t *key, client_t *client, void *arg)
    if (metric->dmax && metric->dmax < tn)
      return 0;
 
+   /* Metrics that changed since their cluster's METRIC_DEFs went out are
+    * reported in full. */
+   if (client->defs && metric_def_id(client, name, metric, &id))
+      return xml_print(client, "<METRIC DEF=\"%u\" VAL=\"%s\" TN=\"%u\"/>\n",
+         id, getfield(metric->strings, metric->valstr), (unsigned int) tn);
+
    rc=xml_print(client, "<METRIC NAME=\"%s\" VAL=\"%s\" TYPE=\"%s\" "
       "UNITS=\"%s\" TN=\"%u\" TMAX=\"%u\" DMAX=\"%u\" SLOPE=\"%s\" "
       "SOURCE=\"%s\">\n",
@@ -223,6 +381,8 @@ source_report_start(Generic_t *self, datum_t *key, client_t *client, void *arg)
                name, source->localtime, getfield(source->strings, source->owner),
                getfield(source->strings, source->latlong),
                getfield(source->strings, source->url));
+            if (!rc && client->compact && source->authority)
+               rc = metric_defs_report(source, client);
       }
    else
       {
@@ -239,6 +399,12 @@ int
 source_report_end(Generic_t *self,  client_t *client, void *arg)
 {
 
+   if (client->defs)
+      {
+         hash_destroy(client->defs);
+         client->defs = NULL;
+      }
+
    if (self->id == CLUSTER_NODE)
       return xml_print(client, "</CLUSTER>\n");
    else
@@ -246,24 +412,31 @@ source_report_end(Generic_t *self,  client_t *client, void *arg)
 }
 
 
+static int
+http_report_start(client_t *client)
+{
+   /* The event server writes its own HTTP/1.1 headers. */
+   if (!client->http || client->conn)
+      return 0;
+
+   return xml_print(client, "HTTP/1.0 200 OK\r\n"
+                            "Server: gmetad/" GANGLIA_VERSION_FULL "\r\n"
+                            "Content-Type: application/xml\r\n"
+                            "Connection: close\r\n"
+                            "\r\n");
+}
+
+
 /* These are a bit different since they always need to go out. */
 int
 root_report_start(client_t *client)
 {
    int rc;
 
-   if (client->http)
-      {
-         rc = xml_print(client, "HTTP/1.0 200 OK\r\n"
-                                "Server: gmetad/" GANGLIA_VERSION_FULL "\r\n"
-                                "Content-Type: application/xml\r\n"
-                                "Connection: close\r\n"
-                                "\r\n");
-         if (rc)
-            return rc;
-      }
+   rc = http_report_start(client);
+   if (rc) return rc;
 
-   rc = xml_print(client, DTD);
+   rc = xml_print(client, "%s", client->compact ? DTD_COMPACT : DTD);
    if (rc) return 1;
 
    rc = xml_print(client, "<GANGLIA_XML VERSION=\"%s\" SOURCE=\"gmetad\">\n", 
@@ -332,32 +505,751 @@ applyfilter(client_t *client, Generic_t *node)
 }
 
 
-/* Processes filter name and sets client->filter. 
- * Assumes path has already been 'cleaned', and that
- * filter points to something like 'filter=[name]'.
+/* Splits a comma separated list into terms. */
+static int
+query_list(char *val, const char **terms, int *n)
+{
+   char *p, *save;
+
+   for (p = strtok_r(val, ",", &save); p; p = strtok_r(NULL, ",", &save))
+      {
+         if (*n == MAX_QUERY_TERMS)
+            return 1;
+         terms[(*n)++] = p;
+      }
+   return 0;
+}
+
+/* Parses a list of metric:op:value predicates. */
+static int
+query_where(query_t *q, char *val)
+{
+   static const char *ops[] = { "eq", "ne", "lt", "le", "gt", "ge" };
+   const char *terms[MAX_QUERY_TERMS];
+   int i, j, n = 0;
+   char *op, *arg, *end;
+   query_pred_t *w;
+
+   if (query_list(val, terms, &n) || q->nwhere + n > MAX_QUERY_TERMS)
+      return 1;
+
+   for (i = 0; i < n; i++)
+      {
+         w = &q->where[q->nwhere++];
+         w->metric = terms[i];
+         op = strchr(terms[i], ':');
+         if (!op)
+            return 1;
+         *op++ = 0;
+         arg = strchr(op, ':');
+         if (!arg)
+            return 1;
+         *arg++ = 0;
+
+         for (j = 0; j < 6 && strcmp(op, ops[j]); j++)
+            ;
+         if (j == 6)
+            return 1;
+         w->op = (query_op_t) j;
+         w->str = arg;
+         w->value = strtod(arg, &end);
+         w->numeric = *arg && !*end;
+      }
+   return 0;
+}
+
+static int
+query_indexed(query_t *q, const char *metric)
+{
+   int i;
+
+   for (i = 0; i < q->nindex; i++)
+      if (!strcmp(metric, q->index[i]))
+         return 1;
+   for (i = 0; i < q->nhistory; i++)
+      if (!strcmp(metric, q->history[i]))
+         return 1;
+   return 0;
+}
+
+/* Processes the query string after the '?' of a request, which looks
+ * like 'filter=summary&metrics=load_*&hosts=web*&where=load_one:gt:2&limit=10'.
+ * Assumes path has already been 'cleaned'.
  */
 int
 processfilter(client_t *client, const char *filter)
 {
-   const char *p=filter;
+   query_t *q = &client->query;
+   char *param, *val, *arg, *save;
+   int i;
 
    client->filter = NO_FILTER;
+   client->selective = 0;
+   q->nmetrics = q->nhosts = q->nwhere = q->nindex = q->nhistory = 0;
+   q->limit = q->reported = 0;
+   q->since = 0;
+   q->stats = NULL;
+   q->sort = NULL;
+
+   strncpy(q->buf, filter, REQUESTLEN);
+   q->buf[REQUESTLEN] = 0;
+
+   for (param = strtok_r(q->buf, "&", &save); param;
+        param = strtok_r(NULL, "&", &save))
+      {
+         val = strchr(param, '=');
+         if (!val)
+            return 1;
+         *val++ = 0;
+
+         if (!strcmp(param, "filter"))
+            {
+               /* This could be done with a gperf hash, etc. */
+               if (!strcmp(val, "summary"))
+                  client->filter = SUMMARY;
+               else
+                  err_msg("Got unknown filter %s", val);
+            }
+         else if (!strcmp(param, "metrics"))
+            {
+               if (query_list(val, q->metrics, &q->nmetrics))
+                  return 1;
+               client->selective = 1;
+            }
+         else if (!strcmp(param, "hosts"))
+            {
+               if (query_list(val, q->hosts, &q->nhosts))
+                  return 1;
+               client->selective = 1;
+            }
+         else if (!strcmp(param, "where"))
+            {
+               if (query_where(q, val))
+                  return 1;
+               client->selective = 1;
+            }
+         else if (!strcmp(param, "index"))
+            {
+               if (!gmetad_config.metric_index)
+                  {
+                     err_msg("Got an index query but metric_index is off");
+                     return 1;
+                  }
+               if (query_list(val, q->index, &q->nindex))
+                  return 1;
+            }
+         else if (!strcmp(param, "history"))
+            {
+               if (!gmetad_config.history_samples)
+                  {
+                     err_msg("Got a history query but history_samples is 0");
+                     return 1;
+                  }
+               if (query_list(val, q->history, &q->nhistory))
+                  return 1;
+            }
+         else if (!strcmp(param, "stats"))
+            {
+               if (strcmp(val, "sinks"))
+                  return 1;
+               q->stats = val;
+            }
+         else if (!strcmp(param, "since"))
+            q->since = strtoul(val, NULL, 10);
+         else if (!strcmp(param, "top") || !strcmp(param, "bottom"))
+            {
+               /* top=metric[:n] is short for top=metric&limit=n */
+               arg = strchr(val, ':');
+               if (arg)
+                  {
+                     *arg++ = 0;
+                     q->limit = atoi(arg);
+                     if (q->limit <= 0)
+                        return 1;
+                  }
+               if (!*val)
+                  return 1;
+               q->sort = val;
+               q->sort_desc = (*param == 't');
+               client->selective = 1;
+            }
+         else if (!strcmp(param, "limit"))
+            {
+               q->limit = atoi(val);
+               if (q->limit < 0)
+                  return 1;
+               client->selective = 1;
+            }
+         else
+            err_msg("Got unknown query parameter %s", param);
+      }
+
+   /* An index query can only test and sort by the metrics it reports. */
+   if (q->nindex || q->nhistory)
+      {
+         for (i = 0; i < q->nwhere; i++)
+            if (!query_indexed(q, q->where[i].metric))
+               return 1;
+         if (q->sort && !query_indexed(q, q->sort))
+            return 1;
+      }
 
-   p = strchr(p, '=');
-   if (!p)
+   return 0;
+}
+
+
+static int
+query_glob(const char * const *globs, int n, const char *name)
+{
+   int i;
+
+   for (i = 0; i < n; i++)
+      if (!fnmatch(globs[i], name, 0))
          return 1;
+   return 0;
+}
+
+static int
+query_compare(query_pred_t *w, const char *val)
+{
+   char *end;
+   double d;
+   int cmp;
 
-   p++;
-   /* This could be done with a gperf hash, etc. */
-   if (!strcmp(p, "summary"))
-      client->filter = SUMMARY;
+   if (w->numeric)
+      {
+         d = strtod(val, &end);
+         if (end == val)
+            return 0;
+         cmp = (d > w->value) - (d < w->value);
+      }
    else
-      err_msg("Got unknown filter %s", filter);
+      cmp = strcmp(val, w->str);
+
+   switch (w->op)
+      {
+      case QUERY_EQ:
+         return cmp == 0;
+      case QUERY_NE:
+         return cmp != 0;
+      case QUERY_LT:
+         return cmp < 0;
+      case QUERY_LE:
+         return cmp <= 0;
+      case QUERY_GT:
+         return cmp > 0;
+      case QUERY_GE:
+         return cmp >= 0;
+      }
+   return 0;
+}
+
+static int
+query_pred(query_pred_t *w, Host_t *host)
+{
+   datum_t key, *found;
+   Metric_t *metric;
+   int rc;
+
+   key.data = (void*) w->metric;
+   key.size = strlen(w->metric) + 1;
+   found = hash_lookup(&key, host->metrics);
+   if (!found)
+      return 0;
+
+   metric = (Metric_t*) found->data;
+   rc = query_compare(w, getfield(metric->strings, metric->valstr));
+   datum_free(found);
+   return rc;
+}
 
+/* Decides whether a host or metric belongs in a selective report before
+ * anything of it is formatted.  Returns 0 to report the node, 1 to skip
+ * it and -1 when the limit has been reached. */
+static int
+query_skip(client_t *client, const char *name, Generic_t *node)
+{
+   query_t *q = &client->query;
+   int i;
+
+   switch (node->id)
+      {
+      case HOST_NODE:
+         if (q->limit && q->reported >= q->limit)
+            return -1;
+         if (q->nhosts && !query_glob(q->hosts, q->nhosts, name))
+            return 1;
+         for (i = 0; i < q->nwhere; i++)
+            if (!query_pred(&q->where[i], (Host_t*) node))
+               return 1;
+         q->reported++;
+         return 0;
+
+      case METRIC_NODE:
+         return q->nmetrics && !query_glob(q->metrics, q->nmetrics, name);
+
+      default:
+         break;
+      }
    return 0;
 }
 
 
+/* The hosts of a top= or bottom= query are picked with a heap bounded by
+ * the query's limit.  Its root is the worst host kept so far, so each
+ * candidate costs O(log k) and no more than k hosts are ever held. */
+struct top_item
+   {
+      double val;
+      hash_t *hosts;  /* The host table of the host's cluster. */
+      void *ref;      /* The host's name, or its index entry. */
+   };
+
+typedef struct
+   {
+      struct top_item *items;
+      int n;
+      int size;
+      int k;          /* Most items kept, 0 for all. */
+      int desc;
+   }
+top_heap_t;
+
+struct top_context
+   {
+      client_t *client;
+      top_heap_t heap;
+      const char *source;
+      hash_t *hosts;
+   };
+
+#define TOP_BETTER(h, a, b) ((h)->desc ? (a) > (b) : (a) < (b))
+
+static void
+top_sift_up(top_heap_t *h, int i)
+{
+   struct top_item t = h->items[i];
+   int p;
+
+   for (; i > 0; i = p)
+      {
+         p = (i - 1) / 2;
+         if (!TOP_BETTER(h, h->items[p].val, t.val))
+            break;
+         h->items[i] = h->items[p];
+      }
+   h->items[i] = t;
+}
+
+static void
+top_sift_down(top_heap_t *h, int i)
+{
+   struct top_item t = h->items[i];
+   int c;
+
+   for (; (c = 2 * i + 1) < h->n; i = c)
+      {
+         /* Follow the worse child. */
+         if (c + 1 < h->n && TOP_BETTER(h, h->items[c].val, h->items[c+1].val))
+            c++;
+         if (!TOP_BETTER(h, t.val, h->items[c].val))
+            break;
+         h->items[i] = h->items[c];
+      }
+   h->items[i] = t;
+}
+
+/* Offers an item to the heap.  Returns the ref of the item that did not
+ * make it, the one offered or the one it pushed out, or NULL. */
+static void *
+top_add(top_heap_t *h, double val, hash_t *hosts, void *ref)
+{
+   struct top_item *items;
+   void *out;
+   int size;
+
+   if (h->k && h->n == h->k)
+      {
+         if (!TOP_BETTER(h, val, h->items[0].val))
+            return ref;
+         out = h->items[0].ref;
+         h->items[0].val = val;
+         h->items[0].hosts = hosts;
+         h->items[0].ref = ref;
+         top_sift_down(h, 0);
+         return out;
+      }
+
+   if (h->n == h->size)
+      {
+         size = h->size ? h->size * 2 : 64;
+         if (h->k && size > h->k)
+            size = h->k;
+         items = realloc(h->items, size * sizeof(*items));
+         if (!items)
+            return ref;
+         h->items = items;
+         h->size = size;
+      }
+   h->items[h->n].val = val;
+   h->items[h->n].hosts = hosts;
+   h->items[h->n].ref = ref;
+   top_sift_up(h, h->n++);
+   return NULL;
+}
+
+static int
+top_cmp_desc(const void *a, const void *b)
+{
+   double x = ((const struct top_item*) a)->val;
+   double y = ((const struct top_item*) b)->val;
+
+   return (x < y) - (x > y);
+}
+
+static int
+top_cmp_asc(const void *a, const void *b)
+{
+   return top_cmp_desc(b, a);
+}
+
+/* Puts the items in report order, best first. */
+static void
+top_sort(top_heap_t *h)
+{
+   if (h->n)
+      qsort(h->items, h->n, sizeof(*h->items),
+            h->desc ? top_cmp_desc : top_cmp_asc);
+}
+
+static int
+top_host(datum_t *key, datum_t *val, void *arg)
+{
+   struct top_context *ctx = (struct top_context*) arg;
+   query_t *q = &ctx->client->query;
+   Host_t *host = (Host_t*) val->data;
+   datum_t mkey, *found;
+   Metric_t *metric;
+   char *name, *valstr, *end;
+   double d;
+   int i;
+
+   if (q->nhosts && !query_glob(q->hosts, q->nhosts, (char*) key->data))
+      return 0;
+   for (i = 0; i < q->nwhere; i++)
+      if (!query_pred(&q->where[i], host))
+         return 0;
+
+   mkey.data = (void*) q->sort;
+   mkey.size = strlen(q->sort) + 1;
+   found = hash_lookup(&mkey, host->metrics);
+   if (!found)
+      return 0;
+   metric = (Metric_t*) found->data;
+   valstr = getfield(metric->strings, metric->valstr);
+   d = strtod(valstr, &end);
+   i = (end != valstr);
+   datum_free(found);
+   if (!i)
+      return 0;
+
+   name = strdup((char*) key->data);
+   if (name)
+      free(top_add(&ctx->heap, d, ctx->hosts, name));
+   return 0;
+}
+
+static int
+top_source(datum_t *key, datum_t *val, void *arg)
+{
+   struct top_context *ctx = (struct top_context*) arg;
+   Source_t *source = (Source_t*) val->data;
+
+   /* Only clusters we are the authority for have hosts. */
+   if (!source->authority)
+      return 0;
+   if (ctx->source && strcmp(ctx->source, (char*) key->data))
+      return 0;
+
+   ctx->hosts = source->authority;
+   hash_foreach(source->authority, top_host, ctx);
+   return 0;
+}
+
+/* Picks the hosts of a sorted tree query before anything is reported, so
+ * the limit holds across every cluster under the path.  Each cluster then
+ * reports its share of them, best first. */
+static void
+top_select(client_t *client, const char *path)
+{
+   query_t *q = &client->query;
+   struct top_context ctx;
+   char source[REQUESTLEN + 1];
+   size_t len;
+
+   memset(&ctx, 0, sizeof(ctx));
+   ctx.client = client;
+   ctx.heap.k = q->limit;
+   ctx.heap.desc = q->sort_desc;
+
+   len = strcspn(path + 1, "/");
+   if (len && strncmp(path + 1, "*", len))
+      {
+         memcpy(source, path + 1, len);
+         source[len] = 0;
+         ctx.source = source;
+      }
+
+   hash_foreach(root.authority, top_source, &ctx);
+   top_sort(&ctx.heap);
+   q->top = ctx.heap.items;
+   q->ntop = ctx.heap.n;
+}
+
+static void
+top_free(client_t *client)
+{
+   query_t *q = &client->query;
+   int i;
+
+   for (i = 0; i < q->ntop; i++)
+      free(q->top[i].ref);
+   free(q->top);
+   q->top = NULL;
+   q->ntop = 0;
+}
+
+static int
+top_report(Generic_t *node, client_t *client)
+{
+   query_t *q = &client->query;
+   datum_t key, *found;
+   int i, rc = 0;
+
+   for (i = 0; !rc && i < q->ntop; i++)
+      {
+         if (q->top[i].hosts != node->children)
+            continue;
+         key.data = q->top[i].ref;
+         key.size = strlen((char*) key.data) + 1;
+         found = hash_lookup(&key, node->children);
+         if (!found)
+            continue;  /* Deleted since we looked. */
+         rc = tree_report(&key, found, client);
+         datum_free(found);
+      }
+   return rc;
+}
+
+/* Reports a node's children, a cluster's hosts in the order of a sorted
+ * query. */
+static void
+report_children(Generic_t *node, client_t *client)
+{
+   if (client->selective && client->query.sort && node->id == CLUSTER_NODE)
+      top_report(node, client);
+   else
+      /* Allow this to stop early (return code = 1) */
+      hash_foreach(node->children, tree_report, (void*) client);
+}
+
+
+/* Writes the recent values of metric on the host of e. */
+static int
+history_series(client_t *client, const char *metric, index_entry_t *e)
+{
+   history_t *h;
+   uint32_t *t = NULL;
+   double *v = NULL;
+   unsigned int j, n = 0;
+   char val[32];
+   int rc;
+
+   h = metric_index_history(e->host, metric);
+   if (h)
+      {
+         n = history_count(h);
+         t = malloc((n ? n : 1) * sizeof(*t));
+         v = malloc((n ? n : 1) * sizeof(*v));
+         if (t && v)
+            n = history_read(h, client->query.since, t, v);
+         else
+            n = 0;
+         history_free(h);
+      }
+
+   rc = xml_print(client, "<SERIES HOST=\"%s\" CLUSTER=\"%s\" NUM=\"%u\" "
+                  "TIMES=\"", e->host->name, e->host->source, n);
+   for (j = 0; !rc && j < n; j++)
+      rc = xml_print(client, j ? " %u" : "%u", t[j]);
+   if (!rc)
+      rc = xml_print(client, "\" VALUES=\"");
+   for (j = 0; !rc && j < n; j++)
+      {
+         gm_format_general(val, sizeof(val), v[j], 15);
+         rc = xml_print(client, j ? " %s" : "%s", val);
+      }
+   if (!rc)
+      rc = xml_print(client, "\"/>\n");
+
+   free(t);
+   free(v);
+   return rc;
+}
+
+/* Answers an index= or history= query from the metric index, with one
+ * linear scan per metric instead of a walk of every host.  The path may
+ * name a cluster, and a host within it. */
+static int
+index_report(client_t *client, char *path)
+{
+   query_t *q = &client->query;
+   index_entry_t *entries, *e;
+   const index_host_t *h;
+   top_heap_t heap;
+   const char *metric, *element;
+   char *source, *host;
+   char type[32], units[32], val[32];
+   int i, j, k, m, n, rc, sorted;
+
+   source = path + 1;
+   host = strchr(source, '/');
+   if (host)
+      {
+         *host++ = 0;
+         if (!*host)
+            host = NULL;
+      }
+
+   rc = http_report_start(client);
+   if (!rc)
+      rc = xml_print(client, "%s", DTD_INDEX);
+   if (!rc)
+      rc = xml_print(client, "<GANGLIA_XML VERSION=\"%s\" SOURCE=\"gmetad\">\n",
+                     VERSION);
+
+   for (i = 0; !rc && i < q->nindex + q->nhistory; i++)
+      {
+         if (i < q->nindex)
+            {
+               metric = q->index[i];
+               element = "METRIC_INDEX";
+            }
+         else
+            {
+               metric = q->history[i - q->nindex];
+               element = "METRIC_HISTORY";
+            }
+
+         n = metric_index_snapshot(metric, &entries, type, units);
+         if (n < 0)
+            {
+               rc = xml_print(client, "<%s NAME=\"%s\" NUM=\"0\" "
+                  "LOCALTIME=\"%u\">\n</%s>\n", element, metric,
+                  (unsigned int) client->now.tv_sec, element);
+               continue;
+            }
+
+         /* Select in place, so NUM can go in the start tag. */
+         sorted = q->sort && !strcmp(q->sort, metric);
+         for (j = k = 0; j < n && (sorted || !q->limit || k < q->limit); j++)
+            {
+               h = entries[j].host;
+               if (*source && strcmp(h->source, source))
+                  continue;
+               if (host && strcmp(h->name, host))
+                  continue;
+               if (q->nhosts && !query_glob(q->hosts, q->nhosts, h->name))
+                  continue;
+               gm_format_general(val, sizeof(val), entries[j].val, 15);
+               for (m = 0; m < q->nwhere; m++)
+                  if (!strcmp(q->where[m].metric, metric)
+                      && !query_compare(&q->where[m], val))
+                     break;
+               if (m < q->nwhere)
+                  continue;
+               entries[k++] = entries[j];
+            }
+
+         if (sorted)
+            {
+               memset(&heap, 0, sizeof(heap));
+               heap.k = q->limit;
+               heap.desc = q->sort_desc;
+               for (j = 0; j < k; j++)
+                  top_add(&heap, entries[j].val, NULL, &entries[j]);
+               top_sort(&heap);
+               k = heap.n;
+            }
+
+         rc = xml_print(client, "<%s NAME=\"%s\" TYPE=\"%s\" "
+            "UNITS=\"%s\" NUM=\"%d\" LOCALTIME=\"%u\">\n", element, metric,
+            type, units, k, (unsigned int) client->now.tv_sec);
+         for (j = 0; !rc && j < k; j++)
+            {
+               e = sorted ? (index_entry_t*) heap.items[j].ref : &entries[j];
+               if (i >= q->nindex)
+                  rc = history_series(client, metric, e);
+               else
+                  {
+                     gm_format_general(val, sizeof(val), e->val, 15);
+                     rc = xml_print(client, "<HOST NAME=\"%s\" CLUSTER=\"%s\" "
+                        "VAL=\"%s\" REPORTED=\"%u\"/>\n", e->host->name,
+                        e->host->source, val, e->reported);
+                  }
+            }
+         if (!rc)
+            rc = xml_print(client, "</%s>\n", element);
+         if (sorted)
+            free(heap.items);
+         free(entries);
+      }
+
+   if (!rc)
+      rc = xml_print(client, "</GANGLIA_XML>\n");
+   return rc;
+}
+
+
+/* Reports how the metric sinks keep up: for each, its queue and the
+ * values it took, wrote, failed and dropped, its recent write rate, and
+ * how long values waited to be written. */
+static int
+stats_report(client_t *client)
+{
+   sink_stats_t st;
+   unsigned long submitted, skipped;
+   int i, rc;
+
+   rc = http_report_start(client);
+   if (!rc)
+      rc = xml_print(client, "%s", DTD_STATS);
+   if (!rc)
+      rc = xml_print(client, "<GANGLIA_XML VERSION=\"%s\" SOURCE=\"gmetad\">\n",
+                     VERSION);
+
+   sink_totals(&submitted, &skipped);
+   if (!rc)
+      rc = xml_print(client, "<VALUES SUBMITTED=\"%lu\" SKIPPED=\"%lu\"/>\n",
+                     submitted, skipped);
+
+   for (i = 0; !rc && i < sink_count(); i++)
+      {
+         sink_stats(i, &st);
+         rc = xml_print(client, "<SINK NAME=\"%s\" POLICY=\"%s\" "
+            "QUEUED=\"%u\" QUEUE_SIZE=\"%u\" SUBMITTED=\"%lu\" "
+            "WRITTEN=\"%lu\" ERRORS=\"%lu\" DROPPED=\"%lu\" RATE=\"%.1f\" "
+            "LAG=\"%.3f\" MAX_LAG=\"%.3f\"/>\n", st.name, st.policy,
+            st.queued, st.queue_size, st.submitted, st.written, st.errors,
+            st.dropped, st.rate, st.lag, st.max_lag);
+      }
+
+   if (!rc)
+      rc = xml_print(client, "</GANGLIA_XML>\n");
+   return rc;
+}
+
+
 /* sacerdoti: An Object Oriented design in C.
  * We use function pointers to approximate virtual method functions.
  * A recursive-descent design.
@@ -371,16 +1263,20 @@ tree_report(datum_t *key, datum_t *val, void *arg)
 
    if (client->filter && !applicable(client->filter, node)) return 1;
 
+   if (client->selective)
+      {
+         rc = query_skip(client, (char*) key->data, node);
+         if (rc)
+            return rc < 0;  /* Past the limit, stop this walk. */
+      }
+
    rc = node->report_start(node, key, client, NULL);
    if (rc) return 1;
 
    applyfilter(client, node);
 
    if (node->children)
-      {
-         /* Allow this to stop early (return code = 1) */
-         hash_foreach(node->children, tree_report, arg);
-      }
+      report_children(node, client);
 
    rc = node->report_end(node, client, NULL);
 
@@ -411,10 +1307,7 @@ process_path (client_t *client, char *path, datum_t *myroot, datum_t *key)
          applyfilter(client, node);
 
          if (node->children)
-            {
-               /* Allow this to stop early (return code = 1) */
-               hash_foreach(node->children, tree_report, (void*) client);
-            }
+            report_children(node, client);
          return 0;
       }
 
@@ -592,7 +1485,121 @@ readline(int fd, char *buf, int maxlen)
    return (maxlen - nleft);
 }
 
-#define REQUESTLEN 2048
+/* Fills in remote_ip (at least 16 bytes) and returns nonzero if the
+ * client may see our data. */
+int
+client_trusted (client_t *client, char *remote_ip)
+{
+   llist_entry *le;
+
+   my_inet_ntop( AF_INET, (void *)&(client->addr.sin_addr), remote_ip, 16 );
+
+   return !strcmp(remote_ip, "127.0.0.1")
+      || gmetad_config.all_trusted
+      || (llist_search(&(gmetad_config.trusted_hosts), (void *)remote_ip, strcmp, &le) == 0);
+}
+
+
+static int
+tree_request (client_t *client, char *path)
+{
+   datum_t rootdatum;
+
+   if(root_report_start(client))
+      {
+         err_msg("server_thread() %lx unable to write root preamble (DTD, etc)",
+                 (unsigned long) pthread_self() );
+         return 1;
+      }
+
+   /* Start search at the root node. */
+   rootdatum.data = &root;
+   rootdatum.size = sizeof(root);
+
+   if (process_path(client, path, &rootdatum, NULL))
+      {
+         err_msg("server_thread() %lx unable to write XML tree info",
+                 (unsigned long) pthread_self() );
+         return 1;
+      }
+
+   if(root_report_end(client))
+      {
+         err_msg("server_thread() %lx unable to write root epilog",
+                 (unsigned long) pthread_self() );
+      }
+   return 0;
+}
+
+
+/* Answers one request.  The xml_port always gets the whole tree, the
+ * interactive port gets the subtree and filter named by request.
+ * Returns nonzero if nothing useful was (or could be) written. */
+int
+serve_request (client_t *client, char *request, int interactive,
+               const char *remote_ip)
+{
+   char *path = "/";
+   int rc;
+
+   client->filter=0;
+   client->selective=0;
+   client->query.nindex=0;
+   client->query.nhistory=0;
+   client->query.stats=NULL;
+   client->query.top=NULL;
+   client->query.ntop=0;
+   client->http=0;
+   client->compact = !interactive && gmetad_config.compact_xml;
+   if (client->defs)
+      {
+         /* Left over from a client that went away mid-cluster. */
+         hash_destroy(client->defs);
+         client->defs = NULL;
+      }
+   gettimeofday(&client->now, NULL);
+
+   if (interactive)
+      {
+         debug_msg("server_thread() received request \"%s\" from %s", request, remote_ip);
+
+         if (process_request(client, request))
+            {
+               err_msg("Got a malformed path request from %s", remote_ip);
+               return 1;
+            }
+         path = request;
+
+         if (client->query.stats)
+            {
+               if (stats_report(client))
+                  {
+                     err_msg("server_thread() %lx unable to write stats report",
+                             (unsigned long) pthread_self() );
+                     return 1;
+                  }
+               return 0;
+            }
+
+         if (client->query.nindex || client->query.nhistory)
+            {
+               if (index_report(client, path))
+                  {
+                     err_msg("server_thread() %lx unable to write index report",
+                             (unsigned long) pthread_self() );
+                     return 1;
+                  }
+               return 0;
+            }
+      }
+
+   if (client->selective && client->query.sort)
+      top_select(client, path);
+
+   rc = tree_request(client, path);
+   top_free(client);
+   return rc;
+}
 
 void *
 server_thread (void *arg)
@@ -603,8 +1610,9 @@ server_thread (void *arg)
    client_t client;
    char remote_ip[16];
    char request[REQUESTLEN + 1];
-   llist_entry *le;
-   datum_t rootdatum;
+
+   client.defs = NULL;
+   client.conn = NULL;
 
    for (;;)
       {
@@ -631,14 +1639,7 @@ server_thread (void *arg)
                continue;
             }
 
-         my_inet_ntop( AF_INET, (void *)&(client.addr.sin_addr), remote_ip, 16 );
-
-         if ( !strcmp(remote_ip, "127.0.0.1")
-               || gmetad_config.all_trusted
-               || (llist_search(&(gmetad_config.trusted_hosts), (void *)remote_ip, strcmp, &le) == 0) )
-            {
-               client.valid = 1;
-            }
+         client.valid = client_trusted(&client, remote_ip);
 
          if(! client.valid )
             {
@@ -648,10 +1649,6 @@ server_thread (void *arg)
                continue;
             }
 
-         client.filter=0;
-         client.http=0;
-         gettimeofday(&client.now, NULL);
-
          if (interactive)
             {
                request_len = readline(client.fd, request, REQUESTLEN);
@@ -661,43 +1658,9 @@ server_thread (void *arg)
                      close(client.fd);
                      continue;
                   }
-               debug_msg("server_thread() received request \"%s\" from %s", request, remote_ip);
-
-               if (process_request(&client, request))
-                  {
-                     err_msg("Got a malformed path request from %s", remote_ip);
-                     close(client.fd);
-                     continue;
-                  }
             }
-         else
-            strcpy(request, "/");
-
-         if(root_report_start(&client))
-            {
-               err_msg("server_thread() %lx unable to write root preamble (DTD, etc)",
-                       (unsigned long) pthread_self() );
-               close(client.fd);
-               continue;
-            }
-
-         /* Start search at the root node. */
-         rootdatum.data = &root;
-         rootdatum.size = sizeof(root);
 
-         if (process_path(&client, request, &rootdatum, NULL))
-            {
-               err_msg("server_thread() %lx unable to write XML tree info",
-                       (unsigned long) pthread_self() );
-               close(client.fd);
-               continue;
-            }
-
-         if(root_report_end(&client))
-            {
-               err_msg("server_thread() %lx unable to write root epilog",
-                       (unsigned long) pthread_self() );
-            }
+         serve_request(&client, request, interactive, remote_ip);
 
          close(client.fd);
       }
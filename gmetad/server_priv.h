@@ -9,4 +9,10 @@ struct request_context {
 static int
 process_path_adapter (datum_t *key, datum_t *val, void *arg);
 
+static int
+query_glob (const char * const *globs, int n, const char *name);
+
+static int
+tree_report (datum_t *key, datum_t *val, void *arg);
+
 #endif
@@ -0,0 +1,603 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "gmetad.h"
+#include "rrd_helpers.h"
+#include "gm_number.h"
+#include "sink.h"
+#include "tsdb.h"
+
+/* Metric values leave gmetad through sinks: RRD files (or the tsdb store
+ * in their place), a carbon relay and memcached.  Each sink has its own
+ * bounded queues and worker threads, so a slow or dead carbon relay no
+ * longer holds up parsing or the RRD writes.  A value is allocated once
+ * and shared by reference between the sinks that take it.
+ *
+ * A sink with several workers gives each one its own queue and routes a
+ * value by the hash of its RRD path, so the values of one RRD are written
+ * in order.  When a queue is full, the sink's policy decides: block waits
+ * for room, drop throws the value away, and sample starts keeping only
+ * one in every few values once the queue is three quarters full.
+ */
+
+#define SINK_DEFAULT_QUEUE 65536
+#define SINK_DEFAULT_SAMPLE 10
+#define SINK_RATE_INTERVAL 10   /* Seconds. */
+
+typedef struct
+   {
+      struct sink *sink;
+      pthread_mutex_t lock;
+      pthread_cond_t not_empty;
+      pthread_cond_t not_full;
+      sink_sample_t **ring;
+      unsigned int size;
+      unsigned int head;
+      unsigned int n;
+      unsigned int skip;   /* For the sample policy. */
+   }
+sink_queue_t;
+
+typedef struct sink
+   {
+      const sink_ops_t *ops;
+      sink_policy_t policy;
+      unsigned int sample;
+      int nqueues;
+      sink_queue_t *queues;
+
+      /* Counters, under lock. */
+      pthread_mutex_t lock;
+      unsigned long submitted;
+      unsigned long written;
+      unsigned long errors;
+      unsigned long dropped;
+      double lag;
+      double max_lag;
+      double rate;
+      unsigned long window_written;
+      time_t window_start;
+   }
+sink_t;
+
+static sink_t sinks[MAX_SINKS];
+static int nsinks;
+
+static const char *policy_names[] = { "block", "drop", "sample" };
+
+static tsdb_t *tsdb;
+
+static unsigned long submitted_total;
+static unsigned long skipped_total;
+
+extern gmetad_config_t gmetad_config;
+
+
+static int rrd_sink_submit(void *state, const sink_sample_t *s);
+static int rrd_sink_flush(void *state);
+static int tsdb_sink_submit(void *state, const sink_sample_t *s);
+static void *carbon_sink_init(void);
+static int carbon_sink_submit(void *state, const sink_sample_t *s);
+static int carbon_sink_flush(void *state);
+#ifdef WITH_MEMCACHED
+static int memcached_sink_submit(void *state, const sink_sample_t *s);
+#endif
+
+static const sink_ops_t rrd_sink =
+   { "rrd", 1, NULL, rrd_sink_submit, rrd_sink_flush };
+static const sink_ops_t tsdb_sink =
+   { "tsdb", 1, NULL, tsdb_sink_submit, NULL };
+static const sink_ops_t carbon_sink =
+   { "carbon", 0, carbon_sink_init, carbon_sink_submit, carbon_sink_flush };
+#ifdef WITH_MEMCACHED
+static const sink_ops_t memcached_sink =
+   { "memcached", 0, NULL, memcached_sink_submit, NULL };
+#endif
+
+
+static void
+sample_release(sink_sample_t *s)
+{
+   if (__sync_sub_and_fetch(&s->refs, 1) == 0)
+      free(s);
+}
+
+static double
+elapsed(const struct timeval *from, const struct timeval *to)
+{
+   return (to->tv_sec - from->tv_sec) + (to->tv_usec - from->tv_usec) / 1e6;
+}
+
+/* Counts n values as written, or as errors if rc is nonzero.  queued is
+ * when the oldest of them was submitted. */
+static void
+sink_account(sink_t *sink, int rc, unsigned long n,
+             const struct timeval *queued)
+{
+   struct timeval now;
+
+   gettimeofday(&now, NULL);
+   pthread_mutex_lock(&sink->lock);
+   if (rc)
+      sink->errors += n;
+   else
+      sink->written += n;
+   sink->lag = elapsed(queued, &now);
+   if (sink->lag > sink->max_lag)
+      sink->max_lag = sink->lag;
+   sink->window_written += n;
+   if (now.tv_sec - sink->window_start >= SINK_RATE_INTERVAL)
+      {
+         sink->rate = (double) sink->window_written
+            / (now.tv_sec - sink->window_start);
+         sink->window_written = 0;
+         sink->window_start = now.tv_sec;
+      }
+   pthread_mutex_unlock(&sink->lock);
+}
+
+/* The values a batching sink holds, not yet counted. */
+typedef struct
+   {
+      unsigned long n;
+      struct timeval oldest;
+   }
+sink_pending_t;
+
+static void
+sink_flush(sink_t *sink, void *state, sink_pending_t *pending)
+{
+   int rc = sink->ops->flush(state);
+
+   if (pending->n)
+      sink_account(sink, rc, pending->n, &pending->oldest);
+   pending->n = 0;
+}
+
+static void *
+sink_worker(void *arg)
+{
+   sink_queue_t *q = (sink_queue_t *) arg;
+   sink_t *sink = q->sink;
+   sink_sample_t *s;
+   sink_pending_t pending = { 0 };
+   void *state = NULL;
+   int rc;
+
+   if (sink->ops->init)
+      state = sink->ops->init();
+
+   for (;;)
+      {
+         pthread_mutex_lock(&q->lock);
+         if (!q->n && sink->ops->flush)
+            {
+               pthread_mutex_unlock(&q->lock);
+               sink_flush(sink, state, &pending);
+               pthread_mutex_lock(&q->lock);
+            }
+         while (!q->n)
+            pthread_cond_wait(&q->not_empty, &q->lock);
+         s = q->ring[q->head];
+         q->head = (q->head + 1) % q->size;
+         q->n--;
+         pthread_cond_signal(&q->not_full);
+         pthread_mutex_unlock(&q->lock);
+
+         rc = sink->ops->submit(state, s);
+         if (rc == SINK_FULL)
+            {
+               sink_flush(sink, state, &pending);
+               rc = sink->ops->submit(state, s);
+            }
+         if (rc == SINK_BUFFERED)
+            {
+               if (!pending.n++)
+                  pending.oldest = s->queued;
+            }
+         else
+            sink_account(sink, rc, 1, &s->queued);
+
+         sample_release(s);
+      }
+   return NULL;
+}
+
+/* Returns nonzero if the sink did not take s. */
+static int
+sink_enqueue(sink_t *sink, sink_sample_t *s)
+{
+   sink_queue_t *q = &sink->queues[s->hash % sink->nqueues];
+   int rc = 0;
+
+   pthread_mutex_lock(&q->lock);
+   switch (sink->policy)
+      {
+      case SINK_BLOCK:
+         while (q->n == q->size)
+            pthread_cond_wait(&q->not_full, &q->lock);
+         break;
+      case SINK_SAMPLE:
+         if (q->n >= q->size - q->size / 4 && q->skip++ % sink->sample)
+            rc = 1;
+         break;
+      case SINK_DROP:
+         break;
+      }
+   if (q->n == q->size)
+      rc = 1;
+   if (!rc)
+      {
+         __sync_add_and_fetch(&s->refs, 1);
+         q->ring[(q->head + q->n++) % q->size] = s;
+         pthread_cond_signal(&q->not_empty);
+      }
+   pthread_mutex_unlock(&q->lock);
+
+   pthread_mutex_lock(&sink->lock);
+   sink->submitted++;
+   if (rc)
+      sink->dropped++;
+   pthread_mutex_unlock(&sink->lock);
+   return rc;
+}
+
+
+static const sink_config_t *
+sink_config(gmetad_config_t *c, const char *name)
+{
+   int i;
+
+   for (i = 0; i < c->num_sinks; i++)
+      if (!strcmp(c->sinks[i].name, name))
+         return &c->sinks[i];
+   return NULL;
+}
+
+static void
+sink_add(gmetad_config_t *c, const sink_ops_t *ops, sink_policy_t policy)
+{
+   const sink_config_t *conf = sink_config(c, ops->name);
+   unsigned int size = SINK_DEFAULT_QUEUE;
+   sink_t *sink = &sinks[nsinks];
+   pthread_attr_t attr;
+   pthread_t pid;
+   int i;
+
+   memset(sink, 0, sizeof(*sink));
+   sink->ops = ops;
+   sink->policy = policy;
+   sink->sample = SINK_DEFAULT_SAMPLE;
+   sink->nqueues = 1;
+   if (conf)
+      {
+         if (conf->queue_size > 0)
+            size = conf->queue_size;
+         if (conf->threads > 0)
+            sink->nqueues = conf->threads;
+         if (conf->sample > 0)
+            sink->sample = conf->sample;
+         if (conf->policy >= 0)
+            sink->policy = (sink_policy_t) conf->policy;
+      }
+   size = (size + sink->nqueues - 1) / sink->nqueues;
+   pthread_mutex_init(&sink->lock, NULL);
+   sink->window_start = time(NULL);
+
+   sink->queues = calloc(sink->nqueues, sizeof(sink_queue_t));
+   if (!sink->queues)
+      err_quit("Unable to allocate the %s sink", ops->name);
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   for (i = 0; i < sink->nqueues; i++)
+      {
+         sink->queues[i].sink = sink;
+         sink->queues[i].size = size;
+         sink->queues[i].ring = malloc(size * sizeof(sink_sample_t *));
+         if (!sink->queues[i].ring)
+            err_quit("Unable to allocate the %s sink", ops->name);
+         pthread_mutex_init(&sink->queues[i].lock, NULL);
+         pthread_cond_init(&sink->queues[i].not_empty, NULL);
+         pthread_cond_init(&sink->queues[i].not_full, NULL);
+         pthread_create(&pid, &attr, sink_worker, &sink->queues[i]);
+      }
+   pthread_attr_destroy(&attr);
+
+   debug_msg("Started the %s sink: %d worker(s), %u values per queue, "
+             "policy %s", ops->name, sink->nqueues, size,
+             policy_names[sink->policy]);
+   nsinks++;
+}
+
+void
+sink_start(gmetad_config_t *c)
+{
+   int i;
+
+   for (i = 0; i < c->num_sinks; i++)
+      if (strcmp(c->sinks[i].name, "rrd") && strcmp(c->sinks[i].name, "tsdb")
+          && strcmp(c->sinks[i].name, "carbon")
+#ifdef WITH_MEMCACHED
+          && strcmp(c->sinks[i].name, "memcached")
+#endif
+         )
+         err_msg("Ignoring the configuration of unknown sink %s",
+                 c->sinks[i].name);
+
+   /* RRD writes keep their old back pressure on the data threads; the
+    * network outputs are best effort. */
+   if (c->write_rrds == 1 && c->storage == STORAGE_TSDB)
+      {
+         tsdb = tsdb_open(c->tsdb_rootdir, c->RRAs, c->num_RRAs);
+         if (!tsdb)
+            err_quit("Unable to open the tsdb store in %s", c->tsdb_rootdir);
+         tsdb_start(tsdb);
+         sink_add(c, &tsdb_sink, SINK_BLOCK);
+      }
+   else if (c->write_rrds == 1)
+      sink_add(c, &rrd_sink, SINK_BLOCK);
+   if (c->carbon_server)
+      sink_add(c, &carbon_sink, SINK_DROP);
+#ifdef WITH_MEMCACHED
+   if (c->memcached_parameters)
+      sink_add(c, &memcached_sink, SINK_DROP);
+#endif
+}
+
+
+static unsigned int
+sample_hash(const char *s, unsigned int h)
+{
+   while (s && *s)
+      {
+         h ^= (unsigned char) *s++;
+         h *= 16777619;
+      }
+   return h;
+}
+
+void
+sink_submit(const char *source, const char *host, const char *metric,
+            const char *sum, const char *num, unsigned int step,
+            unsigned int process_time, ganglia_slope_t slope,
+            unsigned int dmax)
+{
+   size_t lens[5], total = 0;
+   const char *strs[5];
+   const char **fields[5];
+   sink_sample_t *s;
+   char *p;
+   int i;
+
+   __sync_fetch_and_add(&submitted_total, 1);
+   for (i = 0; i < nsinks; i++)
+      if (host || sinks[i].ops->summaries)
+         break;
+   if (i == nsinks)
+      return;
+
+   strs[0] = source;
+   strs[1] = host;
+   strs[2] = metric;
+   strs[3] = sum;
+   strs[4] = num;
+   for (i = 0; i < 5; i++)
+      {
+         lens[i] = strs[i] ? strlen(strs[i]) + 1 : 0;
+         total += lens[i];
+      }
+
+   s = malloc(sizeof(*s) + total);
+   if (!s)
+      {
+         err_msg("Unable to queue metric %s", metric);
+         return;
+      }
+
+   fields[0] = &s->source;
+   fields[1] = &s->host;
+   fields[2] = &s->metric;
+   fields[3] = &s->sum;
+   fields[4] = &s->num;
+   for (i = 0, p = s->strings; i < 5; i++)
+      {
+         if (!strs[i])
+            {
+               *fields[i] = NULL;
+               continue;
+            }
+         memcpy(p, strs[i], lens[i]);
+         *fields[i] = p;
+         p += lens[i];
+      }
+
+   s->step = step;
+   s->process_time = process_time;
+   s->slope = slope;
+   s->dmax = dmax;
+   s->hash = sample_hash(metric, sample_hash(host, sample_hash(source,
+                                                              2166136261u)));
+   gettimeofday(&s->queued, NULL);
+
+   /* Hold a reference while handing it out, so a fast worker cannot free
+    * it under us. */
+   s->refs = 1;
+   for (i = 0; i < nsinks; i++)
+      if (host || sinks[i].ops->summaries)
+         sink_enqueue(&sinks[i], s);
+   sample_release(s);
+}
+
+
+void
+sink_skip(void)
+{
+   __sync_fetch_and_add(&skipped_total, 1);
+}
+
+void
+sink_totals(unsigned long *submitted, unsigned long *skipped)
+{
+   *submitted = __sync_fetch_and_add(&submitted_total, 0);
+   *skipped = __sync_fetch_and_add(&skipped_total, 0);
+}
+
+int
+sink_count(void)
+{
+   return nsinks;
+}
+
+void
+sink_stats(int i, sink_stats_t *st)
+{
+   sink_t *sink = &sinks[i];
+   int j;
+
+   memset(st, 0, sizeof(*st));
+   st->name = sink->ops->name;
+   st->policy = policy_names[sink->policy];
+   for (j = 0; j < sink->nqueues; j++)
+      {
+         pthread_mutex_lock(&sink->queues[j].lock);
+         st->queue_size += sink->queues[j].size;
+         st->queued += sink->queues[j].n;
+         pthread_mutex_unlock(&sink->queues[j].lock);
+      }
+
+   pthread_mutex_lock(&sink->lock);
+   st->submitted = sink->submitted;
+   st->written = sink->written;
+   st->errors = sink->errors;
+   st->dropped = sink->dropped;
+   st->rate = sink->rate;
+   st->lag = sink->lag;
+   st->max_lag = sink->max_lag;
+   pthread_mutex_unlock(&sink->lock);
+}
+
+
+/* The RRD sink.  librrd is not thread safe, so rrd_helpers.c serializes
+ * the writes themselves; more than one worker only overlaps the path
+ * building and directory creation. */
+static int
+rrd_sink_submit(void *state, const sink_sample_t *s)
+{
+   return write_data_to_rrd(s->source, s->host, s->metric, s->sum, s->num,
+                            s->step, s->process_time, s->slope);
+}
+
+/* With the write-behind cache, a lull is the time to get the journal out
+ * of gmetad's buffers. */
+static int
+rrd_sink_flush(void *state)
+{
+   rrd_cache_sync();
+   return 0;
+}
+
+
+/* The tsdb sink.  A series is named like the RRD it replaces, host/metric
+ * or __SummaryInfo__/metric, under the source's directory. */
+static int
+tsdb_sink_submit(void *state, const sink_sample_t *s)
+{
+   char key[CARBON_MSGSIZE];
+   uint32_t num;
+   char *p;
+   int len;
+
+   if (s->host)
+      {
+         len = snprintf(key, sizeof(key), "%s/%s", s->host, s->metric);
+         if (!gmetad_config.case_sensitive_hostnames)
+            for (p = key; *p && *p != '/'; p++)
+               *p = tolower(*p);
+      }
+   else
+      len = snprintf(key, sizeof(key), "__SummaryInfo__/%s", s->metric);
+   if (len >= (int) sizeof(key))
+      return 1;
+   if (s->num)
+      num = strtoul(s->num, NULL, 10);
+
+   return tsdb_write(tsdb, s->source ? s->source : TSDB_ROOT_SOURCE, key,
+                     s->step, s->process_time ? s->process_time : time(NULL),
+                     gm_strtod(s->sum, NULL), s->num ? &num : NULL);
+}
+
+
+/* The carbon sink sends everything queued up in one connection, rather
+ * than connecting for every value.  A value only counts as written once
+ * its batch is sent. */
+#define CARBON_BATCH 65536
+
+typedef struct
+   {
+      char *buf;
+      size_t len;
+   }
+carbon_batch_t;
+
+static void *
+carbon_sink_init(void)
+{
+   carbon_batch_t *b = calloc(1, sizeof(*b));
+
+   if (b)
+      b->buf = malloc(CARBON_BATCH);
+   if (!b || !b->buf)
+      err_quit("Unable to allocate the carbon sink");
+   return b;
+}
+
+static int
+carbon_sink_flush(void *state)
+{
+   carbon_batch_t *b = (carbon_batch_t *) state;
+   int rc;
+
+   if (!b->len)
+      return 0;
+   rc = push_data_to_carbon(b->buf);
+   b->len = 0;
+   return rc;
+}
+
+static int
+carbon_sink_submit(void *state, const sink_sample_t *s)
+{
+   carbon_batch_t *b = (carbon_batch_t *) state;
+   char msg[CARBON_MSGSIZE];
+   size_t len;
+
+   if (carbon_message(msg, s->source, s->host, s->metric, s->sum,
+                      s->process_time))
+      return 1;
+   len = strlen(msg);
+   if (b->len + len >= CARBON_BATCH)
+      return SINK_FULL;
+   memcpy(b->buf + b->len, msg, len + 1);
+   b->len += len;
+   return SINK_BUFFERED;
+}
+
+
+#ifdef WITH_MEMCACHED
+static int
+memcached_sink_submit(void *state, const sink_sample_t *s)
+{
+   return write_data_to_memcached(s->source, s->host, s->metric, s->sum,
+                                  s->process_time, s->dmax);
+}
+#endif
@@ -0,0 +1,87 @@
+#ifndef SINK_H
+#define SINK_H 1
+
+#include <sys/time.h>
+
+#include "ganglia.h"
+#include "conf.h"
+
+/* One value on its way out of gmetad.  host is NULL for cluster and grid
+ * summaries, source is NULL for the root summary, and num is NULL unless
+ * the value is a summary.  The strings live in the same allocation. */
+typedef struct sink_sample
+   {
+      int refs;
+      unsigned int hash;   /* Of the RRD path, to keep its values in order. */
+      struct timeval queued;
+      const char *source;
+      const char *host;
+      const char *metric;
+      const char *sum;
+      const char *num;
+      unsigned int step;
+      unsigned int process_time;
+      unsigned int dmax;
+      ganglia_slope_t slope;
+      char strings[1];
+   }
+sink_sample_t;
+
+/* An output for metric values.  init() runs once on each of the sink's
+ * worker threads and returns that worker's state.  submit() writes one
+ * value and returns nonzero if it failed; flush() is called whenever the
+ * worker's queue runs empty, for sinks that batch, and returns nonzero
+ * if it failed.
+ *
+ * A sink that batches returns SINK_BUFFERED from submit() for a value it
+ * kept, which counts as written or as an error when the next flush()
+ * says, and SINK_FULL for a value it could not take until it flushes. */
+#define SINK_BUFFERED -1
+#define SINK_FULL -2
+
+typedef struct
+   {
+      const char *name;
+      int summaries;       /* Also takes cluster and grid summaries. */
+      void *(*init)(void);
+      int (*submit)(void *state, const sink_sample_t *s);
+      int (*flush)(void *state);
+   }
+sink_ops_t;
+
+typedef struct
+   {
+      const char *name;
+      const char *policy;
+      unsigned int queue_size;   /* Over all of the sink's workers. */
+      unsigned int queued;
+      unsigned long submitted;
+      unsigned long written;
+      unsigned long errors;
+      unsigned long dropped;
+      double rate;               /* Values written per second, lately. */
+      double lag;                /* Seconds from submit to write, last. */
+      double max_lag;
+   }
+sink_stats_t;
+
+/* Starts the sinks gmetad is configured for (rrd, carbon, memcached). */
+void sink_start(gmetad_config_t *c);
+
+/* Hands a value to every sink that takes it.  Only the block policy ever
+ * waits; the other policies drop values when a sink falls behind. */
+void sink_submit(const char *source, const char *host, const char *metric,
+                 const char *sum, const char *num, unsigned int step,
+                 unsigned int process_time, ganglia_slope_t slope,
+                 unsigned int dmax);
+
+/* Counts a value that was not submitted because the sinks have it. */
+void sink_skip(void);
+
+/* Host and summary values submitted, and host values skipped. */
+void sink_totals(unsigned long *submitted, unsigned long *skipped);
+
+int sink_count(void);
+void sink_stats(int i, sink_stats_t *st);
+
+#endif
@@ -0,0 +1,1511 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "ganglia.h"
+#include "tsdb.h"
+
+/* A time series store that writes sequentially, instead of the random
+ * read-modify-write of one RRD file per metric.
+ *
+ * Each source has a directory per level, and each level is cut into
+ * partitions of about TSDB_POINTS values per series, rounded up so that a
+ * partition ends where a step of the next level does.  A partition is
+ * three files named after its start time:
+ *
+ *   <start>.data    a header, then chunks appended as they fill
+ *   <start>.series  "id key" lines, a key being host/metric
+ *   <start>.index   written when the partition is sealed: for each series
+ *                   (sorted by id) the offsets and time ranges of its
+ *                   chunks, so a read touches only the chunks it needs
+ *
+ * A chunk holds up to TSDB_CHUNK values of one series as three columns:
+ * the delta of delta of the times, the XOR of each value with the one
+ * before it (as its changed bytes only), and the delta of the host count
+ * for summaries.  Steady metrics take two or three bytes a value.  Chunks
+ * are kept in memory until they fill or reach TSDB_FLUSH_AGE, so the
+ * write volume follows the data, not the number of series, and a crash
+ * loses at most the last minute or two.  The files are in host byte
+ * order.
+ *
+ * The levels follow the configured RRAs: level k consolidates the values
+ * of level k-1 into one per RRA step when a level k-1 partition is
+ * sealed, and each level drops partitions older than its RRA's rows.
+ * Sealing runs without the store's lock, taking it only to write the
+ * consolidated values, so it does not hold up the writers.
+ */
+
+#define TSDB_POINTS 720       /* Per series and partition, at least. */
+#define TSDB_CHUNK 120        /* Values per chunk. */
+#define TSDB_FLUSH_AGE 60     /* Seconds an open chunk may wait. */
+#define TSDB_GRACE 300        /* Seconds past its end a partition stays open. */
+#define TSDB_WRITE_BUF 65536
+#define TSDB_PARTITIONS 256   /* Buckets of the open partition table. */
+#define TSDB_MAINTAIN 30
+
+#define DATA_MAGIC "GTSDATA1"
+#define INDEX_MAGIC "GTSIDX1"
+
+typedef struct
+   {
+      char magic[8];
+      uint32_t version;
+      uint32_t step;
+      uint32_t res;
+      uint32_t span;
+      uint32_t start;
+      uint32_t level;
+   }
+data_hdr_t;
+
+typedef struct
+   {
+      uint32_t series;
+      uint32_t count;
+      uint32_t t_first;
+      uint32_t t_last;
+      uint32_t tlen;
+      uint32_t vlen;
+      uint32_t nlen;
+   }
+chunk_hdr_t;
+
+/* Chunks are padded to 8 bytes, so mapped headers stay aligned. */
+#define CHUNK_SIZE(h) \
+   ((sizeof(chunk_hdr_t) + (h)->tlen + (h)->vlen + (h)->nlen + 7) & ~7ULL)
+
+typedef struct
+   {
+      char magic[8];
+      uint32_t nseries;
+      uint32_t nrefs;
+   }
+index_hdr_t;
+
+typedef struct
+   {
+      uint32_t id;
+      uint32_t first;
+      uint32_t n;
+      uint32_t unused;     /* Keeps the chunk references aligned. */
+   }
+index_series_t;
+
+typedef struct
+   {
+      uint64_t off;
+      uint32_t t_first;
+      uint32_t t_last;
+   }
+chunk_ref_t;
+
+typedef struct
+   {
+      unsigned char *buf;
+      size_t len;
+      size_t size;
+   }
+bytes_t;
+
+typedef struct series
+   {
+      char *key;
+      uint32_t id;
+      uint32_t last_t;      /* Of the last value taken. */
+
+      /* The open chunk. */
+      bytes_t t, v, n;
+      uint32_t count;
+      uint32_t t_first;
+      uint32_t t_last;
+      int64_t delta;
+      uint64_t v_prev;
+      uint32_t n_prev;
+
+      /* The chunks written, for the index. */
+      chunk_ref_t *chunks;
+      uint32_t nchunks;
+      uint32_t chunks_size;
+   }
+series_t;
+
+typedef struct partition
+   {
+      char *source;
+      int level;
+      data_hdr_t hdr;
+      char *path;           /* Without the extension. */
+      int data_fd;
+      int series_fd;
+      uint64_t data_len;    /* Including wbuf. */
+      bytes_t wbuf;
+      bytes_t sbuf;         /* Series lines not yet written. */
+      series_t **table;     /* Open addressing, by key. */
+      unsigned int mask;
+      series_t **by_id;
+      unsigned int nseries;
+      struct partition *next;
+   }
+partition_t;
+
+typedef struct
+   {
+      char cf[16];
+      unsigned int steps;
+      unsigned int rows;
+      unsigned int points;  /* Per series and partition. */
+   }
+level_t;
+
+struct tsdb
+   {
+      char *root;
+      pthread_mutex_t lock;
+      level_t levels[TSDB_MAX_LEVELS];
+      int nlevels;
+      partition_t *open[TSDB_PARTITIONS];
+      partition_t *sealing; /* Unlinked from open, still being written. */
+   };
+
+
+/* Formats a file name into name, which has room for size bytes.  Returns
+ * nonzero if it does not fit. */
+static int
+path_fmt(char *name, size_t size, const char *fmt, ...)
+{
+   va_list ap;
+   int n;
+
+   va_start(ap, fmt);
+   n = vsnprintf(name, size, fmt, ap);
+   va_end(ap);
+   if (n < 0 || (size_t) n >= size)
+      {
+         err_msg("tsdb: file name too long: %.64s...", name);
+         return 1;
+      }
+   return 0;
+}
+
+/* FNV-1a */
+static unsigned int
+hash_str(const char *s, unsigned int h)
+{
+   while (*s)
+      {
+         h ^= (unsigned char) *s++;
+         h *= 16777619;
+      }
+   return h;
+}
+
+static int
+bytes_reserve(bytes_t *b, size_t n)
+{
+   unsigned char *buf;
+   size_t size;
+
+   if (b->len + n <= b->size)
+      return 0;
+   for (size = b->size ? b->size * 2 : 32; size < b->len + n; size *= 2)
+      ;
+   buf = realloc(b->buf, size);
+   if (!buf)
+      return 1;
+   b->buf = buf;
+   b->size = size;
+   return 0;
+}
+
+static int
+bytes_put(bytes_t *b, const void *p, size_t n)
+{
+   if (!n)
+      return 0;
+   if (bytes_reserve(b, n))
+      return 1;
+   memcpy(b->buf + b->len, p, n);
+   b->len += n;
+   return 0;
+}
+
+static int
+put_varint(bytes_t *b, uint64_t x)
+{
+   unsigned char c[10];
+   int n = 0;
+
+   do
+      {
+         c[n] = x & 0x7f;
+         x >>= 7;
+         if (x)
+            c[n] |= 0x80;
+         n++;
+      }
+   while (x);
+   return bytes_put(b, c, n);
+}
+
+static uint64_t
+zigzag(int64_t x)
+{
+   return ((uint64_t) x << 1) ^ (uint64_t) (x >> 63);
+}
+
+static int64_t
+unzigzag(uint64_t x)
+{
+   return (int64_t) (x >> 1) ^ -(int64_t) (x & 1);
+}
+
+/* Returns the number of bytes read, or 0 past end. */
+static size_t
+get_varint(const unsigned char *p, const unsigned char *end, uint64_t *x)
+{
+   const unsigned char *start = p;
+   int shift = 0;
+
+   *x = 0;
+   while (p < end && shift < 64)
+      {
+         *x |= (uint64_t) (*p & 0x7f) << shift;
+         if (!(*p++ & 0x80))
+            return p - start;
+         shift += 7;
+      }
+   return 0;
+}
+
+
+/* Column coding. */
+
+static int
+chunk_add(series_t *s, uint32_t t, double val, const uint32_t *num)
+{
+   unsigned char c[9];
+   uint64_t bits, x;
+   int64_t delta;
+   int lead, trail, i, n;
+
+   if (!s->count)
+      {
+         s->t_first = s->t_last = t;
+         s->delta = 0;
+         s->v_prev = 0;
+         s->n_prev = 0;
+      }
+   delta = (int64_t) t - s->t_last;
+   if (put_varint(&s->t, zigzag(delta - s->delta)))
+      return 1;
+
+   memcpy(&bits, &val, sizeof(bits));
+   x = bits ^ s->v_prev;
+   if (!x)
+      {
+         c[0] = 0;
+         n = 1;
+      }
+   else
+      {
+         /* A control byte with the unchanged bytes at either end, then
+          * the changed ones. */
+         for (lead = 0; !(x >> (56 - 8 * lead) & 0xff); lead++)
+            ;
+         for (trail = 0; !(x >> (8 * trail) & 0xff); trail++)
+            ;
+         c[0] = 0x40 | (lead << 3) | trail;
+         for (i = 7 - lead, n = 1; i >= trail; i--)
+            c[n++] = x >> (8 * i) & 0xff;
+      }
+   if (bytes_put(&s->v, c, n))
+      return 1;
+
+   if (num && put_varint(&s->n, zigzag((int64_t) *num - s->n_prev)))
+      return 1;
+
+   s->delta = delta;
+   s->t_last = t;
+   s->v_prev = bits;
+   if (num)
+      s->n_prev = *num;
+   s->count++;
+   return 0;
+}
+
+/* Decodes a chunk into t, val and num (which may be NULL), each with room
+ * for hdr->count values.  Returns nonzero if the chunk is corrupt. */
+static int
+chunk_decode(const chunk_hdr_t *hdr, const unsigned char *p, uint32_t *t,
+             double *val, uint32_t *num)
+{
+   const unsigned char *end;
+   uint64_t x, bits = 0;
+   int64_t delta = 0;
+   uint32_t i, ts = hdr->t_first, n = 0;
+   size_t len;
+   int lead, trail, k;
+
+   end = p + hdr->tlen;
+   for (i = 0; i < hdr->count; i++)
+      {
+         len = get_varint(p, end, &x);
+         if (!len)
+            return 1;
+         p += len;
+         delta += unzigzag(x);
+         ts += delta;
+         t[i] = ts;
+      }
+   if (p != end)
+      return 1;
+
+   end = p + hdr->vlen;
+   for (i = 0; i < hdr->count; i++)
+      {
+         if (p >= end)
+            return 1;
+         if (*p)
+            {
+               lead = *p >> 3 & 7;
+               trail = *p & 7;
+               if (lead + trail > 7 || p + 1 + 8 - lead - trail > end)
+                  return 1;
+               p++;
+               for (x = 0, k = 7 - lead; k >= trail; k--)
+                  x |= (uint64_t) *p++ << (8 * k);
+               bits ^= x;
+            }
+         else
+            p++;
+         memcpy(&val[i], &bits, sizeof(bits));
+      }
+   if (p != end)
+      return 1;
+
+   end = p + hdr->nlen;
+   for (i = 0; num && hdr->nlen && i < hdr->count; i++)
+      {
+         len = get_varint(p, end, &x);
+         if (!len)
+            return 1;
+         p += len;
+         n += unzigzag(x);
+         num[i] = n;
+      }
+   return 0;
+}
+
+
+/* Writing. */
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+   const char *p = buf;
+   ssize_t n;
+
+   while (len)
+      {
+         n = write(fd, p, len);
+         if (n < 0 && errno == EINTR)
+            continue;
+         if (n <= 0)
+            return 1;
+         p += n;
+         len -= n;
+      }
+   return 0;
+}
+
+static int
+mkdirs(char *path)
+{
+   char *p;
+
+   for (p = strchr(path + 1, '/'); ; p = strchr(p + 1, '/'))
+      {
+         if (p)
+            *p = 0;
+         if (mkdir(path, 0755) && errno != EEXIST)
+            {
+               err_msg("tsdb: unable to mkdir(%s): %s", path, strerror(errno));
+               if (p)
+                  *p = '/';
+               return 1;
+            }
+         if (!p)
+            return 0;
+         *p = '/';
+      }
+}
+
+static int
+partition_flush(partition_t *p)
+{
+   int rc = 0;
+
+   /* Series first, so every chunk on disk has its series line. */
+   if (p->sbuf.len)
+      rc = write_all(p->series_fd, p->sbuf.buf, p->sbuf.len);
+   p->sbuf.len = 0;
+   if (!rc && p->wbuf.len)
+      rc = write_all(p->data_fd, p->wbuf.buf, p->wbuf.len);
+   p->wbuf.len = 0;
+   if (rc)
+      err_msg("tsdb: unable to write %s: %s", p->path, strerror(errno));
+   return rc;
+}
+
+static int
+chunk_write(partition_t *p, series_t *s)
+{
+   static const char zeros[8];
+   chunk_hdr_t hdr;
+   chunk_ref_t *ref;
+   size_t pad;
+
+   if (!s->count)
+      return 0;
+
+   if (s->nchunks == s->chunks_size)
+      {
+         ref = realloc(s->chunks, (s->chunks_size ? s->chunks_size * 2 : 4)
+                                     * sizeof(*ref));
+         if (!ref)
+            return 1;
+         s->chunks = ref;
+         s->chunks_size = s->chunks_size ? s->chunks_size * 2 : 4;
+      }
+
+   hdr.series = s->id;
+   hdr.count = s->count;
+   hdr.t_first = s->t_first;
+   hdr.t_last = s->t_last;
+   hdr.tlen = s->t.len;
+   hdr.vlen = s->v.len;
+   hdr.nlen = s->n.len;
+   pad = CHUNK_SIZE(&hdr) - (sizeof(hdr) + hdr.tlen + hdr.vlen + hdr.nlen);
+   if (bytes_put(&p->wbuf, &hdr, sizeof(hdr))
+       || bytes_put(&p->wbuf, s->t.buf, s->t.len)
+       || bytes_put(&p->wbuf, s->v.buf, s->v.len)
+       || bytes_put(&p->wbuf, s->n.buf, s->n.len)
+       || bytes_put(&p->wbuf, zeros, pad))
+      return 1;
+
+   ref = &s->chunks[s->nchunks++];
+   ref->off = p->data_len;
+   ref->t_first = s->t_first;
+   ref->t_last = s->t_last;
+   p->data_len += CHUNK_SIZE(&hdr);
+
+   s->t.len = s->v.len = s->n.len = 0;
+   s->count = 0;
+
+   if (p->wbuf.len >= TSDB_WRITE_BUF)
+      return partition_flush(p);
+   return 0;
+}
+
+static series_t *
+series_add(partition_t *p, const char *key, uint32_t id)
+{
+   series_t **table, **by_id, *s;
+   unsigned int i, j, mask;
+
+   if ((p->nseries + 1) * 4 > (p->mask + 1) * 3)
+      {
+         mask = p->mask ? p->mask * 2 + 1 : 1023;
+         table = calloc(mask + 1, sizeof(series_t *));
+         if (!table)
+            return NULL;
+         for (i = 0; p->table && i <= p->mask; i++)
+            {
+               if (!p->table[i])
+                  continue;
+               for (j = hash_str(p->table[i]->key, 2166136261u) & mask;
+                    table[j]; j = (j + 1) & mask)
+                  ;
+               table[j] = p->table[i];
+            }
+         by_id = realloc(p->by_id, (mask + 1) * sizeof(series_t *));
+         if (!by_id)
+            {
+               free(table);
+               return NULL;
+            }
+         free(p->table);
+         p->table = table;
+         p->by_id = by_id;
+         p->mask = mask;
+      }
+
+   if (id >= p->mask + 1 || id < p->nseries)
+      return NULL;
+   s = calloc(1, sizeof(*s));
+   if (!s || !(s->key = strdup(key)))
+      {
+         free(s);
+         return NULL;
+      }
+   s->id = id;
+   for (i = hash_str(key, 2166136261u) & p->mask; p->table[i];
+        i = (i + 1) & p->mask)
+      ;
+   p->table[i] = s;
+   for (; p->nseries <= id; p->nseries++)
+      p->by_id[p->nseries] = NULL;
+   p->by_id[id] = s;
+   return s;
+}
+
+static series_t *
+series_find(partition_t *p, const char *key)
+{
+   unsigned int i;
+
+   if (!p->table)
+      return NULL;
+   for (i = hash_str(key, 2166136261u) & p->mask; p->table[i];
+        i = (i + 1) & p->mask)
+      if (!strcmp(p->table[i]->key, key))
+         return p->table[i];
+   return NULL;
+}
+
+static void
+partition_free(partition_t *p)
+{
+   series_t *s;
+   unsigned int i;
+
+   for (i = 0; i < p->nseries; i++)
+      {
+         s = p->by_id[i];
+         if (!s)
+            continue;
+         free(s->key);
+         free(s->t.buf);
+         free(s->v.buf);
+         free(s->n.buf);
+         free(s->chunks);
+         free(s);
+      }
+   if (p->data_fd >= 0)
+      close(p->data_fd);
+   if (p->series_fd >= 0)
+      close(p->series_fd);
+   free(p->table);
+   free(p->by_id);
+   free(p->wbuf.buf);
+   free(p->sbuf.buf);
+   free(p->path);
+   free(p->source);
+   free(p);
+}
+
+/* Reads back the series and chunks of a partition that was open when
+ * gmetad stopped, dropping a chunk cut short at the end. */
+static int
+partition_recover(partition_t *p)
+{
+   char name[4096], *line, *sp, *save;
+   chunk_hdr_t hdr;
+   chunk_ref_t *ref;
+   series_t *s;
+   struct stat st;
+   uint64_t off;
+   char *buf;
+   ssize_t n;
+
+   if (path_fmt(name, sizeof(name), "%s.series", p->path)
+       || fstat(p->series_fd, &st))
+      return 1;
+   buf = malloc(st.st_size + 1);
+   if (!buf)
+      return 1;
+   n = pread(p->series_fd, buf, st.st_size, 0);
+   if (n < 0)
+      n = 0;
+   buf[n] = 0;
+   /* A line cut short has no newline and is dropped. */
+   if (n && buf[n - 1] != '\n')
+      {
+         sp = strrchr(buf, '\n');
+         n = sp ? sp - buf + 1 : 0;
+         buf[n] = 0;
+         if (ftruncate(p->series_fd, n))
+            err_msg("tsdb: unable to truncate %s", name);
+      }
+   for (line = strtok_r(buf, "\n", &save); line;
+        line = strtok_r(NULL, "\n", &save))
+      {
+         sp = strchr(line, ' ');
+         if (!sp)
+            continue;
+         *sp++ = 0;
+         if (!series_add(p, sp, strtoul(line, NULL, 10)))
+            break;
+      }
+   free(buf);
+
+   for (off = sizeof(data_hdr_t);
+        pread(p->data_fd, &hdr, sizeof(hdr), off) == sizeof(hdr); )
+      {
+         if (off + CHUNK_SIZE(&hdr) > p->data_len)
+            break;
+         s = hdr.series < p->nseries ? p->by_id[hdr.series] : NULL;
+         if (s)
+            {
+               if (s->nchunks == s->chunks_size)
+                  {
+                     ref = realloc(s->chunks, (s->chunks_size
+                        ? s->chunks_size * 2 : 4) * sizeof(*ref));
+                     if (!ref)
+                        return 1;
+                     s->chunks = ref;
+                     s->chunks_size = s->chunks_size ? s->chunks_size * 2 : 4;
+                  }
+               ref = &s->chunks[s->nchunks++];
+               ref->off = off;
+               ref->t_first = hdr.t_first;
+               ref->t_last = hdr.t_last;
+               s->last_t = hdr.t_last;
+            }
+         off += CHUNK_SIZE(&hdr);
+      }
+   if (off != p->data_len)
+      {
+         debug_msg("tsdb: dropping %lu bytes cut short in %s.data",
+                   (unsigned long) (p->data_len - off), p->path);
+         if (ftruncate(p->data_fd, off))
+            return 1;
+         p->data_len = off;
+      }
+   return lseek(p->data_fd, off, SEEK_SET) < 0;
+}
+
+static unsigned int
+partition_hash(const char *source, int level, uint32_t start)
+{
+   return (hash_str(source, 2166136261u) ^ (level * 31 + start))
+      % TSDB_PARTITIONS;
+}
+
+/* Returns the open partition of source and level holding time t, opening
+ * it if needed, or NULL if it is sealed. */
+static partition_t *
+partition_get(tsdb_t *db, const char *source, int level, unsigned int step,
+              uint32_t t)
+{
+   unsigned int res, span, h;
+   uint32_t start;
+   partition_t *p;
+   struct stat st;
+   char dir[4096], name[4096];
+
+   res = step * (level ? db->levels[level].steps : 1);
+   span = res * db->levels[level].points;
+   start = t - t % span;
+
+   h = partition_hash(source, level, start);
+   for (p = db->open[h]; p; p = p->next)
+      if (p->hdr.start == start && p->level == level
+          && !strcmp(p->source, source))
+         return p;
+   for (p = db->sealing; p; p = p->next)
+      if (p->hdr.start == start && p->level == level
+          && !strcmp(p->source, source))
+         return NULL;
+
+   if (path_fmt(dir, sizeof(dir), "%s/%s/%d", db->root, source, level)
+       || path_fmt(name, sizeof(name), "%s/%u.index", dir, start))
+      return NULL;
+   if (!stat(name, &st))
+      return NULL;
+   if (mkdirs(dir))
+      return NULL;
+
+   p = calloc(1, sizeof(*p));
+   if (!p)
+      return NULL;
+   p->data_fd = p->series_fd = -1;
+   p->level = level;
+   if (path_fmt(name, sizeof(name), "%s/%u", dir, start))
+      goto fail;
+   p->source = strdup(source);
+   p->path = strdup(name);
+   if (!p->source || !p->path)
+      goto fail;
+
+   if (path_fmt(name, sizeof(name), "%s.series", p->path))
+      goto fail;
+   p->series_fd = open(name, O_RDWR | O_CREAT | O_APPEND, 0644);
+   if (p->series_fd >= 0 && !path_fmt(name, sizeof(name), "%s.data", p->path))
+      p->data_fd = open(name, O_RDWR | O_CREAT, 0644);
+   if (p->data_fd < 0 || p->series_fd < 0 || fstat(p->data_fd, &st))
+      {
+         err_msg("tsdb: unable to open %s: %s", name, strerror(errno));
+         goto fail;
+      }
+
+   if (st.st_size < (off_t) sizeof(data_hdr_t))
+      {
+         memset(&p->hdr, 0, sizeof(p->hdr));
+         memcpy(p->hdr.magic, DATA_MAGIC, 8);
+         p->hdr.version = 1;
+         p->hdr.step = step;
+         p->hdr.res = res;
+         p->hdr.span = span;
+         p->hdr.start = start;
+         p->hdr.level = level;
+         if (ftruncate(p->data_fd, 0) || ftruncate(p->series_fd, 0)
+             || write_all(p->data_fd, &p->hdr, sizeof(p->hdr)))
+            goto fail;
+         p->data_len = sizeof(p->hdr);
+      }
+   else
+      {
+         if (pread(p->data_fd, &p->hdr, sizeof(p->hdr), 0) != sizeof(p->hdr)
+             || memcmp(p->hdr.magic, DATA_MAGIC, 8) || p->hdr.span != span)
+            {
+               err_msg("tsdb: %s.data is not a partition of this store",
+                       p->path);
+               goto fail;
+            }
+         p->data_len = st.st_size;
+         if (partition_recover(p))
+            goto fail;
+      }
+
+   p->next = db->open[h];
+   db->open[h] = p;
+   return p;
+
+ fail:
+   partition_free(p);
+   return NULL;
+}
+
+static int
+partition_write(tsdb_t *db, const char *source, const char *key, int level,
+                unsigned int step, uint32_t t, double val, const uint32_t *num)
+{
+   partition_t *p;
+   series_t *s;
+   char id[16];
+
+   p = partition_get(db, source, level, step, t);
+   if (!p)
+      return 1;
+
+   s = series_find(p, key);
+   if (!s)
+      {
+         s = series_add(p, key, p->nseries);
+         if (!s)
+            return 1;
+         snprintf(id, sizeof(id), "%u ", s->id);
+         if (bytes_put(&p->sbuf, id, strlen(id))
+             || bytes_put(&p->sbuf, key, strlen(key))
+             || bytes_put(&p->sbuf, "\n", 1))
+            return 1;
+      }
+
+   /* RRDs refuse values that are not newer, and so do we. */
+   if (s->last_t && t <= s->last_t)
+      return 1;
+   if (chunk_add(s, t, val, num))
+      return 1;
+   s->last_t = t;
+   if (s->count == TSDB_CHUNK)
+      return chunk_write(p, s);
+   return 0;
+}
+
+
+static int
+parse_rra(const char *rra, level_t *l)
+{
+   char cf[16];
+
+   if (sscanf(rra, "RRA:%15[^:]:%*[^:]:%u:%u", cf, &l->steps, &l->rows) != 3
+       || !l->steps || !l->rows)
+      return 1;
+   strcpy(l->cf, cf);
+   return 0;
+}
+
+tsdb_t *
+tsdb_open(const char *root, char **rras, int nrras)
+{
+   unsigned int ratio;
+   tsdb_t *db;
+   int i;
+
+   db = calloc(1, sizeof(*db));
+   if (!db || !(db->root = strdup(root)))
+      {
+         free(db);
+         return NULL;
+      }
+   pthread_mutex_init(&db->lock, NULL);
+
+   for (i = 0; i < nrras && db->nlevels < TSDB_MAX_LEVELS; i++)
+      {
+         if (parse_rra(rras[i], &db->levels[db->nlevels]))
+            {
+               err_msg("tsdb: ignoring RRA %s", rras[i]);
+               continue;
+            }
+         /* A level is consolidated from the one before it. */
+         if (db->nlevels && db->levels[db->nlevels].steps
+                % db->levels[db->nlevels - 1].steps)
+            {
+               err_msg("tsdb: ignoring RRA %s, its step is not a multiple "
+                       "of the one before", rras[i]);
+               continue;
+            }
+         db->nlevels++;
+      }
+   if (!db->nlevels)
+      {
+         strcpy(db->levels[0].cf, "AVERAGE");
+         db->levels[0].steps = 1;
+         db->levels[0].rows = 5856;
+         db->nlevels = 1;
+      }
+
+   /* A partition ends where a step of the next level does, or the bucket
+    * across its end would be consolidated from half its values. */
+   for (i = 0; i < db->nlevels; i++)
+      {
+         ratio = i + 1 < db->nlevels ? db->levels[i + 1].steps
+            / (i ? db->levels[i].steps : 1) : 1;
+         db->levels[i].points = (TSDB_POINTS + ratio - 1) / ratio * ratio;
+      }
+   return db;
+}
+
+int
+tsdb_write(tsdb_t *db, const char *source, const char *key,
+           unsigned int step, uint32_t t, double val, const uint32_t *num)
+{
+   int rc;
+
+   if (!step || !t)
+      return 1;
+   pthread_mutex_lock(&db->lock);
+   rc = partition_write(db, source, key, 0, step, t, val, num);
+   pthread_mutex_unlock(&db->lock);
+   return rc;
+}
+
+
+/* Consolidation.  Holds the values of one series in one bucket of the
+ * next level. */
+typedef struct
+   {
+      uint32_t bucket;
+      unsigned int count;
+      double sum, min, max, last;
+      uint32_t num;
+      int has_num;
+   }
+bucket_t;
+
+static void
+bucket_emit(tsdb_t *db, partition_t *p, const char *key, bucket_t *b)
+{
+   const char *cf = db->levels[p->level + 1].cf;
+   double val;
+
+   if (!b->count)
+      return;
+   if (!strcmp(cf, "MIN"))
+      val = b->min;
+   else if (!strcmp(cf, "MAX"))
+      val = b->max;
+   else if (!strcmp(cf, "LAST"))
+      val = b->last;
+   else
+      val = b->sum / b->count;
+   partition_write(db, p->source, key, p->level + 1, p->hdr.step, b->bucket,
+                   val, b->has_num ? &b->num : NULL);
+}
+
+/* Runs without db->lock, which p no longer needs once it is on the
+ * sealing list, and takes it for each series' consolidated values. */
+static void
+partition_consolidate(tsdb_t *db, partition_t *p)
+{
+   unsigned int res = p->hdr.step * db->levels[p->level + 1].steps;
+   uint32_t t[TSDB_CHUNK], num[TSDB_CHUNK], i, j, k, bucket;
+   unsigned int nb, size = 0;
+   double val[TSDB_CHUNK];
+   const unsigned char *map;
+   const chunk_hdr_t *hdr;
+   bucket_t *b = NULL, *nbuf;
+   series_t *s;
+
+   if (p->data_len <= sizeof(data_hdr_t))
+      return;
+   map = mmap(NULL, p->data_len, PROT_READ, MAP_SHARED, p->data_fd, 0);
+   if (map == MAP_FAILED)
+      {
+         err_msg("tsdb: unable to map %s.data: %s", p->path, strerror(errno));
+         return;
+      }
+
+   for (i = 0; i < p->nseries; i++)
+      {
+         s = p->by_id[i];
+         if (!s)
+            continue;
+         nb = 0;
+         for (j = 0; j < s->nchunks; j++)
+            {
+               hdr = (const chunk_hdr_t *) (map + s->chunks[j].off);
+               if (hdr->count > TSDB_CHUNK
+                   || chunk_decode(hdr, (const unsigned char *) (hdr + 1), t,
+                                   val, num))
+                  {
+                     err_msg("tsdb: skipping a corrupt chunk in %s.data",
+                             p->path);
+                     continue;
+                  }
+               for (k = 0; k < hdr->count; k++)
+                  {
+                     bucket = t[k] - t[k] % res;
+                     if (!nb || b[nb - 1].bucket != bucket)
+                        {
+                           if (nb == size)
+                              {
+                                 nbuf = realloc(b, (size ? size * 2 : 64)
+                                                   * sizeof(*b));
+                                 if (!nbuf)
+                                    {
+                                       err_msg("tsdb: out of memory "
+                                               "consolidating %s", p->path);
+                                       goto done;
+                                    }
+                                 b = nbuf;
+                                 size = size ? size * 2 : 64;
+                              }
+                           memset(&b[nb], 0, sizeof(*b));
+                           b[nb++].bucket = bucket;
+                        }
+                     if (!b[nb - 1].count)
+                        b[nb - 1].sum = b[nb - 1].min = b[nb - 1].max = val[k];
+                     else
+                        {
+                           b[nb - 1].sum += val[k];
+                           if (val[k] < b[nb - 1].min)
+                              b[nb - 1].min = val[k];
+                           if (val[k] > b[nb - 1].max)
+                              b[nb - 1].max = val[k];
+                        }
+                     b[nb - 1].last = val[k];
+                     b[nb - 1].num = num[k];
+                     b[nb - 1].has_num = hdr->nlen != 0;
+                     b[nb - 1].count++;
+                  }
+            }
+         pthread_mutex_lock(&db->lock);
+         for (j = 0; j < nb; j++)
+            bucket_emit(db, p, s->key, &b[j]);
+         pthread_mutex_unlock(&db->lock);
+      }
+ done:
+   free(b);
+   munmap((void *) map, p->data_len);
+}
+
+static int
+partition_seal(tsdb_t *db, partition_t *p)
+{
+   char name[4096], tmp[4096];
+   index_hdr_t ih;
+   index_series_t is;
+   bytes_t out;
+   unsigned int i, n;
+   series_t *s;
+   int fd, rc;
+
+   for (i = 0; i < p->nseries; i++)
+      if (p->by_id[i] && chunk_write(p, p->by_id[i]))
+         return 1;
+   if (partition_flush(p))
+      return 1;
+
+   /* by_id is in id order, as the index wants. */
+   memset(&out, 0, sizeof(out));
+   memset(&ih, 0, sizeof(ih));
+   memcpy(ih.magic, INDEX_MAGIC, 8);
+   for (i = 0; i < p->nseries; i++)
+      if (p->by_id[i])
+         {
+            ih.nseries++;
+            ih.nrefs += p->by_id[i]->nchunks;
+         }
+   rc = bytes_put(&out, &ih, sizeof(ih));
+   for (i = n = 0; !rc && i < p->nseries; i++)
+      {
+         s = p->by_id[i];
+         if (!s)
+            continue;
+         is.id = s->id;
+         is.first = n;
+         is.n = s->nchunks;
+         is.unused = 0;
+         n += s->nchunks;
+         rc = bytes_put(&out, &is, sizeof(is));
+      }
+   for (i = 0; !rc && i < p->nseries; i++)
+      if (p->by_id[i])
+         rc = bytes_put(&out, p->by_id[i]->chunks,
+                        p->by_id[i]->nchunks * sizeof(chunk_ref_t));
+
+   if (path_fmt(name, sizeof(name), "%s.index", p->path)
+       || path_fmt(tmp, sizeof(tmp), "%s.index.tmp", p->path))
+      {
+         free(out.buf);
+         return 1;
+      }
+   fd = rc ? -1 : open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0 || write_all(fd, out.buf, out.len) || fsync(fd)
+       || close(fd) || rename(tmp, name))
+      {
+         err_msg("tsdb: unable to write %s: %s", name, strerror(errno));
+         rc = 1;
+      }
+   free(out.buf);
+   if (rc)
+      return 1;
+
+   debug_msg("tsdb: sealed %s, %u series", p->path, ih.nseries);
+   if (p->level + 1 < db->nlevels)
+      partition_consolidate(db, p);
+   return 0;
+}
+
+static void
+expire_level(tsdb_t *db, const char *source, int level, time_t now)
+{
+   char dir[4096], name[4096];
+   unsigned long retention;
+   struct dirent *d;
+   data_hdr_t hdr;
+   uint32_t start;
+   char *end;
+   DIR *dp;
+   int fd;
+
+   if (path_fmt(dir, sizeof(dir), "%s/%s/%d", db->root, source, level))
+      return;
+   dp = opendir(dir);
+   if (!dp)
+      return;
+   while ((d = readdir(dp)))
+      {
+         start = strtoul(d->d_name, &end, 10);
+         if (strcmp(end, ".data"))
+            continue;
+         if (path_fmt(name, sizeof(name), "%s/%s", dir, d->d_name))
+            continue;
+         fd = open(name, O_RDONLY);
+         if (fd < 0)
+            continue;
+         if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+            hdr.span = 0;
+         close(fd);
+
+         retention = (unsigned long) db->levels[level].rows
+            * db->levels[level].steps * hdr.step;
+         if (!hdr.span || (unsigned long) start + hdr.span + retention
+                             >= (unsigned long) now)
+            continue;
+
+         debug_msg("tsdb: expiring %s", name);
+         unlink(name);
+         if (!path_fmt(name, sizeof(name), "%s/%u.series", dir, start))
+            unlink(name);
+         if (!path_fmt(name, sizeof(name), "%s/%u.index", dir, start))
+            unlink(name);
+      }
+   closedir(dp);
+}
+
+void
+tsdb_maintain(tsdb_t *db, time_t now)
+{
+   partition_t **pp, **sp, *p;
+   series_t *s;
+   struct dirent *d;
+   unsigned int h, i;
+   int level;
+   DIR *dp;
+
+   /* Lower levels first, since sealing one writes to the next. */
+   for (level = 0; level < db->nlevels; level++)
+      {
+         pthread_mutex_lock(&db->lock);
+         for (h = 0; h < TSDB_PARTITIONS; h++)
+            for (pp = &db->open[h]; (p = *pp); )
+               {
+                  if (p->level != level)
+                     {
+                        pp = &p->next;
+                        continue;
+                     }
+                  if ((time_t) p->hdr.start + p->hdr.span
+                         + TSDB_GRACE * (level + 1) > now)
+                     {
+                        for (i = 0; i < p->nseries; i++)
+                           {
+                              s = p->by_id[i];
+                              if (s && s->count
+                                  && (time_t) s->t_first + TSDB_FLUSH_AGE
+                                     < now)
+                                 chunk_write(p, s);
+                           }
+                        partition_flush(p);
+                        pp = &p->next;
+                        continue;
+                     }
+                  /* Onto the sealing list, where writers leave it alone
+                   * and partition_get() will not open it again.  It is
+                   * kept in time order, as the next level only takes
+                   * values newer than the last. */
+                  *pp = p->next;
+                  for (sp = &db->sealing; *sp && (*sp)->hdr.start
+                          <= p->hdr.start; sp = &(*sp)->next)
+                     ;
+                  p->next = *sp;
+                  *sp = p;
+               }
+         pthread_mutex_unlock(&db->lock);
+
+         for (p = db->sealing; p; p = p->next)
+            partition_seal(db, p);
+
+         pthread_mutex_lock(&db->lock);
+         while ((p = db->sealing))
+            {
+               db->sealing = p->next;
+               partition_free(p);
+            }
+         pthread_mutex_unlock(&db->lock);
+      }
+
+   dp = opendir(db->root);
+   while (dp && (d = readdir(dp)))
+      {
+         if (d->d_name[0] == '.')
+            continue;
+         for (level = 0; level < db->nlevels; level++)
+            expire_level(db, d->d_name, level, now);
+      }
+   if (dp)
+      closedir(dp);
+}
+
+static void *
+tsdb_thread(void *arg)
+{
+   tsdb_t *db = (tsdb_t *) arg;
+
+   for (;;)
+      {
+         sleep(TSDB_MAINTAIN);
+         tsdb_maintain(db, time(NULL));
+      }
+   return NULL;
+}
+
+void
+tsdb_start(tsdb_t *db)
+{
+   pthread_attr_t attr;
+   pthread_t pid;
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   pthread_create(&pid, &attr, tsdb_thread, db);
+   pthread_attr_destroy(&attr);
+}
+
+
+/* Reading.  Partitions are mapped read only, so a reader never gets in
+ * the way of gmetad writing to the same store. */
+
+typedef struct
+   {
+      uint32_t start;
+      char name[64];
+   }
+part_name_t;
+
+static int
+cmp_part(const void *a, const void *b)
+{
+   uint32_t x = ((const part_name_t *) a)->start;
+   uint32_t y = ((const part_name_t *) b)->start;
+
+   return (x > y) - (x < y);
+}
+
+/* Returns the keys of a partition by id, or NULL. */
+static char **
+read_series(const char *path, uint32_t *n)
+{
+   char name[4096], *buf, *line, *sp, *save, **keys = NULL, **k;
+   uint32_t id, size = 0;
+   struct stat st;
+   FILE *fp;
+
+   *n = 0;
+   if (path_fmt(name, sizeof(name), "%s.series", path))
+      return NULL;
+   fp = fopen(name, "r");
+   if (!fp)
+      return NULL;
+   if (fstat(fileno(fp), &st) || !(buf = malloc(st.st_size + 1)))
+      {
+         fclose(fp);
+         return NULL;
+      }
+   buf[fread(buf, 1, st.st_size, fp)] = 0;
+   fclose(fp);
+
+   for (line = strtok_r(buf, "\n", &save); line;
+        line = strtok_r(NULL, "\n", &save))
+      {
+         sp = strchr(line, ' ');
+         if (!sp)
+            continue;
+         *sp++ = 0;
+         id = strtoul(line, NULL, 10);
+         if (id >= size)
+            {
+               k = realloc(keys, (id + 64) * sizeof(char *));
+               if (!k)
+                  break;
+               memset(k + size, 0, (id + 64 - size) * sizeof(char *));
+               keys = k;
+               size = id + 64;
+            }
+         keys[id] = strdup(sp);
+         if (id >= *n)
+            *n = id + 1;
+      }
+   free(buf);
+   return keys;
+}
+
+static long
+fetch_chunk(const unsigned char *map, size_t len, uint64_t off,
+            const char *key, uint32_t start, uint32_t end, tsdb_point_cb cb,
+            void *arg, int *stop)
+{
+   uint32_t t[TSDB_CHUNK], i;
+   double val[TSDB_CHUNK];
+   const chunk_hdr_t *hdr;
+   long n = 0;
+
+   if (off + sizeof(*hdr) > len)
+      return 0;
+   hdr = (const chunk_hdr_t *) (map + off);
+   if (hdr->count > TSDB_CHUNK
+       || off + CHUNK_SIZE(hdr) > len
+       || chunk_decode(hdr, (const unsigned char *) (hdr + 1), t, val, NULL))
+      return 0;
+   for (i = 0; i < hdr->count && !*stop; i++)
+      if (t[i] >= start && t[i] < end)
+         {
+            n++;
+            *stop = cb(key, t[i], val[i], arg);
+         }
+   return n;
+}
+
+static long
+fetch_partition(const char *path, const char *key, uint32_t start,
+                uint32_t end, tsdb_point_cb cb, void *arg, int *stop)
+{
+   const unsigned char *map, *imap = MAP_FAILED;
+   const index_hdr_t *ih;
+   const index_series_t *is = NULL;
+   const chunk_ref_t *refs;
+   const chunk_hdr_t *hdr;
+   char name[4096], **keys;
+   uint32_t nkeys, id = 0, lo, hi, mid, i;
+   struct stat st, ist;
+   uint64_t off;
+   long n = 0;
+   int fd, ifd;
+
+   keys = read_series(path, &nkeys);
+   if (key)
+      {
+         for (id = 0; id < nkeys && (!keys[id] || strcmp(keys[id], key)); id++)
+            ;
+         if (id == nkeys)
+            goto done;
+      }
+
+   if (path_fmt(name, sizeof(name), "%s.data", path))
+      goto done;
+   fd = open(name, O_RDONLY);
+   if (fd < 0)
+      goto done;
+   if (fstat(fd, &st) || st.st_size <= (off_t) sizeof(data_hdr_t)
+       || (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0))
+          == MAP_FAILED)
+      {
+         close(fd);
+         goto done;
+      }
+   close(fd);
+
+   /* A sealed partition has an index to go straight to the chunks of a
+    * series; an open one is scanned. */
+   ifd = key && !path_fmt(name, sizeof(name), "%s.index", path)
+      ? open(name, O_RDONLY) : -1;
+   if (ifd >= 0)
+      {
+         if (!fstat(ifd, &ist) && ist.st_size >= (off_t) sizeof(*ih))
+            imap = mmap(NULL, ist.st_size, PROT_READ, MAP_SHARED, ifd, 0);
+         close(ifd);
+      }
+
+   if (imap != MAP_FAILED)
+      {
+         ih = (const index_hdr_t *) imap;
+         if (!memcmp(ih->magic, INDEX_MAGIC, 8)
+             && sizeof(*ih) + ih->nseries * sizeof(*is)
+                + (uint64_t) ih->nrefs * sizeof(*refs) <= (uint64_t) ist.st_size)
+            {
+               is = (const index_series_t *) (ih + 1);
+               refs = (const chunk_ref_t *) (is + ih->nseries);
+               for (lo = 0, hi = ih->nseries; lo < hi; )
+                  {
+                     mid = (lo + hi) / 2;
+                     if (is[mid].id < id)
+                        lo = mid + 1;
+                     else
+                        hi = mid;
+                  }
+               if (lo < ih->nseries && is[lo].id == id
+                   && is[lo].first + is[lo].n <= ih->nrefs)
+                  for (i = 0; i < is[lo].n && !*stop; i++)
+                     {
+                        if (refs[is[lo].first + i].t_last < start
+                            || refs[is[lo].first + i].t_first >= end)
+                           continue;
+                        n += fetch_chunk(map, st.st_size,
+                                         refs[is[lo].first + i].off, key,
+                                         start, end, cb, arg, stop);
+                     }
+            }
+         munmap((void *) imap, ist.st_size);
+      }
+
+   if (!is)
+      for (off = sizeof(data_hdr_t); off + sizeof(*hdr) <= (uint64_t) st.st_size
+              && !*stop; )
+         {
+            hdr = (const chunk_hdr_t *) (map + off);
+            if ((!key || hdr->series == id) && hdr->series < nkeys
+                && keys[hdr->series] && hdr->t_last >= start
+                && hdr->t_first < end)
+               n += fetch_chunk(map, st.st_size, off, keys[hdr->series],
+                                start, end, cb, arg, stop);
+            off += CHUNK_SIZE(hdr);
+         }
+   munmap((void *) map, st.st_size);
+
+ done:
+   for (i = 0; i < nkeys; i++)
+      free(keys[i]);
+   free(keys);
+   return n;
+}
+
+long
+tsdb_fetch(const char *root, const char *source, const char *key,
+           int level, uint32_t start, uint32_t end, tsdb_point_cb cb,
+           void *arg)
+{
+   char dir[4096], path[4096];
+   part_name_t *parts = NULL, *pn;
+   unsigned int nparts = 0, size = 0, i;
+   struct dirent *d;
+   data_hdr_t hdr;
+   uint32_t pstart;
+   char *e;
+   long n = 0;
+   int fd, stop = 0;
+   DIR *dp;
+
+   if (path_fmt(dir, sizeof(dir), "%s/%s/%d", root, source, level))
+      return -1;
+   dp = opendir(dir);
+   if (!dp)
+      return -1;
+   while ((d = readdir(dp)))
+      {
+         pstart = strtoul(d->d_name, &e, 10);
+         if (strcmp(e, ".data"))
+            continue;
+         if (nparts == size)
+            {
+               pn = realloc(parts, (size ? size * 2 : 16) * sizeof(*pn));
+               if (!pn)
+                  break;
+               parts = pn;
+               size = size ? size * 2 : 16;
+            }
+         parts[nparts].start = pstart;
+         snprintf(parts[nparts].name, sizeof(parts[nparts].name), "%u",
+                  pstart);
+         nparts++;
+      }
+   closedir(dp);
+   if (nparts)
+      qsort(parts, nparts, sizeof(*parts), cmp_part);
+
+   for (i = 0; i < nparts && !stop; i++)
+      {
+         if (parts[i].start >= end)
+            break;
+         if (path_fmt(path, sizeof(path), "%s/%s.data", dir, parts[i].name))
+            continue;
+         fd = open(path, O_RDONLY);
+         if (fd < 0)
+            continue;
+         if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+            hdr.span = 0;
+         close(fd);
+         if (!hdr.span || (uint64_t) parts[i].start + hdr.span <= start)
+            continue;
+         if (path_fmt(path, sizeof(path), "%s/%s", dir, parts[i].name))
+            continue;
+         n += fetch_partition(path, key, start, end, cb, arg, &stop);
+      }
+   free(parts);
+   return n;
+}
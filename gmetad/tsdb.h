@@ -0,0 +1,50 @@
+#ifndef TSDB_H
+#define TSDB_H 1
+
+#include <stdint.h>
+#include <time.h>
+
+/* An append-only store for metric values, as an alternative to one RRD
+ * file per metric.  See tsdb.c for the layout. */
+typedef struct tsdb tsdb_t;
+
+#define TSDB_MAX_LEVELS 8
+
+/* The directory gmetad keeps the root (grid) summaries under. */
+#define TSDB_ROOT_SOURCE "__SummaryInfo__"
+
+/* Opens the store under root.  The RRA definitions, e.g.
+ * "RRA:AVERAGE:0.5:4:20160", set the resolution and retention of each
+ * level: the first holds the values as written, the others hold
+ * consolidated values.  Returns NULL on error. */
+tsdb_t *tsdb_open(const char *root, char **rras, int nrras);
+
+/* Appends a value of series key (host/metric, as in an RRD path) of
+ * source.  num is the host count of a summary, or NULL.  Returns nonzero
+ * if the value was not stored, e.g. because its partition is sealed. */
+int tsdb_write(tsdb_t *db, const char *source, const char *key,
+               unsigned int step, uint32_t t, double val,
+               const uint32_t *num);
+
+/* Writes out old chunks, seals partitions that have ended, consolidates
+ * them into the next level and deletes partitions past their level's
+ * retention.  Meant to run about twice a minute. */
+void tsdb_maintain(tsdb_t *db, time_t now);
+
+/* Runs tsdb_maintain() on a thread of its own. */
+void tsdb_start(tsdb_t *db);
+
+
+/* Reading.  The callback returns nonzero to stop early. */
+typedef int (*tsdb_point_cb)(const char *key, uint32_t t, double val,
+                             void *arg);
+
+/* Calls cb for the values of key (or of every series, if key is NULL) in
+ * source at level with start <= t < end, in time order for each series
+ * and partition.  Returns the number of values, or -1 if level does not
+ * exist. */
+long tsdb_fetch(const char *root, const char *source, const char *key,
+                int level, uint32_t start, uint32_t end, tsdb_point_cb cb,
+                void *arg);
+
+#endif
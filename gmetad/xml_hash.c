@@ -29,17 +29,16 @@ error "gperf generated tables don't work with this execution character set. Plea
 #endif
 
 #line 1 "xml_hash.gperf"
-
 #include <gmetad.h>
-#line 5 "xml_hash.gperf"
+#line 4 "xml_hash.gperf"
 struct xml_tag;
 
-#define TOTAL_KEYWORDS 33
+#define TOTAL_KEYWORDS 36
 #define MIN_WORD_LENGTH 2
 #define MAX_WORD_LENGTH 13
-#define MIN_HASH_VALUE 4
-#define MAX_HASH_VALUE 49
-/* maximum key range = 46, duplicates = 0 */
+#define MIN_HASH_VALUE 2
+#define MAX_HASH_VALUE 42
+/* maximum key range = 41, duplicates = 0 */
 
 #ifdef __GNUC__
 __inline
@@ -55,32 +54,32 @@ xml_hash (str, len)
 {
   static unsigned char asso_values[] =
     {
-      50, 50, 50, 50, 50, 50, 50, 50, 50, 50,
-      50, 50, 50, 50, 50, 50, 50, 50, 50, 50,
-      50, 50, 50, 50, 50, 50, 50, 50, 50, 50,
-      50, 50, 50, 50, 50, 50, 50, 50, 50, 50,
-      50, 50, 50, 50, 50, 50, 50, 50, 50, 50,
-      50, 50, 50, 50, 50, 50, 50, 50, 50, 50,
-      50, 50, 50, 50, 50,  0, 50,  5, 25,  5,
-      50,  0, 35, 25, 50, 50, 10,  5,  5,  5,
-      10, 50, 10,  0,  0, 20, 15, 50, 15, 40,
-      50, 50, 50, 50, 50, 50, 50, 50, 50, 50,
-      50, 50, 50, 50, 50, 50, 50, 50, 50, 50,
-      50, 50, 50, 50, 50, 50, 50, 50, 50, 50,
-      50, 50, 50, 50, 50, 50, 50, 50, 50, 50,
-      50, 50, 50, 50, 50, 50, 50, 50, 50, 50,
-      50, 50, 50, 50, 50, 50, 50, 50, 50, 50,
-      50, 50, 50, 50, 50, 50, 50, 50, 50, 50,
-      50, 50, 50, 50, 50, 50, 50, 50, 50, 50,
-      50, 50, 50, 50, 50, 50, 50, 50, 50, 50,
-      50, 50, 50, 50, 50, 50, 50, 50, 50, 50,
-      50, 50, 50, 50, 50, 50, 50, 50, 50, 50,
-      50, 50, 50, 50, 50, 50, 50, 50, 50, 50,
-      50, 50, 50, 50, 50, 50, 50, 50, 50, 50,
-      50, 50, 50, 50, 50, 50, 50, 50, 50, 50,
-      50, 50, 50, 50, 50, 50, 50, 50, 50, 50,
-      50, 50, 50, 50, 50, 50, 50, 50, 50, 50,
-      50, 50, 50, 50, 50, 50
+      43, 43, 43, 43, 43, 43, 43, 43, 43, 43,
+      43, 43, 43, 43, 43, 43, 43, 43, 43, 43,
+      43, 43, 43, 43, 43, 43, 43, 43, 43, 43,
+      43, 43, 43, 43, 43, 43, 43, 43, 43, 43,
+      43, 43, 43, 43, 43, 43, 43, 43, 43, 43,
+      43, 43, 43, 43, 43, 43, 43, 43, 43, 43,
+      43, 43, 43, 43, 43,  3, 43, 18,  5, 14,
+       5,  0, 12,  0, 43, 43, 15, 18,  2, 16,
+       0, 43, 16, 15, 12,  1,  6, 43,  1,  2,
+      43, 43, 43, 43, 43, 43, 43, 43, 43, 43,
+      43, 43, 43, 43, 43, 43, 43, 43, 43, 43,
+      43, 43, 43, 43, 43, 43, 43, 43, 43, 43,
+      43, 43, 43, 43, 43, 43, 43, 43, 43, 43,
+      43, 43, 43, 43, 43, 43, 43, 43, 43, 43,
+      43, 43, 43, 43, 43, 43, 43, 43, 43, 43,
+      43, 43, 43, 43, 43, 43, 43, 43, 43, 43,
+      43, 43, 43, 43, 43, 43, 43, 43, 43, 43,
+      43, 43, 43, 43, 43, 43, 43, 43, 43, 43,
+      43, 43, 43, 43, 43, 43, 43, 43, 43, 43,
+      43, 43, 43, 43, 43, 43, 43, 43, 43, 43,
+      43, 43, 43, 43, 43, 43, 43, 43, 43, 43,
+      43, 43, 43, 43, 43, 43, 43, 43, 43, 43,
+      43, 43, 43, 43, 43, 43, 43, 43, 43, 43,
+      43, 43, 43, 43, 43, 43, 43, 43, 43, 43,
+      43, 43, 43, 43, 43, 43, 43, 43, 43, 43,
+      43, 43, 43, 43, 43, 43
     };
   return len + asso_values[(unsigned char)str[len - 1]] + asso_values[(unsigned char)str[0]];
 }
@@ -98,86 +97,89 @@ in_xml_list (str, len)
 {
   static unsigned char lengthtable[] =
     {
-       0,  0,  0,  0,  4,  0,  0,  2,  3,  4,  5,  6,  7,  3,
-       4, 10,  6,  7, 13,  4,  5, 11,  7,  8,  9,  5,  0,  7,
-       3,  4,  0,  0,  2,  3,  4,  0,  0,  2, 13,  4,  5,  0,
-       0,  8,  4,  0,  0,  0,  0,  9
+       0,  0,  2,  2,  0,  0,  0,  2,  0,  4,  4,  4,  0,  3,
+       9,  7,  2,  4, 13,  3,  4,  5,  7,  3,  3,  8, 11, 10,
+       4,  8,  4,  4,  5, 10,  5,  6,  3,  5,  9, 13,  7,  7,
+       6
     };
   static struct xml_tag xml_tags[] =
     {
-      {"", 0}, {"", 0}, {"", 0}, {"", 0},
-#line 11 "xml_hash.gperf"
-      {"TAGS", TAGS_TAG},
       {"", 0}, {"", 0},
-#line 31 "xml_hash.gperf"
+#line 21 "xml_hash.gperf"
+      {"IP", IP_TAG},
+#line 19 "xml_hash.gperf"
+      {"UP", UP_TAG,},
+      {"", 0}, {"", 0}, {"", 0},
+#line 41 "xml_hash.gperf"
+      {"ID", ID_TAG},
+      {"", 0},
+#line 8 "xml_hash.gperf"
+      {"GRID", GRID_TAG},
+#line 32 "xml_hash.gperf"
+      {"DMAX", DMAX_TAG},
+#line 20 "xml_hash.gperf"
+      {"DOWN", DOWN_TAG,},
+      {"", 0},
+#line 40 "xml_hash.gperf"
+      {"DEF", DEF_TAG},
+#line 11 "xml_hash.gperf"
+      {"AUTHORITY", AUTHORITY_TAG},
+#line 7 "xml_hash.gperf"
+      {"VERSION", VERSION_TAG},
+#line 30 "xml_hash.gperf"
       {"TN", TN_TAG},
+#line 31 "xml_hash.gperf"
+      {"TMAX", TMAX_TAG},
+#line 24 "xml_hash.gperf"
+      {"GMOND_STARTED", STARTED_TAG},
+#line 16 "xml_hash.gperf"
+      {"URL", URL_TAG,},
+#line 9 "xml_hash.gperf"
+      {"NAME", NAME_TAG},
+#line 29 "xml_hash.gperf"
+      {"UNITS", UNITS_TAG},
+#line 15 "xml_hash.gperf"
+      {"LATLONG", LATLONG_TAG,},
 #line 28 "xml_hash.gperf"
-      {"SUM", SUM_TAG,},
-#line 35 "xml_hash.gperf"
+      {"NUM", NUM_TAG,},
+#line 33 "xml_hash.gperf"
+      {"VAL", VAL_TAG},
+#line 22 "xml_hash.gperf"
+      {"LOCATION", LOCATION_TAG},
+#line 6 "xml_hash.gperf"
+      {"GANGLIA_XML", GANGLIA_XML_TAG},
+#line 37 "xml_hash.gperf"
+      {"EXTRA_DATA", EXTRA_DATA_TAG},
+#line 17 "xml_hash.gperf"
+      {"HOST", HOST_TAG},
+#line 23 "xml_hash.gperf"
+      {"REPORTED", REPORTED_TAG},
+#line 34 "xml_hash.gperf"
       {"TYPE", TYPE_TAG},
-#line 36 "xml_hash.gperf"
+#line 10 "xml_hash.gperf"
+      {"TAGS", TAGS_TAG},
+#line 18 "xml_hash.gperf"
+      {"HOSTS", HOSTS_TAG,},
+#line 39 "xml_hash.gperf"
+      {"METRIC_DEF", METRIC_DEF_TAG},
+#line 35 "xml_hash.gperf"
       {"SLOPE", SLOPE_TAG},
-#line 37 "xml_hash.gperf"
+#line 36 "xml_hash.gperf"
       {"SOURCE", SOURCE_TAG},
 #line 27 "xml_hash.gperf"
-      {"METRICS", METRICS_TAG},
-#line 29 "xml_hash.gperf"
-      {"NUM", NUM_TAG,},
-#line 10 "xml_hash.gperf"
-      {"NAME", NAME_TAG},
-#line 38 "xml_hash.gperf"
-      {"EXTRA_DATA", EXTRA_DATA_TAG},
-#line 26 "xml_hash.gperf"
-      {"METRIC", METRIC_TAG},
-#line 16 "xml_hash.gperf"
-      {"LATLONG", LATLONG_TAG,},
-#line 39 "xml_hash.gperf"
-      {"EXTRA_ELEMENT", EXTRA_ELEMENT_TAG},
-#line 32 "xml_hash.gperf"
-      {"TMAX", TMAX_TAG},
-#line 15 "xml_hash.gperf"
+      {"SUM", SUM_TAG,},
+#line 14 "xml_hash.gperf"
       {"OWNER", OWNER_TAG,},
-#line 7 "xml_hash.gperf"
-      {"GANGLIA_XML", GANGLIA_XML_TAG},
 #line 13 "xml_hash.gperf"
-      {"CLUSTER", CLUSTER_TAG},
-#line 23 "xml_hash.gperf"
-      {"LOCATION", LOCATION_TAG},
-#line 14 "xml_hash.gperf"
       {"LOCALTIME", LOCALTIME_TAG},
-#line 30 "xml_hash.gperf"
-      {"UNITS", UNITS_TAG},
-      {"", 0},
-#line 8 "xml_hash.gperf"
-      {"VERSION", VERSION_TAG},
-#line 34 "xml_hash.gperf"
-      {"VAL", VAL_TAG},
-#line 9 "xml_hash.gperf"
-      {"GRID", GRID_TAG},
-      {"", 0}, {"", 0},
-#line 20 "xml_hash.gperf"
-      {"UP", UP_TAG,},
-#line 17 "xml_hash.gperf"
-      {"URL", URL_TAG,},
-#line 21 "xml_hash.gperf"
-      {"DOWN", DOWN_TAG,},
-      {"", 0}, {"", 0},
-#line 22 "xml_hash.gperf"
-      {"IP", IP_TAG},
-#line 25 "xml_hash.gperf"
-      {"GMOND_STARTED", STARTED_TAG},
-#line 18 "xml_hash.gperf"
-      {"HOST", HOST_TAG},
-#line 19 "xml_hash.gperf"
-      {"HOSTS", HOSTS_TAG,},
-      {"", 0}, {"", 0},
-#line 24 "xml_hash.gperf"
-      {"REPORTED", REPORTED_TAG},
-#line 33 "xml_hash.gperf"
-      {"DMAX", DMAX_TAG},
-      {"", 0}, {"", 0}, {"", 0}, {"", 0},
+#line 38 "xml_hash.gperf"
+      {"EXTRA_ELEMENT", EXTRA_ELEMENT_TAG},
+#line 26 "xml_hash.gperf"
+      {"METRICS", METRICS_TAG},
 #line 12 "xml_hash.gperf"
-      {"AUTHORITY", AUTHORITY_TAG}
+      {"CLUSTER", CLUSTER_TAG},
+#line 25 "xml_hash.gperf"
+      {"METRIC", METRIC_TAG}
     };
 
   if (len <= MAX_WORD_LENGTH && len >= MIN_WORD_LENGTH)
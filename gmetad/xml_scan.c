@@ -0,0 +1,1292 @@
+/* A scanner for the Ganglia XML dialect (fast_xml).
+ *
+ * Most of the time Expat spends on a dump goes to things the Ganglia DTD
+ * never uses, and the handlers then look up every attribute name in
+ * xml_hash and convert every number from scratch.  This scanner reads
+ * the documents gmond and gmetad write: an XML declaration in UTF-8,
+ * ISO-8859-1 or US-ASCII, a DOCTYPE with an internal subset of ELEMENT
+ * and ATTLIST declarations, and elements with attributes, whitespace,
+ * comments and processing instructions between them.  Attribute values
+ * may hold the predefined entities and character references.  It
+ * applies the attribute defaults and normalization of the ATTLISTs as
+ * Expat does.
+ *
+ * The handlers get the xml_tag of each attribute with the attributes.
+ * The attribute names of an element are the same from one element to
+ * the next (every METRIC of a dump is written by the same code), so the
+ * scanner keeps the names and tags of the last element of each name, its
+ * shape, and only looks names up when the shape changes.
+ *
+ * At the first thing it does not handle, including any error, the
+ * scanner hands over to Expat: it feeds a new Expat parser the prolog
+ * and a start tag for each element that is open, with no handlers, then
+ * the rest of the document with the handlers.  No handler has been
+ * called for the token that stopped the scanner, so the handlers see the
+ * document through exactly once, and errors come from Expat.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "xml_scan.h"
+
+extern struct xml_tag *in_xml_list (const char *, unsigned int);
+
+#define SCAN_MAX_NAME 32
+#define SCAN_MAX_DEPTH 32
+#define SCAN_MAX_ATTRS 24
+#define SCAN_MAX_DEFAULTS 8
+#define SCAN_MAX_ATTDEFS 128
+#define SCAN_SHAPES 16
+
+enum { SCAN_START, SCAN_PROLOG, SCAN_CONTENT, SCAN_EPILOG };
+
+enum { ENC_UTF8, ENC_LATIN1, ENC_ASCII };
+
+/* An attribute declared in the internal subset. */
+typedef struct
+   {
+      char el[SCAN_MAX_NAME];
+      char name[SCAN_MAX_NAME];
+      char *value;      /* The default, or NULL. */
+      int tokenized;    /* Not CDATA: spaces are trimmed and collapsed. */
+   }
+scan_attdef_t;
+
+/* The attribute names of the last element of a name, and what goes with
+ * them. */
+typedef struct
+   {
+      char el[SCAN_MAX_NAME];
+      size_t el_len;
+      struct xml_tag *xt;
+      int nattrs;       /* As written, before the defaults. */
+      int ndefaults;
+      char names[SCAN_MAX_ATTRS][SCAN_MAX_NAME];
+      size_t lens[SCAN_MAX_ATTRS];
+      int tokenized[SCAN_MAX_ATTRS];
+      const char *attr[2 * (SCAN_MAX_ATTRS + SCAN_MAX_DEFAULTS) + 1];
+      struct xml_tag *tags[SCAN_MAX_ATTRS + SCAN_MAX_DEFAULTS];
+      long nums[SCAN_MAX_ATTRS + SCAN_MAX_DEFAULTS];
+   }
+scan_shape_t;
+
+typedef struct
+   {
+      char name[SCAN_MAX_NAME];
+      size_t len;
+      struct xml_tag *xt;
+   }
+scan_open_t;
+
+struct xml_scan
+   {
+      XML_Memory_Handling_Suite mem;
+      XML_Parser expat;         /* Kept from one document to the next. */
+      int handed;               /* True once Expat has the document. */
+      XML_StartElementHandler start;
+      XML_EndElementHandler end;
+      xml_scan_start_t fast_start;
+      xml_scan_end_t fast_end;
+      void *data;
+
+      int state;
+      int encoding;
+      int doctype;              /* True once we have read the DOCTYPE. */
+      const char *prolog;
+      size_t prolog_len;
+      char root[SCAN_MAX_NAME];
+      long fed;                 /* Bytes parsed before this call. */
+      long byte_adjust;         /* From Expat's idea of where it is. */
+      int line_adjust;
+
+      scan_attdef_t attdefs[SCAN_MAX_ATTDEFS];
+      int nattdefs;
+      scan_shape_t shapes[SCAN_SHAPES];
+      int next_shape;
+      scan_open_t open[SCAN_MAX_DEPTH];
+      int depth;
+
+      char *scratch;            /* The values of the current element. */
+      size_t scratch_size;
+   };
+
+#define NAME_START 1
+#define NAME_CHAR 2
+#define SPACE 4
+#define SPECIAL 8               /* Needs a look in an attribute value. */
+
+static unsigned char cclass[256];
+static pthread_once_t cclass_once = PTHREAD_ONCE_INIT;
+
+static void
+cclass_init(void)
+{
+   int c;
+
+   for (c = 0; c < 256; c++)
+      {
+         if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_'
+             || c == ':')
+            cclass[c] |= NAME_START | NAME_CHAR;
+         if ((c >= '0' && c <= '9') || c == '-' || c == '.')
+            cclass[c] |= NAME_CHAR;
+         if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+            cclass[c] |= SPACE;
+         if (c < 0x20 || c >= 0x80 || c == '&' || c == '<')
+            cclass[c] |= SPECIAL;
+      }
+}
+
+#define IS(c, cl) (cclass[(unsigned char) (c)] & (cl))
+
+static const char *
+skip_space(const char *p, const char *end)
+{
+   while (p < end && IS(*p, SPACE))
+      p++;
+   return p;
+}
+
+static const char *
+skip_name(const char *p, const char *end)
+{
+   if (p >= end || !IS(*p, NAME_START))
+      return NULL;
+   for (p++; p < end && IS(*p, NAME_CHAR); p++)
+      ;
+   return p;
+}
+
+static int
+starts(const char *p, const char *end, const char *s)
+{
+   size_t n = strlen(s);
+
+   return (size_t) (end - p) >= n && !memcmp(p, s, n);
+}
+
+const char *
+xml_scan_find(const char *p, const char *end, const char *s)
+{
+   size_t n = strlen(s);
+
+   while ((p = memchr(p, s[0], end - p)))
+      {
+         if ((size_t) (end - p) < n)
+            return NULL;
+         if (!memcmp(p, s, n))
+            return p;
+         p++;
+      }
+   return NULL;
+}
+
+/* Returns the first byte of an attribute value from p on that is its
+ * closing quote or needs a closer look, or end.  Values are short, but
+ * SSE2 still checks the longer ones sixteen bytes at a time. */
+static const char *
+value_scan(const char *p, const char *end, char quote)
+{
+#ifdef __SSE2__
+   const __m128i q = _mm_set1_epi8(quote);
+   const __m128i amp = _mm_set1_epi8('&');
+   const __m128i lt = _mm_set1_epi8('<');
+   const __m128i sp = _mm_set1_epi8(' ');
+   __m128i v;
+   int m;
+
+   while (end - p >= 16)
+      {
+         v = _mm_loadu_si128((const __m128i *) p);
+         /* The compare is signed, so bytes from 0x80 up are below ' '. */
+         m = _mm_movemask_epi8(
+               _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, q),
+                                         _mm_cmpeq_epi8(v, amp)),
+                            _mm_or_si128(_mm_cmpeq_epi8(v, lt),
+                                         _mm_cmplt_epi8(v, sp))));
+         if (m)
+            return p + __builtin_ctz(m);
+         p += 16;
+      }
+#endif
+   for (; p < end; p++)
+      if (*p == quote || IS(*p, SPECIAL))
+         return p;
+   return end;
+}
+
+/* The length of the valid UTF-8 character at p, or 0. */
+static int
+utf8_char(const unsigned char *p, const unsigned char *end)
+{
+   int n, i;
+
+   if (p[0] >= 0xC2 && p[0] <= 0xDF)
+      n = 2;
+   else if (p[0] >= 0xE0 && p[0] <= 0xEF)
+      n = 3;
+   else if (p[0] >= 0xF0 && p[0] <= 0xF4)
+      n = 4;
+   else
+      return 0;
+   if (end - p < n)
+      return 0;
+   for (i = 1; i < n; i++)
+      if ((p[i] & 0xC0) != 0x80)
+         return 0;
+   /* Overlong forms, surrogates, U+FFFE and U+FFFF, and past U+10FFFF. */
+   if ((p[0] == 0xE0 && p[1] < 0xA0) || (p[0] == 0xED && p[1] > 0x9F)
+       || (p[0] == 0xEF && p[1] == 0xBF && p[2] > 0xBD)
+       || (p[0] == 0xF0 && p[1] < 0x90) || (p[0] == 0xF4 && p[1] > 0x8F))
+      return 0;
+   return n;
+}
+
+static char *
+utf8_put(char *d, unsigned long c)
+{
+   if (c < 0x80)
+      *d++ = c;
+   else if (c < 0x800)
+      {
+         *d++ = 0xC0 | (c >> 6);
+         *d++ = 0x80 | (c & 0x3F);
+      }
+   else if (c < 0x10000)
+      {
+         *d++ = 0xE0 | (c >> 12);
+         *d++ = 0x80 | ((c >> 6) & 0x3F);
+         *d++ = 0x80 | (c & 0x3F);
+      }
+   else
+      {
+         *d++ = 0xF0 | (c >> 18);
+         *d++ = 0x80 | ((c >> 12) & 0x3F);
+         *d++ = 0x80 | ((c >> 6) & 0x3F);
+         *d++ = 0x80 | (c & 0x3F);
+      }
+   return d;
+}
+
+/* Copies the attribute value [s, e) to d as Expat would pass it on:
+ * entities replaced, whitespace made spaces and UTF-8.  Returns the end
+ * of the copy, which takes at most twice the space, or NULL if the value
+ * is not one we handle. */
+static char *
+decode(xml_scan_t *scan, char *d, const char *s, const char *e)
+{
+   const char *semi;
+   unsigned long c;
+   char *q;
+   int n;
+
+   while (s < e)
+      {
+         c = (unsigned char) *s;
+         if (c == '&')
+            {
+               semi = memchr(s, ';', e - s);
+               if (!semi)
+                  return NULL;
+               n = semi - s;
+               if (n == 3 && !memcmp(s, "&lt", 3))
+                  *d++ = '<';
+               else if (n == 3 && !memcmp(s, "&gt", 3))
+                  *d++ = '>';
+               else if (n == 4 && !memcmp(s, "&amp", 4))
+                  *d++ = '&';
+               else if (n == 5 && !memcmp(s, "&quot", 5))
+                  *d++ = '"';
+               else if (n == 5 && !memcmp(s, "&apos", 5))
+                  *d++ = '\'';
+               else if (n > 2 && s[1] == '#' && n < 12)
+                  {
+                     c = s[2] == 'x' ? strtoul(s + 3, &q, 16)
+                                     : strtoul(s + 2, &q, 10);
+                     if (q != semi || !IS(s[2] == 'x' ? s[3] : s[2], NAME_CHAR)
+                         || !(c == 0x9 || c == 0xA || c == 0xD
+                              || (c >= 0x20 && c <= 0xD7FF)
+                              || (c >= 0xE000 && c <= 0xFFFD)
+                              || (c >= 0x10000 && c <= 0x10FFFF)))
+                        return NULL;
+                     /* A character reference is no longer than what it
+                      * stands for in UTF-8. */
+                     d = utf8_put(d, c);
+                  }
+               else
+                  return NULL;
+               s = semi + 1;
+            }
+         else if (c == '\r')
+            {
+               *d++ = ' ';
+               s++;
+               if (s < e && *s == '\n')
+                  s++;
+            }
+         else if (c == '\t' || c == '\n')
+            {
+               *d++ = ' ';
+               s++;
+            }
+         else if (c < 0x20)
+            return NULL;
+         else if (c < 0x80)
+            *d++ = *s++;
+         else if (scan->encoding == ENC_LATIN1)
+            {
+               d = utf8_put(d, c);
+               s++;
+            }
+         else if (scan->encoding == ENC_UTF8
+                  && (n = utf8_char((const unsigned char *) s,
+                                    (const unsigned char *) e)))
+            {
+               memcpy(d, s, n);
+               d += n;
+               s += n;
+            }
+         else
+            return NULL;
+      }
+   return d;
+}
+
+/* Whether the value of a tokenized attribute is the same once Expat has
+ * trimmed and collapsed its spaces, which is all we check for. */
+static int
+tokens_normal(const char *v)
+{
+   size_t n = strlen(v);
+
+   return !n || (v[0] != ' ' && v[n - 1] != ' ' && !strstr(v, "  "));
+}
+
+/* A plain decimal of up to nine digits, as the handlers would read it
+ * with atoi() or strtoul(), or -1. */
+static long
+plain_number(const char *v, size_t n)
+{
+   long x = 0;
+   size_t i;
+
+   if (n < 1 || n > 9)
+      return -1;
+   for (i = 0; i < n; i++)
+      {
+         if (v[i] < '0' || v[i] > '9')
+            return -1;
+         x = x * 10 + (v[i] - '0');
+      }
+   return x;
+}
+
+static int
+skip_comment(const char **pp, const char *end)
+{
+   const char *p = xml_scan_find(*pp + 4, end, "--");
+
+   if (!p || p + 2 >= end || p[2] != '>')
+      return -1;
+   *pp = p + 3;
+   return 0;
+}
+
+/* A processing instruction other than an XML declaration. */
+static int
+skip_pi(const char **pp, const char *end)
+{
+   const char *p = *pp + 2, *name = p;
+
+   p = skip_name(p, end);
+   if (!p || (p - name == 3 && !strncasecmp(name, "xml", 3)))
+      return -1;
+   p = xml_scan_find(p, end, "?>");
+   if (!p)
+      return -1;
+   *pp = p + 2;
+   return 0;
+}
+
+const char *
+xml_scan_skip_markup(const char *p, const char *end, int *kind)
+{
+   char quote = 0;
+   int brackets = 0;
+
+   *kind = XML_SCAN_OTHER;
+   if (end - p < 2)
+      return NULL;
+
+   if (p[1] == '?')
+      {
+         /* Unlike skip_pi(), the XML declaration too. */
+         p = xml_scan_find(p + 2, end, "?>");
+         return p ? p + 2 : NULL;
+      }
+   if (p[1] == '!')
+      {
+         if (starts(p, end, "<!--"))
+            return skip_comment(&p, end) ? NULL : p;
+         if (starts(p, end, "<![CDATA["))
+            {
+               p = xml_scan_find(p + 9, end, "]]>");
+               return p ? p + 3 : NULL;
+            }
+         /* A declaration such as DOCTYPE, which may have an internal
+          * subset of declarations and comments in brackets. */
+         for (p += 2; p < end; p++)
+            {
+               if (quote)
+                  {
+                     if (*p == quote)
+                        quote = 0;
+                  }
+               else if (*p == '"' || *p == '\'')
+                  quote = *p;
+               else if (*p == '[')
+                  brackets++;
+               else if (*p == ']')
+                  brackets--;
+               else if (starts(p, end, "<!--"))
+                  {
+                     if (skip_comment(&p, end))
+                        return NULL;
+                     p--;
+                  }
+               else if (*p == '>' && brackets <= 0)
+                  return p + 1;
+            }
+         return NULL;
+      }
+   if (p[1] == '/')
+      {
+         *kind = XML_SCAN_END;
+         p = memchr(p + 2, '>', end - p - 2);
+         return p ? p + 1 : NULL;
+      }
+
+   /* A start tag: attribute values may hold a '>', but never a '<'. */
+   for (p++; p < end; p++)
+      {
+         if (quote)
+            {
+               if (*p == quote)
+                  quote = 0;
+            }
+         else if (*p == '"' || *p == '\'')
+            quote = *p;
+         else if (*p == '>')
+            {
+               *kind = p[-1] == '/' ? XML_SCAN_EMPTY : XML_SCAN_START;
+               return p + 1;
+            }
+      }
+   return NULL;
+}
+
+/* Reads a quoted value at *pp into a new string, normalized as an
+ * attribute default.  Only plain values are handled. */
+static char *
+read_default(xml_scan_t *scan, const char **pp, const char *end,
+             int tokenized)
+{
+   const char *p = *pp, *e;
+   char *v, *d, *s;
+
+   if (p >= end || (*p != '"' && *p != '\''))
+      return NULL;
+   e = memchr(p + 1, *p, end - p - 1);
+   if (!e)
+      return NULL;
+   v = scan->mem.malloc_fcn(e - p);
+   if (!v)
+      return NULL;
+   for (s = (char *) p + 1, d = v; s < e; s++)
+      {
+         if (IS(*s, SPACE))
+            *d++ = ' ';
+         else if (IS(*s, SPECIAL))
+            {
+               scan->mem.free_fcn(v);
+               return NULL;
+            }
+         else
+            *d++ = *s;
+      }
+   *d = '\0';
+   if (tokenized && !tokens_normal(v))
+      {
+         scan->mem.free_fcn(v);
+         return NULL;
+      }
+   *pp = e + 1;
+   return v;
+}
+
+static int
+parse_attlist(xml_scan_t *scan, const char **pp, const char *end)
+{
+   static const char *tokenized_types[] =
+      { "ID", "IDREF", "IDREFS", "ENTITY", "ENTITIES", "NMTOKEN",
+        "NMTOKENS", NULL };
+   const char *p = *pp + 9, *el, *name, *q;
+   size_t el_len, name_len;
+   scan_attdef_t *a;
+   char *value;
+   int tokenized, i;
+
+   q = skip_space(p, end);
+   if (q == p)
+      return -1;
+   el = q;
+   p = skip_name(q, end);
+   if (!p || (el_len = p - el) >= SCAN_MAX_NAME)
+      return -1;
+
+   for (;;)
+      {
+         q = skip_space(p, end);
+         if (q < end && *q == '>')
+            {
+               *pp = q + 1;
+               return 0;
+            }
+         if (q == p)
+            return -1;
+         name = q;
+         p = skip_name(q, end);
+         if (!p || (name_len = p - name) >= SCAN_MAX_NAME)
+            return -1;
+
+         q = skip_space(p, end);
+         if (q == p || q >= end)
+            return -1;
+         p = q;
+         if (*p == '(' || starts(p, end, "NOTATION"))
+            {
+               p = memchr(p, ')', end - p);
+               if (!p)
+                  return -1;
+               p++;
+               tokenized = 1;
+            }
+         else if (starts(p, end, "CDATA"))
+            {
+               p += 5;
+               tokenized = 0;
+            }
+         else
+            {
+               q = skip_name(p, end);
+               if (!q)
+                  return -1;
+               for (i = 0; tokenized_types[i]; i++)
+                  if ((size_t) (q - p) == strlen(tokenized_types[i])
+                      && !memcmp(p, tokenized_types[i], q - p))
+                     break;
+               if (!tokenized_types[i])
+                  return -1;
+               p = q;
+               tokenized = 1;
+            }
+
+         q = skip_space(p, end);
+         if (q == p)
+            return -1;
+         p = q;
+         value = NULL;
+         if (starts(p, end, "#REQUIRED"))
+            p += 9;
+         else if (starts(p, end, "#IMPLIED"))
+            p += 8;
+         else
+            {
+               if (starts(p, end, "#FIXED"))
+                  {
+                     q = skip_space(p + 6, end);
+                     if (q == p + 6)
+                        return -1;
+                     p = q;
+                  }
+               value = read_default(scan, &p, end, tokenized);
+               if (!value)
+                  return -1;
+            }
+
+         /* The first declaration of an attribute is the one that holds. */
+         for (i = 0; i < scan->nattdefs; i++)
+            {
+               a = &scan->attdefs[i];
+               if (strlen(a->el) == el_len && !memcmp(a->el, el, el_len)
+                   && strlen(a->name) == name_len
+                   && !memcmp(a->name, name, name_len))
+                  break;
+            }
+         if (i < scan->nattdefs)
+            {
+               scan->mem.free_fcn(value);
+               continue;
+            }
+         if (scan->nattdefs == SCAN_MAX_ATTDEFS)
+            {
+               scan->mem.free_fcn(value);
+               return -1;
+            }
+         a = &scan->attdefs[scan->nattdefs++];
+         memcpy(a->el, el, el_len);
+         a->el[el_len] = '\0';
+         memcpy(a->name, name, name_len);
+         a->name[name_len] = '\0';
+         a->value = value;
+         a->tokenized = tokenized;
+      }
+}
+
+/* A DOCTYPE without an external subset. */
+static int
+parse_doctype(xml_scan_t *scan, const char **pp, const char *end)
+{
+   const char *p = *pp + 9, *q;
+
+   q = skip_space(p, end);
+   if (q == p)
+      return -1;
+   p = skip_name(q, end);
+   if (!p)
+      return -1;
+   p = skip_space(p, end);
+   if (p < end && *p == '[')
+      {
+         p++;
+         for (;;)
+            {
+               p = skip_space(p, end);
+               if (p >= end)
+                  return -1;
+               if (*p == ']')
+                  {
+                     p = skip_space(p + 1, end);
+                     break;
+                  }
+               if (starts(p, end, "<!--"))
+                  {
+                     if (skip_comment(&p, end))
+                        return -1;
+                  }
+               else if (starts(p, end, "<?"))
+                  {
+                     if (skip_pi(&p, end))
+                        return -1;
+                  }
+               else if (starts(p, end, "<!ELEMENT"))
+                  {
+                     p = memchr(p, '>', end - p);
+                     if (!p)
+                        return -1;
+                     p++;
+                  }
+               else if (starts(p, end, "<!ATTLIST"))
+                  {
+                     if (parse_attlist(scan, &p, end))
+                        return -1;
+                  }
+               else
+                  return -1;
+            }
+      }
+   if (p >= end || *p != '>')
+      return -1;
+   scan->doctype = 1;
+   *pp = p + 1;
+   return 0;
+}
+
+static int
+parse_xmldecl(xml_scan_t *scan, const char **pp, const char *end)
+{
+   const char *p = *pp, *e, *enc, *q;
+   size_t n;
+
+   e = xml_scan_find(p, end, "?>");
+   if (!e)
+      return -1;
+   scan->encoding = ENC_UTF8;
+   enc = xml_scan_find(p, e, "encoding");
+   if (enc)
+      {
+         p = skip_space(enc + 8, e);
+         if (p >= e || *p != '=')
+            return -1;
+         p = skip_space(p + 1, e);
+         if (p >= e || (*p != '"' && *p != '\''))
+            return -1;
+         q = memchr(p + 1, *p, e - p - 1);
+         if (!q)
+            return -1;
+         p++;
+         n = q - p;
+         if (n == 5 && !strncasecmp(p, "UTF-8", 5))
+            scan->encoding = ENC_UTF8;
+         else if (n == 10 && !strncasecmp(p, "ISO-8859-1", 10))
+            scan->encoding = ENC_LATIN1;
+         else if (n == 8 && !strncasecmp(p, "US-ASCII", 8))
+            scan->encoding = ENC_ASCII;
+         else
+            return -1;
+      }
+   *pp = e + 2;
+   return 0;
+}
+
+/* Reads the prolog from *pp.  Returns 1 with *pp at the root element,
+ * 0 if the prolog runs on past end, or -1 to hand over. */
+static int
+scan_prolog(xml_scan_t *scan, const char **pp, const char *end)
+{
+   const char *p = *pp;
+
+   for (;;)
+      {
+         p = skip_space(p, end);
+         *pp = p;
+         if (p >= end)
+            return 0;
+         if (*p != '<' || end - p < 2)
+            return -1;
+         if (p[1] == '?')
+            {
+               if (skip_pi(&p, end))
+                  return -1;
+            }
+         else if (starts(p, end, "<!--"))
+            {
+               if (skip_comment(&p, end))
+                  return -1;
+            }
+         else if (starts(p, end, "<!DOCTYPE") && !scan->doctype)
+            {
+               if (parse_doctype(scan, &p, end))
+                  return -1;
+            }
+         else if (IS(p[1], NAME_START))
+            return 1;
+         else
+            return -1;
+      }
+}
+
+/* Makes shape fit the element el with the n attribute names in an[]. */
+static int
+build_shape(xml_scan_t *scan, scan_shape_t *shape, const char *el,
+            size_t el_len, const char **an, const size_t *anl, int n)
+{
+   scan_attdef_t *a;
+   int i, j, k;
+
+   memcpy(shape->el, el, el_len);
+   shape->el[el_len] = '\0';
+   shape->el_len = el_len;
+   shape->xt = in_xml_list(shape->el, el_len);
+   shape->nattrs = n;
+   shape->ndefaults = 0;
+
+   for (i = 0; i < n; i++)
+      {
+         memcpy(shape->names[i], an[i], anl[i]);
+         shape->names[i][anl[i]] = '\0';
+         shape->lens[i] = anl[i];
+         for (j = 0; j < i; j++)
+            if (anl[j] == anl[i] && !memcmp(an[j], an[i], anl[i]))
+               goto fail;
+         shape->attr[2 * i] = shape->names[i];
+         shape->tags[i] = in_xml_list(shape->names[i], anl[i]);
+         shape->tokenized[i] = 0;
+      }
+
+   for (k = 0; k < scan->nattdefs; k++)
+      {
+         a = &scan->attdefs[k];
+         if (strcmp(a->el, shape->el))
+            continue;
+         for (i = 0; i < n; i++)
+            if (!strcmp(a->name, shape->names[i]))
+               break;
+         if (i < n)
+            {
+               shape->tokenized[i] = a->tokenized;
+               continue;
+            }
+         if (!a->value)
+            continue;
+         if (shape->ndefaults == SCAN_MAX_DEFAULTS)
+            goto fail;
+         i = n + shape->ndefaults++;
+         shape->attr[2 * i] = a->name;
+         shape->attr[2 * i + 1] = a->value;
+         shape->tags[i] = in_xml_list(a->name, strlen(a->name));
+         shape->nums[i] = plain_number(a->value, strlen(a->value));
+      }
+   shape->attr[2 * (n + shape->ndefaults)] = NULL;
+   return 0;
+
+ fail:
+   shape->el_len = 0;
+   return -1;
+}
+
+static int
+scan_start_tag(xml_scan_t *scan, const char **pp, const char *end)
+{
+   const char *p = *pp + 1, *q, *el;
+   const char *an[SCAN_MAX_ATTRS], *vs[SCAN_MAX_ATTRS], *ve[SCAN_MAX_ATTRS];
+   size_t anl[SCAN_MAX_ATTRS], el_len, need;
+   int special[SCAN_MAX_ATTRS];
+   scan_shape_t *shape;
+   scan_open_t *o;
+   char quote, *d;
+   int n = 0, empty, i;
+
+   if (scan->depth == SCAN_MAX_DEPTH || scan->state == SCAN_EPILOG)
+      return -1;
+   el = p;
+   p = skip_name(p, end);
+   if (!p || (el_len = p - el) >= SCAN_MAX_NAME)
+      return -1;
+
+   for (;;)
+      {
+         q = skip_space(p, end);
+         if (q >= end)
+            return -1;
+         if (*q == '>')
+            {
+               empty = 0;
+               p = q + 1;
+               break;
+            }
+         if (*q == '/')
+            {
+               if (q + 1 >= end || q[1] != '>')
+                  return -1;
+               empty = 1;
+               p = q + 2;
+               break;
+            }
+         /* Attributes are set apart by whitespace. */
+         if (q == p || n == SCAN_MAX_ATTRS)
+            return -1;
+         an[n] = q;
+         p = skip_name(q, end);
+         if (!p || (anl[n] = p - q) >= SCAN_MAX_NAME)
+            return -1;
+         p = skip_space(p, end);
+         if (p >= end || *p != '=')
+            return -1;
+         p = skip_space(p + 1, end);
+         if (p >= end || (*p != '"' && *p != '\''))
+            return -1;
+         quote = *p++;
+         vs[n] = p;
+         special[n] = 0;
+         for (;;)
+            {
+               p = value_scan(p, end, quote);
+               if (p >= end || *p == '<')
+                  return -1;
+               if (*p == quote)
+                  break;
+               special[n] = 1;
+               p++;
+            }
+         ve[n++] = p++;
+      }
+
+   /* The shape of the last element of this name, if it still fits. */
+   shape = NULL;
+   for (i = 0; i < SCAN_SHAPES; i++)
+      if (scan->shapes[i].el_len == el_len
+          && !memcmp(scan->shapes[i].el, el, el_len))
+         {
+            shape = &scan->shapes[i];
+            break;
+         }
+   if (shape && shape->nattrs == n)
+      {
+         for (i = 0; i < n; i++)
+            if (shape->lens[i] != anl[i]
+                || memcmp(shape->names[i], an[i], anl[i]))
+               break;
+      }
+   if (!shape || shape->nattrs != n || i < n)
+      {
+         if (!shape)
+            {
+               shape = &scan->shapes[scan->next_shape];
+               scan->next_shape = (scan->next_shape + 1) % SCAN_SHAPES;
+            }
+         if (build_shape(scan, shape, el, el_len, an, anl, n))
+            return -1;
+      }
+
+   need = 0;
+   for (i = 0; i < n; i++)
+      need += (special[i] ? 2 : 1) * (ve[i] - vs[i]) + 1;
+   if (need > scan->scratch_size)
+      {
+         d = scan->mem.realloc_fcn(scan->scratch, need);
+         if (!d)
+            return -1;
+         scan->scratch = d;
+         scan->scratch_size = need;
+      }
+
+   d = scan->scratch;
+   for (i = 0; i < n; i++)
+      {
+         shape->attr[2 * i + 1] = d;
+         if (special[i])
+            {
+               q = d;
+               d = decode(scan, d, vs[i], ve[i]);
+               if (!d)
+                  return -1;
+               *d++ = '\0';
+               shape->nums[i] = -1;
+               if (shape->tokenized[i] && !tokens_normal(q))
+                  return -1;
+            }
+         else
+            {
+               memcpy(d, vs[i], ve[i] - vs[i]);
+               d[ve[i] - vs[i]] = '\0';
+               shape->nums[i] = plain_number(d, ve[i] - vs[i]);
+               if (shape->tokenized[i] && !tokens_normal(d))
+                  return -1;
+               d += ve[i] - vs[i] + 1;
+            }
+      }
+
+   if (!scan->depth)
+      {
+         memcpy(scan->root, shape->el, el_len + 1);
+         scan->state = SCAN_CONTENT;
+      }
+   *pp = p;
+
+   if (shape->xt)
+      scan->fast_start(scan->data, shape->xt, shape->el, shape->attr,
+                       shape->tags, shape->nums);
+   if (empty)
+      {
+         if (shape->xt)
+            scan->fast_end(scan->data, shape->xt, shape->el);
+         if (!scan->depth)
+            scan->state = SCAN_EPILOG;
+         return 0;
+      }
+
+   o = &scan->open[scan->depth++];
+   memcpy(o->name, shape->el, el_len + 1);
+   o->len = el_len;
+   o->xt = shape->xt;
+   return 0;
+}
+
+static int
+scan_end_tag(xml_scan_t *scan, const char **pp, const char *end)
+{
+   const char *p = *pp + 2, *el = p;
+   scan_open_t *o;
+
+   p = skip_name(p, end);
+   if (!p || !scan->depth)
+      return -1;
+   o = &scan->open[scan->depth - 1];
+   if ((size_t) (p - el) != o->len || memcmp(o->name, el, o->len))
+      return -1;
+   p = skip_space(p, end);
+   if (p >= end || *p != '>')
+      return -1;
+   *pp = p + 1;
+
+   scan->depth--;
+   if (o->xt)
+      scan->fast_end(scan->data, o->xt, o->name);
+   if (!scan->depth)
+      scan->state = SCAN_EPILOG;
+   return 0;
+}
+
+/* Reads elements from *pp on.  Returns 0 at end, or -1 to hand over at
+ * *pp. */
+static int
+scan_content(xml_scan_t *scan, const char **pp, const char *end)
+{
+   const char *p = *pp;
+   int rc;
+
+   while (p < end)
+      {
+         if (*p != '<')
+            {
+               /* Whitespace is the only character data we expect. */
+               if (!IS(*p, SPACE))
+                  break;
+               p++;
+               continue;
+            }
+         if (end - p < 2)
+            break;
+         if (p[1] == '/')
+            rc = scan_end_tag(scan, &p, end);
+         else if (p[1] == '?')
+            rc = skip_pi(&p, end);
+         else if (p[1] == '!')
+            rc = starts(p, end, "<!--") ? skip_comment(&p, end) : -1;
+         else
+            rc = scan_start_tag(scan, &p, end);
+         if (rc)
+            break;
+      }
+   *pp = p;
+   return p < end ? -1 : 0;
+}
+
+static int
+count_lines(const char *p, const char *end)
+{
+   int n = 0;
+
+   while ((p = memchr(p, '\n', end - p)))
+      {
+         n++;
+         p++;
+      }
+   return n;
+}
+
+/* Hands the document over to Expat at p, in the call that got s. */
+static int
+hand_over(xml_scan_t *scan, const char *s, const char *p, const char *end,
+          int final)
+{
+   char synth[SCAN_MAX_DEPTH * (SCAN_MAX_NAME + 2) + 4], *d = synth;
+   int i;
+
+   if (!scan->expat)
+      scan->expat = XML_ParserCreate_MM(NULL, &scan->mem, NULL);
+   if (!scan->expat)
+      return 0;
+   scan->handed = 1;
+   XML_SetUserData(scan->expat, scan->data);
+
+   if (scan->state == SCAN_START || scan->state == SCAN_PROLOG)
+      {
+         /* Nothing has been handled: Expat reads it all, with the prolog
+          * first if an earlier call gave it to us. */
+         XML_SetElementHandler(scan->expat, scan->start, scan->end);
+         scan->byte_adjust = scan->fed;
+         if (s != scan->prolog && scan->prolog_len)
+            {
+               if (!XML_Parse(scan->expat, scan->prolog, scan->prolog_len, 0))
+                  return 0;
+               scan->byte_adjust -= scan->prolog_len;
+            }
+         return XML_Parse(scan->expat, s, end - s, final);
+      }
+
+   /* Bring Expat to where we are without calling the handlers. */
+   if (scan->state == SCAN_EPILOG)
+      d += sprintf(d, "<%s/>", scan->root);
+   for (i = 0; i < scan->depth; i++)
+      d += sprintf(d, "<%s>", scan->open[i].name);
+   if (!XML_Parse(scan->expat, scan->prolog, scan->prolog_len, 0)
+       || !XML_Parse(scan->expat, synth, d - synth, 0))
+      return 0;
+
+   scan->byte_adjust = scan->fed + (p - s) - scan->prolog_len - (d - synth);
+   scan->line_adjust = count_lines(s, p);
+   if (s <= scan->prolog && scan->prolog < p)
+      scan->line_adjust -= count_lines(scan->prolog,
+                                       scan->prolog + scan->prolog_len);
+
+   XML_SetElementHandler(scan->expat, scan->start, scan->end);
+   return XML_Parse(scan->expat, p, end - p, final);
+}
+
+xml_scan_t *
+xml_scan_create(XML_StartElementHandler start, XML_EndElementHandler end,
+                xml_scan_start_t fast_start, xml_scan_end_t fast_end,
+                const XML_Memory_Handling_Suite *mem)
+{
+   xml_scan_t *scan;
+
+   scan = mem ? mem->malloc_fcn(sizeof(*scan)) : malloc(sizeof(*scan));
+   if (!scan)
+      return NULL;
+   memset(scan, 0, sizeof(*scan));
+   if (mem)
+      scan->mem = *mem;
+   else
+      {
+         scan->mem.malloc_fcn = malloc;
+         scan->mem.realloc_fcn = realloc;
+         scan->mem.free_fcn = free;
+      }
+   scan->start = start;
+   scan->end = end;
+   scan->fast_start = fast_start;
+   scan->fast_end = fast_end;
+
+   pthread_once(&cclass_once, cclass_init);
+   return scan;
+}
+
+int
+xml_scan_reset(xml_scan_t *scan, int fast, void *data)
+{
+   int i;
+
+   /* The shapes may hold defaults from the old DOCTYPE. */
+   for (i = 0; i < scan->nattdefs; i++)
+      scan->mem.free_fcn(scan->attdefs[i].value);
+   scan->nattdefs = 0;
+   for (i = 0; i < SCAN_SHAPES; i++)
+      scan->shapes[i].el_len = 0;
+   scan->next_shape = 0;
+
+   scan->state = SCAN_START;
+   scan->doctype = 0;
+   scan->prolog = NULL;
+   scan->prolog_len = 0;
+   scan->root[0] = '\0';
+   scan->fed = 0;
+   scan->byte_adjust = 0;
+   scan->line_adjust = 0;
+   scan->depth = 0;
+   scan->data = data;
+   scan->handed = 0;
+
+   if (scan->expat && !XML_ParserReset(scan->expat, NULL))
+      {
+         XML_ParserFree(scan->expat);
+         scan->expat = NULL;
+      }
+   if (fast)
+      return 1;
+
+   if (!scan->expat)
+      scan->expat = XML_ParserCreate_MM(NULL, &scan->mem, NULL);
+   if (!scan->expat)
+      return 0;
+   XML_SetElementHandler(scan->expat, scan->start, scan->end);
+   XML_SetUserData(scan->expat, data);
+   scan->handed = 1;
+   return 1;
+}
+
+int
+xml_scan_parse(xml_scan_t *scan, const char *s, size_t len, int final)
+{
+   const char *p = s, *end = s + len;
+   int rval, rc;
+
+   if (scan->handed)
+      return XML_Parse(scan->expat, s, len, final);
+
+   if (scan->state == SCAN_START)
+      {
+         scan->state = SCAN_PROLOG;
+         scan->encoding = ENC_UTF8;
+         scan->prolog = s;
+         if (starts(p, end, "<?xml") && end - p > 5 && IS(p[5], SPACE)
+             && parse_xmldecl(scan, &p, end))
+            goto hand_over;
+      }
+
+   if (scan->state == SCAN_PROLOG)
+      {
+         if (s != scan->prolog + scan->prolog_len)
+            {
+               /* This does not follow on from the prolog, as with the
+                * wrapper the parse threads put around a chunk: it had
+                * better start the root element. */
+               p = skip_space(p, end);
+               if (end - p < 2 || *p != '<' || !IS(p[1], NAME_START))
+                  {
+                     p = s;
+                     goto hand_over;
+                  }
+            }
+         else
+            {
+               rc = scan_prolog(scan, &p, end);
+               if (rc < 0)
+                  goto hand_over;
+               scan->prolog_len = p - scan->prolog;
+               if (!rc)
+                  {
+                     if (final)
+                        goto hand_over;
+                     scan->fed += len;
+                     return 1;
+                  }
+            }
+      }
+
+   if (scan_content(scan, &p, end))
+      goto hand_over;
+   if (final && scan->state != SCAN_EPILOG)
+      goto hand_over;
+   scan->fed += len;
+   return 1;
+
+ hand_over:
+   rval = hand_over(scan, s, p, end, final);
+   scan->fed += len;
+   return rval;
+}
+
+int
+xml_scan_line(xml_scan_t *scan)
+{
+   if (!scan->handed)
+      return 0;
+   return XML_GetCurrentLineNumber(scan->expat) + scan->line_adjust;
+}
+
+long
+xml_scan_byte_index(xml_scan_t *scan)
+{
+   if (!scan->handed)
+      return scan->fed;
+   return XML_GetCurrentByteIndex(scan->expat) + scan->byte_adjust;
+}
+
+const char *
+xml_scan_error(xml_scan_t *scan)
+{
+   if (!scan->handed)
+      return "out of memory";
+   return XML_ErrorString(XML_GetErrorCode(scan->expat));
+}
+
+void
+xml_scan_free(xml_scan_t *scan)
+{
+   int i;
+
+   if (scan->expat)
+      XML_ParserFree(scan->expat);
+   for (i = 0; i < scan->nattdefs; i++)
+      scan->mem.free_fcn(scan->attdefs[i].value);
+   scan->mem.free_fcn(scan->scratch);
+   scan->mem.free_fcn(scan);
+}
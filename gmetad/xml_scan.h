@@ -0,0 +1,68 @@
+#ifndef XML_SCAN_H
+#define XML_SCAN_H 1
+
+#include <stddef.h>
+#include <expat.h>
+#include "gmetad.h"
+
+/* A parser for the XML gmond and gmetad send, which is a small fixed
+ * dialect: elements with attributes and no character data.  It reads
+ * the documents it can faster than Expat and hands the rest of a
+ * document over to Expat as soon as it meets anything else (character
+ * data, CDATA, entities of its own, an encoding it does not know, or an
+ * error), so the handlers see the same calls either way.  See
+ * xml_scan.c. */
+typedef struct xml_scan xml_scan_t;
+
+/* Called for the start tags of elements in xml_hash, with the same el
+ * and attr as an Expat handler, the xml_tag of each attribute attr[i]
+ * at tags[i / 2] (NULL if it is not in xml_hash), and its value at
+ * nums[i / 2] if it is a plain decimal of up to nine digits, -1
+ * otherwise. */
+typedef void (*xml_scan_start_t)(void *data, struct xml_tag *xt,
+                                 const char *el, const char **attr,
+                                 struct xml_tag **tags, long *nums);
+typedef void (*xml_scan_end_t)(void *data, struct xml_tag *xt,
+                               const char *el);
+
+/* The scanner and its Expat parser take their memory from mem, or from
+ * malloc() if it is NULL. */
+xml_scan_t *xml_scan_create(XML_StartElementHandler start,
+                            XML_EndElementHandler end,
+                            xml_scan_start_t fast_start,
+                            xml_scan_end_t fast_end,
+                            const XML_Memory_Handling_Suite *mem);
+
+/* Readies the scanner for a document, with data for the handlers; a
+ * scanner is reset before each document and keeps its memory and its
+ * Expat parser from one to the next.  Without fast the scanner only
+ * passes the document on to Expat.  Returns 0 if out of memory. */
+int xml_scan_reset(xml_scan_t *scan, int fast, void *data);
+
+/* As XML_Parse(): parses the next len bytes of the document.  Each call
+ * should end between tokens, or the rest goes to Expat, and the prolog
+ * (the bytes before the root element) must stay where it is until the
+ * scanner is reset or freed. */
+int xml_scan_parse(xml_scan_t *scan, const char *s, size_t len, int final);
+
+/* Where the document went wrong after xml_scan_parse() returned 0, and
+ * why. */
+int xml_scan_line(xml_scan_t *scan);
+long xml_scan_byte_index(xml_scan_t *scan);
+const char *xml_scan_error(xml_scan_t *scan);
+
+void xml_scan_free(xml_scan_t *scan);
+
+/* Returns the first s in [p, end), or NULL. */
+const char *xml_scan_find(const char *p, const char *end, const char *s);
+
+enum { XML_SCAN_OTHER, XML_SCAN_START, XML_SCAN_EMPTY, XML_SCAN_END };
+
+/* Steps over the markup at p, which points at a '<': a tag, comment,
+ * CDATA section, processing instruction or declaration (with its
+ * internal subset), and sets kind to what it was.  Returns a pointer
+ * just past it, or NULL if it is cut short or a malformed comment.  For
+ * looking through a document without parsing it. */
+const char *xml_scan_skip_markup(const char *p, const char *end, int *kind);
+
+#endif
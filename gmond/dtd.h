@@ -55,4 +55,130 @@
       <!ATTLIST METRICS SOURCE (gmond) 'gmond'>\n\
 ]>\n"
 
+/* The compact dialect declares each distinct set of metric metadata once
+ * per CLUSTER in a METRIC_DEF element, numbered from zero in document order.
+ * A METRIC element then carries only DEF, VAL and TN; the name, type, units,
+ * limits, slope, source and extra data come from the referenced METRIC_DEF.
+ * METRIC elements without a DEF attribute keep their full form. */
+#define DTD_COMPACT "\
+<?xml version=\"1.0\" encoding=\"ISO-8859-1\" standalone=\"yes\"?>\n\
+<!DOCTYPE GANGLIA_XML [\n\
+   <!ELEMENT GANGLIA_XML (GRID|CLUSTER|METRIC_DEF|HOST)*>\n\
+      <!ATTLIST GANGLIA_XML VERSION CDATA #REQUIRED>\n\
+      <!ATTLIST GANGLIA_XML SOURCE CDATA #REQUIRED>\n\
+   <!ELEMENT GRID (CLUSTER | GRID | HOSTS | METRICS)*>\n\
+      <!ATTLIST GRID NAME CDATA #REQUIRED>\n\
+      <!ATTLIST GRID AUTHORITY CDATA #REQUIRED>\n\
+      <!ATTLIST GRID LOCALTIME CDATA #IMPLIED>\n\
+   <!ELEMENT CLUSTER (METRIC_DEF | HOST | HOSTS | METRICS)*>\n\
+      <!ATTLIST CLUSTER NAME CDATA #REQUIRED>\n\
+      <!ATTLIST CLUSTER OWNER CDATA #IMPLIED>\n\
+      <!ATTLIST CLUSTER LATLONG CDATA #IMPLIED>\n\
+      <!ATTLIST CLUSTER URL CDATA #IMPLIED>\n\
+      <!ATTLIST CLUSTER LOCALTIME CDATA #REQUIRED>\n\
+   <!ELEMENT HOST (METRIC)*>\n\
+      <!ATTLIST HOST NAME CDATA #REQUIRED>\n\
+      <!ATTLIST HOST IP CDATA #REQUIRED>\n\
+      <!ATTLIST HOST LOCATION CDATA #IMPLIED>\n\
+      <!ATTLIST HOST TAGS CDATA #IMPLIED>\n\
+      <!ATTLIST HOST REPORTED CDATA #REQUIRED>\n\
+      <!ATTLIST HOST TN CDATA #IMPLIED>\n\
+      <!ATTLIST HOST TMAX CDATA #IMPLIED>\n\
+      <!ATTLIST HOST DMAX CDATA #IMPLIED>\n\
+      <!ATTLIST HOST GMOND_STARTED CDATA #IMPLIED>\n\
+   <!ELEMENT METRIC (EXTRA_DATA*)>\n\
+      <!ATTLIST METRIC NAME CDATA #IMPLIED>\n\
+      <!ATTLIST METRIC VAL CDATA #REQUIRED>\n\
+      <!ATTLIST METRIC TYPE (string | int8 | uint8 | int16 | uint16 | int32 | uint32 | float | double | timestamp) #IMPLIED>\n\
+      <!ATTLIST METRIC UNITS CDATA #IMPLIED>\n\
+      <!ATTLIST METRIC TN CDATA #IMPLIED>\n\
+      <!ATTLIST METRIC TMAX CDATA #IMPLIED>\n\
+      <!ATTLIST METRIC DMAX CDATA #IMPLIED>\n\
+      <!ATTLIST METRIC SLOPE (zero | positive | negative | both | unspecified) #IMPLIED>\n\
+      <!ATTLIST METRIC SOURCE (gmond) 'gmond'>\n\
+      <!ATTLIST METRIC DEF CDATA #IMPLIED>\n\
+   <!ELEMENT METRIC_DEF (EXTRA_DATA*)>\n\
+      <!ATTLIST METRIC_DEF ID CDATA #REQUIRED>\n\
+      <!ATTLIST METRIC_DEF NAME CDATA #REQUIRED>\n\
+      <!ATTLIST METRIC_DEF TYPE (string | int8 | uint8 | int16 | uint16 | int32 | uint32 | float | double | timestamp) #REQUIRED>\n\
+      <!ATTLIST METRIC_DEF UNITS CDATA #IMPLIED>\n\
+      <!ATTLIST METRIC_DEF TMAX CDATA #IMPLIED>\n\
+      <!ATTLIST METRIC_DEF DMAX CDATA #IMPLIED>\n\
+      <!ATTLIST METRIC_DEF SLOPE (zero | positive | negative | both | unspecified) #IMPLIED>\n\
+      <!ATTLIST METRIC_DEF SOURCE (gmond) 'gmond'>\n\
+   <!ELEMENT EXTRA_DATA (EXTRA_ELEMENT*)>\n\
+   <!ELEMENT EXTRA_ELEMENT EMPTY>\n\
+      <!ATTLIST EXTRA_ELEMENT NAME CDATA #REQUIRED>\n\
+      <!ATTLIST EXTRA_ELEMENT VAL CDATA #REQUIRED>\n\
+   <!ELEMENT HOSTS EMPTY>\n\
+      <!ATTLIST HOSTS UP CDATA #REQUIRED>\n\
+      <!ATTLIST HOSTS DOWN CDATA #REQUIRED>\n\
+      <!ATTLIST HOSTS SOURCE (gmond | gmetad) #REQUIRED>\n\
+   <!ELEMENT METRICS (EXTRA_DATA*)>\n\
+      <!ATTLIST METRICS NAME CDATA #REQUIRED>\n\
+      <!ATTLIST METRICS SUM CDATA #REQUIRED>\n\
+      <!ATTLIST METRICS NUM CDATA #REQUIRED>\n\
+      <!ATTLIST METRICS TYPE (string | int8 | uint8 | int16 | uint16 | int32 | uint32 | float | double | timestamp) #REQUIRED>\n\
+      <!ATTLIST METRICS UNITS CDATA #IMPLIED>\n\
+      <!ATTLIST METRICS SLOPE (zero | positive | negative | both | unspecified) #IMPLIED>\n\
+      <!ATTLIST METRICS SOURCE (gmond) 'gmond'>\n\
+]>\n"
+
+/* gmetad answers index= queries on its interactive port from the metric
+ * index: one METRIC_INDEX per metric, with the latest value on each host
+ * that reports it. */
+#define DTD_INDEX "\
+<?xml version=\"1.0\" encoding=\"ISO-8859-1\" standalone=\"yes\"?>\n\
+<!DOCTYPE GANGLIA_XML [\n\
+   <!ELEMENT GANGLIA_XML (METRIC_INDEX | METRIC_HISTORY)*>\n\
+      <!ATTLIST GANGLIA_XML VERSION CDATA #REQUIRED>\n\
+      <!ATTLIST GANGLIA_XML SOURCE CDATA #REQUIRED>\n\
+   <!ELEMENT METRIC_INDEX (HOST)*>\n\
+      <!ATTLIST METRIC_INDEX NAME CDATA #REQUIRED>\n\
+      <!ATTLIST METRIC_INDEX TYPE (string | int8 | uint8 | int16 | uint16 | int32 | uint32 | float | double | timestamp) #IMPLIED>\n\
+      <!ATTLIST METRIC_INDEX UNITS CDATA #IMPLIED>\n\
+      <!ATTLIST METRIC_INDEX NUM CDATA #REQUIRED>\n\
+      <!ATTLIST METRIC_INDEX LOCALTIME CDATA #REQUIRED>\n\
+   <!ELEMENT HOST EMPTY>\n\
+      <!ATTLIST HOST NAME CDATA #REQUIRED>\n\
+      <!ATTLIST HOST CLUSTER CDATA #REQUIRED>\n\
+      <!ATTLIST HOST VAL CDATA #REQUIRED>\n\
+      <!ATTLIST HOST REPORTED CDATA #REQUIRED>\n\
+   <!ELEMENT METRIC_HISTORY (SERIES)*>\n\
+      <!ATTLIST METRIC_HISTORY NAME CDATA #REQUIRED>\n\
+      <!ATTLIST METRIC_HISTORY TYPE (string | int8 | uint8 | int16 | uint16 | int32 | uint32 | float | double | timestamp) #IMPLIED>\n\
+      <!ATTLIST METRIC_HISTORY UNITS CDATA #IMPLIED>\n\
+      <!ATTLIST METRIC_HISTORY NUM CDATA #REQUIRED>\n\
+      <!ATTLIST METRIC_HISTORY LOCALTIME CDATA #REQUIRED>\n\
+   <!ELEMENT SERIES EMPTY>\n\
+      <!ATTLIST SERIES HOST CDATA #REQUIRED>\n\
+      <!ATTLIST SERIES CLUSTER CDATA #REQUIRED>\n\
+      <!ATTLIST SERIES NUM CDATA #REQUIRED>\n\
+      <!ATTLIST SERIES TIMES CDATA #REQUIRED>\n\
+      <!ATTLIST SERIES VALUES CDATA #REQUIRED>\n\
+]>\n"
+
+#define DTD_STATS "\
+<?xml version=\"1.0\" encoding=\"ISO-8859-1\" standalone=\"yes\"?>\n\
+<!DOCTYPE GANGLIA_XML [\n\
+   <!ELEMENT GANGLIA_XML (VALUES, SINK*)>\n\
+      <!ATTLIST GANGLIA_XML VERSION CDATA #REQUIRED>\n\
+      <!ATTLIST GANGLIA_XML SOURCE CDATA #REQUIRED>\n\
+   <!ELEMENT VALUES EMPTY>\n\
+      <!ATTLIST VALUES SUBMITTED CDATA #REQUIRED>\n\
+      <!ATTLIST VALUES SKIPPED CDATA #REQUIRED>\n\
+   <!ELEMENT SINK EMPTY>\n\
+      <!ATTLIST SINK NAME CDATA #REQUIRED>\n\
+      <!ATTLIST SINK POLICY (block | drop | sample) #REQUIRED>\n\
+      <!ATTLIST SINK QUEUED CDATA #REQUIRED>\n\
+      <!ATTLIST SINK QUEUE_SIZE CDATA #REQUIRED>\n\
+      <!ATTLIST SINK SUBMITTED CDATA #REQUIRED>\n\
+      <!ATTLIST SINK WRITTEN CDATA #REQUIRED>\n\
+      <!ATTLIST SINK ERRORS CDATA #REQUIRED>\n\
+      <!ATTLIST SINK DROPPED CDATA #REQUIRED>\n\
+      <!ATTLIST SINK RATE CDATA #REQUIRED>\n\
+      <!ATTLIST SINK LAG CDATA #REQUIRED>\n\
+      <!ATTLIST SINK MAX_LAG CDATA #REQUIRED>\n\
+]>\n"
+
 #endif
@@ -22,7 +22,6 @@
 #ifdef LINUX
 #include <sys/utsname.h>
 #endif
-#include <zlib.h>
 
 #include <apr.h>
 #include <apr_strings.h>
@@ -33,6 +32,8 @@
 #include <apr_network_io.h>
 #include <apr_signal.h>       
 #include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
 #include <apr_tables.h>
 #include <apr_dso.h>
 #include <apr_version.h>
@@ -52,6 +53,9 @@
 #include "g25_config.h" /* for converting old file formats to new */
 #include "update_pidfile.h"
 #include "gm_scoreboard.h"
+#include "gm_compress.h"
+#include "gm_number.h"
+#include "gm_resolver.h"
 #include "ganglia_priv.h"
 
 /* Specifies a single value metric callback */
@@ -61,8 +65,8 @@
    before retry.  Specified in seconds */
 #define RETRY_BIND_DELAY 60
 
-/* The key in the apr_socket_t struct where our gzipped data is stored */
-#define GZIP_KEY "gzip"
+/* The key in the apr_socket_t struct where our output compressor is stored */
+#define COMPRESSOR_KEY "compressor"
 
 /* When this gmond was started */
 apr_time_t started;
@@ -86,6 +90,8 @@ int allow_extra_data;
 apr_time_t udp_last_heard;
 /* Cluster tag boolean */
 int cluster_tag = 0;
+/* Whether the cluster section has been read, since the configuration was */
+static int clusterinit = 0;
 /* This host's location */
 char *host_location = NULL;
 /* This host name, spoofed */
@@ -108,14 +114,43 @@ int host_tmax = 20;
 int cleanup_threshold = 300;
 /* Time interval before send another metadata packet */
 int send_metadata_interval = 0;
+/* The most seconds a collection group's first collection is put off, so
+ * that hosts started together do not send together */
+int collection_phase_spread = 0;
+/* Boolean. Ask for and answer with the metadata of a whole host at once */
+int metadata_bulk = 0;
+/* The most metadata requests sent a second, 0 for no limit */
+int metadata_request_rate = 0;
+/* The most gmetadata_bulk packets sent a second, 0 for no limit */
+int metadata_response_rate = 100;
+/* Seconds between forwarding the hosts table to the tcp_send_channels,
+ * 0 if this gmond is not a relay */
+int relay_interval = 0;
+/* Seconds between working out the cluster summary, 0 for none */
+int summary_interval = 0;
+/* When the main loop next relays and next summarizes, 0 if it does not */
+static apr_time_t next_relay = 0, next_summary = 0;
+/* Threads looking up the names of new hosts, 0 to look them up on the
+ * receive thread */
+int resolver_threads = 4;
+/* Seconds a host name, or a failure to find one, is remembered */
+int resolver_ttl = 3600;
+int resolver_negative_ttl = 300;
 /* The directory where DSO modules are located */
 char *module_dir = NULL;
 
-/* The array for outgoing UDP message channels */
+/* The array for outgoing UDP message channels, and its pool */
 Ganglia_udp_send_channels udp_send_channels = NULL;
+static apr_pool_t *udp_send_context = NULL;
 
-/* TODO: The array for outgoing TCP message channels (later) */
+/* The array for outgoing TCP message channels, NULL if there are none */
 apr_array_header_t *tcp_send_array = NULL;
+/* The channels a reload dropped, whose threads have yet to finish */
+static apr_array_header_t *tcp_send_stopping = NULL;
+
+/* Looks up the names of new hosts, NULL if resolver_threads is 0 */
+gm_resolver_t *resolver = NULL;
+static apr_pool_t *resolver_context = NULL;
 
 enum Ganglia_action_types {
   GANGLIA_ACCESS_DENY = 0,
@@ -139,7 +174,9 @@ typedef struct Ganglia_acl Ganglia_acl;
 /* This is the channel definitions */
 enum Ganglia_channel_types {
   TCP_ACCEPT_CHANNEL,
-  UDP_RECV_CHANNEL
+  UDP_RECV_CHANNEL,
+  TCP_RECV_CHANNEL,
+  TCP_RECV_STREAM
 };
 typedef enum Ganglia_channel_types Ganglia_channel_types;
 
@@ -147,12 +184,105 @@ struct Ganglia_channel {
   Ganglia_channel_types type;
   Ganglia_acl *acl;
   int timeout;
+  int compact_xml;
+  gm_codec_t codec;
+  int codec_level;
+  int max_connections;  /* tcp_recv_channel: most streams open at once */
+  int connections;      /* tcp_recv_channel: streams open now */
+  struct Ganglia_tcp_stream *streams; /* tcp_recv_channel: those streams */
+  struct Ganglia_tcp_stream *stream; /* the stream of a TCP_RECV_STREAM */
 };
 typedef struct Ganglia_channel Ganglia_channel;
 
+/* A listen channel as it was opened.  A reload of the configuration
+ * keeps it for as long as its section stays the same. */
+struct Ganglia_listen_channel {
+  char *key;
+  apr_pool_t *pool;
+  apr_pollfd_t pollfd;
+  /* The sort of section it was opened for and the section, to open it
+   * again if a reload that dropped it is undone */
+  const char *kind;
+  cfg_t *section;
+};
+typedef struct Ganglia_listen_channel Ganglia_listen_channel;
+
+/* The messages coming in on a connection to a tcp_recv_channel: each is
+ * framed by its length, four bytes in network order */
+struct Ganglia_tcp_stream {
+  Ganglia_channel *listener;
+  struct Ganglia_tcp_stream *prev, *next; /* in the listener's streams */
+  apr_pool_t *pool;
+  apr_pollfd_t pollfd;
+  apr_sockaddr_t *remotesa;
+  char remoteip[256];
+  char *buf;
+  apr_size_t len;
+  apr_size_t size;
+};
+typedef struct Ganglia_tcp_stream Ganglia_tcp_stream;
+
+/* The largest message a stream may frame */
+#define TCP_FRAME_MAX 65536
+/* A length with this bit set frames a compressed batch rather than a
+ * message: once uncompressed it is a run of framed messages */
+#define TCP_FRAME_COMPRESSED 0x80000000U
+/* The largest compressed batch a stream may frame, and the most a pass
+ * of the main loop frames for a tcp_send_channel, whatever its queue:
+ * so also the most a batch may uncompress to */
+#define TCP_BATCH_MAX (256 * TCP_FRAME_MAX)
+/* Smaller batches are not worth compressing */
+#define TCP_COMPRESS_MIN 1024
+
+/* Messages for a tcp_send_channel, written to it at once */
+struct Ganglia_tcp_batch {
+  struct Ganglia_tcp_batch *next;
+  apr_size_t len;
+  int messages;
+  int packed;  /* compressed already, or not worth compressing */
+  char data[1];
+};
+typedef struct Ganglia_tcp_batch Ganglia_tcp_batch;
+
+/* A tcp_send_channel.  A thread of its own keeps the connection to the
+ * upstream gmond and writes the batches to it, so that neither a slow
+ * upstream nor one that is down holds up collection. */
+struct Ganglia_tcp_send_channel {
+  char *key;  /* its section of the configuration */
+  char *host;
+  int port;
+  char *bindaddr;
+  apr_size_t max_queue;
+  gm_codec_t codec;
+  int codec_level;
+  apr_pool_t *pool;
+  apr_thread_t *thread;
+  apr_thread_mutex_t *mutex;
+  apr_thread_cond_t *cond;
+  /* A reload that drops the channel asks its thread to finish, and the
+   * thread says when it has.  The mutex protects these. */
+  int stopping, stopped;
+  /* The batches not written yet, oldest first, and their size in bytes.
+   * The mutex protects these. */
+  Ganglia_tcp_batch *head, *tail;
+  apr_size_t queued;
+  /* Set on each new connection, until a relay has sent everything it
+   * knows again */
+  int resync;
+  /* The messages of this pass of the main loop, which only it touches */
+  char *pending;
+  apr_size_t pending_len, pending_size;
+  int pending_messages;
+};
+typedef struct Ganglia_tcp_send_channel Ganglia_tcp_send_channel;
+
 /* Two separate pollsets hold the tcp_accept and udp_recv channels */
 apr_pollset_t *udp_listen_channels = NULL;
 apr_pollset_t *tcp_listen_channels = NULL;
+/* The pool of the pollsets, made again when the configuration is */
+static apr_pool_t *listen_context = NULL;
+/* The open listen channels by key */
+static apr_hash_t *listen_channels_open = NULL;
 
 /* These are the TCP listen channels */
 apr_socket_t **tcp_sockets = NULL;
@@ -171,21 +301,62 @@ uint16_t sflow_udp_port = SFLOW_IANA_REGISTERED_PORT;
 
 #include "gmond_internal.h"
 
-/* This is the structure of the data save to each host->metric hash */
-struct Ganglia_metadata {
-  /* The pool used for allocating memory */
-  apr_pool_t *pool;
-  /* The name of the metric */
-  char *name;
+/* The metadata of a metric as a host sent it, less the host.  Hosts that
+ * send the same metadata share one copy, allocated in a single block. */
+struct Ganglia_metric_def {
+  Ganglia_metadatadef gfull;
+  /* The number of slots pointing to it */
+  unsigned int refs;
+  /* Its key in metric_defs, NULL if it was too long to share */
+  char *key;
+};
+typedef struct Ganglia_metric_def Ganglia_metric_def;
+
+/* What the hosts table keeps of one metric of a host.  A host's slots
+ * are an array indexed by metric id, and the strings are shared, so a
+ * metric costs little more than this. */
+struct Ganglia_metric_slot {
+  /* The metadata, NULL until it comes */
+  Ganglia_metric_def *def;
+  /* When the metadata and the value last came, 0 if they have not */
+  apr_time_t def_heard_from;
+  apr_time_t value_heard_from;
+  /* The value; fmt is shared and a string is malloc'ed */
+  const char *fmt;
   union {
-      /* The ganglia message */
-      Ganglia_metadata_msg f_message;
-      Ganglia_value_msg v_message;
-  } message_u;
-  /* Last heard from */
-  apr_time_t last_heard_from;
+      u_short us;
+      short ss;
+      u_int ui;
+      int si;
+      float f;
+      double d;
+      char *str;
+  } v;
+  Ganglia_msg_formats type;
+  unsigned char spoof;
+  /* Whether it counts as a use of its metric name */
+  unsigned char used;
 };
-typedef struct Ganglia_metadata Ganglia_metadata;
+typedef struct Ganglia_metric_slot Ganglia_metric_slot;
+
+/* A metric name, with its id and the number of slots using it.  A name
+ * no slot uses is forgotten and its id given to the next new name. */
+struct Ganglia_metric_name {
+  char *name;
+  int id;
+  unsigned int users;
+};
+typedef struct Ganglia_metric_name Ganglia_metric_name;
+
+/* Metric names and the ids their slots have in every host, both ways,
+ * and the ids free to reuse */
+static apr_hash_t *metric_ids = NULL;
+static apr_array_header_t *metric_names = NULL;
+static apr_array_header_t *metric_free_ids = NULL;
+/* The shared metric metadata by key */
+static apr_hash_t *metric_defs = NULL;
+/* The value formats, which are few, so kept for good */
+static apr_hash_t *metric_fmts = NULL;
 
 /* The hash to hold the metrics available on this platform */
 apr_hash_t *metric_callbacks = NULL;
@@ -205,11 +376,15 @@ struct Ganglia_metric_callback {
    mmodule *modp;       /* dynamic module info struct */
    int multi_metric_index; /* index identifying which metric is wanted */
    apr_time_t metadata_last_sent; /* when the metadata was last sent */
+   int metadata_queued; /* waiting to go out in a gmetadata_bulk packet */
+   int metadata_full;   /* ... or in a gmetadata_full one, for a gmetadata_request */
 };
 typedef struct Ganglia_metric_callback Ganglia_metric_callback;
 
 /* This is the structure of a collection group */
 struct Ganglia_collection_group {
+  char *key;                /* its section of the configuration */
+  apr_pool_t *pool;
   apr_time_t next_collect;  /* When to collect next */
   apr_time_t next_send;     /* When to send next (tmax) */
   int once;
@@ -219,8 +394,11 @@ struct Ganglia_collection_group {
 };
 typedef struct Ganglia_collection_group Ganglia_collection_group;
 
-/* This is the array of collection groups that we are processing... */
+/* This is the array of collection groups that we are processing, kept
+ * as a binary min-heap on the time of each group's next event */
 apr_array_header_t *collection_groups = NULL;
+/* The groups process_collection_groups() has taken off the heap */
+static apr_array_header_t *due_groups = NULL;
 
 mmodule *metric_modules = NULL;
 extern int daemon_proc; /* defined in error.c */
@@ -228,7 +406,8 @@ extern int daemon_proc; /* defined in error.c */
 char **gmond_argv;
 extern char **environ;
 
-/* apr_socket_send can't assure all characters in buf been sent. */
+/* apr_socket_send can't assure all characters in buf been sent.  Sets
+ * len to the bytes that were, on failure too. */
 static apr_status_t
 socket_send_raw(apr_socket_t *sock, const char *buf, apr_size_t *len)
 {
@@ -249,56 +428,36 @@ socket_send_raw(apr_socket_t *sock, const char *buf, apr_size_t *len)
       else
           break;
     }
+  *len = (p - buf) + (ret == APR_SUCCESS ? thisTime : 0);
   return ret;
 }
 
-/* wrap socket_send_raw with gzip deflate if enabled. */
+static int
+socket_sink(void *arg, const char *buf, size_t len)
+{
+  apr_size_t wlen = len;
+  return socket_send_raw((apr_socket_t *)arg, buf, &wlen) != APR_SUCCESS;
+}
+
+/* wrap socket_send_raw with the channel's compressor if enabled. */
 static apr_status_t
 socket_send(apr_socket_t *sock, const char *buf, apr_size_t *len)
 {
-  char outputbuffer[2048];
-  const int outputlen = sizeof(outputbuffer);
-  apr_size_t wlen;
-  apr_status_t ret;
-  z_stream *strm;
-  int z_ret;
+  gm_compressor_t *c;
 
-  ret = apr_socket_data_get((void**)&strm, GZIP_KEY, sock);
-  if (ret != APR_SUCCESS)
+  if (apr_socket_data_get((void**)&c, COMPRESSOR_KEY, sock) != APR_SUCCESS || !c)
     {
-      ret = socket_send_raw( sock, buf, len );
+      return socket_send_raw( sock, buf, len );
     }
-  else
-    {
-      strm->next_in = (Bytef *)buf;
-      strm->avail_in = *len;
 
-      while( strm->avail_in )
-	{
-	  strm->next_out = (Bytef *)outputbuffer;
-	  strm->avail_out = outputlen;
-
-	  z_ret = deflate( strm, 0 );
-	  if (z_ret != Z_OK)
-	    {
-	      return APR_ENOMEM;
-	    }
-
-	  wlen = outputlen - strm->avail_out;
-	  if( wlen )
-	    {
-	      ret = socket_send_raw( sock, outputbuffer, &wlen );
-	      if(ret != APR_SUCCESS)
-		{
-		  return ret;
-		}
-	    }
-	}
+  if (gm_compressor_write(c, buf, *len, socket_sink, sock))
+    {
+      return APR_EGENERAL;
     }
-  return ret;
+  return APR_SUCCESS;
 }
 
-/* Reload the Ganglia configuration */
+/* Restart gmond, for a configuration it cannot apply in place */
 void
 reload_ganglia_configuration(void)
 {
@@ -331,17 +490,15 @@ reload_ganglia_configuration(void)
   exit(1);
 }
 
-/* this is just a temporary function */
-void
-process_configuration_file(void)
+/* Reads the globals that need nothing more than to be set, both at
+ * startup and on a reload */
+static void
+process_globals( cfg_t *config )
 {
   cfg_t *tmp;
 
-  /* this is a global for now */
-  config_file = (cfg_t*)Ganglia_gmond_config_create( args_info.conf_arg, !args_info.conf_given );
-
   /* Initialize a few variables */
-  tmp = cfg_getsec( config_file, "globals");
+  tmp = cfg_getsec( config, "globals");
   /* Get the maximum UDP message size */
   max_udp_message_len = cfg_getint( tmp, "max_udp_msg_len");
   /* Get the gexec status requested */
@@ -354,6 +511,19 @@ process_configuration_file(void)
   cleanup_threshold   = cfg_getint( tmp, "cleanup_threshold");
   /* Get the send meta data packet interval */
   send_metadata_interval = cfg_getint( tmp, "send_metadata_interval");
+  /* Get the spread of collection group phases */
+  collection_phase_spread = cfg_getint( tmp, "collection_phase_spread");
+  /* Get how metadata is asked for and resent */
+  metadata_bulk = cfg_getbool( tmp, "metadata_bulk");
+  metadata_request_rate = cfg_getint( tmp, "metadata_request_rate");
+  metadata_response_rate = cfg_getint( tmp, "metadata_response_rate");
+  /* Get how often the hosts table is relayed and summarized */
+  relay_interval = cfg_getint( tmp, "relay_interval");
+  summary_interval = cfg_getint( tmp, "summary_interval");
+  /* Get how host names are looked up */
+  resolver_threads = cfg_getint( tmp, "resolver_threads");
+  resolver_ttl = cfg_getint( tmp, "resolver_ttl");
+  resolver_negative_ttl = cfg_getint( tmp, "resolver_negative_ttl");
   /* Get the DSO module dir */
   module_dir = cfg_getstr(tmp, "module_dir");
   /* Acquire spoof name/ip, if they are specified */
@@ -376,6 +546,159 @@ process_configuration_file(void)
 
 }
 
+/* this is just a temporary function */
+void
+process_configuration_file(void)
+{
+  /* this is a global for now */
+  config_file = (cfg_t*)Ganglia_gmond_config_create( args_info.conf_arg, !args_info.conf_given );
+
+  process_globals( config_file );
+}
+
+/* The text a configuration key is built up in */
+struct cfg_key {
+  char *buf;
+  apr_size_t len, size;
+};
+
+static void
+cfg_key_put( struct cfg_key *key, const char *s, apr_size_t len )
+{
+  if(key->len + len + 1 > key->size)
+    {
+      apr_size_t size = key->size ? key->size * 2 : 256;
+      char *buf;
+
+      while(size < key->len + len + 1)
+        size *= 2;
+      if(!(buf = realloc(key->buf, size)))
+        err_quit("Out of memory reading the configuration");
+      key->buf = buf;
+      key->size = size;
+    }
+  memcpy(key->buf + key->len, s, len);
+  key->len += len;
+  key->buf[key->len] = '\0';
+}
+
+static void cfg_key_section( struct cfg_key *key, cfg_t *section );
+
+/* Writes out an option and its values.  A string goes with its length,
+ * so that no run of values can pass for another. */
+static void
+cfg_key_opt( struct cfg_key *key, cfg_opt_t *opt )
+{
+  char num[64];
+  unsigned int i;
+
+  cfg_key_put(key, opt->name, strlen(opt->name));
+  for(i = 0; i < cfg_opt_size(opt); i++)
+    {
+      const char *str = NULL;
+
+      switch(opt->type)
+        {
+        case CFGT_INT:
+          apr_snprintf(num, sizeof(num), "=%ld", cfg_opt_getnint(opt, i));
+          break;
+        case CFGT_FLOAT:
+          apr_snprintf(num, sizeof(num), "=%.17g", cfg_opt_getnfloat(opt, i));
+          break;
+        case CFGT_BOOL:
+          apr_snprintf(num, sizeof(num), "=%d", cfg_opt_getnbool(opt, i) ? 1 : 0);
+          break;
+        case CFGT_STR:
+          str = cfg_opt_getnstr(opt, i);
+          if(str)
+            apr_snprintf(num, sizeof(num), "=%d:", (int)strlen(str));
+          else
+            apr_cpystrn(num, "=~", sizeof(num));
+          break;
+        case CFGT_SEC:
+          cfg_key_put(key, "{", 1);
+          cfg_key_section(key, cfg_opt_getnsec(opt, i));
+          cfg_key_put(key, "}", 1);
+          continue;
+        default:
+          continue;
+        }
+      cfg_key_put(key, num, strlen(num));
+      if(str)
+        cfg_key_put(key, str, strlen(str));
+    }
+  cfg_key_put(key, ";", 1);
+}
+
+static void
+cfg_key_section( struct cfg_key *key, cfg_t *section )
+{
+  const char *title = cfg_title(section);
+  char num[32];
+  cfg_opt_t *opt;
+
+  if(title)
+    {
+      apr_snprintf(num, sizeof(num), "%d:", (int)strlen(title));
+      cfg_key_put(key, num, strlen(num));
+      cfg_key_put(key, title, strlen(title));
+    }
+  for(opt = section->opts; opt->type != CFGT_NONE; opt++)
+    cfg_key_opt(key, opt);
+}
+
+/* Writes out a section with all of its settings and subsections,
+ * defaults included, so that two sections are the same if their keys
+ * are.  A reload keeps what it can of what was made from a section whose
+ * key has not changed.  kind keeps the keys of different sorts of
+ * section apart.  seen, if given, holds the keys handed out so far, so
+ * that a second section just like the first gets a key of its own. */
+static char *
+cfg_section_key( const char *kind, cfg_t *section, apr_hash_t *seen, apr_pool_t *pool )
+{
+  struct cfg_key key = { NULL, 0, 0 };
+  char *s;
+  int *count;
+
+  cfg_key_put(&key, kind, strlen(kind));
+  cfg_key_put(&key, ":", 1);
+  cfg_key_section(&key, section);
+  s = apr_pstrdup(pool, key.buf);
+  free(key.buf);
+  if(!seen)
+    return s;
+
+  count = apr_hash_get(seen, s, APR_HASH_KEY_STRING);
+  if(!count)
+    {
+      count = apr_pcalloc(pool, sizeof(int));
+      apr_hash_set(seen, s, APR_HASH_KEY_STRING, count);
+    }
+  else
+    {
+      s = apr_psprintf(pool, "%s#%d", s, *count);
+      apr_hash_set(seen, s, APR_HASH_KEY_STRING, count);
+    }
+  (*count)++;
+  return s;
+}
+
+/* Whether an option, which may be a section, differs between two
+ * configurations */
+static int
+cfg_option_changed( cfg_t *old, cfg_t *new, const char *name )
+{
+  struct cfg_key a = { NULL, 0, 0 }, b = { NULL, 0, 0 };
+  int changed;
+
+  cfg_key_opt(&a, cfg_getopt(old, name));
+  cfg_key_opt(&b, cfg_getopt(new, name));
+  changed = strcmp(a.buf, b.buf) != 0;
+  free(a.buf);
+  free(b.buf);
+  return changed;
+}
+
 static void
 daemonize_if_necessary( char *argv[] )
 {
@@ -441,8 +764,10 @@ process_allow_extra_data_mode( void )
   allow_extra_data = cfg_getbool( tmp, "allow_extra_data");
 }
 
-static Ganglia_acl *
-Ganglia_acl_create ( cfg_t *channel, apr_pool_t *pool )
+/* Makes the ACL of a channel, which is NULL if it has none.  Returns -1,
+ * having said why, if the ACL is not valid. */
+static int
+Ganglia_acl_create ( cfg_t *channel, apr_pool_t *pool, Ganglia_acl **aclp )
 {
   apr_status_t status;
   Ganglia_acl *acl = NULL;
@@ -451,31 +776,32 @@ Ganglia_acl_create ( cfg_t *channel, apr_pool_t *pool )
   int num_access = 0;
   int i;
 
+  *aclp = NULL;
   if(!channel || !pool)
     {
-      return acl;
+      return 0;
     }
 
 
   acl_config = cfg_getsec(channel, "acl");
   if(!acl_config)
     {
-      return acl;
+      return 0;
     }
 
   /* Find out the number of access entries */
   num_access = cfg_size( acl_config, "access" );
   if(!num_access)
     {
-      return acl;
+      return 0;
     }
 
   /* Create a new ACL from the pool */
   acl = apr_pcalloc( pool, sizeof(Ganglia_acl));
   if(!acl)
     {
-      err_msg("Unable to allocate memory for ACL. Exiting.\n");
-      exit(1);
+      err_msg("Unable to allocate memory for ACL.\n");
+      return -1;
     }
 
   default_action = cfg_getstr( acl_config, "default");
@@ -489,16 +815,16 @@ Ganglia_acl_create ( cfg_t *channel, apr_pool_t *pool )
     }
   else
     {
-      err_msg("Invalid default ACL '%s'. Exiting.\n", default_action);
-      exit(1);
+      err_msg("Invalid default ACL '%s'.\n", default_action);
+      return -1;
     }
 
   /* Create an array to hold each of the access instructions */
   acl->access_array  = apr_array_make( pool, num_access, sizeof(Ganglia_acl *));
   if(!acl->access_array)
     {
-      err_msg("Unable to malloc access array. Exiting.\n");
-      exit(1);
+      err_msg("Unable to malloc access array.\n");
+      return -1;
     }
   for(i=0; i< num_access; i++)
     {
@@ -509,9 +835,9 @@ Ganglia_acl_create ( cfg_t *channel, apr_pool_t *pool )
       if(!access_config)
         {
           /* This shouldn't happen unless maybe acl is empty and
-           * the safest thing to do it exit */
-          err_msg("Unable to process ACLs. Exiting.\n");
-          exit(1);
+           * the safest thing to do it fail */
+          err_msg("Unable to process ACLs.\n");
+          return -1;
         }
 
       ip     = cfg_getstr( access_config, "ip");
@@ -519,8 +845,8 @@ Ganglia_acl_create ( cfg_t *channel, apr_pool_t *pool )
       action = cfg_getstr( access_config, "action");
       if(!ip && !mask && !action)
         {
-          err_msg("An access record requires an ip, mask and action. Exiting.\n");
-          exit(1);
+          err_msg("An access record requires an ip, mask and action.\n");
+          return -1;
         }
 
       /* Process the action first */
@@ -534,23 +860,24 @@ Ganglia_acl_create ( cfg_t *channel, apr_pool_t *pool )
         }
       else
         {
-          err_msg("ACL access entry has action '%s'. Must be deny|allow. Exiting.\n", action);
-          exit(1);
-        }  
+          err_msg("ACL access entry has action '%s'. Must be deny|allow.\n", action);
+          return -1;
+        }
 
       /* Create the subnet */
       access->ipsub = NULL;
       status = apr_ipsubnet_create( &(access->ipsub), ip, mask, pool);
       if(status != APR_SUCCESS)
         {
-          err_msg("ACL access entry has invalid ip('%s')/mask('%s'). Exiting.\n", ip, mask);
-          exit(1);
+          err_msg("ACL access entry has invalid ip('%s')/mask('%s').\n", ip, mask);
+          return -1;
         }
 
       /* Save this access entry to the acl */
       *(Ganglia_access **)apr_array_push( acl->access_array ) = access;
     }
-  return acl;
+  *aclp = acl;
+  return 0;
 }
 
 
@@ -562,7 +889,7 @@ Ganglia_acl_action( Ganglia_acl *acl, apr_sockaddr_t *addr )
   if(!acl)
     {
       /* If no ACL is specified, we assume there is no access control */
-      return GANGLIA_ACCESS_ALLOW; 
+      return GANGLIA_ACCESS_ALLOW;
     }
 
   for(i=0; i< acl->access_array->nelts; i++)
@@ -583,6 +910,7 @@ Ganglia_acl_action( Ganglia_acl *acl, apr_sockaddr_t *addr )
   return acl->default_action;
 }
 
+/* Returns the address family named, or APR_UNSPEC having said why */
 static int32_t
 get_sock_family( char *family )
 {
@@ -595,14 +923,12 @@ get_sock_family( char *family )
 #if APR_INET6
       return APR_INET6;
 #else
-      err_msg("IPv6 is not supported on this host. Exiting.\n");
-      exit(1);
+      err_msg("IPv6 is not supported on this host.\n");
+      return APR_UNSPEC;
 #endif
     }
 
-  err_msg("Unknown family '%s'. Try inet4|inet6. Exiting.\n", family);
-  exit(1);
-  /* shouldn't get here */
+  err_msg("Unknown family '%s'. Try inet4|inet6.\n", family);
   return APR_UNSPEC;
 }
 
@@ -632,300 +958,562 @@ reset_mcast_channels( void )
     }
 }
 
-static void
-setup_listen_channels_pollset( void )
-{
-  apr_status_t status;
-  int i;
-  int num_udp_recv_channels   = cfg_size( config_file, "udp_recv_channel");
-  int num_tcp_accept_channels = cfg_size( config_file, "tcp_accept_channel");
-  int total_listen_channels   = num_udp_recv_channels + num_tcp_accept_channels;
-  Ganglia_channel *channel;
-  int pollset_opts = 0;
-
-  /* check if gmond was really meant to be deaf */
-  if (total_listen_channels == 0)
-    {
-      deaf = 1;
-      return;
-    }
-
-  /* Create my incoming pollset */
-#ifdef LINUX
-  struct utsname _name;
-  if(uname(&_name) >= 0) {
-    if(strcmp(_name.release, "2.6") >= 0)
-      pollset_opts = APR_POLLSET_THREADSAFE;
-  }
-#endif
-  if((status = apr_pollset_create(&udp_listen_channels, num_udp_recv_channels, global_context, pollset_opts)) != APR_SUCCESS)
-    {
-      char apr_err[512];
-      apr_strerror(status, apr_err, 511);
-      err_msg("apr_pollset_create failed: %s", apr_err);
-      exit(1);
-    }
-  if((status = apr_pollset_create(&tcp_listen_channels, num_tcp_accept_channels, global_context, pollset_opts)) != APR_SUCCESS)
-    {
-      char apr_err[512];
-      apr_strerror(status, apr_err, 511);
-      err_msg("apr_pollset_create failed: %s", apr_err);
-      exit(1);
-    }
-
-  if((udp_recv_sockets = (apr_socket_t **)apr_pcalloc(global_context, sizeof(apr_socket_t *) * (num_udp_recv_channels + 1))) == NULL)
-    err_quit("unable to allocate UDP listening sockets");
+static void close_tcp_recv_stream( Ganglia_tcp_stream *stream );
 
-  /* Process all the udp_recv_channels */
-  for(i = 0; i< num_udp_recv_channels; i++)
-    {
-      cfg_t *udp_recv_channel;
-      char *mcast_join, *mcast_if, *bindaddr, *family;
-      int port, retry_bind, buffer;
-      apr_socket_t *socket = NULL;
-      apr_pollfd_t socket_pollfd;
-      apr_pool_t *pool = NULL;
-      int32_t sock_family = APR_INET;
-      apr_int32_t rx_buf_sz;
-      socklen_t _optlen;
-
-      udp_recv_channel = cfg_getnsec( config_file, "udp_recv_channel", i);
-      mcast_join     = cfg_getstr( udp_recv_channel, "mcast_join" );
-      mcast_if       = cfg_getstr( udp_recv_channel, "mcast_if" );
-      port           = cfg_getint( udp_recv_channel, "port");
-      bindaddr       = cfg_getstr( udp_recv_channel, "bind");
-      family         = cfg_getstr( udp_recv_channel, "family");
-      retry_bind     = cfg_getbool( udp_recv_channel, "retry_bind");
-      buffer         = cfg_getint( udp_recv_channel, "buffer");
+/* The sorts of listen channel, in the order they are set up */
+static const char *listen_channel_kinds[] = {
+  "udp_recv_channel", "tcp_recv_channel", "tcp_accept_channel", NULL
+};
 
-      debug_msg("udp_recv_channel mcast_join=%s mcast_if=%s port=%d bind=%s buffer=%d",
-                mcast_join? mcast_join:"NULL", 
-                mcast_if? mcast_if:"NULL", port,
-                bindaddr? bindaddr: "NULL", buffer);
+/* The keys of the sections of one kind of listen channel, in order */
+static char **
+listen_channel_keys( cfg_t *cfg, const char *kind, apr_hash_t *seen, apr_pool_t *pool )
+{
+  int i, n = cfg_size( cfg, kind );
+  char **keys = apr_pcalloc( pool, (n + 1) * sizeof(char *));
 
+  for(i = 0; i < n; i++)
+    keys[i] = cfg_section_key( kind, cfg_getnsec( cfg, kind, i), seen, pool );
+  return keys;
+}
 
-      /* Create a sub-pool for this channel */
-      apr_pool_create(&pool, global_context);
+/* Opens the socket of a udp_recv_channel.  Only at startup does it wait
+ * for a port that will not bind, if the section says to retry. */
+static apr_socket_t *
+udp_recv_channel_open( cfg_t *udp_recv_channel, apr_pool_t *pool, int retry )
+{
+  char *mcast_join, *mcast_if, *bindaddr, *family;
+  int port, retry_bind, buffer;
+  apr_socket_t *socket = NULL;
+  int32_t sock_family = APR_INET;
+  apr_int32_t rx_buf_sz;
+  socklen_t _optlen;
+
+  mcast_join     = cfg_getstr( udp_recv_channel, "mcast_join" );
+  mcast_if       = cfg_getstr( udp_recv_channel, "mcast_if" );
+  port           = cfg_getint( udp_recv_channel, "port");
+  bindaddr       = cfg_getstr( udp_recv_channel, "bind");
+  family         = cfg_getstr( udp_recv_channel, "family");
+  retry_bind     = retry && cfg_getbool( udp_recv_channel, "retry_bind");
+  buffer         = cfg_getint( udp_recv_channel, "buffer");
+
+  debug_msg("udp_recv_channel mcast_join=%s mcast_if=%s port=%d bind=%s buffer=%d",
+            mcast_join? mcast_join:"NULL",
+            mcast_if? mcast_if:"NULL", port,
+            bindaddr? bindaddr: "NULL", buffer);
+
+  sock_family = get_sock_family(family);
+  if(sock_family == APR_UNSPEC)
+    return NULL;
 
-      sock_family = get_sock_family(family);
+  if( mcast_join )
+    {
+      /* Listen on the specified multicast channel */
+      socket = create_mcast_server(pool, sock_family, mcast_join, port, bindaddr, mcast_if );
 
-      if( mcast_join )
+      while(!socket)
         {
-          /* Listen on the specified multicast channel */
-          socket = create_mcast_server(pool, sock_family, mcast_join, port, bindaddr, mcast_if );
-
-          while(!socket)
+          if(!retry_bind)
             {
-              if(retry_bind == cfg_false)
-                {
-                  err_msg("Error creating multicast server mcast_join=%s port=%d mcast_if=%s family='%s'. Try setting retry_bind.  Exiting.\n",
-                  mcast_join? mcast_join: "NULL", port, mcast_if? mcast_if:"NULL",family);
-                  exit(1);
-                }
-              err_msg("Error creating multicast server mcast_join=%s port=%d mcast_if=%s family='%s'.  Will try again...\n",
-                  mcast_join? mcast_join: "NULL", port, mcast_if? mcast_if:"NULL",family);
-              apr_sleep(APR_USEC_PER_SEC * RETRY_BIND_DELAY);
-              socket = create_mcast_server(pool, sock_family, mcast_join, port, bindaddr, mcast_if );
+              err_msg("Error creating multicast server mcast_join=%s port=%d mcast_if=%s family='%s'. Try setting retry_bind.\n",
+              mcast_join? mcast_join: "NULL", port, mcast_if? mcast_if:"NULL",family);
+              return NULL;
             }
+          err_msg("Error creating multicast server mcast_join=%s port=%d mcast_if=%s family='%s'.  Will try again...\n",
+              mcast_join? mcast_join: "NULL", port, mcast_if? mcast_if:"NULL",family);
+          apr_sleep(APR_USEC_PER_SEC * RETRY_BIND_DELAY);
+          socket = create_mcast_server(pool, sock_family, mcast_join, port, bindaddr, mcast_if );
         }
-      else
+    }
+  else
+    {
+      /* Create a UDP server */
+      socket = create_udp_server( pool, sock_family, port, bindaddr );
+      while(!socket)
         {
-          /* Create a UDP server */
-          socket = create_udp_server( pool, sock_family, port, bindaddr );
-          while(!socket)
+          if(!retry_bind)
             {
-              if(retry_bind == cfg_false)
-                {
-                  err_msg("Error creating UDP server on port %d bind=%s.  Try setting retry_bind.  Exiting.\n",
-                    port, bindaddr? bindaddr: "unspecified");
-                  exit(1);
-                }
-              err_msg("Error creating UDP server on port %d bind=%s.  Will try again...\n",
-                  port, bindaddr? bindaddr: "unspecified");
-              apr_sleep(APR_USEC_PER_SEC * RETRY_BIND_DELAY);
-              socket = create_udp_server( pool, sock_family, port, bindaddr );
+              err_msg("Error creating UDP server on port %d bind=%s.  Try setting retry_bind.\n",
+                port, bindaddr? bindaddr: "unspecified");
+              return NULL;
             }
+          err_msg("Error creating UDP server on port %d bind=%s.  Will try again...\n",
+              port, bindaddr? bindaddr: "unspecified");
+          apr_sleep(APR_USEC_PER_SEC * RETRY_BIND_DELAY);
+          socket = create_udp_server( pool, sock_family, port, bindaddr );
         }
+    }
 
-      if(buffer)
+  if(buffer)
+    {
+      debug_msg("setting UDP socket receive buffer to: %d\n", (apr_int32_t) buffer);
+      if(apr_socket_opt_set(socket, APR_SO_RCVBUF, (apr_int32_t) buffer) == APR_SUCCESS)
         {
-          debug_msg("setting UDP socket receive buffer to: %d\n", (apr_int32_t) buffer);
-          if(apr_socket_opt_set(socket, APR_SO_RCVBUF, (apr_int32_t) buffer) == APR_SUCCESS)
+          debug_msg("APR reports success setting APR_SO_RCVBUF to: %d\n", (apr_int32_t)buffer );
+
+          /* RB: Let's check if it actually worked to be sure */
+          _optlen = sizeof(rx_buf_sz);
+          if(getsockopt(get_apr_os_socket(socket), SOL_SOCKET, SO_RCVBUF,
+                          &rx_buf_sz, &_optlen) == 0)
             {
-              debug_msg("APR reports success setting APR_SO_RCVBUF to: %d\n", (apr_int32_t)buffer );
+              debug_msg("socket created, SO_RCVBUF = %d\n", rx_buf_sz);
 
-              /* RB: Let's check if it actually worked to be sure */
-              _optlen = sizeof(rx_buf_sz);
-              if(getsockopt(get_apr_os_socket(socket), SOL_SOCKET, SO_RCVBUF,
-                              &rx_buf_sz, &_optlen) == 0)
+              if(buffer)
                 {
-                  debug_msg("socket created, SO_RCVBUF = %d\n", rx_buf_sz);
-
-                  if(buffer)
+                  /* RB: getsockopt() returns double SO_RCVBUF since kernel reserves overhead space */
+                  if(rx_buf_sz!=(buffer*2))
                     {
-                      /* RB: getsockopt() returns double SO_RCVBUF since kernel reserves overhead space */
-                      if(rx_buf_sz!=(buffer*2))
-                        {
-                          err_msg("Error setting UDP receive buffer for port %d bind=%s to size: %d.\n",
-                            port, bindaddr? bindaddr: "unspecified", (apr_int32_t) buffer);
-                          err_msg("Reported buffer size by OS: %d : does not match config setting %d.\n",
-                            (int) (rx_buf_sz/2), (int) buffer);
-                          err_msg("NOTE: only supported on systems that have Apache Portable Runtime library version 0.9.4 or higher.\n");
-                          err_msg("Check Operating System (kernel) limits, change or disable buffer size. Exiting.\n");
-                          exit(1);
-                        }
-                      else
-                        { /* RB: Eureka */
-                          debug_msg("Actual receive buffer size reported by OS matches config setting. Success.");
-                        }
+                      err_msg("Error setting UDP receive buffer for port %d bind=%s to size: %d.\n",
+                        port, bindaddr? bindaddr: "unspecified", (apr_int32_t) buffer);
+                      err_msg("Reported buffer size by OS: %d : does not match config setting %d.\n",
+                        (int) (rx_buf_sz/2), (int) buffer);
+                      err_msg("NOTE: only supported on systems that have Apache Portable Runtime library version 0.9.4 or higher.\n");
+                      err_msg("Check Operating System (kernel) limits, change or disable buffer size.\n");
+                      apr_socket_close(socket);
+                      return NULL;
+                    }
+                  else
+                    { /* RB: Eureka */
+                      debug_msg("Actual receive buffer size reported by OS matches config setting. Success.");
                     }
-                }
-              else
-                {
-                  err_msg("Unable to verify UDP receive buffer for port %d bind=%s to size: %d. Check Operating System (limits) or change buffer size. Exiting.\n",
-                           port, bindaddr? bindaddr: "unspecified", buffer);
-                  exit(1);
                 }
             }
           else
             {
-              err_msg("Error setting UDP receive buffer for port %d bind=%s to size: %d. Check Operating System limits or change buffer size. Exiting.\n",
-                port, bindaddr? bindaddr: "unspecified", (apr_int32_t) buffer);
-              err_msg("This is currently only supported on systems that have Apache Portable Runtime library version 0.9.4 or higher.\n");
-              err_msg("Check Operating System (kernel) limits, change or disable buffer size. Exiting.\n");
-              exit(1);
+              err_msg("Unable to verify UDP receive buffer for port %d bind=%s to size: %d. Check Operating System (limits) or change buffer size.\n",
+                       port, bindaddr? bindaddr: "unspecified", buffer);
+              apr_socket_close(socket);
+              return NULL;
             }
         }
-
-      /* Find out about the RX socket buffer 
-         This is logged to help people troubleshoot
-         Some users have observed messages about errors when sending 
-         or receiving metric packets, and a small buffer size 
-         could be an issue */
-      /* RB: Just log this for debugging purposes now */
-      _optlen = sizeof(rx_buf_sz);
-      if(getsockopt(get_apr_os_socket(socket), SOL_SOCKET, SO_RCVBUF,
-                      &rx_buf_sz, &_optlen) == 0)
-        {
-          debug_msg("socket created, SO_RCVBUF = %d\n", rx_buf_sz);
-        }
       else
         {
-          debug_msg("getsockopt SO_RCVBUF failed\n");
+          err_msg("Error setting UDP receive buffer for port %d bind=%s to size: %d. Check Operating System limits or change buffer size.\n",
+            port, bindaddr? bindaddr: "unspecified", (apr_int32_t) buffer);
+          err_msg("This is currently only supported on systems that have Apache Portable Runtime library version 0.9.4 or higher.\n");
+          err_msg("Check Operating System (kernel) limits, change or disable buffer size.\n");
+          apr_socket_close(socket);
+          return NULL;
         }
+    }
 
-      /* Build the socket poll file descriptor structure */
-      socket_pollfd.desc_type   = APR_POLL_SOCKET;
-      socket_pollfd.reqevents   = APR_POLLIN;
-      socket_pollfd.desc.s      = socket;
-
-      udp_recv_sockets[i] = socket;
+  /* Find out about the RX socket buffer
+     This is logged to help people troubleshoot
+     Some users have observed messages about errors when sending
+     or receiving metric packets, and a small buffer size
+     could be an issue */
+  /* RB: Just log this for debugging purposes now */
+  _optlen = sizeof(rx_buf_sz);
+  if(getsockopt(get_apr_os_socket(socket), SOL_SOCKET, SO_RCVBUF,
+                  &rx_buf_sz, &_optlen) == 0)
+    {
+      debug_msg("socket created, SO_RCVBUF = %d\n", rx_buf_sz);
+    }
+  else
+    {
+      debug_msg("getsockopt SO_RCVBUF failed\n");
+    }
+  return socket;
+}
 
-      channel = apr_pcalloc( pool, sizeof(Ganglia_channel));
-      if(!channel)
-        {
-          err_msg("Unable to malloc memory for channel.  Exiting. \n");
-          exit(1);
-        }
+/* Opens the socket of a tcp_recv_channel or a tcp_accept_channel */
+static apr_socket_t *
+tcp_channel_open( const char *kind, cfg_t *tcp_channel, apr_pool_t *pool )
+{
+  char *bindaddr, *interface, *family;
+  int port;
+  int32_t sock_family;
+  apr_socket_t *socket;
 
-      /* Mark this channel as a udp_recv_channel */
-      channel->type = UDP_RECV_CHANNEL;
+  port           = cfg_getint( tcp_channel, "port");
+  bindaddr       = cfg_getstr( tcp_channel, "bind");
+  interface      = cfg_getstr( tcp_channel, "interface");
+  family         = cfg_getstr( tcp_channel, "family");
 
-      /* Make sure this socket never blocks */
-      channel->timeout = 0;
-      apr_socket_timeout_set( socket, channel->timeout);
+  debug_msg("%s bind=%s port=%d", kind, bindaddr? bindaddr: "NULL", port);
 
-      /* Save the ACL information */
-      channel->acl = Ganglia_acl_create ( udp_recv_channel, pool );
+  sock_family = get_sock_family(family);
+  if(sock_family == APR_UNSPEC)
+    return NULL;
 
-      /* Save the pointer to this socket specific data */
-      socket_pollfd.client_data = channel;
+  /* A tcp_accept_channel blocks with a timeout.  The main loop reads a
+   * tcp_recv_channel with the UDP channels, so it must not block. */
+  socket = create_tcp_server(pool, sock_family, port, bindaddr, interface,
+                             !strcmp(kind, "tcp_accept_channel"));
+  if(!socket)
+    err_msg("Unable to create %s on port %d bind=%s.\n", kind, port,
+            bindaddr? bindaddr: "unspecified");
+  return socket;
+}
 
-      /* Add the socket to the pollset */
-      status = apr_pollset_add(udp_listen_channels, &socket_pollfd);
-      if(status != APR_SUCCESS)
-        {
-          err_msg("Failed to add socket to pollset. Exiting.\n");
-          exit(1);
-        }
-    }
+/* The codec of a tcp_accept_channel, or -1 having said why */
+static int
+tcp_accept_channel_codec( cfg_t *tcp_accept_channel )
+{
+  char *compression = cfg_getstr( tcp_accept_channel, "compression");
+  int codec;
 
-  if ((tcp_sockets = (apr_socket_t **)apr_pcalloc(global_context, sizeof(apr_socket_t *) * (num_tcp_accept_channels + 1))) == NULL)
-    err_quit("Unable to allocate TCP listening sockets");
+  /* Without a "compression" setting the --gzip-output flag decides */
+  if (!compression)
+    return args_info.gzip_output_flag ? GM_CODEC_GZIP : GM_CODEC_NONE;
 
-  /* Process all the tcp_accept_channels */ 
-  for(i=0; i< num_tcp_accept_channels; i++)
+  /* gmetad tells a codec by its magic number, which the zlib format of
+   * "deflate" lacks */
+  codec = gm_codec_from_cstr(compression);
+  if (codec < 0 || codec == GM_CODEC_DEFLATE)
     {
-      cfg_t *tcp_accept_channel = cfg_getnsec( config_file, "tcp_accept_channel", i);
-      char *bindaddr, *interface, *family;
-      int port, timeout;
-      apr_socket_t *socket = NULL;
-      apr_pollfd_t socket_pollfd;
-      apr_pool_t *pool = NULL;
-      int32_t sock_family;
-
-      port           = cfg_getint( tcp_accept_channel, "port");
-      bindaddr       = cfg_getstr( tcp_accept_channel, "bind");
-      interface      = cfg_getstr( tcp_accept_channel, "interface"); 
-      timeout        = cfg_getint( tcp_accept_channel, "timeout");
-      family         = cfg_getstr( tcp_accept_channel, "family");
-
-      debug_msg("tcp_accept_channel bind=%s port=%d",
-                bindaddr? bindaddr: "NULL", port);
+      err_msg("Unknown or unsupported compression '%s' for tcp_accept_channel.\n",
+              compression);
+      return -1;
+    }
+  return codec;
+}
 
-      /* Create a subpool context */
-      apr_pool_create(&pool, global_context);
+/* Checks what of a listen section does not depend on its socket, so a
+ * reload is refused before any channel is closed for it */
+static int
+listen_channel_check( const char *kind, cfg_t *section, apr_pool_t *pool )
+{
+  Ganglia_acl *acl;
 
-      sock_family = get_sock_family(family);
+  if(Ganglia_acl_create( section, pool, &acl ) ||
+     get_sock_family( cfg_getstr( section, "family")) == APR_UNSPEC)
+    return -1;
+  if(!strcmp(kind, "tcp_accept_channel") && tcp_accept_channel_codec(section) < 0)
+    return -1;
+  return 0;
+}
 
-      /* Create the socket for the channel, blocking w/timeout */
-      socket = create_tcp_server(pool, sock_family, port, bindaddr, 
-                                 interface, 1);
-      if(!socket)
-        {
-          err_msg("Unable to create tcp_accept_channel. Exiting.\n");
-          exit(1);
-        }
+/* Opens the channel of a listen section, in a pool of its own, with
+ * what it is to do with the data.  Returns NULL, having said why, if the
+ * section is not valid or its socket will not open. */
+static Ganglia_listen_channel *
+listen_channel_open( const char *kind, cfg_t *section, const char *key, int retry )
+{
+  Ganglia_listen_channel *lc;
+  Ganglia_channel *channel;
+  apr_socket_t *socket;
+  apr_pool_t *pool = NULL;
 
-      tcp_sockets[i] = socket;
+  /* Create a sub-pool for this channel */
+  apr_pool_create(&pool, global_context);
+  channel = apr_pcalloc( pool, sizeof(Ganglia_channel));
 
-      /* Build the socket poll file descriptor structure */
-      socket_pollfd.desc_type   = APR_POLL_SOCKET;
-      socket_pollfd.reqevents   = APR_POLLIN;
-      socket_pollfd.desc.s      = socket;
+  /* Save the ACL information */
+  if(Ganglia_acl_create( section, pool, &(channel->acl) ))
+    goto failed;
 
-      channel = apr_pcalloc( pool, sizeof(Ganglia_channel));
-      if(!channel)
-        {
-          err_msg("Unable to malloc data for channel. Exiting.\n");
-          exit(1);
-        }
-      
+  if(!strcmp(kind, "udp_recv_channel"))
+    {
+      /* Make sure this socket never blocks */
+      channel->type = UDP_RECV_CHANNEL;
+      channel->timeout = 0;
+      if(!(socket = udp_recv_channel_open(section, pool, retry)))
+        goto failed;
+      apr_socket_timeout_set( socket, channel->timeout);
+    }
+  else if(!strcmp(kind, "tcp_recv_channel"))
+    {
+      channel->type = TCP_RECV_CHANNEL;
+      channel->max_connections = cfg_getint( section, "max_connections");
+      if(!(socket = tcp_channel_open(kind, section, pool)))
+        goto failed;
+    }
+  else
+    {
       channel->type = TCP_ACCEPT_CHANNEL;
 
       /* Save the timeout for this socket */
-      channel->timeout = timeout;
+      channel->timeout = cfg_getint( section, "timeout");
 
-      /* Save the ACL information */
-      channel->acl = Ganglia_acl_create( tcp_accept_channel, pool ); 
+      /* Does this channel speak the compact XML dialect? */
+      channel->compact_xml = cfg_getbool( section, "compact_xml");
 
-      /* Save the pointer to this channel data */
-      socket_pollfd.client_data = channel;
+      /* How is output on this channel compressed? */
+      if((channel->codec = tcp_accept_channel_codec(section)) < 0)
+        goto failed;
+      channel->codec_level = cfg_getint( section, "compression_level");
 
-      /* Add the socket to the pollset */
-      status = apr_pollset_add(tcp_listen_channels, &socket_pollfd);
-      if(status != APR_SUCCESS)
-         {
-            err_msg("Failed to add socket to pollset. Exiting.\n");
-            exit(1);
-         }
+      if(!(socket = tcp_channel_open(kind, section, pool)))
+        goto failed;
     }
+
+  lc = apr_pcalloc( pool, sizeof(Ganglia_listen_channel));
+  lc->key = apr_pstrdup(pool, key);
+  lc->kind = kind;
+  lc->section = section;
+  lc->pool = pool;
+
+  /* Build the socket poll file descriptor structure */
+  lc->pollfd.desc_type   = APR_POLL_SOCKET;
+  lc->pollfd.reqevents   = APR_POLLIN;
+  lc->pollfd.desc.s      = socket;
+  /* Save the pointer to this socket specific data */
+  lc->pollfd.client_data = channel;
+  return lc;
+
+ failed:
+  apr_pool_destroy(pool);
+  return NULL;
 }
 
-void sanitize_metric_name(char *metric_name, int is_spoof_msg)
+/* Adds a channel to the pollset for its kind, and the streams of a
+ * tcp_recv_channel with it */
+static int
+listen_channel_add( Ganglia_listen_channel *lc, apr_pollset_t *udp_pollset, apr_pollset_t *tcp_pollset )
 {
-    if (metric_name == NULL) return;
-    if (strlen(metric_name) < 1) return;
+  Ganglia_channel *channel = lc->pollfd.client_data;
+  Ganglia_tcp_stream *stream, *next;
+
+  if(apr_pollset_add(channel->type == TCP_ACCEPT_CHANNEL ? tcp_pollset : udp_pollset,
+                     &(lc->pollfd)) != APR_SUCCESS)
+    {
+      err_msg("Failed to add socket to pollset.\n");
+      return -1;
+    }
+  for(stream = channel->streams; stream; stream = next)
+    {
+      next = stream->next;
+      if(apr_pollset_add(udp_pollset, &(stream->pollfd)) != APR_SUCCESS)
+        {
+          err_msg("Failed to add TCP stream from %s to pollset.\n", stream->remoteip);
+          close_tcp_recv_stream(stream);
+        }
+    }
+  return 0;
+}
+
+/* Closes a channel, with any streams open on it */
+static void
+listen_channel_close( Ganglia_listen_channel *lc )
+{
+  Ganglia_channel *channel = lc->pollfd.client_data;
+
+  while(channel->streams)
+    close_tcp_recv_stream(channel->streams);
+  apr_pollset_remove(channel->type == TCP_ACCEPT_CHANNEL ?
+                     tcp_listen_channels : udp_listen_channels, &(lc->pollfd));
+  apr_socket_close(lc->pollfd.desc.s);
+  apr_pool_destroy(lc->pool);
+}
+
+/* Closes the open channels that no section of a reload has a key of, and
+ * returns what it takes to open them again */
+static apr_array_header_t *
+listen_channels_drop( apr_hash_t *seen, apr_pool_t *pool )
+{
+  apr_array_header_t *dropped = apr_array_make(pool, 1, sizeof(Ganglia_listen_channel));
+  Ganglia_listen_channel *lc, *copy;
+  apr_hash_index_t *hi;
+
+  for(hi = apr_hash_first(pool, listen_channels_open); hi; hi = apr_hash_next(hi))
+    {
+      apr_hash_this(hi, NULL, NULL, (void **)&lc);
+      if(apr_hash_get(seen, lc->key, APR_HASH_KEY_STRING))
+        continue;
+      copy = apr_array_push(dropped);
+      copy->key = apr_pstrdup(pool, lc->key);
+      copy->kind = lc->kind;
+      copy->section = lc->section;
+      apr_hash_set(listen_channels_open, lc->key, APR_HASH_KEY_STRING, NULL);
+      listen_channel_close(lc);
+    }
+  return dropped;
+}
+
+/* Points the socket arrays at the channels of the configuration */
+static void
+listen_sockets_index( cfg_t *cfg, apr_pool_t *pool )
+{
+  apr_hash_t *seen = apr_hash_make(pool);
+  Ganglia_listen_channel *lc;
+  char **keys;
+  int i, n;
+
+  /* The keys come as they did, each kind in turn */
+  keys = listen_channel_keys(cfg, "udp_recv_channel", seen, pool);
+  n = cfg_size( cfg, "udp_recv_channel");
+  udp_recv_sockets = apr_pcalloc(pool, (n + 1) * sizeof(apr_socket_t *));
+  for(i = 0; i < n; i++)
+    if((lc = apr_hash_get(listen_channels_open, keys[i], APR_HASH_KEY_STRING)))
+      udp_recv_sockets[i] = lc->pollfd.desc.s;
+
+  listen_channel_keys(cfg, "tcp_recv_channel", seen, pool);
+
+  keys = listen_channel_keys(cfg, "tcp_accept_channel", seen, pool);
+  n = cfg_size( cfg, "tcp_accept_channel");
+  tcp_sockets = apr_pcalloc(pool, (n + 1) * sizeof(apr_socket_t *));
+  for(i = 0; i < n; i++)
+    if((lc = apr_hash_get(listen_channels_open, keys[i], APR_HASH_KEY_STRING)))
+      tcp_sockets[i] = lc->pollfd.desc.s;
+}
+
+/* Opens the listen channels of cfg and makes the pollsets.  On a reload
+ * the channels whose sections are unchanged are moved to the new
+ * pollsets as they are, with their streams, and the others are opened
+ * while the old ones still run.  A section that is not valid fails it
+ * at once.  A new channel that will not open may want the port of one
+ * the reload drops, so those are closed and it is tried again; if it
+ * still will not, what was opened is closed and what was dropped opened
+ * again.  Either way -1 is returned and the old channels go on as they
+ * were. */
+static int
+setup_listen_channels_pollset( cfg_t *cfg )
+{
+  apr_status_t status;
+  int i, k, n, failed = 0;
+  int num_udp_recv_channels   = cfg_size( cfg, "udp_recv_channel");
+  int num_tcp_accept_channels = cfg_size( cfg, "tcp_accept_channel");
+  int num_tcp_recv_channels   = cfg_size( cfg, "tcp_recv_channel");
+  int total_listen_channels   = num_udp_recv_channels + num_tcp_accept_channels + num_tcp_recv_channels;
+  int num_data_sockets        = num_udp_recv_channels;
+  Ganglia_listen_channel *lc, **opened;
+  apr_pool_t *context;
+  apr_pollset_t *udp_pollset, *tcp_pollset;
+  apr_hash_t *old = listen_channels_open, *seen, *open;
+  apr_array_header_t *dropped = NULL;
+  char **keys[3];
+  int pollset_opts = 0;
+
+  /* check if gmond was really meant to be deaf */
+  if (total_listen_channels == 0)
+    {
+      deaf = 1;
+      return 0;
+    }
+
+  apr_pool_create(&context, global_context);
+  seen = apr_hash_make(context);
+  for(k = 0; listen_channel_kinds[k]; k++)
+    keys[k] = listen_channel_keys(cfg, listen_channel_kinds[k], seen, context);
+
+  /* Check what is new, then open it.  The channels are numbered across
+   * the kinds. */
+  for(k = 0; listen_channel_kinds[k]; k++)
+    for(i = 0; keys[k][i]; i++)
+      {
+        if(old && apr_hash_get(old, keys[k][i], APR_HASH_KEY_STRING))
+          continue;
+        if(listen_channel_check(listen_channel_kinds[k],
+                                cfg_getnsec(cfg, listen_channel_kinds[k], i), context))
+          {
+            apr_pool_destroy(context);
+            return -1;
+          }
+      }
+  opened = apr_pcalloc(context, total_listen_channels * sizeof(Ganglia_listen_channel *));
+  for(n = 0, k = 0; listen_channel_kinds[k]; k++)
+    for(i = 0; keys[k][i]; i++, n++)
+      {
+        if(old && apr_hash_get(old, keys[k][i], APR_HASH_KEY_STRING))
+          continue;
+        opened[n] = listen_channel_open(listen_channel_kinds[k],
+                                        cfg_getnsec(cfg, listen_channel_kinds[k], i),
+                                        keys[k][i], !old);
+        if(!opened[n])
+          failed++;
+      }
+  if(failed && old)
+    {
+      err_msg("Closing the listen channels the reload drops, to try again.\n");
+      dropped = listen_channels_drop(seen, context);
+      for(n = 0, k = 0; listen_channel_kinds[k]; k++)
+        for(i = 0; keys[k][i]; i++, n++)
+          {
+            if(opened[n] || apr_hash_get(old, keys[k][i], APR_HASH_KEY_STRING))
+              continue;
+            opened[n] = listen_channel_open(listen_channel_kinds[k],
+                                            cfg_getnsec(cfg, listen_channel_kinds[k], i),
+                                            keys[k][i], 0);
+            if(opened[n])
+              failed--;
+          }
+    }
+  if(failed)
+    goto undo;
+
+  /* Create my incoming pollset */
+#ifdef LINUX
+  struct utsname _name;
+  if(uname(&_name) >= 0) {
+    if(strcmp(_name.release, "2.6") >= 0)
+      pollset_opts = APR_POLLSET_THREADSAFE;
+  }
+#endif
+  /* The streams of the tcp_recv_channels come in with the UDP data */
+  for(i = 0; i< num_tcp_recv_channels; i++)
+    {
+      cfg_t *tcp_recv_channel = cfg_getnsec( cfg, "tcp_recv_channel", i);
+      num_data_sockets += 1 + cfg_getint( tcp_recv_channel, "max_connections");
+    }
+  if((status = apr_pollset_create(&udp_pollset, num_data_sockets, context, pollset_opts)) != APR_SUCCESS ||
+     (status = apr_pollset_create(&tcp_pollset, num_tcp_accept_channels, context, pollset_opts)) != APR_SUCCESS)
+    {
+      char apr_err[512];
+      apr_strerror(status, apr_err, 511);
+      err_msg("apr_pollset_create failed: %s", apr_err);
+      goto undo;
+    }
+
+  /* The new pollsets get what is kept and what was opened */
+  open = apr_hash_make(context);
+  for(n = 0, k = 0; listen_channel_kinds[k]; k++)
+    for(i = 0; keys[k][i]; i++, n++)
+      {
+        lc = opened[n] ? opened[n] : apr_hash_get(old, keys[k][i], APR_HASH_KEY_STRING);
+        if(listen_channel_add(lc, udp_pollset, tcp_pollset))
+          goto undo;
+        apr_hash_set(open, lc->key, APR_HASH_KEY_STRING, lc);
+      }
+
+  /* Close what is left of the old, then let the old pollsets go */
+  if(old && !dropped)
+    listen_channels_drop(seen, context);
+  if(listen_context)
+    apr_pool_destroy(listen_context);
+  listen_context = context;
+  listen_channels_open = open;
+  udp_listen_channels = udp_pollset;
+  tcp_listen_channels = tcp_pollset;
+  listen_sockets_index(cfg, listen_context);
+  return 0;
+
+ undo:
+  for(n = 0; n < total_listen_channels; n++)
+    {
+      if(!opened[n])
+        continue;
+      apr_socket_close(opened[n]->pollfd.desc.s);
+      apr_pool_destroy(opened[n]->pool);
+    }
+  for(i = 0; dropped && i < dropped->nelts; i++)
+    {
+      Ganglia_listen_channel *copy = &((Ganglia_listen_channel *)dropped->elts)[i];
+
+      lc = listen_channel_open(copy->kind, copy->section, copy->key, 0);
+      if(!lc || listen_channel_add(lc, udp_listen_channels, tcp_listen_channels))
+        {
+          err_msg("Unable to open the %s of the old configuration again: it is closed.\n",
+                  copy->kind);
+          if(lc)
+            {
+              apr_socket_close(lc->pollfd.desc.s);
+              apr_pool_destroy(lc->pool);
+            }
+          continue;
+        }
+      apr_hash_set(listen_channels_open, lc->key, APR_HASH_KEY_STRING, lc);
+    }
+  if(dropped)
+    listen_sockets_index(config_file, listen_context);
+  apr_pool_destroy(context);
+  return -1;
+}
+
+void sanitize_metric_name(char *metric_name, int is_spoof_msg)
+{
+    if (metric_name == NULL) return;
+    if (strlen(metric_name) < 1) return;
     char *p = metric_name;
     while (p < (metric_name + strlen(metric_name))) {
         if (
@@ -980,6 +1568,321 @@ get_metric_names (Ganglia_metric_id *metric_id, char **metricName, char **realNa
     return;
 }
 
+/* Returns the id of a metric name, giving a new name the next id if
+ * create is set, or -1.  Only the main thread uses the ids. */
+static int
+metric_name_to_id( const char *name, int create )
+{
+  Ganglia_metric_name *m;
+
+  if (!metric_ids)
+    {
+      metric_ids = apr_hash_make(global_context);
+      metric_names = apr_array_make(global_context, 256, sizeof(Ganglia_metric_name *));
+      metric_free_ids = apr_array_make(global_context, 16, sizeof(int));
+    }
+  if (!name)
+    return -1;
+  m = apr_hash_get(metric_ids, name, APR_HASH_KEY_STRING);
+  if (m)
+    return m->id;
+  if (!create)
+    return -1;
+
+  m = calloc(1, sizeof(*m));
+  if (!m || !(m->name = strdup(name)))
+    {
+      free(m);
+      return -1;
+    }
+  if (metric_free_ids->nelts)
+    m->id = *(int *)apr_array_pop(metric_free_ids);
+  else
+    {
+      m->id = metric_names->nelts;
+      apr_array_push(metric_names);
+    }
+  ((Ganglia_metric_name **)metric_names->elts)[m->id] = m;
+  apr_hash_set(metric_ids, m->name, APR_HASH_KEY_STRING, m);
+  return m->id;
+}
+
+static const char *
+metric_id_to_name( int id )
+{
+  return ((Ganglia_metric_name **)metric_names->elts)[id]->name;
+}
+
+/* Counts a slot as a use of its metric name */
+static void
+metric_id_use( int id )
+{
+  ((Ganglia_metric_name **)metric_names->elts)[id]->users++;
+}
+
+/* Drops a use of a metric name, forgetting the name with its last use.
+ * Every host's slot for the id is empty by then, so the id can be given
+ * to another name. */
+static void
+metric_id_release( int id )
+{
+  Ganglia_metric_name *m = ((Ganglia_metric_name **)metric_names->elts)[id];
+
+  if (--m->users)
+    return;
+  apr_hash_set(metric_ids, m->name, APR_HASH_KEY_STRING, NULL);
+  ((Ganglia_metric_name **)metric_names->elts)[id] = NULL;
+  *(int *)apr_array_push(metric_free_ids) = id;
+  free(m->name);
+  free(m);
+}
+
+/* Returns the shared copy of a value format */
+static const char *
+Ganglia_metric_fmt( const char *fmt )
+{
+  char *f;
+
+  if (!fmt)
+    return NULL;
+  if (!metric_fmts)
+    metric_fmts = apr_hash_make(global_context);
+  f = apr_hash_get(metric_fmts, fmt, APR_HASH_KEY_STRING);
+  if (!f)
+    {
+      f = apr_pstrdup(global_context, fmt);
+      apr_hash_set(metric_fmts, f, APR_HASH_KEY_STRING, f);
+    }
+  return f;
+}
+
+static char *
+metric_def_strcpy( char **p, const char *s )
+{
+  apr_size_t len = strlen(s ? s : "") + 1;
+  char *d = *p;
+
+  memcpy(d, s ? s : "", len);
+  *p += len;
+  return d;
+}
+
+/* Returns the shared copy of a metric's metadata, with a reference for
+ * the caller, making it if no host has sent the same before. */
+static Ganglia_metric_def *
+Ganglia_metric_def_get( Ganglia_metadatadef *gfull )
+{
+  Ganglia_metadata_message *m = &(gfull->metric);
+  Ganglia_extra_data *extra = m->metadata.metadata_val;
+  Ganglia_metric_def *def;
+  char key[4096], *p;
+  apr_size_t len, size;
+  int shared;
+  u_int i;
+
+#define DEF_STR(s) (s ? s : "")
+  len = apr_snprintf(key, sizeof(key), "%s\001%d\001%s\001%s\001%s\001%u\001%u\001%u",
+                     DEF_STR(gfull->metric_id.name), gfull->metric_id.spoof,
+                     DEF_STR(m->type), DEF_STR(m->name), DEF_STR(m->units),
+                     m->slope, m->tmax, m->dmax);
+  for (i = 0; i < m->metadata.metadata_len && len < sizeof(key) - 1; i++)
+    len += apr_snprintf(key + len, sizeof(key) - len, "\001%s\001%s",
+                        DEF_STR(extra[i].name), DEF_STR(extra[i].data));
+  shared = len < sizeof(key) - 1;
+
+  if (!metric_defs)
+    metric_defs = apr_hash_make(global_context);
+  if (shared && (def = apr_hash_get(metric_defs, key, APR_HASH_KEY_STRING)))
+    {
+      def->refs++;
+      return def;
+    }
+
+  size = sizeof(*def) + m->metadata.metadata_len * sizeof(Ganglia_extra_data) +
+         strlen(DEF_STR(gfull->metric_id.name)) + strlen(DEF_STR(m->type)) +
+         strlen(DEF_STR(m->name)) + strlen(DEF_STR(m->units)) + 4 +
+         (shared ? len + 1 : 0);
+  for (i = 0; i < m->metadata.metadata_len; i++)
+    size += strlen(DEF_STR(extra[i].name)) + strlen(DEF_STR(extra[i].data)) + 2;
+#undef DEF_STR
+
+  def = malloc(size);
+  if (!def)
+    return NULL;
+  def->gfull = *gfull;
+  def->gfull.metric_id.host = NULL;
+  def->gfull.metric.metadata.metadata_val = (Ganglia_extra_data *)(def + 1);
+  p = (char *)(def->gfull.metric.metadata.metadata_val + m->metadata.metadata_len);
+  def->gfull.metric_id.name = metric_def_strcpy(&p, gfull->metric_id.name);
+  def->gfull.metric.type = metric_def_strcpy(&p, m->type);
+  def->gfull.metric.name = metric_def_strcpy(&p, m->name);
+  def->gfull.metric.units = metric_def_strcpy(&p, m->units);
+  for (i = 0; i < m->metadata.metadata_len; i++)
+    {
+      def->gfull.metric.metadata.metadata_val[i].name = metric_def_strcpy(&p, extra[i].name);
+      def->gfull.metric.metadata.metadata_val[i].data = metric_def_strcpy(&p, extra[i].data);
+    }
+  def->refs = 1;
+  def->key = NULL;
+  if (shared)
+    {
+      def->key = metric_def_strcpy(&p, key);
+      apr_hash_set(metric_defs, def->key, APR_HASH_KEY_STRING, def);
+    }
+  return def;
+}
+
+static void
+Ganglia_metric_def_release( Ganglia_metric_def *def )
+{
+  if (!def || --def->refs)
+    return;
+  if (def->key)
+    apr_hash_set(metric_defs, def->key, APR_HASH_KEY_STRING, NULL);
+  free(def);
+}
+
+/* Fills in a value message from a slot, to format or send on */
+static void
+Ganglia_metric_slot_value( Ganglia_metric_slot *slot, const char *name, Ganglia_value_msg *msg )
+{
+  msg->id = slot->type;
+  msg->Ganglia_value_msg_u.gstr.metric_id.host = NULL;
+  msg->Ganglia_value_msg_u.gstr.metric_id.name = (char *)name;
+  msg->Ganglia_value_msg_u.gstr.metric_id.spoof = slot->spoof;
+  msg->Ganglia_value_msg_u.gstr.fmt = (char *)slot->fmt;
+  switch(slot->type)
+    {
+    case gmetric_string:
+      msg->Ganglia_value_msg_u.gstr.str = slot->v.str;
+      break;
+    case gmetric_ushort:
+      msg->Ganglia_value_msg_u.gu_short.us = slot->v.us;
+      break;
+    case gmetric_short:
+      msg->Ganglia_value_msg_u.gs_short.ss = slot->v.ss;
+      break;
+    case gmetric_uint:
+      msg->Ganglia_value_msg_u.gu_int.ui = slot->v.ui;
+      break;
+    case gmetric_int:
+      msg->Ganglia_value_msg_u.gs_int.si = slot->v.si;
+      break;
+    case gmetric_float:
+      msg->Ganglia_value_msg_u.gf.f = slot->v.f;
+      break;
+    case gmetric_double:
+      msg->Ganglia_value_msg_u.gd.d = slot->v.d;
+      break;
+    default:
+      break;
+    }
+}
+
+/* Empties the slot of metric id, letting go of its name if nothing
+ * else uses it */
+static void
+Ganglia_metric_slot_clear( Ganglia_metric_slot *slot, int id )
+{
+  int used = slot->used;
+
+  Ganglia_metric_def_release(slot->def);
+  if (slot->type == gmetric_string)
+    free(slot->v.str);
+  memset(slot, 0, sizeof(*slot));
+  if (used)
+    metric_id_release(id);
+}
+
+/* Returns the slot of a host's metric, making room for it if create is
+ * set, or NULL.  The XML thread may be reading the slots, so they are
+ * moved with the host's mutex held. */
+static Ganglia_metric_slot *
+Ganglia_host_slot( Ganglia_host *host, const char *name, int create )
+{
+  Ganglia_metric_slot *slots;
+  int id = metric_name_to_id(name, create), n;
+
+  if (id < 0)
+    return NULL;
+  if (id < host->nslots)
+    {
+      slots = host->slots;
+      goto found;
+    }
+  if (!create)
+    return NULL;
+
+  /* Half again as many as it has, so a host adding metrics one by one
+   * does not copy its slots each time, but never past the ids in use */
+  n = host->nslots + host->nslots / 2;
+  if (n <= id)
+    n = id + 1;
+  if (n > metric_names->nelts)
+    n = metric_names->nelts;
+  apr_thread_mutex_lock(host->mutex);
+  slots = realloc(host->slots, n * sizeof(Ganglia_metric_slot));
+  if (slots)
+    {
+      memset(slots + host->nslots, 0, (n - host->nslots) * sizeof(Ganglia_metric_slot));
+      host->slots = slots;
+      host->nslots = n;
+    }
+  apr_thread_mutex_unlock(host->mutex);
+  if (!slots)
+    {
+      /* Forgets the name again if it was new */
+      metric_id_use(id);
+      metric_id_release(id);
+      return NULL;
+    }
+
+ found:
+  if (create && !slots[id].used)
+    {
+      slots[id].used = 1;
+      metric_id_use(id);
+    }
+  return &(slots[id]);
+}
+
+/* Frees a host's slots with its pool */
+static apr_status_t
+Ganglia_host_slots_free( void *data )
+{
+  Ganglia_host *host = data;
+  int i;
+
+  for (i = 0; i < host->nslots; i++)
+    Ganglia_metric_slot_clear(&(host->slots[i]), i);
+  free(host->slots);
+  host->slots = NULL;
+  host->nslots = 0;
+  return APR_SUCCESS;
+}
+
+/* Gives a host that went by its ip its name */
+static void
+Ganglia_host_rename(Ganglia_host *host, const char *hostname)
+{
+  char *name = apr_pstrdup(host->pool, hostname);
+
+  debug_msg("host %s is %s", host->ip, name);
+  apr_thread_mutex_lock(hosts_mutex);
+  host->hostname = name;
+  apr_thread_mutex_unlock(hosts_mutex);
+}
+
+static void
+Ganglia_host_resolved(void *arg, const char *ip, const char *hostname)
+{
+  Ganglia_host *host = apr_hash_get(hosts, ip, APR_HASH_KEY_STRING);
+
+  /* Unless it went away, or a spoofed name came in meanwhile */
+  if(host && !strcmp(host->hostname, host->ip))
+      Ganglia_host_rename(host, hostname);
+}
+
 Ganglia_host *
 Ganglia_host_get( char *remIP, apr_sockaddr_t *sa, Ganglia_metric_id *metric_id)
 {
@@ -1031,7 +1934,7 @@ Ganglia_host_get( char *remIP, apr_sockaddr_t *sa, Ganglia_metric_id *metric_id)
   if(!hostdata)
     {
       /* Lookup the hostname or use the proxy information if available */
-      if( !hostname )
+      if( !hostname && !resolver )
         {
           /* We'll use the resolver to find the hostname */
           status = apr_getnameinfo(&hostname, sa, 0);
@@ -1063,8 +1966,10 @@ Ganglia_host_get( char *remIP, apr_sockaddr_t *sa, Ganglia_metric_id *metric_id)
        * for this particular host */
       hostdata->pool = pool;
 
-      /* Save the hostname */
-      hostdata->hostname = apr_pstrdup( pool, hostname );
+      /* Save the hostname.  With resolver threads, go by the ip until
+       * they find the name rather than stall the receive thread on DNS */
+      if( hostname || !gm_resolver_lookup(resolver, remoteip, &hostdata->hostname, pool) )
+          hostdata->hostname = apr_pstrdup( pool, hostname ? hostname : remoteip );
 
       /* Dup the remoteip (it will be freed later) */
       hostdata->ip =  apr_pstrdup( pool, remoteip);
@@ -1083,23 +1988,10 @@ Ganglia_host_get( char *remIP, apr_sockaddr_t *sa, Ganglia_metric_id *metric_id)
           return NULL;
         }
 
-      /* Create a hash for the metric data */
-      hostdata->metrics = apr_hash_make( pool );
-      if(!hostdata->metrics)
-        {
-          if (buff) free(buff);
-          apr_pool_destroy(pool);
-          return NULL;
-        }
-
-      /* Create a hash for the gmetric data */
-      hostdata->gmetrics = apr_hash_make( pool );
-      if(!hostdata->gmetrics)
-        {
-          if (buff) free(buff);
-          apr_pool_destroy(pool);
-          return NULL;
-        }
+      /* The metric slots come as the metrics do, and go with the pool */
+      hostdata->slots = NULL;
+      hostdata->nslots = 0;
+      apr_pool_cleanup_register(pool, hostdata, Ganglia_host_slots_free, apr_pool_cleanup_null);
 
       /* Save this host data to the "hosts" hash */
       apr_thread_mutex_lock(hosts_mutex);
@@ -1110,6 +2002,11 @@ Ganglia_host_get( char *remIP, apr_sockaddr_t *sa, Ganglia_metric_id *metric_id)
     {
       /* We already have this host in our "hosts" hash update timestamp */
       hostdata->last_heard_from = apr_time_now();
+
+      /* A relay may have sent the ip until it had the name */
+      if(hostname && strcmp(hostname, hostdata->hostname) &&
+         !strcmp(hostdata->hostname, hostdata->ip))
+          Ganglia_host_rename(hostdata, hostname);
     }
 
   if (buff) free(buff);
@@ -1132,7 +2029,7 @@ Ganglia_update_vidals( Ganglia_host *host, Ganglia_value_msg *vmsg)
         /* We have to manage this memory here because.. returning NULL
          * will not cause Ganglia_message_save to be run.  Maybe this
          * could be done better later i.e should these metrics be
-         * in the host->metrics list instead of the host structure? */
+         * in the host's metric slots instead of the host structure? */
         if(host->location)
           {
             /* Free old location */
@@ -1163,145 +2060,212 @@ Ganglia_update_vidals( Ganglia_host *host, Ganglia_value_msg *vmsg)
     return;
 }
 
-void
-Ganglia_metadata_check(Ganglia_host *host, Ganglia_value_msg *vmsg )
+/* A token bucket: rate tokens a second, of which up to a second's worth
+ * are saved up.  A rate of 0 or less is no limit. */
+struct token_bucket {
+  int *rate;
+  double tokens;
+  apr_time_t last;
+};
+typedef struct token_bucket token_bucket;
+
+static token_bucket metadata_request_bucket = { &metadata_request_rate, 0, 0 };
+static token_bucket metadata_response_bucket = { &metadata_response_rate, 0, 0 };
+
+static int
+token_bucket_take( token_bucket *bucket, apr_time_t now )
 {
-    char *metric_name = vmsg->Ganglia_value_msg_u.gstr.metric_id.name;
-    int is_spoof_msg = vmsg->Ganglia_value_msg_u.gstr.metric_id.spoof;
-    Ganglia_metadata *metric = 
-        (Ganglia_metadata *)apr_hash_get(host->metrics, metric_name, APR_HASH_KEY_STRING);
-    
-    if(!metric)
-      {
-        int len;
-        XDR x;
-        char msgbuf[GANGLIA_MAX_MESSAGE_LEN];
-        char hostbuf[512];
-        Ganglia_metadata_msg msg;
+  int rate = *bucket->rate;
+
+  if (rate <= 0)
+      return 1;
+  if (!bucket->last)
+      bucket->tokens = rate;
+  else if (now > bucket->last)
+      bucket->tokens += (double)(now - bucket->last) * rate / APR_USEC_PER_SEC;
+  if (bucket->tokens > rate)
+      bucket->tokens = rate;
+  bucket->last = now;
+
+  if (bucket->tokens < 1)
+      return 0;
+  bucket->tokens -= 1;
+  return 1;
+}
 
-        msg.id = gmetadata_request;
-        if (is_spoof_msg) 
-            apr_snprintf(hostbuf, 512, "%s:%s", host->ip, host->hostname);
-        else
-            apr_snprintf(hostbuf, 512, "%s", host->hostname);
-        msg.Ganglia_metadata_msg_u.grequest.metric_id.host = hostbuf;
-        msg.Ganglia_metadata_msg_u.grequest.metric_id.name = metric_name;
-        msg.Ganglia_metadata_msg_u.grequest.metric_id.spoof = is_spoof_msg;
+/* When the bucket will next have a token */
+static apr_time_t
+token_bucket_next( token_bucket *bucket )
+{
+  int rate = *bucket->rate;
 
-        debug_msg("sending metadata request flag for metric: %s host: %s", metric_name, host->hostname);
-        ganglia_scoreboard_inc(PKTS_SENT_REQUEST);
-        ganglia_scoreboard_inc(PKTS_SENT_ALL);
+  if (rate <= 0 || bucket->tokens >= 1)
+      return bucket->last;
+  return bucket->last + (apr_time_t)((1 - bucket->tokens) * APR_USEC_PER_SEC / rate) + 1;
+}
 
-        /* Send the message */
-        xdrmem_create(&x, msgbuf, GANGLIA_MAX_MESSAGE_LEN, XDR_ENCODE);
-        if(!xdr_Ganglia_metadata_msg(&x, &msg))
-          {
-            return;
-          }
-        len = xdr_getpos(&x); 
-        /* Send the encoded data along...*/
-        Ganglia_udp_send_message( udp_send_channels, msgbuf, len);
-      }
+static int send_message( char *buf, int len );
 
-    return;
+static int
+Ganglia_metadata_request_send( Ganglia_metadata_msg *msg )
+{
+  int len;
+  XDR x;
+  char msgbuf[GANGLIA_MAX_MESSAGE_LEN];
+
+  xdrmem_create(&x, msgbuf, GANGLIA_MAX_MESSAGE_LEN, XDR_ENCODE);
+  if(!xdr_Ganglia_metadata_msg(&x, msg))
+    {
+      return 1;
+    }
+  len = xdr_getpos(&x); 
+
+  ganglia_scoreboard_inc(PKTS_SENT_REQUEST);
+  ganglia_scoreboard_inc(PKTS_SENT_ALL);
+  /* Send the encoded data along...*/
+  return send_message( msgbuf, len );
 }
 
-#if 0
+static int metadata_hosts_wanted = 0;
+
+/* The metadata of host is complete, or as complete as we are going to
+ * get it by asking */
 static void
-Ganglia_metadata_free( Ganglia_metadata *metric )
+Ganglia_metadata_recovered( Ganglia_host *host, apr_time_t now )
 {
-  if(!metric)
-    return;
-  apr_pool_destroy( metric->pool );
+  int secs;
+
+  if (!host->metadata_wanted)
+      return;
+
+  secs = (int)apr_time_sec(now - host->metadata_wanted);
+  debug_msg("metadata for host %s recovered after %d seconds", host->hostname, secs);
+  ganglia_scoreboard_set(METADATA_RECOVERY_SECS, secs);
+  ganglia_scoreboard_set(HOSTS_METADATA_WANTED, --metadata_hosts_wanted);
+  host->metadata_wanted = 0;
+}
+
+/* Asks a host for all of its metadata when it sends a value we have no
+ * metadata for, once a host_tmax at most, since the answer may take a
+ * while to come in full.  The host is taken to be recovered when it says
+ * it has sent everything, or when it has sent no such value for a
+ * host_tmax. */
+static void
+Ganglia_metadata_check_host( Ganglia_host *host, Ganglia_value_msg *vmsg, int known )
+{
+  apr_time_t now = apr_time_now();
+  apr_time_t retry = apr_time_from_sec(host_tmax);
+  Ganglia_metadata_msg msg;
+
+  if (known)
+    {
+      if (host->metadata_wanted && now - host->metadata_missed >= retry)
+          Ganglia_metadata_recovered(host, now);
+      return;
+    }
+
+  host->metadata_missed = now;
+  if (!host->metadata_wanted)
+    {
+      host->metadata_wanted = now;
+      ganglia_scoreboard_set(HOSTS_METADATA_WANTED, ++metadata_hosts_wanted);
+    }
+  if (host->metadata_asked && now - host->metadata_asked < retry)
+      return;
+  if (!token_bucket_take(&metadata_request_bucket, now))
+    {
+      ganglia_scoreboard_inc(PKTS_REQUEST_LIMITED);
+      return;
+    }
+
+  /* Ask by the name it gives itself, which it can match */
+  msg.id = gmetadata_request_host;
+  msg.Ganglia_metadata_msg_u.grequest_host.host = vmsg->Ganglia_value_msg_u.gstr.metric_id.host;
+
+  debug_msg("sending metadata request for host: %s", host->hostname);
+  Ganglia_metadata_request_send(&msg);
+  host->metadata_asked = now;
 }
-#endif
 
 void
-Ganglia_metadata_save( Ganglia_host *host, Ganglia_metadata_msg *message )
+Ganglia_metadata_check(Ganglia_host *host, Ganglia_value_msg *vmsg )
 {
-    /* Search for the Ganglia_metadata in the Ganglia_host */
-    sanitize_metric_name(message->Ganglia_metadata_msg_u.gfull.metric_id.name, message->Ganglia_metadata_msg_u.gfull.metric_id.spoof);
-    Ganglia_metadata *metric = 
-        (Ganglia_metadata *)apr_hash_get(host->metrics, 
-                                         message->Ganglia_metadata_msg_u.gfull.metric_id.name,
-                                         APR_HASH_KEY_STRING);
-    if(!host || !message)
-        return;
-    
-    if(metric)
+    char *metric_name = vmsg->Ganglia_value_msg_u.gstr.metric_id.name;
+    int is_spoof_msg = vmsg->Ganglia_value_msg_u.gstr.metric_id.spoof;
+    Ganglia_metric_slot *slot = Ganglia_host_slot(host, metric_name, 0);
+    int have_metadata = slot && slot->def;
+
+    if (metadata_bulk)
       {
-        apr_pool_clear(metric->pool);
+        Ganglia_metadata_check_host(host, vmsg, have_metadata);
+        return;
       }
-    else
+    
+    if(!have_metadata)
       {
-        apr_status_t status;
+        char hostbuf[512];
+        Ganglia_metadata_msg msg;
 
-        /* This is a new metric sent from this host... allocate space for this data */
-        
-        /* Allocate a new metric from this context */
-        metric = apr_pcalloc(host->pool, sizeof(Ganglia_metadata));
-        if(!metric)
+        if (!token_bucket_take(&metadata_request_bucket, apr_time_now()))
+          {
+            ganglia_scoreboard_inc(PKTS_REQUEST_LIMITED);
             return;
+          }
 
-        /* Create the context for this metric */
-        status = apr_pool_create(&(metric->pool), host->pool);
-        if(status != APR_SUCCESS)
-            return;
+        msg.id = gmetadata_request;
+        if (is_spoof_msg) 
+            apr_snprintf(hostbuf, 512, "%s:%s", host->ip, host->hostname);
+        else
+            apr_snprintf(hostbuf, 512, "%s", host->hostname);
+        msg.Ganglia_metadata_msg_u.grequest.metric_id.host = hostbuf;
+        msg.Ganglia_metadata_msg_u.grequest.metric_id.name = metric_name;
+        msg.Ganglia_metadata_msg_u.grequest.metric_id.spoof = is_spoof_msg;
 
-        debug_msg("***Allocating metadata packet for host--%s-- and metric --%s-- ****\n", host->hostname, message->Ganglia_metadata_msg_u.gfull.metric_id.name);
-    }
-    
-    if(metric)
-      {
-        Ganglia_metadata_msg *fmessage = &(metric->message_u.f_message);
-        u_int i,mlen = message->Ganglia_metadata_msg_u.gfull.metric.metadata.metadata_len;
-        
-        metric->name = apr_pstrdup(metric->pool, message->Ganglia_metadata_msg_u.gfull.metric_id.name);
-        fmessage->id = message->id;
-        fmessage->Ganglia_metadata_msg_u.gfull.metric_id.host = 
-            apr_pstrdup(metric->pool, message->Ganglia_metadata_msg_u.gfull.metric_id.host);
-        fmessage->Ganglia_metadata_msg_u.gfull.metric_id.name = 
-            apr_pstrdup(metric->pool, message->Ganglia_metadata_msg_u.gfull.metric_id.name);
-        fmessage->Ganglia_metadata_msg_u.gfull.metric_id.spoof = 
-            message->Ganglia_metadata_msg_u.gfull.metric_id.spoof;
-        fmessage->Ganglia_metadata_msg_u.gfull.metric.type = 
-            apr_pstrdup(metric->pool, message->Ganglia_metadata_msg_u.gfull.metric.type);
-        fmessage->Ganglia_metadata_msg_u.gfull.metric.name = 
-            apr_pstrdup(metric->pool, message->Ganglia_metadata_msg_u.gfull.metric.name);
-        fmessage->Ganglia_metadata_msg_u.gfull.metric.units = 
-            apr_pstrdup(metric->pool, message->Ganglia_metadata_msg_u.gfull.metric.units);
-        fmessage->Ganglia_metadata_msg_u.gfull.metric.slope = 
-            message->Ganglia_metadata_msg_u.gfull.metric.slope;
-        fmessage->Ganglia_metadata_msg_u.gfull.metric.tmax = 
-            message->Ganglia_metadata_msg_u.gfull.metric.tmax;
-        fmessage->Ganglia_metadata_msg_u.gfull.metric.dmax = 
-            message->Ganglia_metadata_msg_u.gfull.metric.dmax;
-        fmessage->Ganglia_metadata_msg_u.gfull.metric.metadata.metadata_len = mlen;
-        
-        fmessage->Ganglia_metadata_msg_u.gfull.metric.metadata.metadata_val = 
-            apr_pcalloc(metric->pool, sizeof(Ganglia_extra_data)*mlen);
-        for (i = 0; i < mlen; i++) 
-          {
-            fmessage->Ganglia_metadata_msg_u.gfull.metric.metadata.metadata_val[i].name = 
-                apr_pstrdup(metric->pool, 
-                            message->Ganglia_metadata_msg_u.gfull.metric.metadata.metadata_val[i].name);
-            fmessage->Ganglia_metadata_msg_u.gfull.metric.metadata.metadata_val[i].data = 
-                apr_pstrdup(metric->pool, 
-                            message->Ganglia_metadata_msg_u.gfull.metric.metadata.metadata_val[i].data);
-          }
-    
-        metric->last_heard_from = apr_time_now();
-    
-        /* Save the full metric */
-        apr_thread_mutex_lock(host->mutex);
-        apr_hash_set(host->metrics, metric->name, APR_HASH_KEY_STRING, metric);
-        apr_thread_mutex_unlock(host->mutex);
-        debug_msg("saving metadata for metric: %s host: %s", metric->name, host->hostname);
+        debug_msg("sending metadata request flag for metric: %s host: %s", metric_name, host->hostname);
+        Ganglia_metadata_request_send(&msg);
       }
+
+    return;
 }
 
+void
+Ganglia_metadata_save( Ganglia_host *host, Ganglia_metadata_msg *message )
+{
+    Ganglia_metric_slot *slot;
+    Ganglia_metric_def *def, *old;
+    char *name;
+
+    if(!host || !message)
+        return;
+
+    /* Search for the metric's slot in the Ganglia_host */
+    name = message->Ganglia_metadata_msg_u.gfull.metric_id.name;
+    sanitize_metric_name(name, message->Ganglia_metadata_msg_u.gfull.metric_id.spoof);
+    slot = Ganglia_host_slot(host, name, 1);
+    if(!slot)
+        return;
+    if(!slot->def)
+        debug_msg("***Allocating metadata packet for host--%s-- and metric --%s-- ****\n", host->hostname, name);
+
+    /* The same metadata from another host is shared */
+    def = Ganglia_metric_def_get(&(message->Ganglia_metadata_msg_u.gfull));
+    if(!def)
+        return;
+
+    /* Save the full metric */
+    apr_thread_mutex_lock(host->mutex);
+    old = slot->def;
+    slot->def = def;
+    slot->def_heard_from = apr_time_now();
+    apr_thread_mutex_unlock(host->mutex);
+    Ganglia_metric_def_release(old);
+    debug_msg("saving metadata for metric: %s host: %s", name, host->hostname);
+}
+
+static void Ganglia_metadata_queue( Ganglia_metric_callback *cb, int full, apr_time_t now );
+
 static void
-Ganglia_metadata_request( Ganglia_host *host, Ganglia_metadata_msg *message )
+Ganglia_metadata_request( Ganglia_host *host, Ganglia_metadata_msg *message, apr_time_t now )
 {
   char *name = message->Ganglia_metadata_msg_u.grequest.metric_id.name;
   Ganglia_metric_callback *metric_cb;
@@ -1321,186 +2285,178 @@ Ganglia_metadata_request( Ganglia_host *host, Ganglia_metadata_msg *message )
   if(!host || !message)
     return;
 
-  if (metric_cb) 
-      metric_cb->metadata_last_sent = 0;
-  debug_msg("setting metadata request flag for metric: %s host: %s", name, host->hostname);
+  /* Answered at metadata_response_rate, as requests for a whole host
+   * are: every gmond that missed a packet asks at once */
+  if (metric_cb && !mute)
+    {
+      Ganglia_metadata_queue(metric_cb, 1, now);
+      debug_msg("queued metadata for metric: %s host: %s", name, host->hostname);
+    }
 }
 
-void
-Ganglia_value_save( Ganglia_host *host, Ganglia_value_msg *message )
+/* The metrics whose metadata was asked for, in the order they go out,
+ * and the next one to go */
+static apr_array_header_t *metadata_queue = NULL;
+static int metadata_queue_next = 0;
+
+/* Do not answer again for metadata sent in the last few seconds: the
+ * other aggregators that asked have had it too */
+#define METADATA_BULK_HOLDOFF apr_time_from_sec(5)
+
+/* Queues the metadata of cb to go out in a gmetadata_full packet if full,
+ * for gmonds that asked with gmetadata_request, or else in a
+ * gmetadata_bulk one */
+static void
+Ganglia_metadata_queue( Ganglia_metric_callback *cb, int full, apr_time_t now )
 {
-    /* Search for the Ganglia_metric in the Ganglia_host */
-    Ganglia_metadata *metric = 
-        (Ganglia_metadata *)apr_hash_get( host->gmetrics,
-                                        message->Ganglia_value_msg_u.gstr.metric_id.name,
-                                        APR_HASH_KEY_STRING);
-  if(!host || !message)
-    return;
+  /* Older gmonds ignore gmetadata_bulk packets */
+  if (cb->metadata_queued && full)
+      cb->metadata_full = 1;
+  if (cb->metadata_queued || cb->info->type == GANGLIA_VALUE_UNKNOWN)
+      return;
+  if (cb->metadata_last_sent && now - cb->metadata_last_sent < METADATA_BULK_HOLDOFF)
+      return;
+  if (!metadata_queue)
+      metadata_queue = apr_array_make(global_context, 64, sizeof(Ganglia_metric_callback *));
+  cb->metadata_queued = 1;
+  cb->metadata_full = full;
+  *(Ganglia_metric_callback **)apr_array_push(metadata_queue) = cb;
+}
 
-  if(metric)
-    {
-      apr_pool_clear(metric->pool);
-    }
-  else
-    {
-      apr_status_t status;
+static void
+Ganglia_metadata_request_host( char *host, apr_time_t now )
+{
+  int i, j, queued = 0;
+
+  if (!metadata_bulk || mute)
+      return;
 
-      /* This is a new metric sent from this host... allocate space for this data */
+  for (i = 0; i < collection_groups->nelts; i++)
+    {
+      Ganglia_collection_group *group = ((Ganglia_collection_group **)(collection_groups->elts))[i];
 
-      /* Allocate a new metric from this context */
-      metric = apr_pcalloc(host->pool, sizeof(Ganglia_metadata));
-      if(!metric)
+      for (j = 0; j < group->metric_array->nelts; j++)
         {
-          /* no memory */
-          return;
+          Ganglia_metric_callback *cb = ((Ganglia_metric_callback **)(group->metric_array->elts))[j];
+
+          if (cb->metadata_queued || !cb->msg.Ganglia_value_msg_u.gstr.metric_id.host ||
+              strcmp(cb->msg.Ganglia_value_msg_u.gstr.metric_id.host, host))
+              continue;
+          Ganglia_metadata_queue(cb, 0, now);
+          if (cb->metadata_queued)
+              queued++;
         }
-
-      /* Create the context for this metric */
-      status = apr_pool_create(&(metric->pool), host->pool);
-      if(status != APR_SUCCESS)
-          return;
-
-      debug_msg("***Allocating value packet for host--%s-- and metric --%s-- ****\n", message->Ganglia_value_msg_u.gstr.metric_id.host, message->Ganglia_value_msg_u.gstr.metric_id.name );
     }
+  debug_msg("queued metadata of %d metrics for host: %s", queued, host);
+}
 
+/* Saves the metadata of a gmetadata_bulk packet as if each definition
+ * had come in a gmetadata_full packet of its own */
+static void
+Ganglia_metadata_bulk_save( char *remoteip, apr_sockaddr_t *remotesa, Ganglia_metadata_bulk *bulk, apr_time_t now )
+{
+  Ganglia_metadata_msg fmsg;
+  Ganglia_host *hostdata;
+  u_int i;
 
-  if(metric)
+  for (i = 0; i < bulk->defs.defs_len; i++)
     {
-      Ganglia_value_msg *vmessage = &(metric->message_u.v_message);
-
-      metric->name = apr_pstrdup(metric->pool, message->Ganglia_value_msg_u.gstr.metric_id.name );
-      vmessage->id = message->id;
-      vmessage->Ganglia_value_msg_u.gstr.metric_id.host = 
-          apr_pstrdup(metric->pool, message->Ganglia_value_msg_u.gstr.metric_id.host);
-      vmessage->Ganglia_value_msg_u.gstr.metric_id.name = 
-          apr_pstrdup(metric->pool, message->Ganglia_value_msg_u.gstr.metric_id.name);
-      vmessage->Ganglia_value_msg_u.gstr.metric_id.spoof = 
-          message->Ganglia_value_msg_u.gstr.metric_id.spoof;
-      vmessage->Ganglia_value_msg_u.gstr.fmt = 
-          apr_pstrdup(metric->pool, message->Ganglia_value_msg_u.gstr.fmt);
+      Ganglia_metadatadef *def = &(bulk->defs.defs_val[i]);
 
-      switch(message->id)
+      hostdata = Ganglia_host_get(remoteip, remotesa, &(def->metric_id));
+      if (!hostdata)
         {
-        case gmetric_string:
-          vmessage->Ganglia_value_msg_u.gstr.str = 
-              apr_pstrdup(metric->pool, message->Ganglia_value_msg_u.gstr.str);
-          break;
-        case gmetric_ushort:
-          vmessage->Ganglia_value_msg_u.gu_short.us = 
-              message->Ganglia_value_msg_u.gu_short.us;
-          break;
-        case gmetric_short:
-          vmessage->Ganglia_value_msg_u.gs_short.ss = 
-              message->Ganglia_value_msg_u.gs_short.ss;
-          break;
-        case gmetric_uint:
-          vmessage->Ganglia_value_msg_u.gu_int.ui = 
-              message->Ganglia_value_msg_u.gu_int.ui;
-          break;
-        case gmetric_int:
-          vmessage->Ganglia_value_msg_u.gs_int.si = 
-              message->Ganglia_value_msg_u.gs_int.si;
-          break;
-        case gmetric_float:
-          vmessage->Ganglia_value_msg_u.gf.f = 
-              message->Ganglia_value_msg_u.gf.f;
-          break;
-        case gmetric_double:
-          vmessage->Ganglia_value_msg_u.gd.d = 
-              message->Ganglia_value_msg_u.gd.d;
-          break;
-        default:
-          break;
+          ganglia_scoreboard_inc(PKTS_RECVD_FAILED);
+          continue;
         }
+      fmsg.id = gmetadata_full;
+      fmsg.Ganglia_metadata_msg_u.gfull = *def;
+      Ganglia_metadata_save( hostdata, &fmsg );
+      if (!bulk->more)
+          Ganglia_metadata_recovered(hostdata, now);
+    }
+}
+
+void
+Ganglia_value_save( Ganglia_host *host, Ganglia_value_msg *message )
+{
+  Ganglia_metric_slot *slot;
+  const char *fmt;
+  char *str = NULL, *old = NULL;
 
-      metric->last_heard_from = apr_time_now();
+  if(!host || !message)
+    return;
 
-      /* Save the last update metric */
-      apr_thread_mutex_lock(host->mutex);
-      apr_hash_set(host->gmetrics, metric->name, APR_HASH_KEY_STRING, metric);
-      apr_thread_mutex_unlock(host->mutex);
+  /* Search for the metric's slot in the Ganglia_host */
+  slot = Ganglia_host_slot(host, message->Ganglia_value_msg_u.gstr.metric_id.name, 1);
+  if(!slot)
+    return;
+  if(!slot->value_heard_from)
+      debug_msg("***Allocating value packet for host--%s-- and metric --%s-- ****\n", message->Ganglia_value_msg_u.gstr.metric_id.host, message->Ganglia_value_msg_u.gstr.metric_id.name );
+
+  fmt = Ganglia_metric_fmt(message->Ganglia_value_msg_u.gstr.fmt);
+  if(message->id == gmetric_string && message->Ganglia_value_msg_u.gstr.str)
+    {
+      /* Strings mostly stay the same */
+      if(slot->type == gmetric_string && slot->v.str &&
+         !strcmp(slot->v.str, message->Ganglia_value_msg_u.gstr.str))
+          str = slot->v.str;
+      else if(!(str = strdup(message->Ganglia_value_msg_u.gstr.str)))
+          return;
     }
+
+  /* Save the last update metric */
+  apr_thread_mutex_lock(host->mutex);
+  if(slot->type == gmetric_string && slot->v.str != str)
+      old = slot->v.str;
+  memset(&(slot->v), 0, sizeof(slot->v));
+  slot->type = message->id;
+  slot->spoof = message->Ganglia_value_msg_u.gstr.metric_id.spoof;
+  slot->fmt = fmt;
+  switch(message->id)
+    {
+    case gmetric_string:
+      slot->v.str = str;
+      break;
+    case gmetric_ushort:
+      slot->v.us = message->Ganglia_value_msg_u.gu_short.us;
+      break;
+    case gmetric_short:
+      slot->v.ss = message->Ganglia_value_msg_u.gs_short.ss;
+      break;
+    case gmetric_uint:
+      slot->v.ui = message->Ganglia_value_msg_u.gu_int.ui;
+      break;
+    case gmetric_int:
+      slot->v.si = message->Ganglia_value_msg_u.gs_int.si;
+      break;
+    case gmetric_float:
+      slot->v.f = message->Ganglia_value_msg_u.gf.f;
+      break;
+    case gmetric_double:
+      slot->v.d = message->Ganglia_value_msg_u.gd.d;
+      break;
+    default:
+      break;
+    }
+  slot->value_heard_from = apr_time_now();
+  apr_thread_mutex_unlock(host->mutex);
+  free(old);
 }
 
+/* Saves a message from remoteip, whichever channel it came in on */
 static void
-process_udp_recv_channel(const apr_pollfd_t *desc, apr_time_t now)
+process_message(char *buf, apr_size_t len, char *remoteip, apr_sockaddr_t *remotesa, apr_time_t now)
 {
-  apr_status_t status;
-  apr_socket_t *socket;
-  apr_sockaddr_t *remotesa = NULL;
-#ifdef SFLOW
-  uint16_t localport;
-  char *errorMsg = NULL;
-#endif
-  char  remoteip[256];
-  char buf[max_udp_message_len];
-  apr_size_t len = max_udp_message_len;
-  Ganglia_channel *channel;
   XDR x;
   Ganglia_metadata_msg fmsg;
   Ganglia_value_msg vmsg;
   Ganglia_host *hostdata = NULL;
-  apr_pool_t *p = NULL;
   Ganglia_msg_formats id;
   bool_t ret;
 
-  socket         = desc->desc.s;
-  /* We could also use the apr_socket_data_get/set() functions
-   * to have per socket user data .. see APR docs */
-  channel       = desc->client_data;
-
-  /* We need to create a copy of the local sockaddr so that the
-     recvfrom call has a place holder to put the remote information.
-     Getting the remote sockaddr might not work since a SOCK_DGRAM
-     type socket is connectionless. */
-  apr_pool_create(&p, global_context);
-  status = apr_socket_addr_get(&remotesa, APR_LOCAL, socket);
-#ifdef SFLOW
-  /* remember this before it gets overwritten */
-  localport = remotesa->port;
-#endif
-  status = apr_sockaddr_info_get(&remotesa, NULL, remotesa->family, remotesa->port, 0, p);
-
-  /* Grab the data */
-  status = apr_socket_recvfrom(remotesa, socket, 0, buf, &len);
-  if(status != APR_SUCCESS)
-    {
-      apr_pool_destroy(p);
-      return;
-    }  
-
-  /* This function is in ./lib/apr_net.c and not APR. The
-   * APR counterpart is apr_sockaddr_ip_get() but we don't 
-   * want to malloc memory evertime we call this */
-  apr_sockaddr_ip_buffer_get(remoteip, 256, remotesa);
-
-  /* Check the ACL */
-  if(Ganglia_acl_action( channel->acl, remotesa) != GANGLIA_ACCESS_ALLOW)
-    {
-      apr_pool_destroy(p);
-      return;
-    }
-
-  ganglia_scoreboard_inc(PKTS_RECVD_ALL);
-
-#ifdef SFLOW
-  if(localport == sflow_udp_port) {
-    if(process_sflow_datagram(remotesa, buf, len, now, &errorMsg)) {
-      ganglia_scoreboard_inc(PKTS_RECVD_VALUE);
-    }
-    else {
-      if(errorMsg) {
-	debug_msg("sFlow error: %s", errorMsg);
-      }
-      ganglia_scoreboard_inc(PKTS_RECVD_FAILED);
-    }
-    apr_pool_destroy(p);
-    return;
-  }
-#endif
-
   /* Create the XDR receive stream */
-  xdrmem_create(&x, buf, max_udp_message_len, XDR_DECODE);
+  xdrmem_create(&x, buf, len, XDR_DECODE);
 
   /* Flush the data... */
   memset( &fmsg, 0, sizeof(Ganglia_metadata_msg));
@@ -1528,7 +2484,33 @@ process_udp_recv_channel(const apr_pollfd_t *desc, apr_time_t now)
           break;
         }
       debug_msg("Processing a metric metadata request message from %s", hostdata->hostname);
-      Ganglia_metadata_request(hostdata, &fmsg);
+      Ganglia_metadata_request(hostdata, &fmsg, now);
+      xdr_free((xdrproc_t)xdr_Ganglia_metadata_msg, (char *)&fmsg);
+      break;
+    case gmetadata_request_host:
+      ganglia_scoreboard_inc(PKTS_RECVD_REQUEST);
+      ret = xdr_Ganglia_metadata_msg(&x, &fmsg);
+      if(!ret)
+        {
+          ganglia_scoreboard_inc(PKTS_RECVD_FAILED);
+          xdr_free((xdrproc_t)xdr_Ganglia_metadata_msg, (char *)&fmsg);
+          break;
+        }
+      debug_msg("Processing a host metadata request message from %s", remoteip);
+      Ganglia_metadata_request_host(fmsg.Ganglia_metadata_msg_u.grequest_host.host, now);
+      xdr_free((xdrproc_t)xdr_Ganglia_metadata_msg, (char *)&fmsg);
+      break;
+    case gmetadata_bulk:
+      ganglia_scoreboard_inc(PKTS_RECVD_BULK);
+      ret = xdr_Ganglia_metadata_msg(&x, &fmsg);
+      if(!ret)
+        {
+          ganglia_scoreboard_inc(PKTS_RECVD_FAILED);
+          xdr_free((xdrproc_t)xdr_Ganglia_metadata_msg, (char *)&fmsg);
+          break;
+        }
+      debug_msg("Processing a bulk metadata message from %s", remoteip);
+      Ganglia_metadata_bulk_save(remoteip, remotesa, &(fmsg.Ganglia_metadata_msg_u.gbulk), now);
       xdr_free((xdrproc_t)xdr_Ganglia_metadata_msg, (char *)&fmsg);
       break;
     case gmetadata_full:
@@ -1577,107 +2559,324 @@ process_udp_recv_channel(const apr_pollfd_t *desc, apr_time_t now)
       ganglia_scoreboard_inc(PKTS_RECVD_IGNORED);
       break;
   }
+}
 
+static void
+process_udp_recv_channel(const apr_pollfd_t *desc, apr_time_t now)
+{
+  apr_status_t status;
+  apr_socket_t *socket;
+  apr_sockaddr_t *remotesa = NULL;
+#ifdef SFLOW
+  uint16_t localport;
+  char *errorMsg = NULL;
+#endif
+  char  remoteip[256];
+  char buf[max_udp_message_len];
+  apr_size_t len = max_udp_message_len;
+  Ganglia_channel *channel;
+  apr_pool_t *p = NULL;
+
+  socket         = desc->desc.s;
+  /* We could also use the apr_socket_data_get/set() functions
+   * to have per socket user data .. see APR docs */
+  channel       = desc->client_data;
+
+  /* We need to create a copy of the local sockaddr so that the
+     recvfrom call has a place holder to put the remote information.
+     Getting the remote sockaddr might not work since a SOCK_DGRAM
+     type socket is connectionless. */
+  apr_pool_create(&p, global_context);
+  status = apr_socket_addr_get(&remotesa, APR_LOCAL, socket);
+#ifdef SFLOW
+  /* remember this before it gets overwritten */
+  localport = remotesa->port;
+#endif
+  status = apr_sockaddr_info_get(&remotesa, NULL, remotesa->family, remotesa->port, 0, p);
+
+  /* Grab the data */
+  status = apr_socket_recvfrom(remotesa, socket, 0, buf, &len);
+  if(status != APR_SUCCESS)
+    {
+      apr_pool_destroy(p);
+      return;
+    }  
+
+  /* This function is in ./lib/apr_net.c and not APR. The
+   * APR counterpart is apr_sockaddr_ip_get() but we don't 
+   * want to malloc memory evertime we call this */
+  apr_sockaddr_ip_buffer_get(remoteip, 256, remotesa);
+
+  /* Check the ACL */
+  if(Ganglia_acl_action( channel->acl, remotesa) != GANGLIA_ACCESS_ALLOW)
+    {
+      apr_pool_destroy(p);
+      return;
+    }
+
+  ganglia_scoreboard_inc(PKTS_RECVD_ALL);
+
+#ifdef SFLOW
+  if(localport == sflow_udp_port) {
+    if(process_sflow_datagram(remotesa, buf, len, now, &errorMsg)) {
+      ganglia_scoreboard_inc(PKTS_RECVD_VALUE);
+    }
+    else {
+      if(errorMsg) {
+	debug_msg("sFlow error: %s", errorMsg);
+      }
+      ganglia_scoreboard_inc(PKTS_RECVD_FAILED);
+    }
+    apr_pool_destroy(p);
+    return;
+  }
+#endif
+
+  process_message(buf, len, remoteip, remotesa, now);
   apr_pool_destroy(p);
 
   return;
 }
 
-static z_stream *
-zstream_new()
+static apr_status_t
+tcp_stream_cleanup( void *data )
 {
-  int err;
+  free(data);
+  return APR_SUCCESS;
+}
+
+static void
+close_tcp_recv_stream( Ganglia_tcp_stream *stream )
+{
+  debug_msg("closing TCP stream from %s", stream->remoteip);
+  apr_pollset_remove(udp_listen_channels, &(stream->pollfd));
+  apr_socket_close(stream->pollfd.desc.s);
+  if(stream->prev)
+    stream->prev->next = stream->next;
+  else
+    stream->listener->streams = stream->next;
+  if(stream->next)
+    stream->next->prev = stream->prev;
+  stream->listener->connections--;
+  apr_pool_destroy(stream->pool);
+}
+
+static void
+process_tcp_recv_channel(const apr_pollfd_t *desc, apr_time_t now)
+{
+  Ganglia_channel *channel = desc->client_data;
+  Ganglia_channel *conn;
+  Ganglia_tcp_stream *stream;
+  apr_socket_t *client = NULL;
+  apr_pool_t *pool = NULL;
+
+  apr_pool_create(&pool, global_context);
+  if(apr_socket_accept(&client, desc->desc.s, pool) != APR_SUCCESS)
+    {
+      apr_pool_destroy(pool);
+      return;
+    }
+
+  stream = apr_pcalloc(pool, sizeof(Ganglia_tcp_stream));
+  apr_socket_addr_get(&(stream->remotesa), APR_REMOTE, client);
+  apr_sockaddr_ip_buffer_get(stream->remoteip, 256, stream->remotesa);
+
+  if(Ganglia_acl_action( channel->acl, stream->remotesa) != GANGLIA_ACCESS_ALLOW ||
+     channel->connections >= channel->max_connections)
+    {
+      debug_msg("refusing TCP stream from %s", stream->remoteip);
+      apr_socket_close(client);
+      apr_pool_destroy(pool);
+      return;
+    }
+
+  /* Make sure this socket never blocks */
+  apr_socket_timeout_set(client, 0);
+
+  stream->listener = channel;
+  stream->pool = pool;
+  stream->size = 8192;
+  stream->buf = malloc(stream->size);
+  if(!stream->buf)
+    {
+      apr_socket_close(client);
+      apr_pool_destroy(pool);
+      return;
+    }
+  apr_pool_cleanup_register(pool, stream->buf, tcp_stream_cleanup, apr_pool_cleanup_null);
+
+  conn = apr_pcalloc(pool, sizeof(Ganglia_channel));
+  conn->type = TCP_RECV_STREAM;
+  conn->acl = channel->acl;
+  conn->stream = stream;
+
+  stream->pollfd.desc_type   = APR_POLL_SOCKET;
+  stream->pollfd.reqevents   = APR_POLLIN;
+  stream->pollfd.desc.s      = client;
+  stream->pollfd.client_data = conn;
+  if(apr_pollset_add(udp_listen_channels, &(stream->pollfd)) != APR_SUCCESS)
+    {
+      err_msg("Failed to add TCP stream from %s to pollset.\n", stream->remoteip);
+      apr_socket_close(client);
+      apr_pool_destroy(pool);
+      return;
+    }
+  stream->next = channel->streams;
+  if(stream->next)
+    stream->next->prev = stream;
+  channel->streams = stream;
+  channel->connections++;
+  debug_msg("accepted TCP stream from %s", stream->remoteip);
+}
+
+/* Saves the messages of a compressed batch.  Returns -1 unless it
+ * uncompresses into whole messages. */
+static int
+process_tcp_batch(Ganglia_tcp_stream *stream, char *buf, apr_size_t len, apr_time_t now)
+{
+  char *out = NULL;
+  size_t outlen, off = 0;
+  const char *err = NULL;
+  uint32_t frame;
+
+  if(gm_decompress_max(gm_codec_detect(buf, len), buf, len, TCP_BATCH_MAX, &out, &outlen, &err))
+    {
+      debug_msg("cannot uncompress a batch from %s: %s", stream->remoteip, err);
+      return -1;
+    }
+
+  /* gm_decompress() mallocs out, so the messages are aligned as in
+   * the stream buffer */
+  while(outlen - off >= 4)
+    {
+      memcpy(&frame, out + off, 4);
+      frame = ntohl(frame);
+      if(!frame || frame > TCP_FRAME_MAX || outlen - off - 4 < frame)
+        break;
+      ganglia_scoreboard_inc(PKTS_RECVD_ALL);
+      process_message(out + off + 4, frame, stream->remoteip, stream->remotesa, now);
+      off += 4 + frame;
+    }
+  free(out);
+  return off == outlen ? 0 : -1;
+}
+
+/* Reads what has come in on a stream and saves each whole message */
+static void
+process_tcp_recv_stream(const apr_pollfd_t *desc, apr_time_t now)
+{
+  Ganglia_channel *conn = desc->client_data;
+  Ganglia_tcp_stream *stream = conn->stream;
+  apr_size_t len = stream->size - stream->len, off = 0;
+  apr_status_t status;
+  uint32_t frame, size;
+
+  status = apr_socket_recv(desc->desc.s, stream->buf + stream->len, &len);
+  if(APR_STATUS_IS_EAGAIN(status) && !len)
+      return;
+  if(status != APR_SUCCESS || !len)
+    {
+      close_tcp_recv_stream(stream);
+      return;
+    }
+  stream->len += len;
 
-  z_stream *strm = malloc(sizeof(z_stream));
-  if (strm == 0)
+  while(stream->len - off >= 4)
     {
-      return NULL;
+      memcpy(&frame, stream->buf + off, 4);
+      frame = ntohl(frame);
+      size = frame & ~TCP_FRAME_COMPRESSED;
+      if(!size || size > (frame & TCP_FRAME_COMPRESSED ? TCP_BATCH_MAX : TCP_FRAME_MAX))
+        {
+          err_msg("Bad frame of %u bytes from %s.  Closing the stream.\n", size, stream->remoteip);
+          ganglia_scoreboard_inc(PKTS_RECVD_FAILED);
+          close_tcp_recv_stream(stream);
+          return;
+        }
+      if(stream->len - off - 4 < size)
+        {
+          /* Make room for the rest of it */
+          if(4 + size > stream->size)
+            {
+              char *buf = realloc(stream->buf, 4 + size);
+              if(!buf)
+                {
+                  close_tcp_recv_stream(stream);
+                  return;
+                }
+              apr_pool_cleanup_kill(stream->pool, stream->buf, tcp_stream_cleanup);
+              apr_pool_cleanup_register(stream->pool, buf, tcp_stream_cleanup, apr_pool_cleanup_null);
+              stream->buf = buf;
+              stream->size = 4 + size;
+            }
+          break;
+        }
+      if(frame & TCP_FRAME_COMPRESSED)
+        {
+          if(process_tcp_batch(stream, stream->buf + off + 4, size, now))
+            {
+              err_msg("Bad batch from %s.  Closing the stream.\n", stream->remoteip);
+              ganglia_scoreboard_inc(PKTS_RECVD_FAILED);
+              close_tcp_recv_stream(stream);
+              return;
+            }
+        }
+      else
+        {
+          ganglia_scoreboard_inc(PKTS_RECVD_ALL);
+          process_message(stream->buf + off + 4, size, stream->remoteip, stream->remotesa, now);
+        }
+      off += 4 + size;
     }
 
-  strm->next_in   = 0;
-  strm->avail_in  = 0;
-  strm->next_out  = 0;
-  strm->avail_out = 0;
-  strm->zalloc    = 0;
-  strm->zfree     = 0;
-  strm->opaque    = 0;
-
-  /* Yes, 15 + 16 are 2 special magic values documented in zlib.h */
-  err = deflateInit2(strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
-  if (err != Z_OK)
+  /* Keep what is left of a message at the start, where messages are
+   * aligned as XDR reads them */
+  if(off)
     {
-      free( strm );
-      return NULL;
+      memmove(stream->buf, stream->buf + off, stream->len - off);
+      stream->len -= off;
     }
-
-  return strm;
 }
 
 static apr_status_t
 socket_flush( apr_socket_t *client )
 {
-  char outputbuffer[2048];
-  const int outputlen = sizeof(outputbuffer);
-  int ret;
-  int status;
-  apr_size_t wlen;
-  z_stream *strm;
+  gm_compressor_t *c;
 
-  if (!args_info.gzip_output_flag)
+  if (apr_socket_data_get((void**)&c, COMPRESSOR_KEY, client) != APR_SUCCESS || !c)
     {
       return APR_SUCCESS;
     }
 
-  if (APR_SUCCESS == apr_socket_data_get((void**)&strm, GZIP_KEY, client))
+  if (gm_compressor_finish(c, socket_sink, client))
     {
-      while( 1 )
-	{
-	  strm->next_out  = (Bytef *)outputbuffer;
-	  strm->avail_out = outputlen;
-
-	  ret = deflate( strm, Z_FINISH );
-	  if (ret != Z_OK && ret != Z_STREAM_END)
-	    {
-	      return APR_ENOMEM;
-	    }
-
-	  wlen = outputlen - strm->avail_out;
-	  status = socket_send_raw( client, outputbuffer, &wlen );
-	  if(status != APR_SUCCESS)
-	    return status;
-
-	  if(ret == Z_STREAM_END)
-	    return APR_SUCCESS;
-	}
+      return APR_EGENERAL;
     }
   return APR_SUCCESS;
 }
 
-static void
-zstream_destroy( z_stream *strm )
+static apr_status_t
+compressor_cleanup( void *data )
 {
-  if (strm)
-    {
-      deflateEnd(strm);
-      free (strm);
-    }
+  gm_compressor_free(data);
+  return APR_SUCCESS;
 }
 
 static apr_status_t
-print_xml_header( apr_socket_t *client )
+print_xml_header( apr_socket_t *client, int compact )
 {
   apr_status_t status;
-  apr_size_t len = strlen(DTD);
+  const char *dtd = compact ? DTD_COMPACT : DTD;
+  apr_size_t len = strlen(dtd);
   char gangliaxml[128];
   char clusterxml[1024];
-  static int clusterinit = 0;
   static char *name = NULL;
   static char *owner = NULL;
   static char *latlong = NULL;
   static char *url = NULL;
   apr_time_t now = apr_time_now();
 
-  status = socket_send( client, DTD, &len );
+  status = socket_send( client, dtd, &len );
   if(status != APR_SUCCESS)
     return status;
 
@@ -1805,34 +3004,46 @@ host_metric_value( Ganglia_25metric *metric, Ganglia_value_msg *message )
     case GANGLIA_VALUE_STRING:
       return message->Ganglia_value_msg_u.gstr.str;
     case GANGLIA_VALUE_UNSIGNED_SHORT:
-      apr_snprintf(value, 1024, metric->fmt, message->Ganglia_value_msg_u.gu_short.us);
+      if (gm_format_int(value, 1024, metric->fmt,
+            message->Ganglia_value_msg_u.gu_short.us) < 0)
+        apr_snprintf(value, 1024, metric->fmt, message->Ganglia_value_msg_u.gu_short.us);
       return value;
     case GANGLIA_VALUE_SHORT:
       /* For right now.. there are no metrics which are signed shorts... use u_short */
-      apr_snprintf(value, 1024, metric->fmt, message->Ganglia_value_msg_u.gs_short.ss);
+      if (gm_format_int(value, 1024, metric->fmt,
+            message->Ganglia_value_msg_u.gs_short.ss) < 0)
+        apr_snprintf(value, 1024, metric->fmt, message->Ganglia_value_msg_u.gs_short.ss);
       return value;
     case GANGLIA_VALUE_UNSIGNED_INT:
-      apr_snprintf(value, 1024, metric->fmt, message->Ganglia_value_msg_u.gu_int.ui);
+      if (gm_format_int(value, 1024, metric->fmt,
+            (int) message->Ganglia_value_msg_u.gu_int.ui) < 0)
+        apr_snprintf(value, 1024, metric->fmt, message->Ganglia_value_msg_u.gu_int.ui);
       return value;
     case GANGLIA_VALUE_INT:
       /* For right now.. there are no metric which are signed ints... use u_int */
-      apr_snprintf(value, 1024, metric->fmt, message->Ganglia_value_msg_u.gs_int.si);
+      if (gm_format_int(value, 1024, metric->fmt,
+            message->Ganglia_value_msg_u.gs_int.si) < 0)
+        apr_snprintf(value, 1024, metric->fmt, message->Ganglia_value_msg_u.gs_int.si);
       return value;
     case GANGLIA_VALUE_FLOAT:
-      apr_snprintf(value, 1024, metric->fmt, message->Ganglia_value_msg_u.gf.f);
+      if (gm_format_double(value, 1024, metric->fmt,
+            message->Ganglia_value_msg_u.gf.f) < 0)
+        apr_snprintf(value, 1024, metric->fmt, message->Ganglia_value_msg_u.gf.f);
       return value;
     case GANGLIA_VALUE_DOUBLE:
-      apr_snprintf(value, 1024, metric->fmt, message->Ganglia_value_msg_u.gd.d);
+      if (gm_format_double(value, 1024, metric->fmt,
+            message->Ganglia_value_msg_u.gd.d) < 0)
+        apr_snprintf(value, 1024, metric->fmt, message->Ganglia_value_msg_u.gd.d);
       return value;
     }
 
   return "unknown";
 }
 
+/* Formats a value as the XML shows it, in value unless it is a string */
 static char *
-gmetric_value_to_str(Ganglia_value_msg *message)
+gmetric_value_format(Ganglia_value_msg *message, char *value, apr_size_t size)
 {
-  static char value[1024];
   if(!message)
     {
       return "unknown";
@@ -1843,44 +3054,179 @@ gmetric_value_to_str(Ganglia_value_msg *message)
     case gmetric_string:
       return message->Ganglia_value_msg_u.gstr.str;
     case gmetric_ushort:
-      apr_snprintf(value, 1024, message->Ganglia_value_msg_u.gu_short.fmt, message->Ganglia_value_msg_u.gu_short.us);
+      if (gm_format_int(value, size, message->Ganglia_value_msg_u.gu_short.fmt,
+            message->Ganglia_value_msg_u.gu_short.us) < 0)
+        apr_snprintf(value, size, message->Ganglia_value_msg_u.gu_short.fmt, message->Ganglia_value_msg_u.gu_short.us);
       return value;
     case gmetric_short:
       /* For right now.. there are no metrics which are signed shorts... use u_short */
-      apr_snprintf(value, 1024, message->Ganglia_value_msg_u.gs_short.fmt, message->Ganglia_value_msg_u.gs_short.ss);
+      if (gm_format_int(value, size, message->Ganglia_value_msg_u.gs_short.fmt,
+            message->Ganglia_value_msg_u.gs_short.ss) < 0)
+        apr_snprintf(value, size, message->Ganglia_value_msg_u.gs_short.fmt, message->Ganglia_value_msg_u.gs_short.ss);
       return value;
     case gmetric_uint:
-      apr_snprintf(value, 1024, message->Ganglia_value_msg_u.gu_int.fmt, message->Ganglia_value_msg_u.gu_int.ui);
+      if (gm_format_int(value, size, message->Ganglia_value_msg_u.gu_int.fmt,
+            (int) message->Ganglia_value_msg_u.gu_int.ui) < 0)
+        apr_snprintf(value, size, message->Ganglia_value_msg_u.gu_int.fmt, message->Ganglia_value_msg_u.gu_int.ui);
       return value;
     case gmetric_int:
       /* For right now.. there are no metric which are signed ints... use u_int */
-      apr_snprintf(value, 1024, message->Ganglia_value_msg_u.gs_int.fmt, message->Ganglia_value_msg_u.gs_int.si);
+      if (gm_format_int(value, size, message->Ganglia_value_msg_u.gs_int.fmt,
+            message->Ganglia_value_msg_u.gs_int.si) < 0)
+        apr_snprintf(value, size, message->Ganglia_value_msg_u.gs_int.fmt, message->Ganglia_value_msg_u.gs_int.si);
       return value;
     case gmetric_float:
-      apr_snprintf(value, 1024, message->Ganglia_value_msg_u.gf.fmt, message->Ganglia_value_msg_u.gf.f);
+      if (gm_format_double(value, size, message->Ganglia_value_msg_u.gf.fmt,
+            message->Ganglia_value_msg_u.gf.f) < 0)
+        apr_snprintf(value, size, message->Ganglia_value_msg_u.gf.fmt, message->Ganglia_value_msg_u.gf.f);
       return value;
     case gmetric_double:
-      apr_snprintf(value, 1024, message->Ganglia_value_msg_u.gd.fmt, message->Ganglia_value_msg_u.gd.d);
+      if (gm_format_double(value, size, message->Ganglia_value_msg_u.gd.fmt,
+            message->Ganglia_value_msg_u.gd.d) < 0)
+        apr_snprintf(value, size, message->Ganglia_value_msg_u.gd.fmt, message->Ganglia_value_msg_u.gd.d);
       return value;
     case gmetadata_full: 
     case gmetadata_request: 
+    case gmetadata_request_host: 
+    case gmetadata_bulk: 
     default:
       return "unknown";
     }
 }
 
+/* NOT THREAD SAFE */
+static char *
+gmetric_value_to_str(Ganglia_value_msg *message)
+{
+  static char value[1024];
+  return gmetric_value_format(message, value, sizeof(value));
+}
+
+/* Builds the METRIC_DEF signature of a metric for the compact XML dialect:
+ * everything we report about it except its value and TN.  Returns -1 if
+ * it does not fit in buf. */
+static int
+host_metric_signature( char *buf, apr_size_t size, const char *metricName, Ganglia_metadata_message *metric )
+{
+  apr_size_t len;
+  int i;
+
+  len = apr_snprintf(buf, size, "%s\001%s\001%s\001%d\001%d\001%d",
+                     metricName, metric->type, metric->units,
+                     metric->tmax, metric->dmax, metric->slope);
+  if (allow_extra_data)
+    {
+      for (i = 0; i < metric->metadata.metadata_len && len < size - 1; i++)
+        {
+          len += apr_snprintf(buf + len, size - len, "\001%s\001%s",
+                              metric->metadata.metadata_val[i].name,
+                              metric->metadata.metadata_val[i].data);
+        }
+    }
+  return len < size - 1 ? (int)len : -1;
+}
+
+/* Declares each distinct set of metric metadata once, before the hosts,
+ * for the compact XML dialect.  The caller holds the hosts_mutex. */
+static apr_status_t
+print_metric_defs( apr_socket_t *client, apr_hash_t *defs, apr_pool_t *pool )
+{
+  apr_hash_index_t *hi;
+  apr_status_t status = APR_SUCCESS;
+  char metricxml[1024];
+  char sig[2048];
+  apr_size_t len;
+  void *val;
+  int i;
+
+  for(hi = apr_hash_first(pool, hosts);
+      hi && status == APR_SUCCESS;
+      hi = apr_hash_next(hi))
+    {
+      Ganglia_host *host;
+
+      apr_hash_this(hi, NULL, NULL, &val);
+      host = (Ganglia_host *)val;
+
+      apr_thread_mutex_lock(host->mutex);
+      for(i = 0; i < host->nslots && status == APR_SUCCESS; i++)
+        {
+          Ganglia_metric_slot *slot = &(host->slots[i]);
+          Ganglia_metadata_message *metric;
+          char *metricName=NULL, *realName=NULL;
+          int extra_len, *id;
+
+          if (!slot->def || !slot->value_heard_from)
+            continue;
+
+          get_metric_names (&(slot->def->gfull.metric_id), &metricName, &realName);
+          if (realName) free(realName);
+          if (!metricName || (!strcasecmp(metricName, "heartbeat") || !strcasecmp(metricName, "location")))
+            {
+              if (metricName) free(metricName);
+              continue;
+            }
+
+          metric = &(slot->def->gfull.metric);
+          if (host_metric_signature(sig, sizeof(sig), metricName, metric) < 0 ||
+              apr_hash_get(defs, sig, APR_HASH_KEY_STRING))
+            {
+              free(metricName);
+              continue;
+            }
+
+          id = apr_palloc(pool, sizeof(int));
+          *id = apr_hash_count(defs);
+          apr_hash_set(defs, apr_pstrdup(pool, sig), APR_HASH_KEY_STRING, id);
+
+          len = apr_snprintf(metricxml, 1024,
+                  "<METRIC_DEF ID=\"%d\" NAME=\"%s\" TYPE=\"%s\" UNITS=\"%s\" TMAX=\"%d\" DMAX=\"%d\" SLOPE=\"%s\">\n",
+                      *id, metricName, metric->type, metric->units,
+                      metric->tmax, metric->dmax, slope_to_cstr(metric->slope));
+          free(metricName);
+
+          status = socket_send(client, metricxml, &len);
+          if ((status == APR_SUCCESS) && allow_extra_data)
+            {
+              len = apr_snprintf(metricxml, 1024, "<EXTRA_DATA>\n");
+              socket_send(client, metricxml, &len);
+              for (extra_len = metric->metadata.metadata_len; extra_len > 0; extra_len--)
+                {
+                  len = apr_snprintf(metricxml, 1024, "<EXTRA_ELEMENT NAME=\"%s\" VAL=\"%s\"/>\n",
+                         metric->metadata.metadata_val[extra_len-1].name,
+                         metric->metadata.metadata_val[extra_len-1].data);
+                  socket_send(client, metricxml, &len);
+                }
+              len = apr_snprintf(metricxml, 1024, "</EXTRA_DATA>\n");
+              socket_send(client, metricxml, &len);
+            }
+          if (status == APR_SUCCESS)
+            {
+              len = apr_snprintf(metricxml, 1024, "</METRIC_DEF>\n");
+              status = socket_send(client, metricxml, &len);
+            }
+        }
+      apr_thread_mutex_unlock(host->mutex);
+    }
+  return status;
+}
+
 static apr_status_t
-print_host_metric( apr_socket_t *client, Ganglia_metadata *data, Ganglia_metadata *val, apr_time_t now )
+print_host_metric( apr_socket_t *client, Ganglia_metric_slot *slot, apr_time_t now, apr_hash_t *defs )
 {
   char metricxml[1024];
   apr_size_t len;
   apr_status_t ret;
   char *metricName=NULL, *realName=NULL;
+  Ganglia_metadatadef *data;
+  Ganglia_value_msg val;
 
-  if (!data || !val)
+  if (!slot->def || !slot->value_heard_from)
       return APR_SUCCESS;
+  data = &(slot->def->gfull);
+  Ganglia_metric_slot_value(slot, data->metric_id.name, &val);
 
-  get_metric_names (&(data->message_u.f_message.Ganglia_metadata_msg_u.gfull.metric_id), &metricName, &realName);
+  get_metric_names (&(data->metric_id), &metricName, &realName);
 
   if (!metricName || (!strcasecmp(metricName, "heartbeat") || !strcasecmp(metricName, "location"))) 
     {
@@ -1888,17 +3234,36 @@ print_host_metric( apr_socket_t *client, Ganglia_metadata *data, Ganglia_metadat
       if (realName) free(realName);
       return APR_SUCCESS;
     }
+
+  if (defs)
+    {
+      char sig[2048];
+      int *id = NULL;
+
+      if (host_metric_signature(sig, sizeof(sig), metricName,
+            &(data->metric)) >= 0)
+        id = apr_hash_get(defs, sig, APR_HASH_KEY_STRING);
+      if (id)
+        {
+          len = apr_snprintf(metricxml, 1024, "<METRIC DEF=\"%d\" VAL=\"%s\" TN=\"%d\"/>\n",
+                  *id, gmetric_value_to_str(&val),
+                  (int)((now - slot->value_heard_from) / APR_USEC_PER_SEC));
+          free(metricName);
+          if (realName) free(realName);
+          return socket_send(client, metricxml, &len);
+        }
+    }
   
   len = apr_snprintf(metricxml, 1024,
           "<METRIC NAME=\"%s\" VAL=\"%s\" TYPE=\"%s\" UNITS=\"%s\" TN=\"%d\" TMAX=\"%d\" DMAX=\"%d\" SLOPE=\"%s\">\n",
               metricName,
-              gmetric_value_to_str(&(val->message_u.v_message)),
-              data->message_u.f_message.Ganglia_metadata_msg_u.gfull.metric.type,
-              data->message_u.f_message.Ganglia_metadata_msg_u.gfull.metric.units,
-              (int)((now - val->last_heard_from) / APR_USEC_PER_SEC),
-              data->message_u.f_message.Ganglia_metadata_msg_u.gfull.metric.tmax,
-              data->message_u.f_message.Ganglia_metadata_msg_u.gfull.metric.dmax,
-              slope_to_cstr(data->message_u.f_message.Ganglia_metadata_msg_u.gfull.metric.slope));
+              gmetric_value_to_str(&val),
+              data->metric.type,
+              data->metric.units,
+              (int)((now - slot->value_heard_from) / APR_USEC_PER_SEC),
+              data->metric.tmax,
+              data->metric.dmax,
+              slope_to_cstr(data->metric.slope));
 
   if (metricName) free(metricName);
   if (realName) free(realName);
@@ -1906,14 +3271,14 @@ print_host_metric( apr_socket_t *client, Ganglia_metadata *data, Ganglia_metadat
   ret = socket_send(client, metricxml, &len);
   if ((ret == APR_SUCCESS) && allow_extra_data) 
     {
-      int extra_len = data->message_u.f_message.Ganglia_metadata_msg_u.gfull.metric.metadata.metadata_len;
+      int extra_len = data->metric.metadata.metadata_len;
       len = apr_snprintf(metricxml, 1024, "<EXTRA_DATA>\n");
       socket_send(client, metricxml, &len);
       for (; extra_len > 0; extra_len--) 
         {
           len = apr_snprintf(metricxml, 1024, "<EXTRA_ELEMENT NAME=\"%s\" VAL=\"%s\"/>\n", 
-                 data->message_u.f_message.Ganglia_metadata_msg_u.gfull.metric.metadata.metadata_val[extra_len-1].name,
-                 data->message_u.f_message.Ganglia_metadata_msg_u.gfull.metric.metadata.metadata_val[extra_len-1].data);
+                 data->metric.metadata.metadata_val[extra_len-1].name,
+                 data->metric.metadata.metadata_val[extra_len-1].data);
           socket_send(client, metricxml, &len);
         }
         len = apr_snprintf(metricxml, 1024, "</EXTRA_DATA>\n");
@@ -1932,17 +3297,224 @@ print_host_end( apr_socket_t *client)
   return socket_send(client, "</HOST>\n", &len); 
 }
 
+/* A metric summed over the hosts that are up, as gmetad would sum it */
+struct Ganglia_summary_metric {
+  char *name;
+  char *type;   /* of the metric, which tells gmetad how to print the sum */
+  char *units;
+  unsigned int slope;
+  int precision;
+  double sum;
+  unsigned int num;
+  Ganglia_extra_data *extra;
+  u_int extra_len;
+};
+typedef struct Ganglia_summary_metric Ganglia_summary_metric;
+
+/* The summary of the cluster that goes before the hosts in the XML, so
+ * that gmetad need not sum the hosts itself.  The main loop works it out
+ * every summary_interval seconds. */
+struct Ganglia_summary {
+  apr_pool_t *pool;
+  unsigned int up, down;
+  apr_array_header_t *metrics;
+};
+typedef struct Ganglia_summary Ganglia_summary;
+
+/* The hosts_mutex guards this pointer */
+static Ganglia_summary *cluster_summary = NULL;
+
+/* Adds a host's value of a metric to its summary */
+static void
+Ganglia_summary_add( Ganglia_summary *summary, apr_hash_t *index, Ganglia_metric_slot *slot, apr_time_t now )
+{
+  Ganglia_metadatadef *def = &(slot->def->gfull);
+  Ganglia_summary_metric *metric;
+  Ganglia_value_msg val;
+  char *metricName = NULL, *realName = NULL;
+  char value[1024], *str, *p;
+  u_int i;
+
+  if (slot->type == gmetric_string ||
+      !strcmp(def->metric.type, "string") || !strcmp(def->metric.type, "timestamp"))
+    return;
+  /* gmetad leaves out what has gone past its dmax */
+  if (def->metric.dmax &&
+      (now - slot->value_heard_from) / APR_USEC_PER_SEC > def->metric.dmax)
+    return;
+
+  get_metric_names (&(def->metric_id), &metricName, &realName);
+  if (!metricName || !strcasecmp(metricName, "heartbeat") || !strcasecmp(metricName, "location"))
+    goto done;
+
+  metric = apr_hash_get(index, metricName, APR_HASH_KEY_STRING);
+  if (!metric)
+    {
+      metric = apr_pcalloc(summary->pool, sizeof(Ganglia_summary_metric));
+      metric->name = apr_pstrdup(summary->pool, metricName);
+      metric->type = apr_pstrdup(summary->pool, def->metric.type);
+      metric->units = apr_pstrdup(summary->pool, def->metric.units);
+      metric->slope = def->metric.slope;
+      if (allow_extra_data && def->metric.metadata.metadata_len)
+        {
+          metric->extra = apr_pcalloc(summary->pool,
+              def->metric.metadata.metadata_len * sizeof(Ganglia_extra_data));
+          for (i = 0; i < def->metric.metadata.metadata_len; i++)
+            {
+              Ganglia_extra_data *extra = &(def->metric.metadata.metadata_val[i]);
+
+              if (!strcasecmp(extra->name, SPOOF_HOST))
+                continue;
+              metric->extra[metric->extra_len].name = apr_pstrdup(summary->pool, extra->name);
+              metric->extra[metric->extra_len++].data = apr_pstrdup(summary->pool, extra->data);
+            }
+        }
+      apr_hash_set(index, metric->name, APR_HASH_KEY_STRING, metric);
+      *(Ganglia_summary_metric **)apr_array_push(summary->metrics) = metric;
+    }
+
+  /* Sum the value as the XML shows it, so that the sum is what gmetad
+   * would have made of the hosts */
+  Ganglia_metric_slot_value(slot, def->metric_id.name, &val);
+  str = gmetric_value_format(&val, value, sizeof(value));
+  metric->sum += gm_strtod(str, NULL);
+  metric->num++;
+  p = strrchr(str, '.');
+  if (p && (int)strlen(p + 1) > metric->precision)
+    metric->precision = strlen(p + 1);
+
+ done:
+  if (metricName) free(metricName);
+  if (realName) free(realName);
+}
+
+/* Works out the cluster summary again and puts it in place of the last */
+static void
+Ganglia_summary_update( apr_pool_t *pool, apr_time_t now )
+{
+  Ganglia_summary *summary, *old;
+  apr_pool_t *summary_pool;
+  apr_hash_index_t *hi;
+  apr_hash_t *index;
+  int i;
+
+  if (apr_pool_create(&summary_pool, global_context) != APR_SUCCESS)
+    return;
+  summary = apr_pcalloc(summary_pool, sizeof(Ganglia_summary));
+  summary->pool = summary_pool;
+  summary->metrics = apr_array_make(summary_pool, 64, sizeof(Ganglia_summary_metric *));
+  index = apr_hash_make(pool);
+
+  for(hi = apr_hash_first(pool, hosts); hi; hi = apr_hash_next(hi))
+    {
+      void *val;
+      Ganglia_host *host;
+
+      apr_hash_this(hi, NULL, NULL, &val);
+      host = val;
+
+      /* Up or down as gmetad tells from TN and TMAX */
+      if ((now - host->last_heard_from) / APR_USEC_PER_SEC >= host_tmax * 4)
+        {
+          summary->down++;
+          continue;
+        }
+      summary->up++;
+
+      for(i = 0; i < host->nslots; i++)
+        {
+          if (host->slots[i].def && host->slots[i].value_heard_from)
+            Ganglia_summary_add(summary, index, &(host->slots[i]), now);
+        }
+    }
+
+  apr_thread_mutex_lock(hosts_mutex);
+  old = cluster_summary;
+  cluster_summary = summary;
+  apr_thread_mutex_unlock(hosts_mutex);
+  if (old)
+    apr_pool_destroy(old->pool);
+
+  debug_msg("summarized %d metrics of %u hosts up and %u down",
+            summary->metrics->nelts, summary->up, summary->down);
+  apr_pool_clear(pool);
+}
+
+/* Stops showing the cluster summary, when it is no longer kept */
+static void
+Ganglia_summary_drop( void )
+{
+  Ganglia_summary *old;
+
+  apr_thread_mutex_lock(hosts_mutex);
+  old = cluster_summary;
+  cluster_summary = NULL;
+  apr_thread_mutex_unlock(hosts_mutex);
+  if (old)
+    apr_pool_destroy(old->pool);
+}
+
+/* Prints the cluster summary.  The caller holds the hosts_mutex. */
+static apr_status_t
+print_cluster_summary( apr_socket_t *client )
+{
+  char summaryxml[1024], sum[64];
+  apr_size_t len;
+  apr_status_t status;
+  int i;
+  u_int j;
+
+  if (!cluster_summary || !cluster_tag)
+    return APR_SUCCESS;
+
+  len = apr_snprintf(summaryxml, 1024, "<HOSTS UP=\"%u\" DOWN=\"%u\" SOURCE=\"gmond\"/>\n",
+                     cluster_summary->up, cluster_summary->down);
+  status = socket_send(client, summaryxml, &len);
+
+  for (i = 0; status == APR_SUCCESS && i < cluster_summary->metrics->nelts; i++)
+    {
+      Ganglia_summary_metric *metric = ((Ganglia_summary_metric **)(cluster_summary->metrics->elts))[i];
+
+      gm_format_fixed(sum, sizeof(sum), metric->sum, metric->precision);
+      len = apr_snprintf(summaryxml, 1024,
+              "<METRICS NAME=\"%s\" SUM=\"%s\" NUM=\"%u\" TYPE=\"%s\" UNITS=\"%s\" SLOPE=\"%s\" SOURCE=\"gmond\">\n",
+              metric->name, sum, metric->num, metric->type, metric->units, slope_to_cstr(metric->slope));
+      status = socket_send(client, summaryxml, &len);
+      if (status == APR_SUCCESS && metric->extra_len)
+        {
+          len = apr_snprintf(summaryxml, 1024, "<EXTRA_DATA>\n");
+          socket_send(client, summaryxml, &len);
+          for (j = 0; j < metric->extra_len; j++)
+            {
+              len = apr_snprintf(summaryxml, 1024, "<EXTRA_ELEMENT NAME=\"%s\" VAL=\"%s\"/>\n",
+                                 metric->extra[j].name, metric->extra[j].data);
+              socket_send(client, summaryxml, &len);
+            }
+          len = apr_snprintf(summaryxml, 1024, "</EXTRA_DATA>\n");
+          socket_send(client, summaryxml, &len);
+        }
+      if (status == APR_SUCCESS)
+        {
+          len = 11;
+          status = socket_send(client, "</METRICS>\n", &len);
+        }
+    }
+  return status;
+}
+
 static void
 process_tcp_accept_channel(const apr_pollfd_t *desc, apr_time_t now)
 {
   apr_status_t status;
-  apr_hash_index_t *hi, *metric_hi;
+  apr_hash_index_t *hi;
   void *val;
+  int i;
   apr_socket_t *client, *server;
   apr_sockaddr_t *remotesa = NULL;
   char  remoteip[256];
   apr_pool_t *client_context = NULL;
   Ganglia_channel *channel;
+  apr_hash_t *defs = NULL;
 
   server         = desc->desc.s;
   /* We could also use the apr_socket_data_get/set() functions
@@ -1972,30 +3544,51 @@ process_tcp_accept_channel(const apr_pollfd_t *desc, apr_time_t now)
   if(Ganglia_acl_action( channel->acl, remotesa ) != GANGLIA_ACCESS_ALLOW)
     goto close_accept_socket;
 
-  if (args_info.gzip_output_flag)
+  if (channel->codec != GM_CODEC_NONE)
     {
-      z_stream *strm = zstream_new();
-      if (strm == NULL)
+      gm_compressor_t *c = gm_compressor_new(channel->codec, channel->codec_level);
+      if (c == NULL)
 	{
-	  debug_msg("failed to allocate gzip stream");
+	  debug_msg("failed to allocate %s stream", gm_codec_to_cstr(channel->codec));
 	  goto close_accept_socket;
 	}
-      apr_status_t r = apr_socket_data_set(client, strm, GZIP_KEY, &zstream_destroy);
+      apr_status_t r = apr_socket_data_set(client, c, COMPRESSOR_KEY, &compressor_cleanup);
       if (r != APR_SUCCESS)
 	{
 	  debug_msg("failed to set socket user data");
-	  zstream_destroy(strm);
+	  gm_compressor_free(c);
 	  goto close_accept_socket;
 	}
     }
 
   /* Print the DTD, GANGLIA_XML and CLUSTER tags */
-  status = print_xml_header(client);
+  status = print_xml_header(client, channel->compact_xml);
   if(status != APR_SUCCESS)
     goto close_accept_socket;
 
   /* Walk the host hash */
   apr_thread_mutex_lock(hosts_mutex);
+
+  /* The summary goes first: gmetad only takes it instead of summing
+   * the hosts if it has it before them */
+  if(print_cluster_summary(client) != APR_SUCCESS)
+    {
+      apr_thread_mutex_unlock(hosts_mutex);
+      goto close_accept_socket;
+    }
+
+  if (channel->compact_xml)
+    {
+      defs = apr_hash_make(client_context);
+      if(print_metric_defs(client, defs, client_context) != APR_SUCCESS)
+        {
+          apr_thread_mutex_unlock(hosts_mutex);
+          apr_socket_shutdown(client, APR_SHUTDOWN_READ);
+          apr_socket_close(client);
+          apr_pool_destroy(client_context);
+          return;
+        }
+    }
   for(hi = apr_hash_first(client_context, hosts);
       hi;
       hi = apr_hash_next(hi))
@@ -2014,16 +3607,10 @@ process_tcp_accept_channel(const apr_pollfd_t *desc, apr_time_t now)
 
       /* Send the metric info for this particular host */
       apr_thread_mutex_lock(((Ganglia_host *)val)->mutex);
-      for(metric_hi = apr_hash_first(client_context, ((Ganglia_host *)val)->metrics);
-          metric_hi; metric_hi = apr_hash_next(metric_hi))
+      for(i = 0; i < ((Ganglia_host *)val)->nslots; i++)
         {
-          void *metric, *mval;
-          apr_hash_this(metric_hi, NULL, NULL, &metric);
-
-          mval = apr_hash_get(((Ganglia_host *)val)->gmetrics, ((Ganglia_metadata*)metric)->name, APR_HASH_KEY_STRING);
-
           /* Print each of the metrics for a host ... */
-          if(print_host_metric(client, metric, mval, now) != APR_SUCCESS)
+          if(print_host_metric(client, &(((Ganglia_host *)val)->slots[i]), now, defs) != APR_SUCCESS)
             {
               /* Release the mutex and close down the accepted socket */
               apr_thread_mutex_unlock(((Ganglia_host *)val)->mutex);
@@ -2094,56 +3681,331 @@ poll_udp_listen_channels( apr_interval_time_t timeout, apr_time_t now)
           process_udp_recv_channel(descs+i, now); 
           udp_last_heard = apr_time_now();
           break;
+        case TCP_RECV_CHANNEL:
+          process_tcp_recv_channel(descs+i, now);
+          break;
+        case TCP_RECV_STREAM:
+          process_tcp_recv_stream(descs+i, now);
+          break;
+        default:
+          continue;
+        }
+    }
+}
+
+static void
+poll_tcp_listen_channels( apr_interval_time_t timeout, apr_time_t now)
+{
+  apr_status_t status;
+  const apr_pollfd_t *descs = NULL;
+  apr_int32_t num = 0;
+  apr_int32_t i;
+
+  /* Poll for incoming TCP requests */
+  status = apr_pollset_poll(tcp_listen_channels, timeout, &num, &descs);
+  if (status != APR_SUCCESS && status != APR_TIMEUP) {
+      char buff[128];
+      debug_msg("apr_pollset_poll returned unexpected status %d = %s\n",
+          status, apr_strerror(status, buff, 128));
+      return;
+  }
+
+  for(i = 0; i< num ; i++)
+    {
+      Ganglia_channel *channel = descs[i].client_data;
+      switch( channel->type )
+        {
+        case TCP_ACCEPT_CHANNEL:
+          debug_msg("[tcp] Request for XML data received.");
+          process_tcp_accept_channel(descs+i, now);
+          debug_msg("[tcp] Request for XML data completed.");
+          break;
         default:
           continue;
         }
     }
 }
 
+/* Frames a message for every tcp_send_channel.  They go out together
+ * when the main loop calls tcp_send_channels_flush(). */
+static int
+tcp_send_message( char *buf, int len )
+{
+  int i, errors = 0;
+  uint32_t frame = htonl(len);
+
+  if(!tcp_send_array)
+    return 0;
+
+  for(i = 0; i < tcp_send_array->nelts; i++)
+    {
+      Ganglia_tcp_send_channel *channel = ((Ganglia_tcp_send_channel **)(tcp_send_array->elts))[i];
+
+      if(channel->pending_len + 4 + len > channel->pending_size)
+        {
+          apr_size_t size = channel->pending_size ? channel->pending_size * 2 : 16384;
+          char *pending;
+
+          while(size < channel->pending_len + 4 + len)
+              size *= 2;
+          if(size > TCP_BATCH_MAX || !(pending = realloc(channel->pending, size)))
+            {
+              errors++;
+              continue;
+            }
+          channel->pending = pending;
+          channel->pending_size = size;
+        }
+      memcpy(channel->pending + channel->pending_len, &frame, 4);
+      memcpy(channel->pending + channel->pending_len + 4, buf, len);
+      channel->pending_len += 4 + len;
+      channel->pending_messages++;
+    }
+  return errors;
+}
+
+/* Frees the channels a reload dropped once their threads are done,
+ * with whatever they had not written */
+static void
+tcp_send_channels_reap( void )
+{
+  int i, n = 0;
+
+  for(i = 0; i < tcp_send_stopping->nelts; i++)
+    {
+      Ganglia_tcp_send_channel *channel = ((Ganglia_tcp_send_channel **)(tcp_send_stopping->elts))[i];
+      Ganglia_tcp_batch *batch, *next;
+      apr_status_t rv;
+      int stopped;
+
+      apr_thread_mutex_lock(channel->mutex);
+      stopped = channel->stopped;
+      apr_thread_mutex_unlock(channel->mutex);
+      if(!stopped)
+        {
+          ((Ganglia_tcp_send_channel **)(tcp_send_stopping->elts))[n++] = channel;
+          continue;
+        }
+
+      apr_thread_join(&rv, channel->thread);
+      for(batch = channel->head; batch; batch = next)
+        {
+          next = batch->next;
+          free(batch);
+        }
+      free(channel->pending);
+      debug_msg("[tcp] closed tcp_send_channel %s:%d", channel->host, channel->port);
+      apr_pool_destroy(channel->pool);
+    }
+  tcp_send_stopping->nelts = n;
+}
+
+/* Hands the messages of this pass to the channel threads, one batch for
+ * each channel.  When an upstream has been away for so long that more
+ * than its queue is waiting, the oldest batches are dropped. */
 static void
-poll_tcp_listen_channels( apr_interval_time_t timeout, apr_time_t now)
+tcp_send_channels_flush( void )
 {
-  apr_status_t status;
-  const apr_pollfd_t *descs = NULL;
-  apr_int32_t num = 0;
-  apr_int32_t i;
+  int i;
 
-  /* Poll for incoming TCP requests */
-  status = apr_pollset_poll(tcp_listen_channels, timeout, &num, &descs);
-  if (status != APR_SUCCESS && status != APR_TIMEUP) {
-      char buff[128];
-      debug_msg("apr_pollset_poll returned unexpected status %d = %s\n",
-          status, apr_strerror(status, buff, 128));
-      return;
-  }
+  if(tcp_send_stopping && tcp_send_stopping->nelts)
+    tcp_send_channels_reap();
+  if(!tcp_send_array)
+    return;
 
-  for(i = 0; i< num ; i++)
+  for(i = 0; i < tcp_send_array->nelts; i++)
     {
-      Ganglia_channel *channel = descs[i].client_data;
-      switch( channel->type )
+      Ganglia_tcp_send_channel *channel = ((Ganglia_tcp_send_channel **)(tcp_send_array->elts))[i];
+      Ganglia_tcp_batch *batch, *dropped = NULL;
+      int lost = 0;
+
+      if(!channel->pending_len)
+        continue;
+
+      batch = malloc(sizeof(Ganglia_tcp_batch) + channel->pending_len);
+      if(!batch)
         {
-        case TCP_ACCEPT_CHANNEL:
-          debug_msg("[tcp] Request for XML data received.");
-          process_tcp_accept_channel(descs+i, now);
-          debug_msg("[tcp] Request for XML data completed.");
-          break;
-        default:
-          continue;
+          lost = channel->pending_messages;
+        }
+      else
+        {
+          batch->next = NULL;
+          batch->len = channel->pending_len;
+          batch->messages = channel->pending_messages;
+          batch->packed = 0;
+          memcpy(batch->data, channel->pending, batch->len);
+
+          apr_thread_mutex_lock(channel->mutex);
+          if(channel->tail)
+              channel->tail->next = batch;
+          else
+              channel->head = batch;
+          channel->tail = batch;
+          channel->queued += batch->len;
+          while(channel->queued > channel->max_queue && channel->head != batch)
+            {
+              Ganglia_tcp_batch *oldest = channel->head;
+
+              channel->head = oldest->next;
+              channel->queued -= oldest->len;
+              oldest->next = dropped;
+              dropped = oldest;
+            }
+          apr_thread_cond_signal(channel->cond);
+          apr_thread_mutex_unlock(channel->mutex);
+        }
+
+      while(dropped)
+        {
+          Ganglia_tcp_batch *next = dropped->next;
+
+          lost += dropped->messages;
+          free(dropped);
+          dropped = next;
+        }
+      if(lost)
+        {
+          debug_msg("dropped %d messages for TCP channel %s:%d", lost, channel->host, channel->port);
+          while(lost--)
+              ganglia_scoreboard_inc(PKTS_SENT_FAILED);
         }
+
+      channel->pending_len = 0;
+      channel->pending_messages = 0;
     }
 }
 
 static int
-tcp_send_message( char *buf, int len )
+send_message( char *buf, int len )
 {
-  /* Mirror of UDP send message for TCP channels */
-  return 0;
+  int errors = 0;
+
+  if(udp_send_channels)
+    errors += Ganglia_udp_send_message(udp_send_channels, buf, len );
+  /* A relay's tcp_send_channels only carry its hosts table, where its
+   * own metrics are once it hears them */
+  if(relay_interval)
+    return errors;
+  return errors + tcp_send_message( buf, len );
 }
 
+/* Whether a tcp_send_channel has connected anew since the last call */
 static int
-send_message( char *buf, int len )
+tcp_send_channels_resync( void )
+{
+  int i, resync = 0;
+
+  if(!tcp_send_array)
+    return 0;
+
+  for(i = 0; i < tcp_send_array->nelts; i++)
+    {
+      Ganglia_tcp_send_channel *channel = ((Ganglia_tcp_send_channel **)(tcp_send_array->elts))[i];
+
+      apr_thread_mutex_lock(channel->mutex);
+      resync |= channel->resync;
+      channel->resync = 0;
+      apr_thread_mutex_unlock(channel->mutex);
+    }
+  return resync;
+}
+
+/* When the hosts table was last relayed in full, and whether to relay
+ * all of it again because a pass that should have did not get through */
+static apr_time_t relay_last = 0;
+static int relay_resync = 0;
+
+/* Forwards what the hosts table took in since the last pass to the
+ * tcp_send_channels, or all of it when an upstream has connected anew.
+ * Every message names the host it came from, as a spoofed one does, so
+ * that the upstream files it under that host rather than under us. */
+static void
+Ganglia_relay_send( apr_pool_t *pool, apr_time_t now )
 {
-  return Ganglia_udp_send_message(udp_send_channels, buf, len ) + tcp_send_message( buf, len );
+  static char *buf = NULL;
+  apr_hash_index_t *hi;
+  apr_time_t since;
+  char hostbuf[512];
+  int sent = 0, failed = 0, all, i;
+  XDR x;
+
+  if(!buf)
+    buf = apr_palloc(global_context, TCP_FRAME_MAX);
+  all = tcp_send_channels_resync() || relay_resync;
+  since = all ? 0 : relay_last;
+
+  for(hi = apr_hash_first(pool, hosts); hi; hi = apr_hash_next(hi))
+    {
+      void *val;
+      Ganglia_host *host;
+
+      apr_hash_this(hi, NULL, NULL, &val);
+      host = val;
+      if(host->last_heard_from <= since)
+        continue;
+      apr_snprintf(hostbuf, sizeof(hostbuf), "%s:%s", host->ip, host->hostname);
+
+      /* The metadata goes first, so the upstream has it for the values */
+      for(i = 0; i < host->nslots; i++)
+        {
+          Ganglia_metric_slot *slot = &(host->slots[i]);
+          Ganglia_metadata_msg msg;
+
+          if(!slot->def || slot->def_heard_from <= since)
+            continue;
+
+          msg.id = gmetadata_full;
+          msg.Ganglia_metadata_msg_u.gfull = slot->def->gfull;
+          msg.Ganglia_metadata_msg_u.gfull.metric_id.host = hostbuf;
+          msg.Ganglia_metadata_msg_u.gfull.metric_id.spoof = TRUE;
+          xdrmem_create(&x, buf, TCP_FRAME_MAX, XDR_ENCODE);
+          if(!xdr_Ganglia_metadata_msg(&x, &msg) || tcp_send_message(buf, xdr_getpos(&x)))
+            {
+              ganglia_scoreboard_inc(PKTS_SENT_FAILED);
+              failed++;
+              continue;
+            }
+          ganglia_scoreboard_inc(PKTS_SENT_RELAY);
+          sent++;
+        }
+
+      for(i = 0; i < host->nslots; i++)
+        {
+          Ganglia_metric_slot *slot = &(host->slots[i]);
+          Ganglia_value_msg msg;
+
+          if(!slot->value_heard_from || slot->value_heard_from <= since)
+            continue;
+
+          Ganglia_metric_slot_value(slot, metric_id_to_name(i), &msg);
+          msg.Ganglia_value_msg_u.gstr.metric_id.host = hostbuf;
+          msg.Ganglia_value_msg_u.gstr.metric_id.spoof = TRUE;
+          xdrmem_create(&x, buf, TCP_FRAME_MAX, XDR_ENCODE);
+          if(!xdr_Ganglia_value_msg(&x, &msg) || tcp_send_message(buf, xdr_getpos(&x)))
+            {
+              ganglia_scoreboard_inc(PKTS_SENT_FAILED);
+              failed++;
+              continue;
+            }
+          ganglia_scoreboard_inc(PKTS_SENT_RELAY);
+          sent++;
+        }
+    }
+
+  /* What did not get through goes again on the next pass, with all that
+   * came in since this one began */
+  if(failed)
+    {
+      err_msg("Could not relay %d messages, will try again\n", failed);
+      relay_resync = all;
+    }
+  else
+    {
+      relay_last = now;
+      relay_resync = 0;
+    }
+  debug_msg("relayed %d messages%s", sent, all ? ", all we have" : "");
+  apr_pool_clear(pool);
 }
 
 static Ganglia_metric_callback *
@@ -2518,29 +4380,150 @@ setup_metric_info(Ganglia_metric_callback *metric_cb, int group_once, cfg_t *met
 #define PCRE_MAX_SUBPATTERNS 9
 #define PCRE_OVECCOUNT ((1 + PCRE_MAX_SUBPATTERNS) * 3)
 
+static apr_time_t
+collection_group_next_event( Ganglia_collection_group *group )
+{
+  return group->next_send < group->next_collect ? group->next_send : group->next_collect;
+}
+
+static void
+collection_groups_push( Ganglia_collection_group *group )
+{
+  Ganglia_collection_group **heap;
+  int i, parent;
+
+  apr_array_push(collection_groups);
+  heap = (Ganglia_collection_group **)collection_groups->elts;
+  for(i = collection_groups->nelts - 1; i > 0; i = parent)
+    {
+      parent = (i - 1) / 2;
+      if(collection_group_next_event(heap[parent]) <= collection_group_next_event(group))
+        break;
+      heap[i] = heap[parent];
+    }
+  heap[i] = group;
+}
+
+static Ganglia_collection_group *
+collection_groups_pop( void )
+{
+  Ganglia_collection_group **heap = (Ganglia_collection_group **)collection_groups->elts;
+  Ganglia_collection_group *top = heap[0], *last;
+  int i, child, n;
+
+  n = --collection_groups->nelts;
+  last = heap[n];
+  for(i = 0; (child = 2 * i + 1) < n; i = child)
+    {
+      if(child + 1 < n && collection_group_next_event(heap[child + 1]) <
+         collection_group_next_event(heap[child]))
+        child++;
+      if(collection_group_next_event(last) <= collection_group_next_event(heap[child]))
+        break;
+      heap[i] = heap[child];
+    }
+  heap[i] = last;
+  return top;
+}
+
+/* How long to put off the first event of the group'th collection group,
+ * up to collection_phase_spread seconds and less than period.  It depends
+ * only on the host name and the group, so each host keeps its place in
+ * the interval across restarts. */
+static apr_time_t
+collection_group_phase( int group, int period )
+{
+  const char *p = override_hostname ? override_hostname : myname;
+  apr_uint32_t h = 2166136261U;
+  apr_interval_time_t range;
+
+  if(period > collection_phase_spread)
+    period = collection_phase_spread;
+  if(period <= 0)
+    return 0;
+
+  /* FNV-1a, then a mix so that node01 and node02 land far apart */
+  for(; *p; p++)
+    h = (h ^ (unsigned char)*p) * 16777619U;
+  h ^= (apr_uint32_t)group * 0x9e3779b9U;
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35U;
+  h ^= h >> 16;
+
+  range = (apr_interval_time_t)period * APR_USEC_PER_SEC;
+  return (apr_time_t)(h % range);
+}
+
+/* Sets up the collection groups.  On a reload a group whose section is
+ * unchanged goes on as it was, on its own schedule and without sending
+ * its metrics again, and only the others are set up anew. */
 double
 setup_collection_groups( void )
 {
   int i, num_collection_groups = cfg_size( config_file, "collection_group" );
   double bytes_per_sec = 0;
-  
-  /* Create the collection group array */
-  collection_groups = apr_array_make( global_context, num_collection_groups,
-                                      sizeof(Ganglia_collection_group *));
+  apr_time_t start = apr_time_now();
+  apr_pool_t *ptemp;
+  apr_hash_t *old, *seen;
+  apr_hash_index_t *hi;
+  Ganglia_collection_group *group;
+
+  apr_pool_create(&ptemp, global_context);
+  old = apr_hash_make(ptemp);
+  seen = apr_hash_make(ptemp);
+  if(collection_groups)
+    {
+      for(i = 0; i < collection_groups->nelts; i++)
+        {
+          group = ((Ganglia_collection_group **)(collection_groups->elts))[i];
+          apr_hash_set(old, group->key, APR_HASH_KEY_STRING, group);
+        }
+      collection_groups->nelts = 0;
+    }
+  else
+    {
+      /* Create the collection group array */
+      collection_groups = apr_array_make( global_context, num_collection_groups,
+                                          sizeof(Ganglia_collection_group *));
+      due_groups = apr_array_make( global_context, num_collection_groups,
+                                   sizeof(Ganglia_collection_group *));
+    }
 
   for(i = 0; i < num_collection_groups; i++)
     {
       int j, num_metrics;
       cfg_t *group_conf;
-      Ganglia_collection_group *group = apr_pcalloc( global_context, 
-                                                     sizeof(Ganglia_collection_group));
+      apr_pool_t *pool;
+      char *key;
+
+      group_conf  = cfg_getnsec( config_file, "collection_group", i);
+      key = cfg_section_key( "collection_group", group_conf, seen, ptemp );
+      if((group = apr_hash_get(old, key, APR_HASH_KEY_STRING)))
+        {
+          apr_hash_set(old, key, APR_HASH_KEY_STRING, NULL);
+          for(j = 0; j < group->metric_array->nelts; j++)
+            {
+              Ganglia_metric_callback *cb = ((Ganglia_metric_callback **)(group->metric_array->elts))[j];
+              if (cb->info) {
+                  bytes_per_sec += ( (double)(cb->info->msg_size) / (double)group->time_threshold );
+              }
+            }
+          collection_groups_push(group);
+          continue;
+        }
+
+      /* Create a sub-pool for this group */
+      apr_pool_create(&pool, global_context);
+      group = apr_pcalloc( pool, sizeof(Ganglia_collection_group));
       if(!group)
         {
           err_msg("Unable to malloc memory for collection group. Exiting.\n");
           exit(1);
         }
-
-      group_conf  = cfg_getnsec( config_file, "collection_group", i);
+      group->pool = pool;
+      group->key  = apr_pstrdup( pool, key );
       group->once = cfg_getbool( group_conf, "collect_once");
       group->collect_every = cfg_getint( group_conf, "collect_every");
       group->time_threshold = cfg_getint( group_conf, "time_threshold");
@@ -2550,16 +4533,17 @@ setup_collection_groups( void )
           /* TODO: this isn't pretty but simplifies the code( next collect in a year)
              since we will collect the value in this function */
           group->next_collect = apr_time_now() + (31536000 * APR_USEC_PER_SEC);
+          group->next_send    = start + collection_group_phase(i, group->time_threshold);
         }
       else
         {
-          group->next_collect = 0;
+          /* The first send follows the first collection */
+          group->next_collect = start + collection_group_phase(i, group->collect_every);
+          group->next_send    = group->next_collect;
         }
 
-      group->next_send    = 0;
-
       num_metrics = cfg_size( group_conf, "metric" );
-      group->metric_array = apr_array_make(global_context, num_metrics,
+      group->metric_array = apr_array_make(pool, num_metrics,
                                            sizeof(Ganglia_metric_callback *)); 
       for(j=0; j< num_metrics; j++)
         {
@@ -2757,9 +4741,17 @@ setup_collection_groups( void )
           }
 
       /* Save the collection group the collection group array */
-      *(Ganglia_collection_group **)apr_array_push(collection_groups) = group;
+      collection_groups_push(group);
     }
 
+  /* The groups whose sections are gone */
+  for(hi = apr_hash_first(ptemp, old); hi; hi = apr_hash_next(hi))
+    {
+      apr_hash_this(hi, NULL, NULL, (void **)&group);
+      apr_pool_destroy(group->pool);
+    }
+  apr_pool_destroy(ptemp);
+
   return bytes_per_sec;
 }
 
@@ -2831,6 +4823,82 @@ Ganglia_collection_group_collect( Ganglia_collection_group *group, apr_time_t no
   group->next_collect = now + (group->collect_every * APR_USEC_PER_SEC);
 }
 
+/* Builds the metadata of a metric as Ganglia_metadata_def() takes it.
+ * Returns NULL if it could not. */
+static Ganglia_metric
+Ganglia_metric_cb_metadata( Ganglia_metric_callback *cb )
+{
+  Ganglia_metric gmetric = Ganglia_metric_create((Ganglia_pool)global_context);
+  char *name, *val, *type;
+  apr_pool_t *gm_pool;
+  int errors;
+
+  if(!gmetric)
+    {
+      /* no memory */
+      return NULL;
+    }
+  gm_pool = (apr_pool_t*)gmetric->pool;
+
+  name = cb->msg.Ganglia_value_msg_u.gstr.metric_id.name;
+  val = apr_pstrdup(gm_pool, host_metric_value(cb->info, &(cb->msg)));
+  type = apr_pstrdup(gm_pool, host_metric_type(cb->info->type));
+
+  errors = Ganglia_metric_set(gmetric, name, val, type,
+              cb->info->units, cstr_to_slope( cb->info->slope),
+              cb->info->tmax, 0);
+
+  if (errors) 
+    {
+      err_msg("Error %d setting the modular data for %s\n", errors, cb->name);
+      Ganglia_metric_destroy(gmetric);
+      return NULL;
+    }
+
+  Ganglia_metadata_add(gmetric, "TITLE", cb->title);
+  Ganglia_metadata_add(gmetric, "DESC", cb->info->desc);
+
+  /* Add the rest of the metadata here by interating through 
+   *  the metadata table of the metric_info structure */
+  if (cb->info->metadata) 
+    {
+      int i;
+      const apr_array_header_t *arr = apr_table_elts((apr_table_t*)cb->info->metadata);
+      const apr_table_entry_t *elts = (const apr_table_entry_t *)arr->elts;
+
+      /* add all of the metadata to the packet */
+      for (i = 0; i < arr->nelts; ++i) 
+        {
+          if (elts[i].key == NULL)
+              continue;
+          Ganglia_metadata_add(gmetric, elts[i].key, elts[i].val);
+        }
+    }
+  return gmetric;
+}
+
+/* Sends metadata on every channel, as Ganglia_metadata_send_real() does
+ * on the UDP ones */
+static int
+Ganglia_metadata_send_all( Ganglia_metric gmetric, char *override_string )
+{
+  int len;
+  XDR x;
+  char gmetricmsg[GANGLIA_MAX_MESSAGE_LEN];
+  Ganglia_metadata_msg msg;
+
+  msg.id = gmetadata_full;
+  Ganglia_metadata_def( gmetric, &(msg.Ganglia_metadata_msg_u.gfull), override_string );
+
+  xdrmem_create(&x, gmetricmsg, GANGLIA_MAX_MESSAGE_LEN, XDR_ENCODE);
+  if(!xdr_Ganglia_metadata_msg(&x, &msg))
+    {
+      return 1;
+    }
+  len = xdr_getpos(&x); 
+  return send_message( gmetricmsg, len );
+}
+
 void
 Ganglia_collection_group_send( Ganglia_collection_group *group, apr_time_t now)
 {
@@ -2883,67 +4951,23 @@ Ganglia_collection_group_send( Ganglia_collection_group *group, apr_time_t now)
         if (!cb->metadata_last_sent || (send_metadata_interval && 
            (cb->metadata_last_sent < (now - apr_time_make(send_metadata_interval,0))))) 
           {
-            Ganglia_metric gmetric = Ganglia_metric_create((Ganglia_pool)global_context);
-            char *name, *val, *type;
-            apr_pool_t *gm_pool = (apr_pool_t*)gmetric->pool;
-
-            if(!gmetric)
-              {
-                /* no memory */
-                return;
-              }
+            Ganglia_metric gmetric;
 
-            name = cb->msg.Ganglia_value_msg_u.gstr.metric_id.name;
             if (override_hostname != NULL)
               {
                 cb->msg.Ganglia_value_msg_u.gstr.metric_id.host = apr_pstrcat(global_context, (char *)( override_ip != NULL ? override_ip : override_hostname ), ":", (char *) override_hostname, NULL);
                 cb->msg.Ganglia_value_msg_u.gstr.metric_id.spoof = TRUE;
               }
-            val = apr_pstrdup(gm_pool, host_metric_value(cb->info, &(cb->msg)));
-            type = apr_pstrdup(gm_pool, host_metric_type(cb->info->type));
-        
-            errors = Ganglia_metric_set(gmetric, name, val, type,
-                        cb->info->units, cstr_to_slope( cb->info->slope),
-                        cb->info->tmax, 0);
 
-            if (errors) 
-              {
-                err_msg("Error %d setting the modular data for %s\n", errors, cb->name);
-              }
-            else 
+            gmetric = Ganglia_metric_cb_metadata(cb);
+            if (gmetric)
               {
-                Ganglia_metadata_add(gmetric, "TITLE", cb->title);
-                Ganglia_metadata_add(gmetric, "DESC", cb->info->desc);
-
-                /* Add the rest of the metadata here by interating through 
-                 *  the metadata table of the metric_info structure */
-                if (cb->info->metadata) 
-                  {
-                    int i;
-                    const apr_array_header_t *arr = apr_table_elts((apr_table_t*)cb->info->metadata);
-                    const apr_table_entry_t *elts = (const apr_table_entry_t *)arr->elts;
-
-                    /* add all of the metadata to the packet */
-                    for (i = 0; i < arr->nelts; ++i) 
-                      {
-                        if (elts[i].key == NULL)
-                            continue;
-                        Ganglia_metadata_add(gmetric, elts[i].key, elts[i].val);
-                      }
-                  }
-
                 debug_msg("\tsending metadata for metric: %s", cb->name);
 
                 ganglia_scoreboard_inc(PKTS_SENT_METADATA);
                 ganglia_scoreboard_inc(PKTS_SENT_ALL);
-                if (override_hostname != NULL)
-                  {
-                    errors = Ganglia_metadata_send_real(gmetric, udp_send_channels, cb->msg.Ganglia_value_msg_u.gstr.metric_id.host);
-                  }
-                else
-                  {
-                    errors = Ganglia_metadata_send(gmetric, udp_send_channels);
-                  }
+                errors = Ganglia_metadata_send_all(gmetric, override_hostname != NULL ?
+                    cb->msg.Ganglia_value_msg_u.gstr.metric_id.host : NULL);
                 if (errors) 
                   {
                     err_msg("Error %d sending the modular data for %s\n", errors, cb->name);
@@ -2954,9 +4978,9 @@ Ganglia_collection_group_send( Ganglia_collection_group *group, apr_time_t now)
                   {
                     cb->metadata_last_sent = now; /* mark the metadata as sent */
                   }
-              }
 
-            Ganglia_metric_destroy(gmetric);
+                Ganglia_metric_destroy(gmetric);
+              }
           }
 
         /* Send the updated value packet ever time it is collected */
@@ -2978,53 +5002,234 @@ Ganglia_collection_group_send( Ganglia_collection_group *group, apr_time_t now)
       }
 }
  
-/* TODO: It might be necessary in the future to use a heap for the collection groups.
- * Running through an array should suffice for now */
-apr_time_t
-process_collection_groups( apr_time_t now )
+/* Packs the metadata of the next metrics in the queue, all of the same
+ * host, into one gmetadata_bulk packet and sends it */
+static void
+Ganglia_metadata_bulk_pack( apr_time_t now )
 {
-  int i;
-  apr_time_t next = 0;
+  Ganglia_metric_callback **queue = (Ganglia_metric_callback **)metadata_queue->elts;
+  char *host = queue[metadata_queue_next]->msg.Ganglia_value_msg_u.gstr.metric_id.host;
+  int first = metadata_queue_next;
+  Ganglia_msg_formats id = gmetadata_bulk;
+  bool_t more = FALSE;
+  u_int count = 0, more_pos, count_pos, pos, len;
+  char buf[max_udp_message_len];
+  int i, errors;
+  XDR x;
+
+  xdrmem_create(&x, buf, max_udp_message_len, XDR_ENCODE);
+  xdr_Ganglia_msg_formats(&x, &id);
+  more_pos = xdr_getpos(&x);
+  xdr_bool(&x, &more);
+  count_pos = xdr_getpos(&x);
+  xdr_u_int(&x, &count);
 
-  /* Run through each collection group and collect any data that needs collecting... */
-  for(i=0; i< collection_groups->nelts; i++)
+  while (metadata_queue_next < metadata_queue->nelts)
     {
-      Ganglia_collection_group *group = ((Ganglia_collection_group **)(collection_groups->elts))[i];
-      if(group->next_collect <= now)
+      Ganglia_metric_callback *cb = queue[metadata_queue_next];
+      Ganglia_metric gmetric;
+      Ganglia_metadatadef def;
+      bool_t fits;
+
+      if (cb->metadata_full || strcmp(cb->msg.Ganglia_value_msg_u.gstr.metric_id.host, host))
+          break;
+      gmetric = Ganglia_metric_cb_metadata(cb);
+      if (!gmetric)
+        {
+          cb->metadata_queued = 0;
+          queue[metadata_queue_next++] = NULL;
+          continue;
+        }
+      Ganglia_metadata_def(gmetric, &def, override_hostname != NULL ? host : NULL);
+
+      pos = xdr_getpos(&x);
+      fits = xdr_Ganglia_metadatadef(&x, &def);
+      Ganglia_metric_destroy(gmetric);
+      if (!fits)
         {
-          Ganglia_collection_group_collect(group, now);
+          xdr_setpos(&x, pos);
+          if (count)
+              break;
+          err_msg("The metadata for %s does not fit in a packet\n", cb->name);
+          cb->metadata_queued = 0;
+          queue[metadata_queue_next++] = NULL;
+          continue;
         }
+      count++;
+      metadata_queue_next++;
+    }
+  if (!count)
+      return;
+
+  more = metadata_queue_next < metadata_queue->nelts &&
+      !queue[metadata_queue_next]->metadata_full &&
+      !strcmp(queue[metadata_queue_next]->msg.Ganglia_value_msg_u.gstr.metric_id.host, host);
+  len = xdr_getpos(&x);
+  xdr_setpos(&x, more_pos);
+  xdr_bool(&x, &more);
+  xdr_setpos(&x, count_pos);
+  xdr_u_int(&x, &count);
+
+  errors = send_message(buf, len);
+  debug_msg("\tsent metadata of %u metrics for host %s with %d errors", count, host, errors);
+  ganglia_scoreboard_inc(PKTS_SENT_BULK);
+  ganglia_scoreboard_inc(PKTS_SENT_ALL);
+  if (errors)
+      ganglia_scoreboard_inc(PKTS_SENT_FAILED);
+
+  for (i = first; i < metadata_queue_next; i++)
+    {
+      if (!queue[i])
+          continue;
+      queue[i]->metadata_queued = 0;
+      if (!errors)
+          queue[i]->metadata_last_sent = now;
+    }
+}
+
+/* Sends the metadata of the next metric in the queue in a gmetadata_full
+ * packet of its own */
+static void
+Ganglia_metadata_full_send( apr_time_t now )
+{
+  Ganglia_metric_callback *cb = ((Ganglia_metric_callback **)metadata_queue->elts)[metadata_queue_next++];
+  Ganglia_metric gmetric;
+  int errors;
+
+  cb->metadata_queued = 0;
+  cb->metadata_full = 0;
+  gmetric = Ganglia_metric_cb_metadata(cb);
+  if (!gmetric)
+      return;
+
+  debug_msg("\tsending requested metadata for metric: %s", cb->name);
+  ganglia_scoreboard_inc(PKTS_SENT_METADATA);
+  ganglia_scoreboard_inc(PKTS_SENT_ALL);
+  errors = Ganglia_metadata_send_all(gmetric, override_hostname != NULL ?
+      cb->msg.Ganglia_value_msg_u.gstr.metric_id.host : NULL);
+  if (errors)
+    {
+      err_msg("Error %d sending the modular data for %s\n", errors, cb->name);
+      ganglia_scoreboard_inc(PKTS_SENT_FAILED);
+    }
+  else
+      cb->metadata_last_sent = now;
+  Ganglia_metric_destroy(gmetric);
+}
+
+/* Sends the metadata that was asked for as fast as metadata_response_rate
+ * lets it go.  Returns when it wants to be called again, or 0 when there
+ * is nothing left to send. */
+static apr_time_t
+Ganglia_metadata_bulk_send( apr_time_t now )
+{
+  if (!metadata_queue || !metadata_queue->nelts)
+      return 0;
+
+  while (metadata_queue_next < metadata_queue->nelts)
+    {
+      if (!token_bucket_take(&metadata_response_bucket, now))
+          return token_bucket_next(&metadata_response_bucket);
+      if (((Ganglia_metric_callback **)metadata_queue->elts)[metadata_queue_next]->metadata_full)
+          Ganglia_metadata_full_send(now);
+      else
+          Ganglia_metadata_bulk_pack(now);
     }
+  metadata_queue->nelts = 0;
+  metadata_queue_next = 0;
+  return 0;
+}
 
-  /* Run through each collection group and send any data that needs sending... */
-  for(i=0; i< collection_groups->nelts; i++)
+/* Drops the metrics a reload took out of every collection group from
+ * the queue, or all of them if gmond is mute now: their metadata no
+ * longer goes out with their values */
+static void
+Ganglia_metadata_queue_prune( void )
+{
+  Ganglia_metric_callback **queue;
+  apr_pool_t *ptemp;
+  apr_hash_t *collected;
+  int i, j, kept;
+
+  if (!metadata_queue || metadata_queue_next >= metadata_queue->nelts)
+      return;
+
+  /* Keyed by the callbacks' addresses, as the groups' arrays hold them */
+  apr_pool_create(&ptemp, global_context);
+  collected = apr_hash_make(ptemp);
+  for (i = 0; !mute && collection_groups && i < collection_groups->nelts; i++)
     {
       Ganglia_collection_group *group = ((Ganglia_collection_group **)(collection_groups->elts))[i];
-      if( group->next_send <= now )
+      Ganglia_metric_callback **cbs = (Ganglia_metric_callback **)group->metric_array->elts;
+
+      for (j = 0; j < group->metric_array->nelts; j++)
+          apr_hash_set(collected, &(cbs[j]), sizeof(Ganglia_metric_callback *), cbs[j]);
+    }
+
+  queue = (Ganglia_metric_callback **)metadata_queue->elts;
+  for (kept = i = metadata_queue_next; i < metadata_queue->nelts; i++)
+    {
+      if (apr_hash_get(collected, &(queue[i]), sizeof(Ganglia_metric_callback *)))
         {
-          Ganglia_collection_group_send(group, now);
+          queue[kept++] = queue[i];
+          continue;
         }
+      queue[i]->metadata_queued = 0;
+      queue[i]->metadata_full = 0;
+    }
+  debug_msg("dropped the metadata of %d metrics from the queue", metadata_queue->nelts - kept);
+  metadata_queue->nelts = kept;
+  apr_pool_destroy(ptemp);
+}
+
+/* Takes the groups that are due off the heap, collects and sends them as
+ * the loops over every group used to, and puts them back, so a pass costs
+ * O(log n) for each group that is due rather than three scans of all of
+ * them.  A group whose send failed is due again at once but waits for the
+ * next pass. */
+apr_time_t
+process_collection_groups( apr_time_t now )
+{
+  int i;
+  apr_time_t next;
+  Ganglia_collection_group **due;
+
+  due_groups->nelts = 0;
+  while(collection_groups->nelts && collection_group_next_event(
+          ((Ganglia_collection_group **)(collection_groups->elts))[0]) <= now)
+    {
+      *(Ganglia_collection_group **)apr_array_push(due_groups) = collection_groups_pop();
     }
+  due = (Ganglia_collection_group **)due_groups->elts;
 
-  /* Run through each collection group and find when our next event (collect|send) occurs */
-  for(i=0; i< collection_groups->nelts; i++)
+  /* Collect any data that needs collecting... */
+  for(i=0; i< due_groups->nelts; i++)
     {
-      apr_time_t min;
-      Ganglia_collection_group *group = ((Ganglia_collection_group **)(collection_groups->elts))[i];
-      min = group->next_send < group->next_collect? group->next_send : group->next_collect;
-      if(!next)
+      if(due[i]->next_collect <= now)
         {
-          next = min;
+          Ganglia_collection_group_collect(due[i], now);
         }
-      else
+    }
+
+  /* Send any data that needs sending... */
+  for(i=0; i< due_groups->nelts; i++)
+    {
+      if( due[i]->next_send <= now )
         {
-          if(min < next)
-            {
-              next = min;
-            }
+          Ganglia_collection_group_send(due[i], now);
         }
     }
 
+  for(i=0; i< due_groups->nelts; i++)
+    {
+      collection_groups_push(due[i]);
+    }
+
+  /* Find when our next event (collect|send) occurs */
+  if(!collection_groups->nelts)
+    return now + 1 * APR_USEC_PER_SEC;
+  next = collection_group_next_event(((Ganglia_collection_group **)(collection_groups->elts))[0]);
+
   /* make sure we don't schedule for the past */
   return next < now ? now + 1 * APR_USEC_PER_SEC: next;
 }
@@ -3080,7 +5285,8 @@ print_metric_list( void )
 static void
 cleanup_data( apr_pool_t *pool, apr_time_t now)
 {
-  apr_hash_index_t *hi, *metric_hi;
+  apr_hash_index_t *hi;
+  int i;
 
   /* Walk the host hash */
   for(hi = apr_hash_first(pool, hosts);
@@ -3100,39 +5306,33 @@ cleanup_data( apr_pool_t *pool, apr_time_t now)
           apr_thread_mutex_lock(hosts_mutex);
           apr_hash_set( hosts, host->ip, APR_HASH_KEY_STRING, NULL);
           apr_thread_mutex_unlock(hosts_mutex);
+          /* we will get no metadata from it now */
+          if (host->metadata_wanted)
+              ganglia_scoreboard_set(HOSTS_METADATA_WANTED, --metadata_hosts_wanted);
           /* free all its memory */
           apr_pool_destroy( host->pool);
         } 
       else
         {
           /* this host isn't being deleted but it might have some stale gmetric data */
-          for( metric_hi = apr_hash_first( pool, host->metrics );
-               metric_hi;
-               metric_hi = apr_hash_next( metric_hi ))
+          for( i = 0; i < host->nslots; i++ )
             {
-              void *val;
-              Ganglia_metadata *metric;
+              Ganglia_metric_slot *slot = &(host->slots[i]);
               int dmax;
 
-              apr_hash_this( metric_hi, NULL, NULL, &val );
-              metric = val;
-
-              if(!metric || metric->message_u.f_message.id != gmetadata_full)
-                  continue;  /* this shouldn't happen */
+              if(!slot->def)
+                  continue;
 
-              dmax = metric->message_u.f_message.Ganglia_metadata_msg_u.gfull.metric.dmax;
-              if( dmax && (now - metric->last_heard_from) > (dmax * APR_USEC_PER_SEC) )
+              dmax = slot->def->gfull.metric.dmax;
+              if( dmax && (now - slot->def_heard_from) > (dmax * APR_USEC_PER_SEC) )
                 {
                   /* this is a stale gmetric */
-                  debug_msg("deleting old metric '%s' from host '%s'", metric->name, host->hostname);
+                  debug_msg("deleting old metric '%s' from host '%s'", metric_id_to_name(i), host->hostname);
 
-                  /* remove the metric from the metric and values hash */
+                  /* remove the metric and its value, freeing what they held */
                   apr_thread_mutex_lock(host->mutex);
-                  apr_hash_set( host->metrics, metric->name, APR_HASH_KEY_STRING, NULL);
-                  apr_hash_set( host->gmetrics, metric->name, APR_HASH_KEY_STRING, NULL);
+                  Ganglia_metric_slot_clear(slot, i);
                   apr_thread_mutex_unlock(host->mutex);
-                  /* destroy any memory that was allocated for this gmetric */
-                  apr_pool_destroy( metric->pool );
                 }
             }
         }
@@ -3155,6 +5355,12 @@ void initialize_scoreboard()
     ganglia_scoreboard_add(PKTS_SENT_METADATA, GSB_READ_RESET);
     ganglia_scoreboard_add(PKTS_SENT_VALUE, GSB_READ_RESET);
     ganglia_scoreboard_add(PKTS_SENT_REQUEST, GSB_READ_RESET);
+    ganglia_scoreboard_add(PKTS_RECVD_BULK, GSB_READ_RESET);
+    ganglia_scoreboard_add(PKTS_SENT_BULK, GSB_READ_RESET);
+    ganglia_scoreboard_add(PKTS_REQUEST_LIMITED, GSB_READ_RESET);
+    ganglia_scoreboard_add(HOSTS_METADATA_WANTED, GSB_STATE);
+    ganglia_scoreboard_add(METADATA_RECOVERY_SECS, GSB_STATE);
+    ganglia_scoreboard_add(PKTS_SENT_RELAY, GSB_READ_RESET);
 }
 
 int done = 0;
@@ -3162,7 +5368,6 @@ int reload_required = 0;
 
 void set_reload_required()
  {
-     done = 1;
      reload_required = 1;
  }
 
@@ -3178,13 +5383,18 @@ void sig_handler(int i)
     }
 }
 
+/* The TCP listener thread, stopped while a reload changes what it uses */
+static apr_thread_t *tcp_listener_thread = NULL;
+static apr_pool_t *tcp_listener_context = NULL;
+static int tcp_listener_stop = 0;
+
 static void* APR_THREAD_FUNC tcp_listener(apr_thread_t *thd, void *data)
 {
   apr_time_t now;
   apr_interval_time_t wait = 1000;
 
   debug_msg("[tcp] Starting TCP listener thread...");
-  for(;!done;)
+  for(;!done && !tcp_listener_stop;)
     {
       if(!deaf)
         {
@@ -3203,10 +5413,611 @@ static void* APR_THREAD_FUNC tcp_listener(apr_thread_t *thd, void *data)
     return NULL;
 }
 
+static void
+tcp_listener_start( void )
+{
+  tcp_listener_stop = 0;
+  apr_pool_create(&tcp_listener_context, global_context);
+  if (apr_thread_create(&tcp_listener_thread, NULL, tcp_listener, NULL, tcp_listener_context) != APR_SUCCESS)
+    {
+      err_msg("Failed to create TCP listener thread. Exiting.\n");
+      exit(1);
+    }
+}
+
+/* Waits for the TCP listener thread to finish the request it is on */
+static void
+tcp_listener_join( void )
+{
+  apr_status_t rv;
+
+  tcp_listener_stop = 1;
+  apr_thread_join(&rv, tcp_listener_thread);
+  apr_pool_destroy(tcp_listener_context);
+}
+
+/* Puts batches the thread could not write back at the head of the queue */
+static void
+tcp_send_channel_requeue( Ganglia_tcp_send_channel *channel, Ganglia_tcp_batch *batch )
+{
+  Ganglia_tcp_batch *last;
+  apr_size_t len = 0;
+
+  for(last = batch; ; last = last->next)
+    {
+      len += last->len;
+      if(!last->next)
+        break;
+    }
+
+  apr_thread_mutex_lock(channel->mutex);
+  last->next = channel->head;
+  if(!channel->head)
+      channel->tail = last;
+  channel->head = batch;
+  channel->queued += len;
+  apr_thread_mutex_unlock(channel->mutex);
+}
+
+/* Drops the messages at the head of a batch that were written in full
+ * before the connection broke, so that they do not go twice.  The
+ * receiver drops what it has of the next, which goes again.  A
+ * compressed batch is a single frame. */
+static void
+tcp_batch_trim( Ganglia_tcp_batch *batch, apr_size_t sent )
+{
+  apr_size_t off = 0;
+  int messages = 0;
+  uint32_t frame;
+
+  while(batch->len - off >= 4)
+    {
+      memcpy(&frame, batch->data + off, 4);
+      frame = ntohl(frame) & ~TCP_FRAME_COMPRESSED;
+      if(sent - off < 4 + (apr_size_t)frame)
+          break;
+      off += 4 + frame;
+      messages++;
+    }
+  if(!off)
+    return;
+  memmove(batch->data, batch->data + off, batch->len - off);
+  batch->len -= off;
+  batch->messages -= messages;
+}
+
+/* Where a batch is compressed to, which must come out smaller */
+struct tcp_compress_out {
+  char *buf;
+  apr_size_t len, size;
+};
+typedef struct tcp_compress_out tcp_compress_out;
+
+static int
+tcp_compress_sink( void *arg, const char *buf, size_t len )
+{
+  tcp_compress_out *out = arg;
+
+  if(len > out->size - out->len)
+    return -1;
+  memcpy(out->buf + out->len, buf, len);
+  out->len += len;
+  return 0;
+}
+
+/* Compresses a batch into a single frame, on the channel's thread so
+ * that the main loop does not pay for it.  Returns the batch to write. */
+static Ganglia_tcp_batch *
+tcp_batch_compress( Ganglia_tcp_send_channel *channel, Ganglia_tcp_batch *batch )
+{
+  Ganglia_tcp_batch *packed;
+  gm_compressor_t *c;
+  tcp_compress_out out;
+  uint32_t frame;
+
+  if(batch->packed || channel->codec == GM_CODEC_NONE || batch->len < TCP_COMPRESS_MIN)
+    return batch;
+  batch->packed = 1;
+
+  packed = malloc(sizeof(Ganglia_tcp_batch) + batch->len);
+  c = gm_compressor_new(channel->codec, channel->codec_level);
+  out.buf = packed ? packed->data + 4 : NULL;
+  out.len = 0;
+  out.size = batch->len - 4;
+  if(!packed || !c ||
+     gm_compressor_write(c, batch->data, batch->len, tcp_compress_sink, &out) ||
+     gm_compressor_finish(c, tcp_compress_sink, &out) ||
+     out.len > TCP_BATCH_MAX)
+    {
+      /* Out of memory, or it did not shrink: it goes as it is */
+      gm_compressor_free(c);
+      free(packed);
+      return batch;
+    }
+  gm_compressor_free(c);
+
+  frame = htonl(TCP_FRAME_COMPRESSED | (uint32_t)out.len);
+  memcpy(packed->data, &frame, 4);
+  packed->next = batch->next;
+  packed->len = 4 + out.len;
+  packed->messages = batch->messages;
+  packed->packed = 1;
+  free(batch);
+  return packed;
+}
+
+#define TCP_SEND_TIMEOUT apr_time_from_sec(10)
+#define TCP_BACKOFF_MIN apr_time_from_sec(1)
+#define TCP_BACKOFF_MAX apr_time_from_sec(60)
+
+/* Waits between attempts to connect, unless a reload drops the channel */
+static void
+tcp_send_channel_backoff( Ganglia_tcp_send_channel *channel, apr_interval_time_t backoff )
+{
+  apr_time_t now = apr_time_now(), until = now + backoff;
+
+  apr_thread_mutex_lock(channel->mutex);
+  while(!channel->stopping && !done && now < until)
+    {
+      apr_thread_cond_timedwait(channel->cond, channel->mutex, until - now);
+      now = apr_time_now();
+    }
+  apr_thread_mutex_unlock(channel->mutex);
+}
+
+static void* APR_THREAD_FUNC
+tcp_sender(apr_thread_t *thd, void *data)
+{
+  Ganglia_tcp_send_channel *channel = data;
+  apr_socket_t *sock = NULL;
+  apr_pool_t *pool = NULL;
+  apr_interval_time_t backoff = 0;
+  Ganglia_tcp_batch *batch;
+
+  debug_msg("[tcp] Starting TCP sender thread for %s:%d...", channel->host, channel->port);
+  for(;!done;)
+    {
+      apr_thread_mutex_lock(channel->mutex);
+      while(!channel->head && !done && !channel->stopping)
+          apr_thread_cond_wait(channel->cond, channel->mutex);
+      if(channel->stopping)
+        {
+          apr_thread_mutex_unlock(channel->mutex);
+          break;
+        }
+      batch = channel->head;
+      channel->head = channel->tail = NULL;
+      channel->queued = 0;
+      apr_thread_mutex_unlock(channel->mutex);
+      if(!batch)
+          continue;
+
+      if(!sock)
+        {
+          apr_pool_create(&pool, channel->pool);
+          sock = create_tcp_client(pool, channel->host, channel->port, NULL, channel->bindaddr, 0);
+          if(!sock)
+            {
+              apr_pool_destroy(pool);
+              tcp_send_channel_requeue(channel, batch);
+              if(!backoff)
+                  err_msg("Unable to connect to tcp_send_channel %s:%d.  Will try again...\n",
+                          channel->host, channel->port);
+              backoff = backoff ? backoff * 2 : TCP_BACKOFF_MIN;
+              if(backoff > TCP_BACKOFF_MAX)
+                  backoff = TCP_BACKOFF_MAX;
+              tcp_send_channel_backoff(channel, backoff);
+              continue;
+            }
+          apr_socket_timeout_set(sock, TCP_SEND_TIMEOUT);
+          apr_socket_opt_set(sock, APR_TCP_NODELAY, 1);
+          apr_socket_opt_set(sock, APR_SO_KEEPALIVE, 1);
+          debug_msg("[tcp] connected to %s:%d", channel->host, channel->port);
+          backoff = 0;
+
+          /* The upstream may have restarted and lost what it knew */
+          apr_thread_mutex_lock(channel->mutex);
+          channel->resync = 1;
+          apr_thread_mutex_unlock(channel->mutex);
+        }
+
+      /* A batch is a pass of the main loop, written at once */
+      while(batch)
+        {
+          Ganglia_tcp_batch *next;
+          apr_size_t len;
+
+          batch = tcp_batch_compress(channel, batch);
+          next = batch->next;
+          len = batch->len;
+
+          if(socket_send_raw(sock, batch->data, &len) != APR_SUCCESS)
+            {
+              tcp_batch_trim(batch, len);
+              break;
+            }
+          free(batch);
+          batch = next;
+        }
+      if(batch)
+        {
+          /* What is left goes again on the next connection */
+          err_msg("Lost the connection to tcp_send_channel %s:%d.\n", channel->host, channel->port);
+          apr_socket_close(sock);
+          apr_pool_destroy(pool);
+          sock = NULL;
+          tcp_send_channel_requeue(channel, batch);
+        }
+    }
+  if(sock)
+    {
+      apr_socket_close(sock);
+      apr_pool_destroy(pool);
+    }
+  apr_thread_mutex_lock(channel->mutex);
+  channel->stopped = 1;
+  apr_thread_mutex_unlock(channel->mutex);
+  apr_thread_exit(thd, APR_SUCCESS);
+
+  return NULL;
+}
+
+/* Asks the thread of a channel a reload dropped to finish; the main
+ * loop frees the channel once it has */
+static void
+tcp_send_channel_stop( Ganglia_tcp_send_channel *channel )
+{
+  apr_thread_mutex_lock(channel->mutex);
+  channel->stopping = 1;
+  apr_thread_cond_signal(channel->cond);
+  apr_thread_mutex_unlock(channel->mutex);
+
+  if(!tcp_send_stopping)
+    tcp_send_stopping = apr_array_make(global_context, 1, sizeof(Ganglia_tcp_send_channel *));
+  *(Ganglia_tcp_send_channel **)apr_array_push(tcp_send_stopping) = channel;
+}
+
+/* Checks a tcp_send_channel section, giving its codec.  Returns -1,
+ * having said why, if it will not do. */
+static int
+tcp_send_channel_check( cfg_t *tcp_send_channel, int *codec )
+{
+  char *host, *compression;
+  int port, queue;
+
+  host  = cfg_getstr( tcp_send_channel, "host");
+  port  = cfg_getint( tcp_send_channel, "port");
+  queue = cfg_getint( tcp_send_channel, "queue");
+
+  debug_msg("tcp_send_channel host=%s port=%d queue=%d",
+            host? host: "NULL", port, queue);
+
+  if(!host || port <= 0)
+    {
+      err_msg("tcp_send_channel needs a host and a port.\n");
+      return -1;
+    }
+
+  /* Room for at least one message */
+  if(queue < 2 * TCP_FRAME_MAX)
+    {
+      err_msg("The queue of tcp_send_channel %s:%d must be at least %d bytes.\n",
+              host, port, 2 * TCP_FRAME_MAX);
+      return -1;
+    }
+
+  /* The receiver tells a codec by its magic number, which the zlib
+   * format of "deflate" lacks */
+  compression = cfg_getstr( tcp_send_channel, "compression");
+  *codec = gm_codec_from_cstr(compression);
+  if(*codec < 0 || *codec == GM_CODEC_DEFLATE)
+    {
+      err_msg("Unknown or unsupported compression '%s' for tcp_send_channel.\n",
+              compression);
+      return -1;
+    }
+  return 0;
+}
+
+/* Sets up the tcp_send_channels and starts their threads.  On a reload a
+ * channel whose section is unchanged keeps its connection and its queue,
+ * and the threads of those that are gone are stopped. */
+static void
+setup_tcp_send_channels( void )
+{
+  int i, num_tcp_send_channels = cfg_size( config_file, "tcp_send_channel");
+  apr_pool_t *ptemp;
+  apr_hash_t *old, *seen;
+  apr_hash_index_t *hi;
+  Ganglia_tcp_send_channel *channel;
+
+  apr_pool_create(&ptemp, global_context);
+  old = apr_hash_make(ptemp);
+  seen = apr_hash_make(ptemp);
+  if(tcp_send_array)
+    {
+      for(i = 0; i < tcp_send_array->nelts; i++)
+        {
+          channel = ((Ganglia_tcp_send_channel **)(tcp_send_array->elts))[i];
+          apr_hash_set(old, channel->key, APR_HASH_KEY_STRING, channel);
+        }
+      tcp_send_array->nelts = 0;
+    }
+  else if(num_tcp_send_channels > 0)
+    {
+      tcp_send_array = apr_array_make(global_context, num_tcp_send_channels,
+                                      sizeof(Ganglia_tcp_send_channel *));
+    }
+
+  for(i = 0; i < num_tcp_send_channels; i++)
+    {
+      cfg_t *tcp_send_channel = cfg_getnsec( config_file, "tcp_send_channel", i);
+      apr_pool_t *pool = NULL;
+      char *host, *key;
+      int codec;
+
+      key = cfg_section_key( "tcp_send_channel", tcp_send_channel, seen, ptemp );
+      if((channel = apr_hash_get(old, key, APR_HASH_KEY_STRING)))
+        {
+          apr_hash_set(old, key, APR_HASH_KEY_STRING, NULL);
+          *(Ganglia_tcp_send_channel **)apr_array_push(tcp_send_array) = channel;
+          continue;
+        }
+
+      /* A reload checks them first, so this exits only at startup */
+      if(tcp_send_channel_check(tcp_send_channel, &codec))
+        {
+          err_msg("Exiting.\n");
+          exit(1);
+        }
+      host = cfg_getstr( tcp_send_channel, "host");
+
+      apr_pool_create(&pool, global_context);
+      channel = apr_pcalloc(pool, sizeof(Ganglia_tcp_send_channel));
+      channel->pool = pool;
+      channel->key = apr_pstrdup(pool, key);
+      channel->host = apr_pstrdup(pool, host);
+      channel->port = cfg_getint( tcp_send_channel, "port");
+      channel->bindaddr = cfg_getstr( tcp_send_channel, "bind");
+      if(channel->bindaddr)
+          channel->bindaddr = apr_pstrdup(pool, channel->bindaddr);
+      channel->max_queue = cfg_getint( tcp_send_channel, "queue");
+      channel->codec = codec;
+      channel->codec_level = cfg_getint( tcp_send_channel, "compression_level");
+
+      if(apr_thread_mutex_create(&(channel->mutex), APR_THREAD_MUTEX_DEFAULT, pool) != APR_SUCCESS ||
+         apr_thread_cond_create(&(channel->cond), pool) != APR_SUCCESS)
+        {
+          err_msg("Failed to create the lock of tcp_send_channel %s:%d. Exiting.\n", host, channel->port);
+          exit(1);
+        }
+
+      *(Ganglia_tcp_send_channel **)apr_array_push(tcp_send_array) = channel;
+
+      if(apr_thread_create(&(channel->thread), NULL, tcp_sender, channel, pool) != APR_SUCCESS)
+        {
+          err_msg("Failed to create TCP sender thread. Exiting.\n");
+          exit(1);
+        }
+    }
+
+  /* The channels whose sections are gone */
+  for(hi = apr_hash_first(ptemp, old); hi; hi = apr_hash_next(hi))
+    {
+      apr_hash_this(hi, NULL, NULL, (void **)&channel);
+      tcp_send_channel_stop(channel);
+    }
+  apr_pool_destroy(ptemp);
+  if(tcp_send_array && !tcp_send_array->nelts)
+    tcp_send_array = NULL;
+}
+
+/* Starts the resolver threads, or starts them again with new settings */
+static void
+setup_resolver( void )
+{
+  apr_hash_index_t *hi;
+  Ganglia_host *host;
+  char *name;
+
+  if(resolver)
+    {
+      gm_resolver_destroy(resolver);
+      apr_pool_destroy(resolver_context);
+      resolver = NULL;
+    }
+  if(resolver_threads <= 0)
+    return;
+
+  apr_pool_create(&resolver_context, global_context);
+  resolver = gm_resolver_create(resolver_context, resolver_threads, resolver_ttl,
+                                resolver_negative_ttl, NULL, NULL);
+  if(!resolver)
+    {
+      err_msg("Failed to create resolver threads. Exiting.\n");
+      exit(1);
+    }
+
+  /* On a reload, what the old threads had queued is asked again */
+  if(!hosts)
+    return;
+  for(hi = apr_hash_first(NULL, hosts); hi; hi = apr_hash_next(hi))
+    {
+      apr_hash_this(hi, NULL, NULL, (void **)&host);
+      if(!strcmp(host->hostname, host->ip))
+        gm_resolver_lookup(resolver, host->ip, &name, host->pool);
+    }
+}
+
+/* The globals a running gmond cannot change: it restarts for them */
+static const char *restart_globals[] = {
+  "daemonize", "setuid", "user", "deaf", "module_dir", NULL
+};
+
+/* Checks what a reload would set up, before anything is changed for it:
+ * the listen channels are checked as they are opened */
+static int
+reload_check( cfg_t *cfg )
+{
+  int i, codec;
+
+  for(i = 0; i < cfg_size( cfg, "tcp_send_channel"); i++)
+    {
+      if(tcp_send_channel_check(cfg_getnsec( cfg, "tcp_send_channel", i), &codec))
+        return -1;
+    }
+  return 0;
+}
+
+/* Reads the configuration again, on SIGHUP, and makes what changed take
+ * effect in place.  The hosts table, the metric modules, and the channels
+ * and collection groups whose sections are unchanged are kept as they
+ * are, so a reload leaves no gap in the data and sets off no burst of
+ * packets.  A configuration that does not parse, or whose channels will
+ * not open, is not used and the old one goes on; a change that cannot be
+ * made in place restarts gmond as SIGHUP used to. */
+static void
+reload_configuration( void )
+{
+  cfg_t *old = config_file, *new, *globals;
+  const char *restart = NULL;
+  apr_pool_t *context = NULL;
+  Ganglia_udp_send_channels channels = NULL;
+  int i, listen_channels;
+
+  debug_msg("reloading the configuration");
+  new = (cfg_t *)Ganglia_gmond_config_reload( args_info.conf_arg, !args_info.conf_given );
+  if(!new)
+    {
+      err_msg("Keeping the old configuration.\n");
+      return;
+    }
+
+  globals = cfg_getsec( new, "globals");
+  for(i = 0; restart_globals[i]; i++)
+    {
+      if(cfg_option_changed( cfg_getsec( old, "globals"), globals, restart_globals[i]))
+        restart = restart_globals[i];
+    }
+  if(cfg_option_changed( old, new, "modules"))
+    restart = "modules";
+  listen_channels = cfg_size( new, "udp_recv_channel") + cfg_size( new, "tcp_recv_channel") +
+                    cfg_size( new, "tcp_accept_channel");
+  if(!deaf && !listen_channels)
+    restart = "the listen channels";
+  if(restart)
+    {
+      err_msg("The configuration of %s changed: restarting.\n", restart);
+      tcp_listener_join();
+      reload_ganglia_configuration();
+    }
+
+  if(cfg_getint( globals, "relay_interval") > 0 && (deaf || !cfg_size( new, "tcp_send_channel")))
+    {
+      err_msg("A relay (relay_interval) must not be deaf and needs a tcp_send_channel. Keeping the old configuration.\n");
+      cfg_free(new);
+      return;
+    }
+  if(deaf && cfg_getbool( globals, "mute"))
+    {
+      err_msg("Configured to run both deaf and mute. Keeping the old configuration.\n");
+      cfg_free(new);
+      return;
+    }
+  if(reload_check(new))
+    {
+      err_msg("Keeping the old configuration.\n");
+      cfg_free(new);
+      return;
+    }
+
+  /* The new channels are opened before anything is changed, so that if
+   * one will not open the old ones are all still there */
+  if(cfg_option_changed( old, new, "udp_send_channel"))
+    {
+      apr_pool_create(&context, global_context);
+      channels = Ganglia_udp_send_channels_reload((Ganglia_pool)context,
+                                                  (Ganglia_gmond_config)new);
+      if(!channels && cfg_size( new, "udp_send_channel"))
+        {
+          err_msg("Keeping the old configuration.\n");
+          apr_pool_destroy(context);
+          cfg_free(new);
+          return;
+        }
+    }
+
+  /* The XML thread reads the configuration, the globals and the
+   * listen channels */
+  tcp_listener_join();
+  if(!deaf && setup_listen_channels_pollset(new))
+    {
+      err_msg("Keeping the old configuration.\n");
+      tcp_listener_start();
+      if(context)
+        apr_pool_destroy(context);
+      cfg_free(new);
+      return;
+    }
+
+  /* The old configuration is not freed: the metric modules were handed
+   * it, and may hold on to it.  Nor are the sections of the listen
+   * channels it dropped, which a later failed reload would open again. */
+  config_file = new;
+  process_globals( config_file );
+  process_allow_extra_data_mode();
+  mute = cfg_getbool( globals, "mute");
+  if(!args_info.location_given)
+    host_location = NULL;
+  clusterinit = 0;
+  cluster_tag = 0;
+#ifdef SFLOW
+  sflow_udp_port = init_sflow(config_file);
+#endif
+
+  /* Turned off, they are not due */
+  if(relay_interval <= 0)
+    next_relay = 0;
+  if(summary_interval <= 0)
+    {
+      next_summary = 0;
+      Ganglia_summary_drop();
+    }
+
+  if(!deaf &&
+     (cfg_option_changed( cfg_getsec( old, "globals"), globals, "resolver_threads") ||
+      cfg_option_changed( cfg_getsec( old, "globals"), globals, "resolver_ttl") ||
+      cfg_option_changed( cfg_getsec( old, "globals"), globals, "resolver_negative_ttl")))
+    setup_resolver();
+
+  if(context)
+    {
+      apr_pool_t *old_context = udp_send_context;
+
+      udp_send_context = context;
+      udp_send_channels = channels;
+      apr_pool_destroy(old_context);
+    }
+  setup_tcp_send_channels();
+  if(!udp_send_channels && (!tcp_send_array || relay_interval > 0))
+    {
+      /* if there are no send channels defined, we are equivalent to mute */
+      mute = 1;
+    }
+  if(!mute)
+    {
+      setup_collection_groups();
+    }
+  Ganglia_metadata_queue_prune();
+
+  tcp_listener_start();
+  debug_msg("reloaded the configuration");
+}
+
 int
 main ( int argc, char *argv[] )
 {
-  apr_time_t now, next_collection, last_cleanup;
+  apr_time_t now, next_collection, next_metadata, last_cleanup;
   apr_pool_t *cleanup_context;
 
   gmond_argv = argv;
@@ -3294,15 +6105,23 @@ main ( int argc, char *argv[] )
   process_deaf_mute_mode();
   process_allow_extra_data_mode();
 
-  if(!deaf)
+  if(!deaf && setup_listen_channels_pollset(config_file))
     {
-      setup_listen_channels_pollset();
+      err_msg("Unable to open the listen channels. Exiting.\n");
+      exit(1);
     }
 
   /* even if mute, a send channel may be needed to send a request for metadata */
-  udp_send_channels = Ganglia_udp_send_channels_create((Ganglia_pool)global_context, 
+  apr_pool_create(&udp_send_context, global_context);
+  udp_send_channels = Ganglia_udp_send_channels_create((Ganglia_pool)udp_send_context,
                                                        (Ganglia_gmond_config)config_file);
-  if(!udp_send_channels)
+  setup_tcp_send_channels();
+  if(relay_interval > 0 && (deaf || !tcp_send_array))
+    {
+      err_msg("A relay (relay_interval) must not be deaf and needs a tcp_send_channel. Exiting.\n");
+      exit(1);
+    }
+  if(!udp_send_channels && (!tcp_send_array || relay_interval > 0))
     {
       /* if there are no send channels defined, we are equivalent to mute */
       mute = 1;
@@ -3322,16 +6141,17 @@ main ( int argc, char *argv[] )
       exit(1);
     }
 
+  /* Start the resolver threads */
+  if(!deaf)
+    {
+      setup_resolver();
+    }
+
   /* Initialize time variables */
   udp_last_heard = last_cleanup = next_collection = now = apr_time_now();
 
   /* Create TCP listener thread */
-  apr_thread_t *thread;
-  if (apr_thread_create(&thread, NULL, tcp_listener, NULL, global_context) != APR_SUCCESS)
-    {
-      err_msg("Failed to create TCP listener thread. Exiting.\n");
-      exit(1);
-    }
+  tcp_listener_start();
 
   /* Loop */
   for(;!done;)
@@ -3349,10 +6169,46 @@ main ( int argc, char *argv[] )
           apr_sleep( wait );
         }
 
-      /* only continue if it's time to process our collection groups */
+      /* name the hosts the resolver threads found names for since the
+       * last turn of the loop */
+      if(resolver)
+          gm_resolver_drain(resolver, Ganglia_host_resolved, NULL);
+
+      /* SIGHUP: read the configuration again */
+      if(reload_required)
+        {
+          reload_required = 0;
+          reload_configuration();
+        }
+
+      /* send what metadata was asked for, as fast as we may */
       now = apr_time_now();
+      next_metadata = mute ? 0 : Ganglia_metadata_bulk_send( now );
+      if(next_metadata && next_metadata < next_collection)
+          next_collection = next_metadata;
+
+      /* relay and summarize the hosts table, each on its own interval */
+      if(relay_interval > 0 && now >= next_relay)
+        {
+          Ganglia_relay_send( cleanup_context, now );
+          next_relay = now + apr_time_from_sec(relay_interval);
+        }
+      if(summary_interval > 0 && !deaf && now >= next_summary)
+        {
+          Ganglia_summary_update( cleanup_context, now );
+          next_summary = now + apr_time_from_sec(summary_interval);
+        }
+      if(next_relay && next_relay < next_collection)
+          next_collection = next_relay;
+      if(next_summary && next_summary < next_collection)
+          next_collection = next_summary;
+
+      /* only continue if it's time to process our collection groups */
       if(now < next_collection)
+        {
+          tcp_send_channels_flush();
           continue;
+        }
 
       if(!deaf)
         {
@@ -3378,16 +6234,22 @@ main ( int argc, char *argv[] )
         {
           /* collect data from collection_groups */
           next_collection = process_collection_groups( now );
+          if(next_metadata && next_metadata < next_collection)
+              next_collection = next_metadata;
         }
       else
         {
           /* we're mute. nothing to collect and send. */
           next_collection = now + 60 * APR_USEC_PER_SEC;
         }
-    }
+      if(next_relay && next_relay < next_collection)
+          next_collection = next_relay;
+      if(next_summary && next_summary < next_collection)
+          next_collection = next_summary;
 
-  if(reload_required == 1)
-    reload_ganglia_configuration();
+      /* what this pass sent goes to the tcp_send_channels at once */
+      tcp_send_channels_flush();
+    }
 
   return 0;
 }
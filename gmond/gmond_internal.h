@@ -50,16 +50,22 @@ struct Ganglia_host {
   unsigned int gmond_started;
   /* The pool used to malloc memory for this host */
   apr_pool_t *pool;
-  /* A hash containing the full metric data from the host */
-  apr_hash_t *metrics;
-  /* A hash containing the last data update from the host */
-  apr_hash_t *gmetrics;
+  /* The metadata and last value of each metric from the host, indexed
+   * by metric id, and how many there is room for */
+  struct Ganglia_metric_slot *slots;
+  int nslots;
   /* First heard from */
   apr_time_t first_heard_from;
   /* Last heard from */
   apr_time_t last_heard_from;
   /* Thread mutex */
   apr_thread_mutex_t *mutex;
+  /* When we found we lacked metadata from this host, 0 if we do not */
+  apr_time_t metadata_wanted;
+  /* When we last asked it for all of its metadata */
+  apr_time_t metadata_asked;
+  /* When a value last came in for a metric we had no metadata for */
+  apr_time_t metadata_missed;
 #ifdef SFLOW
   struct _SFlowAgent *sflow;
 #endif
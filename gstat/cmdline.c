@@ -42,6 +42,7 @@ const char *gengetopt_args_info_help[] = {
   "  -n, --numeric          Print numeric addresses instead of hostnames  \n                           (default=off)",
   "  -i, --gmond_ip=STRING  Specify the ip address of the gmond to query  \n                           (default=`localhost')",
   "  -p, --gmond_port=INT   Specify the gmond port to query  (default=`8649')",
+  "  -c, --cluster=STRING   Ask the gmetad at gmond_ip:gmond_port (its interactive \n                           port) for this cluster, letting it select and \n                           order the hosts",
     0
 };
 
@@ -77,6 +78,7 @@ void clear_given (struct gengetopt_args_info *args_info)
   args_info->numeric_given = 0 ;
   args_info->gmond_ip_given = 0 ;
   args_info->gmond_port_given = 0 ;
+  args_info->cluster_given = 0 ;
 }
 
 static
@@ -93,6 +95,8 @@ void clear_args (struct gengetopt_args_info *args_info)
   args_info->gmond_ip_orig = NULL;
   args_info->gmond_port_arg = 8649;
   args_info->gmond_port_orig = NULL;
+  args_info->cluster_arg = NULL;
+  args_info->cluster_orig = NULL;
   
 }
 
@@ -111,6 +115,7 @@ void init_args_info(struct gengetopt_args_info *args_info)
   args_info->numeric_help = gengetopt_args_info_help[7] ;
   args_info->gmond_ip_help = gengetopt_args_info_help[8] ;
   args_info->gmond_port_help = gengetopt_args_info_help[9] ;
+  args_info->cluster_help = gengetopt_args_info_help[10] ;
   
 }
 
@@ -194,6 +199,8 @@ cmdline_parser_release (struct gengetopt_args_info *args_info)
   free_string_field (&(args_info->gmond_ip_arg));
   free_string_field (&(args_info->gmond_ip_orig));
   free_string_field (&(args_info->gmond_port_orig));
+  free_string_field (&(args_info->cluster_arg));
+  free_string_field (&(args_info->cluster_orig));
   
   
 
@@ -244,6 +251,8 @@ cmdline_parser_dump(FILE *outfile, struct gengetopt_args_info *args_info)
     write_into_file(outfile, "gmond_ip", args_info->gmond_ip_orig, 0);
   if (args_info->gmond_port_given)
     write_into_file(outfile, "gmond_port", args_info->gmond_port_orig, 0);
+  if (args_info->cluster_given)
+    write_into_file(outfile, "cluster", args_info->cluster_orig, 0);
   
 
   i = EXIT_SUCCESS;
@@ -508,10 +517,11 @@ cmdline_parser_internal (
         { "numeric",	0, NULL, 'n' },
         { "gmond_ip",	1, NULL, 'i' },
         { "gmond_port",	1, NULL, 'p' },
+        { "cluster",	1, NULL, 'c' },
         { 0,  0, 0, 0 }
       };
 
-      c = getopt_long (argc, argv, "hVadm1lni:p:", long_options, &option_index);
+      c = getopt_long (argc, argv, "hVadm1lni:p:c:", long_options, &option_index);
 
       if (c == -1) break;	/* Exit from `while (1)' loop.  */
 
@@ -611,6 +621,18 @@ cmdline_parser_internal (
             goto failure;
         
           break;
+        case 'c':	/* Ask the gmetad at gmond_ip:gmond_port (its interactive port) for this cluster, letting it select and order the hosts.  */
+        
+        
+          if (update_arg( (void *)&(args_info->cluster_arg), 
+               &(args_info->cluster_orig), &(args_info->cluster_given),
+              &(local_args_info.cluster_given), optarg, 0, 0, ARG_STRING,
+              check_ambiguity, override, 0, 0,
+              "cluster", 'c',
+              additional_error))
+            goto failure;
+        
+          break;
 
         case 0:	/* Long option with no short option */
         case '?':	/* Invalid option.  */
@@ -57,6 +57,9 @@ struct gengetopt_args_info
   int gmond_port_arg;	/**< @brief Specify the gmond port to query (default='8649').  */
   char * gmond_port_orig;	/**< @brief Specify the gmond port to query original value given at command line.  */
   const char *gmond_port_help; /**< @brief Specify the gmond port to query help description.  */
+  char * cluster_arg;	/**< @brief Ask the gmetad at gmond_ip:gmond_port (its interactive port) for this cluster, letting it select and order the hosts.  */
+  char * cluster_orig;	/**< @brief Ask the gmetad at gmond_ip:gmond_port (its interactive port) for this cluster, letting it select and order the hosts original value given at command line.  */
+  const char *cluster_help; /**< @brief Ask the gmetad at gmond_ip:gmond_port (its interactive port) for this cluster, letting it select and order the hosts help description.  */
   
   unsigned int help_given ;	/**< @brief Whether help was given.  */
   unsigned int version_given ;	/**< @brief Whether version was given.  */
@@ -68,6 +71,7 @@ struct gengetopt_args_info
   unsigned int numeric_given ;	/**< @brief Whether numeric was given.  */
   unsigned int gmond_ip_given ;	/**< @brief Whether gmond_ip was given.  */
   unsigned int gmond_port_given ;	/**< @brief Whether gmond_port was given.  */
+  unsigned int cluster_given ;	/**< @brief Whether cluster was given.  */
 
 } ;
 
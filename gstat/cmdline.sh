@@ -14,6 +14,7 @@ option "list" l "Print ONLY the host list" flag off
 option "numeric" n "Print numeric addresses instead of hostnames" flag off
 option "gmond_ip" i "Specify the ip address of the gmond to query" string default="localhost" no
 option "gmond_port" p "Specify the gmond port to query" int default="8649" no
+option "cluster" c "Ask the gmetad at gmond_ip:gmond_port (its interactive port) for this cluster, letting it select and order the hosts" string no
 
 #Usage (a little tutorial)
 #
@@ -22,12 +22,17 @@ void process_opts( int argc, char **argv );
 
 static int debug_level;
 
+/* The metrics gstat shows, for a gmetad to leave out all others */
+#define GSTAT_METRICS "cpu_num,load_one,load_five,load_fifteen,proc_run," \
+   "proc_total,cpu_user,cpu_nice,cpu_system,cpu_idle,cpu_wio,gexec"
+
 int main(int argc, char *argv[])
 {
    int rval;
    gexec_cluster_t cluster;
    gexec_host_t *host;
    llist_entry *li;
+   char request[1024];
 
    debug_level = 1;
    set_debug_msg_level(debug_level);
@@ -35,7 +40,22 @@ int main(int argc, char *argv[])
    if (cmdline_parser (argc, argv, &args_info) != 0)
       exit(1) ;
 
-   rval = gexec_cluster(&cluster, args_info.gmond_ip_arg, args_info.gmond_port_arg );
+   if( args_info.cluster_given )
+      {
+         /* Let the gmetad pick the metrics, and the gexec hosts if that is
+          * all we print, and hand the live hosts over least loaded first
+          * (sorting leaves out hosts without a load_one). */
+         snprintf(request, sizeof(request), "/%s?metrics=%s%s%s",
+                  args_info.cluster_arg, GSTAT_METRICS,
+                  args_info.dead_flag ? "" : "&bottom=load_one",
+                  (args_info.list_flag || args_info.mpifile_flag)
+                  && !args_info.all_flag && !args_info.dead_flag ?
+                  "&where=gexec:eq:ON" : "");
+         rval = gexec_cluster_query(&cluster, args_info.gmond_ip_arg,
+                                    args_info.gmond_port_arg, request);
+      }
+   else
+      rval = gexec_cluster(&cluster, args_info.gmond_ip_arg, args_info.gmond_port_arg );
    if ( rval != 0)
       {
          printf("Unable to get hostlist from %s %d!\n", args_info.gmond_ip_arg, args_info.gmond_port_arg);
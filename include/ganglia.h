@@ -43,10 +43,14 @@ extern "C" {
 
 Ganglia_gmond_config
 Ganglia_gmond_config_create(char *path, int fallback_to_default);
+Ganglia_gmond_config
+Ganglia_gmond_config_reload(char *path, int fallback_to_default);
 void Ganglia_gmond_config_destroy(Ganglia_gmond_config config);
 
 Ganglia_udp_send_channels
 Ganglia_udp_send_channels_create(Ganglia_pool p, Ganglia_gmond_config config);
+Ganglia_udp_send_channels
+Ganglia_udp_send_channels_reload(Ganglia_pool p, Ganglia_gmond_config config);
 void Ganglia_udp_send_channels_destroy(Ganglia_udp_send_channels channels);
 
 int Ganglia_udp_send_message(Ganglia_udp_send_channels channels, char *buf, int len );
@@ -56,6 +60,7 @@ int Ganglia_metric_set( Ganglia_metric gmetric, char *name, char *value, char *t
 int Ganglia_metric_send( Ganglia_metric gmetric, Ganglia_udp_send_channels send_channels );
 int Ganglia_metadata_send( Ganglia_metric gmetric, Ganglia_udp_send_channels send_channels );
 int Ganglia_metadata_send_real( Ganglia_metric gmetric, Ganglia_udp_send_channels send_channels, char *override_string );
+void Ganglia_metadata_def( Ganglia_metric gmetric, Ganglia_metadatadef *def, char *override_string );
 void Ganglia_metadata_add( Ganglia_metric gmetric, char *name, char *value );
 int Ganglia_value_send( Ganglia_metric gmetric, Ganglia_udp_send_channels send_channels );
 
@@ -48,5 +48,7 @@ gexec_cluster_t;
 
 int gexec_cluster_free ( gexec_cluster_t *cluster );
 int gexec_cluster (gexec_cluster_t *cluster, char *ip, unsigned short port);
+int gexec_cluster_query (gexec_cluster_t *cluster, char *ip, unsigned short port,
+                         const char *request);
 
 #endif
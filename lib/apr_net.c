@@ -160,6 +160,12 @@ create_udp_client(apr_pool_t *context, char *host, apr_port_t port, const char *
   return create_net_client(context, SOCK_DGRAM, host, port, interface, bind_address, bind_hostname);
 }
 
+apr_socket_t *
+create_tcp_client(apr_pool_t *context, char *host, apr_port_t port, const char *interface, char *bind_address, int bind_hostname)
+{
+  return create_net_client(context, SOCK_STREAM, host, port, interface, bind_address, bind_hostname);
+}
+
 static apr_socket_t *
 create_net_server(apr_pool_t *context, int32_t ofamily, int type, apr_port_t port, 
                   char *bind_addr, int blocking)
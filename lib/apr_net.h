@@ -7,6 +7,9 @@
 apr_socket_t *
 create_udp_client(apr_pool_t *context, char *ipaddr, apr_port_t port, const char *interface, char *bind_address, int bind_hostname);
 
+apr_socket_t *
+create_tcp_client(apr_pool_t *context, char *host, apr_port_t port, const char *interface, char *bind_address, int bind_hostname);
+
 apr_socket_t *
 create_udp_server(apr_pool_t *context, int32_t family, apr_port_t port, char *bind);
 
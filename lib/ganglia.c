@@ -15,21 +15,37 @@
 
 int gexec_errno = 0;
 
+/* gmond and gmetad order the attributes differently, so look them up by
+ * name.  Returns "" for a missing attribute. */
+static const char *
+attr_value (const char **attr, const char *name)
+{
+   int n;
+
+   for (n = 0; attr[n]; n += 2)
+      if (! strcmp(attr[n], name))
+         return attr[n+1];
+   return "";
+}
+
 static void
 start (void *data, const char *el, const char **attr)
 {
    int n;
    gexec_cluster_t *cluster = (gexec_cluster_t *)data;
+   const char *name, *ip, *val;
    char *p;
 
    if (! strcmp("CLUSTER", el))
       {
-         strncpy( cluster->name, attr[1], 256 );
-         for(n=0; attr[n] && strcmp(attr[n], "LOCALTIME"); n+=2){}
-         cluster->localtime = atol(attr[n+1]);
+         strncpy( cluster->name, attr_value(attr, "NAME"), 256 );
+         cluster->localtime = atol(attr_value(attr, "LOCALTIME"));
       }
    else if (! strcmp("HOST",el))
       {
+         name = attr_value(attr, "NAME");
+         ip = attr_value(attr, "IP");
+
          cluster->host = (gexec_host_t *)calloc(1, sizeof(gexec_host_t) );
          if ( cluster->host == NULL )
             {
@@ -39,22 +55,22 @@ start (void *data, const char *el, const char **attr)
                return;
             } 
 
-         if(! strcmp( attr[1], attr[3]))
+         if(! strcmp( name, ip))
             {
                /* The IP address did not resolve at all */
                cluster->host->name_resolved = 0;
-               strcpy(cluster->host->name,   attr[1]);
+               strcpy(cluster->host->name,   name);
                strcpy(cluster->host->domain, "unresolved");
             }
          else
             {
                cluster->host->name_resolved = 1;
-               p = strchr( attr[1], '.' );
+               p = strchr( name, '.' );
                if( p )
                   {
                      /* The IP DID resolve AND we have a domainname */
-                     n = p - attr[1];
-                     strncpy(cluster->host->name, attr[1], n);
+                     n = p - name;
+                     strncpy(cluster->host->name, name, n);
                      cluster->host->name[n] = '\0';
                      p++;
                      strncpy(cluster->host->domain, p, GEXEC_HOST_STRING_LEN);
@@ -62,13 +78,13 @@ start (void *data, const char *el, const char **attr)
                else
                   {
                      /* The IP DID resolve BUT we DON'T have a domainname */
-                     strncpy(cluster->host->name, attr[1], GEXEC_HOST_STRING_LEN);
+                     strncpy(cluster->host->name, name, GEXEC_HOST_STRING_LEN);
                      strcpy(cluster->host->domain, "unspecified");
                   }
             }
 
-         strcpy(cluster->host->ip, attr[3]);
-         cluster->host->last_reported = atol(attr[7]);
+         strncpy(cluster->host->ip, ip, sizeof(cluster->host->ip) - 1);
+         cluster->host->last_reported = atol(attr_value(attr, "REPORTED"));
 
          if( abs(cluster->localtime - cluster->host->last_reported) < GEXEC_TIMEOUT )
             {
@@ -81,57 +97,59 @@ start (void *data, const char *el, const char **attr)
       }
    else if (! strcmp("METRIC", el))
       {
-         if( cluster->malloc_error )
+         if( cluster->malloc_error || ! cluster->host )
             {
                return;
             } 
-         if(! strcmp( attr[1], "cpu_num" ))
+         name = attr_value(attr, "NAME");
+         val = attr_value(attr, "VAL");
+         if(! strcmp( name, "cpu_num" ))
             {
-               cluster->host->cpu_num = atoi( attr[3] );
+               cluster->host->cpu_num = atoi( val );
             }
-         else if(! strcmp( attr[1], "load_one" ))
+         else if(! strcmp( name, "load_one" ))
             {
-               cluster->host->load_one = atof( attr[3] );
+               cluster->host->load_one = atof( val );
             }
-         else if(! strcmp( attr[1], "load_five" ))
+         else if(! strcmp( name, "load_five" ))
             {
-               cluster->host->load_five = atof( attr[3] );
+               cluster->host->load_five = atof( val );
             }
-         else if(! strcmp( attr[1], "load_fifteen" ))
+         else if(! strcmp( name, "load_fifteen" ))
             {
-               cluster->host->load_fifteen = atof( attr[3] );
+               cluster->host->load_fifteen = atof( val );
             }
-         else if(! strcmp( attr[1], "proc_run" ))
+         else if(! strcmp( name, "proc_run" ))
             {
-               cluster->host->proc_run = atoi( attr[3] );
+               cluster->host->proc_run = atoi( val );
             }
-         else if(! strcmp( attr[1], "proc_total" ))
+         else if(! strcmp( name, "proc_total" ))
             {
-               cluster->host->proc_total = atoi( attr[3] );
+               cluster->host->proc_total = atoi( val );
             }
-         else if(! strcmp( attr[1], "cpu_user" ))
+         else if(! strcmp( name, "cpu_user" ))
             {
-               cluster->host->cpu_user = atof( attr[3] );
+               cluster->host->cpu_user = atof( val );
             }
-         else if(! strcmp( attr[1], "cpu_nice" ))
+         else if(! strcmp( name, "cpu_nice" ))
             {
-               cluster->host->cpu_nice = atof( attr[3] );
+               cluster->host->cpu_nice = atof( val );
             }
-         else if(! strcmp( attr[1], "cpu_system"))
+         else if(! strcmp( name, "cpu_system"))
             {
-               cluster->host->cpu_system = atof( attr[3] );
+               cluster->host->cpu_system = atof( val );
             }
-         else if(! strcmp( attr[1], "cpu_idle"))
+         else if(! strcmp( name, "cpu_idle"))
             {
-               cluster->host->cpu_idle = atof( attr[3] );
+               cluster->host->cpu_idle = atof( val );
             }
-         else if(! strcmp( attr[1], "cpu_wio"))
+         else if(! strcmp( name, "cpu_wio"))
             {
-               cluster->host->cpu_wio = atof( attr[3] );
+               cluster->host->cpu_wio = atof( val );
             }
-         else if(! strcmp( attr[1], "gexec" ))
+         else if(! strcmp( name, "gexec" ))
             {
-               if(! strcmp( attr[3], "ON" ))
+               if(! strcmp( val, "ON" ))
                   cluster->host->gexec_on = 1;
             }
       }
@@ -251,9 +269,19 @@ cluster_dead_hosts_sort( llist_entry *a, llist_entry *b )
 
 int
 gexec_cluster (gexec_cluster_t *cluster, char *ip, unsigned short port)
+{
+   return gexec_cluster_query(cluster, ip, port, NULL);
+}
+
+/* Like gexec_cluster(), but first sends request, a gmetad interactive
+ * port query, when it is not NULL. */
+int
+gexec_cluster_query (gexec_cluster_t *cluster, char *ip, unsigned short port,
+                     const char *request)
 {
    XML_Parser xml_parser;
    g_tcp_socket *gmond_socket;
+   int rval;
 #if 0
    int gmond_fd;
 #endif
@@ -272,6 +300,22 @@ gexec_cluster (gexec_cluster_t *cluster, char *ip, unsigned short port)
       }
 
    debug_msg("Connected to socket %s:%d", ip, port);
+
+   if (request)
+      {
+         SYS_CALL( rval, write(gmond_socket->sockfd, request, strlen(request)));
+         if (rval != (int) strlen(request))
+            rval = -1;
+         else
+            SYS_CALL( rval, write(gmond_socket->sockfd, "\n", 1));
+         if (rval != 1)
+            {
+               gexec_errno = 8;
+               g_tcp_socket_delete(gmond_socket);
+               return gexec_errno;
+            }
+         debug_msg("Sent request %s", request);
+      }
  
    xml_parser = XML_ParserCreate (NULL);
    if (! xml_parser)
@@ -0,0 +1,512 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LIBLZ4
+#include <lz4frame.h>
+#endif
+
+#include "gm_compress.h"
+
+/* Largest piece of input handed to a codec in one call */
+#define GM_COMPRESS_CHUNK 65536
+
+#ifndef ZSTD_CLEVEL_DEFAULT
+#define ZSTD_CLEVEL_DEFAULT 3
+#endif
+
+struct gm_compressor {
+  gm_codec_t codec;
+  char *out;
+  size_t outsize;
+  z_stream zs;
+#ifdef HAVE_LIBZSTD
+  ZSTD_CStream *zstd;
+#endif
+#ifdef HAVE_LIBLZ4
+  LZ4F_compressionContext_t lz4;
+  LZ4F_preferences_t lz4_prefs;
+  int lz4_started;
+#endif
+};
+
+int
+gm_codec_from_cstr(const char *name)
+{
+  if (!name || !strcasecmp(name, "none"))
+    return GM_CODEC_NONE;
+  if (!strcasecmp(name, "gzip"))
+    return GM_CODEC_GZIP;
+  if (!strcasecmp(name, "deflate"))
+    return GM_CODEC_DEFLATE;
+#ifdef HAVE_LIBZSTD
+  if (!strcasecmp(name, "zstd"))
+    return GM_CODEC_ZSTD;
+#endif
+#ifdef HAVE_LIBLZ4
+  if (!strcasecmp(name, "lz4"))
+    return GM_CODEC_LZ4;
+#endif
+  return -1;
+}
+
+const char *
+gm_codec_to_cstr(gm_codec_t codec)
+{
+  switch (codec)
+    {
+    case GM_CODEC_NONE:
+      return "none";
+    case GM_CODEC_GZIP:
+      return "gzip";
+    case GM_CODEC_ZSTD:
+      return "zstd";
+    case GM_CODEC_LZ4:
+      return "lz4";
+    case GM_CODEC_DEFLATE:
+      return "deflate";
+    }
+  return "unknown";
+}
+
+gm_codec_t
+gm_codec_detect(const char *buf, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)buf;
+
+  /* RFC 1952 section 2.3.1 */
+  if (len > 2 && p[0] == 0x1f && p[1] == 0x8b)
+    return GM_CODEC_GZIP;
+  /* RFC 8878 section 3.1.1 */
+  if (len > 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd)
+    return GM_CODEC_ZSTD;
+  /* LZ4 frame format, magic number 0x184D2204 */
+  if (len > 4 && p[0] == 0x04 && p[1] == 0x22 && p[2] == 0x4d && p[3] == 0x18)
+    return GM_CODEC_LZ4;
+  return GM_CODEC_NONE;
+}
+
+gm_compressor_t *
+gm_compressor_new(gm_codec_t codec, int level)
+{
+  gm_compressor_t *c;
+
+  c = calloc(1, sizeof(*c));
+  if (!c)
+    return NULL;
+  c->codec = codec;
+
+  switch (codec)
+    {
+    case GM_CODEC_GZIP:
+    case GM_CODEC_DEFLATE:
+      if (level == GM_CODEC_DEFAULT_LEVEL)
+        level = Z_DEFAULT_COMPRESSION;
+      /* Yes, 15 + 16 are 2 special magic values documented in zlib.h;
+         15 alone gives the zlib wrapper */
+      if (deflateInit2(&c->zs, level, Z_DEFLATED,
+                       codec == GM_CODEC_GZIP ? 15 + 16 : 15, 8,
+                       Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+          free(c);
+          return NULL;
+        }
+      c->outsize = GM_COMPRESS_CHUNK;
+      break;
+#ifdef HAVE_LIBZSTD
+    case GM_CODEC_ZSTD:
+      c->zstd = ZSTD_createCStream();
+      if (!c->zstd ||
+          ZSTD_isError(ZSTD_initCStream(c->zstd,
+              level == GM_CODEC_DEFAULT_LEVEL ? ZSTD_CLEVEL_DEFAULT : level)))
+        {
+          if (c->zstd)
+            ZSTD_freeCStream(c->zstd);
+          free(c);
+          return NULL;
+        }
+      c->outsize = ZSTD_CStreamOutSize();
+      break;
+#endif
+#ifdef HAVE_LIBLZ4
+    case GM_CODEC_LZ4:
+      if (LZ4F_isError(LZ4F_createCompressionContext(&c->lz4, LZ4F_VERSION)))
+        {
+          free(c);
+          return NULL;
+        }
+      memset(&c->lz4_prefs, 0, sizeof(c->lz4_prefs));
+      c->lz4_prefs.compressionLevel =
+        level == GM_CODEC_DEFAULT_LEVEL ? 0 : level;
+      /* Big enough for one chunk plus the frame header and footer */
+      c->outsize = LZ4F_compressBound(GM_COMPRESS_CHUNK, &c->lz4_prefs) + 32;
+      break;
+#endif
+    default:
+      free(c);
+      return NULL;
+    }
+
+  c->out = malloc(c->outsize);
+  if (!c->out)
+    {
+      gm_compressor_free(c);
+      return NULL;
+    }
+  return c;
+}
+
+static int
+gzip_run(gm_compressor_t *c, int flush, gm_compress_sink_t sink, void *arg)
+{
+  size_t n;
+  int ret;
+
+  do
+    {
+      c->zs.next_out = (Bytef *)c->out;
+      c->zs.avail_out = c->outsize;
+      ret = deflate(&c->zs, flush);
+      if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+        return -1;
+      n = c->outsize - c->zs.avail_out;
+      if (n && sink(arg, c->out, n))
+        return -1;
+    }
+  while (flush == Z_FINISH ? ret != Z_STREAM_END : c->zs.avail_in > 0);
+  return 0;
+}
+
+int
+gm_compressor_write(gm_compressor_t *c, const char *buf, size_t len,
+                    gm_compress_sink_t sink, void *arg)
+{
+  switch (c->codec)
+    {
+    case GM_CODEC_GZIP:
+    case GM_CODEC_DEFLATE:
+      c->zs.next_in = (Bytef *)buf;
+      c->zs.avail_in = len;
+      return gzip_run(c, Z_NO_FLUSH, sink, arg);
+#ifdef HAVE_LIBZSTD
+    case GM_CODEC_ZSTD:
+      {
+        ZSTD_inBuffer in = { buf, len, 0 };
+
+        while (in.pos < in.size)
+          {
+            ZSTD_outBuffer out = { c->out, c->outsize, 0 };
+
+            if (ZSTD_isError(ZSTD_compressStream(c->zstd, &out, &in)))
+              return -1;
+            if (out.pos && sink(arg, c->out, out.pos))
+              return -1;
+          }
+        return 0;
+      }
+#endif
+#ifdef HAVE_LIBLZ4
+    case GM_CODEC_LZ4:
+      {
+        size_t n, chunk;
+
+        if (!c->lz4_started)
+          {
+            n = LZ4F_compressBegin(c->lz4, c->out, c->outsize, &c->lz4_prefs);
+            if (LZ4F_isError(n) || sink(arg, c->out, n))
+              return -1;
+            c->lz4_started = 1;
+          }
+        while (len)
+          {
+            chunk = len > GM_COMPRESS_CHUNK ? GM_COMPRESS_CHUNK : len;
+            n = LZ4F_compressUpdate(c->lz4, c->out, c->outsize, buf, chunk,
+                                    NULL);
+            if (LZ4F_isError(n))
+              return -1;
+            if (n && sink(arg, c->out, n))
+              return -1;
+            buf += chunk;
+            len -= chunk;
+          }
+        return 0;
+      }
+#endif
+    default:
+      break;
+    }
+  return -1;
+}
+
+int
+gm_compressor_finish(gm_compressor_t *c, gm_compress_sink_t sink, void *arg)
+{
+  switch (c->codec)
+    {
+    case GM_CODEC_GZIP:
+    case GM_CODEC_DEFLATE:
+      c->zs.next_in = NULL;
+      c->zs.avail_in = 0;
+      return gzip_run(c, Z_FINISH, sink, arg);
+#ifdef HAVE_LIBZSTD
+    case GM_CODEC_ZSTD:
+      {
+        size_t left;
+
+        do
+          {
+            ZSTD_outBuffer out = { c->out, c->outsize, 0 };
+
+            left = ZSTD_endStream(c->zstd, &out);
+            if (ZSTD_isError(left))
+              return -1;
+            if (out.pos && sink(arg, c->out, out.pos))
+              return -1;
+          }
+        while (left > 0);
+        return 0;
+      }
+#endif
+#ifdef HAVE_LIBLZ4
+    case GM_CODEC_LZ4:
+      {
+        size_t n;
+
+        if (!c->lz4_started && gm_compressor_write(c, "", 0, sink, arg))
+          return -1;
+        n = LZ4F_compressEnd(c->lz4, c->out, c->outsize, NULL);
+        if (LZ4F_isError(n) || sink(arg, c->out, n))
+          return -1;
+        return 0;
+      }
+#endif
+    default:
+      break;
+    }
+  return -1;
+}
+
+void
+gm_compressor_free(gm_compressor_t *c)
+{
+  if (!c)
+    return;
+
+  switch (c->codec)
+    {
+    case GM_CODEC_GZIP:
+    case GM_CODEC_DEFLATE:
+      deflateEnd(&c->zs);
+      break;
+#ifdef HAVE_LIBZSTD
+    case GM_CODEC_ZSTD:
+      ZSTD_freeCStream(c->zstd);
+      break;
+#endif
+#ifdef HAVE_LIBLZ4
+    case GM_CODEC_LZ4:
+      LZ4F_freeCompressionContext(c->lz4);
+      break;
+#endif
+    default:
+      break;
+    }
+  free(c->out);
+  free(c);
+}
+
+/* Doubles the output buffer, keeping room for the trailing NUL, up to
+ * max bytes of output if max is not 0. */
+static int
+grow(char **out, size_t *size, size_t max, const char **err)
+{
+  size_t want = *size * 2;
+  char *p;
+
+  if (max && want > max + 1)
+    want = max + 1;
+  if (want <= *size)
+    {
+      *err = "uncompressed data too large";
+      return -1;
+    }
+  p = realloc(*out, want);
+  if (!p)
+    {
+      *err = "out of memory";
+      return -1;
+    }
+  *out = p;
+  *size = want;
+  return 0;
+}
+
+int
+gm_decompress(gm_codec_t codec, const char *in, size_t inlen,
+              char **out, size_t *outlen, const char **err)
+{
+  return gm_decompress_max(codec, in, inlen, 0, out, outlen, err);
+}
+
+int
+gm_decompress_max(gm_codec_t codec, const char *in, size_t inlen,
+                  size_t max, char **out, size_t *outlen, const char **err)
+{
+  size_t size, used = 0;
+  char *buf;
+
+  *err = NULL;
+
+  /* XML compresses around 10:1; start there and double as needed. */
+  size = inlen * 8 < GM_COMPRESS_CHUNK ? GM_COMPRESS_CHUNK : inlen * 8;
+  if (max && size > max + 1)
+    size = max + 1;
+  buf = malloc(size);
+  if (!buf)
+    {
+      *err = "out of memory";
+      return -1;
+    }
+
+  switch (codec)
+    {
+    case GM_CODEC_GZIP:
+    case GM_CODEC_DEFLATE:
+      {
+        z_stream zs;
+        int ret;
+
+        memset(&zs, 0, sizeof(zs));
+        zs.next_in = (Bytef *)in;
+        zs.avail_in = inlen;
+        /* 15 + 16: max window size and gzip wrapper */
+        if (inflateInit2(&zs, codec == GM_CODEC_GZIP ? 15 + 16 : 15) != Z_OK)
+          {
+            *err = "inflateInit failed";
+            break;
+          }
+        for (;;)
+          {
+            if (used + 1 >= size && grow(&buf, &size, max, err))
+              break;
+            zs.next_out = (Bytef *)(buf + used);
+            zs.avail_out = size - used - 1;
+            ret = inflate(&zs, Z_FINISH);
+            used = zs.total_out;
+            if (ret == Z_STREAM_END)
+              break;
+            if (ret != Z_OK && ret != Z_BUF_ERROR)
+              {
+                *err = zError(ret);
+                break;
+              }
+            if (ret == Z_BUF_ERROR && zs.avail_in == 0)
+              {
+                *err = codec == GM_CODEC_GZIP ? "truncated gzip stream"
+                                              : "truncated deflate stream";
+                break;
+              }
+          }
+        inflateEnd(&zs);
+        break;
+      }
+#ifdef HAVE_LIBZSTD
+    case GM_CODEC_ZSTD:
+      {
+        ZSTD_DStream *ds;
+        ZSTD_inBuffer zin = { in, inlen, 0 };
+        size_t ret = 1;
+
+        ds = ZSTD_createDStream();
+        if (!ds || ZSTD_isError(ZSTD_initDStream(ds)))
+          {
+            *err = "ZSTD_initDStream failed";
+            if (ds)
+              ZSTD_freeDStream(ds);
+            break;
+          }
+        while (ret != 0)
+          {
+            ZSTD_outBuffer zout;
+
+            if (used + 1 >= size && grow(&buf, &size, max, err))
+              break;
+            zout.dst = buf;
+            zout.size = size - 1;
+            zout.pos = used;
+            ret = ZSTD_decompressStream(ds, &zout, &zin);
+            used = zout.pos;
+            if (ZSTD_isError(ret))
+              {
+                *err = ZSTD_getErrorName(ret);
+                break;
+              }
+            if (ret != 0 && zin.pos == zin.size && zout.pos < zout.size)
+              {
+                *err = "truncated zstd stream";
+                break;
+              }
+          }
+        ZSTD_freeDStream(ds);
+        break;
+      }
+#endif
+#ifdef HAVE_LIBLZ4
+    case GM_CODEC_LZ4:
+      {
+        LZ4F_decompressionContext_t dctx;
+        size_t ret = 1, pos = 0, srclen, dstlen;
+
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+          {
+            *err = "LZ4F_createDecompressionContext failed";
+            break;
+          }
+        while (ret != 0)
+          {
+            if (used + 1 >= size && grow(&buf, &size, max, err))
+              break;
+            srclen = inlen - pos;
+            dstlen = size - used - 1;
+            ret = LZ4F_decompress(dctx, buf + used, &dstlen, in + pos, &srclen,
+                                  NULL);
+            if (LZ4F_isError(ret))
+              {
+                *err = LZ4F_getErrorName(ret);
+                break;
+              }
+            pos += srclen;
+            used += dstlen;
+            if (ret != 0 && pos == inlen && dstlen == 0)
+              {
+                *err = "truncated lz4 stream";
+                break;
+              }
+          }
+        LZ4F_freeDecompressionContext(dctx);
+        break;
+      }
+#endif
+    default:
+      *err = "codec not compiled in";
+      break;
+    }
+
+  if (*err)
+    {
+      free(buf);
+      return -1;
+    }
+
+  buf[used] = '\0';
+  *out = buf;
+  *outlen = used;
+  return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef GM_COMPRESS_H
+#define GM_COMPRESS_H 1
+
+#include <stddef.h>
+
+/* Stream compression for the XML dumps gmond and gmetad exchange.
+ * gzip is always available; zstd and lz4 are compiled in when
+ * configure finds them (HAVE_LIBZSTD, HAVE_LIBLZ4).  A receiver tells
+ * the codecs apart by their frame magic, so nothing is negotiated on
+ * the wire. */
+enum gm_codec {
+  GM_CODEC_NONE = 0,
+  GM_CODEC_GZIP,
+  GM_CODEC_ZSTD,
+  GM_CODEC_LZ4,
+  GM_CODEC_DEFLATE  /* zlib format, the HTTP "deflate" content coding */
+};
+typedef enum gm_codec gm_codec_t;
+
+/* Use the codec's own default compression level */
+#define GM_CODEC_DEFAULT_LEVEL -1
+
+typedef struct gm_compressor gm_compressor_t;
+
+/* Receives compressed output.  Returns 0 on success. */
+typedef int (*gm_compress_sink_t)(void *arg, const char *buf, size_t len);
+
+/* Returns the codec for "none", "gzip", "deflate", "zstd" or "lz4", or
+ * -1 if the name is unknown or the codec was not compiled in. */
+int gm_codec_from_cstr(const char *name);
+const char *gm_codec_to_cstr(gm_codec_t codec);
+
+/* Recognizes a compressed stream by its frame magic. */
+gm_codec_t gm_codec_detect(const char *buf, size_t len);
+
+gm_compressor_t *gm_compressor_new(gm_codec_t codec, int level);
+int gm_compressor_write(gm_compressor_t *c, const char *buf, size_t len,
+                        gm_compress_sink_t sink, void *arg);
+int gm_compressor_finish(gm_compressor_t *c, gm_compress_sink_t sink,
+                         void *arg);
+void gm_compressor_free(gm_compressor_t *c);
+
+/* Decompresses a whole stream into a malloc'ed buffer with a trailing
+ * NUL (not counted in *outlen).  Returns 0 on success; on failure *err
+ * points to a static description of the problem. */
+int gm_decompress(gm_codec_t codec, const char *in, size_t inlen,
+                  char **out, size_t *outlen, const char **err);
+/* As gm_decompress(), failing once the output passes max bytes, for
+ * input from peers that are not trusted to be reasonable. */
+int gm_decompress_max(gm_codec_t codec, const char *in, size_t inlen,
+                      size_t max, char **out, size_t *outlen,
+                      const char **err);
+
+#endif /* GM_COMPRESS_H */
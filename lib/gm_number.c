@@ -0,0 +1,353 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <float.h>
+#include <math.h>       /* signbit() only: libganglia does not need libm */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gm_number.h"
+
+/* The shortcuts below need each double operation rounded once, to
+ * double.  Where intermediate results are kept wider (x87), the C
+ * library does everything. */
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#define GM_NUMBER_FAST 1
+#else
+#define GM_NUMBER_FAST 0
+#endif
+
+/* 2^53: every integer below it is a double. */
+#define GM_EXACT_INT 9007199254740992.0
+
+/* The powers of ten that are doubles exactly. */
+static const double pow10_exact[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+#define GM_POW10_MAX 22
+
+/* Room for a sign, the digits of a uint64_t and a decimal point. */
+#define GM_NUMBER_BUF 32
+
+static int
+is_space(int c)
+{
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/* A decimal with at most 19 significant digits is m * 10^e10 with both
+ * exact.  If m is below 2^53 and 10^|e10| a double, one multiplication
+ * or division gives the correctly rounded result (Clinger's fast path).
+ * That covers the values of nearly every metric; the rest, and
+ * hexadecimal, inf and nan, go to strtod(). */
+double
+gm_strtod(const char *s, char **end)
+{
+  const char *p = s;
+  uint64_t m = 0;
+  int digits = 0, any = 0, e10 = 0, exp = 0, eneg = 0;
+  int neg = 0;
+  double v;
+
+  if (!GM_NUMBER_FAST)
+    return strtod(s, end);
+
+  while (is_space(*p))
+    p++;
+  if (*p == '-' || *p == '+')
+    neg = *p++ == '-';
+  if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+    return strtod(s, end);
+
+  for (; *p >= '0' && *p <= '9'; p++)
+    {
+      any = 1;
+      if (!m && *p == '0')
+        continue;
+      if (digits == 19)
+        return strtod(s, end);
+      m = m * 10 + (*p - '0');
+      digits++;
+    }
+  if (*p == '.')
+    {
+      for (p++; *p >= '0' && *p <= '9'; p++)
+        {
+          any = 1;
+          if (!m && *p == '0')
+            {
+              e10--;
+              continue;
+            }
+          if (digits == 19)
+            return strtod(s, end);
+          m = m * 10 + (*p - '0');
+          digits++;
+          e10--;
+        }
+    }
+  if (!any)
+    return strtod(s, end);
+
+  if ((*p == 'e' || *p == 'E')
+      && ((p[1] >= '0' && p[1] <= '9')
+          || ((p[1] == '-' || p[1] == '+') && p[2] >= '0' && p[2] <= '9')))
+    {
+      p++;
+      if (*p == '-' || *p == '+')
+        eneg = *p++ == '-';
+      for (; *p >= '0' && *p <= '9'; p++)
+        if (exp < 10000)
+          exp = exp * 10 + (*p - '0');
+      e10 += eneg ? -exp : exp;
+    }
+
+  if (!m)
+    v = 0.0;
+  else if (m > (UINT64_C(1) << 53) || e10 > GM_POW10_MAX
+           || e10 < -GM_POW10_MAX)
+    return strtod(s, end);
+  else if (e10 < 0)
+    v = (double) m / pow10_exact[-e10];
+  else
+    v = (double) m * pow10_exact[e10];
+
+  if (end)
+    *end = (char *) p;
+  return neg ? -v : v;
+}
+
+/* Rounds a * 10^precision, for a >= 0, to the nearest integer as printf
+ * does from the exact value of a.  The product is within half an ulp of
+ * exact, so only products that close to a tie are left to the C
+ * library.  Returns -1 for those and for anything too large. */
+static int
+scale_round(double a, int precision, uint64_t *n)
+{
+  double scaled, frac;
+
+  if (!GM_NUMBER_FAST || precision < 0 || precision > GM_POW10_MAX)
+    return -1;
+  scaled = a * pow10_exact[precision];
+  if (!(scaled < GM_EXACT_INT))
+    return -1;
+  *n = (uint64_t) scaled;
+  frac = scaled - (double) *n;
+  if (!precision)
+    {
+      /* Exact: ties go to even, as in the default rounding mode. */
+      if (frac > 0.5 || (frac == 0.5 && (*n & 1)))
+        ++*n;
+    }
+  else
+    {
+      if (frac - 0.5 <= scaled * DBL_EPSILON
+          && 0.5 - frac <= scaled * DBL_EPSILON)
+        return -1;
+      if (frac > 0.5)
+        ++*n;
+    }
+  return 0;
+}
+
+/* Writes n / 10^precision with precision decimals to tmp, less trailing
+ * zeros if strip.  Returns the length. */
+static int
+put_fixed(char *tmp, int neg, uint64_t n, int precision, int strip)
+{
+  char digits[GM_NUMBER_BUF];
+  int len = 0, lo = 0, i;
+  char *d = tmp;
+
+  do
+    {
+      digits[len++] = '0' + n % 10;
+      n /= 10;
+    }
+  while (n);
+  while (len < precision + 1)
+    digits[len++] = '0';
+
+  /* The digits are least significant first. */
+  if (neg)
+    *d++ = '-';
+  for (i = len - 1; i >= precision; i--)
+    *d++ = digits[i];
+  if (strip)
+    while (lo < precision && digits[lo] == '0')
+      lo++;
+  if (lo < precision)
+    {
+      *d++ = '.';
+      for (i = precision - 1; i >= lo; i--)
+        *d++ = digits[i];
+    }
+  return d - tmp;
+}
+
+/* Copies out as snprintf() would. */
+static int
+put(char *buf, size_t size, const char *s, int len)
+{
+  size_t n = len;
+
+  if (size)
+    {
+      if (n >= size)
+        n = size - 1;
+      memcpy(buf, s, n);
+      buf[n] = '\0';
+    }
+  return len;
+}
+
+static int
+fixed(char *buf, size_t size, double v, int precision)
+{
+  char tmp[GM_NUMBER_BUF];
+  uint64_t n;
+
+  if (precision < 0)
+    precision = 6;
+  if (precision > 17 || scale_round(v < 0 ? -v : v, precision, &n))
+    return -1;
+  return put(buf, size, tmp, put_fixed(tmp, signbit(v), n, precision, 0));
+}
+
+/* %g with P significant digits is %f with P - 1 - X decimals and no
+ * trailing zeros, where X is the decimal exponent of the rounded value,
+ * when -4 <= X < P; otherwise it is the exponent form, which we leave
+ * to the C library. */
+static int
+general(char *buf, size_t size, double v, int precision)
+{
+  char tmp[GM_NUMBER_BUF];
+  double a = v < 0 ? -v : v;
+  uint64_t n;
+  int x, tries;
+
+  if (precision < 0)
+    precision = 6;
+  if (!precision)
+    precision = 1;
+  if (precision > 15 || !GM_NUMBER_FAST)
+    return -1;
+  if (a == 0.0)
+    return put(buf, size, signbit(v) ? "-0" : "0", signbit(v) ? 2 : 1);
+  if (!(a <= DBL_MAX))
+    return -1;
+
+  /* A first guess at the decimal exponent. */
+  x = 0;
+  if (a >= 1.0)
+    while (x < precision && a >= pow10_exact[x + 1])
+      x++;
+  else
+    do
+      x--;
+    while (x > -5 && a * pow10_exact[-x] < 1.0);
+
+  for (tries = 0; tries < 3; tries++)
+    {
+      if (x < -4 || x >= precision
+          || scale_round(a, precision - 1 - x, &n))
+        return -1;
+      /* The guess may be off by one near a power of ten, and rounding
+       * may carry into the next. */
+      if ((double) n >= pow10_exact[precision])
+        x++;
+      else if ((double) n < pow10_exact[precision - 1])
+        x--;
+      else
+        return put(buf, size, tmp,
+                   put_fixed(tmp, signbit(v), n, precision - 1 - x, 1));
+    }
+  return -1;
+}
+
+int
+gm_format_fixed(char *buf, size_t size, double v, int precision)
+{
+  int len = fixed(buf, size, v, precision);
+
+  return len >= 0 ? len : snprintf(buf, size, "%.*f", precision, v);
+}
+
+int
+gm_format_general(char *buf, size_t size, double v, int precision)
+{
+  int len = general(buf, size, v, precision);
+
+  return len >= 0 ? len : snprintf(buf, size, "%.*g", precision, v);
+}
+
+int
+gm_format_int(char *buf, size_t size, const char *fmt, int v)
+{
+  char tmp[GM_NUMBER_BUF];
+  unsigned int u;
+  int half = 0, neg = 0, len = 0, i;
+  char c;
+
+  if (!fmt || fmt[0] != '%')
+    return -1;
+  fmt++;
+  if (*fmt == 'h')
+    {
+      half = 1;
+      fmt++;
+    }
+  c = *fmt++;
+  if (*fmt || (c != 'd' && c != 'i' && c != 'u'))
+    return -1;
+
+  if (c == 'u')
+    u = half ? (unsigned short) v : (unsigned int) v;
+  else
+    {
+      if (half)
+        v = (short) v;
+      neg = v < 0;
+      u = neg ? 0u - (unsigned int) v : (unsigned int) v;
+    }
+
+  do
+    {
+      tmp[sizeof(tmp) - 1 - len++] = '0' + u % 10;
+      u /= 10;
+    }
+  while (u);
+  if (neg)
+    tmp[sizeof(tmp) - 1 - len++] = '-';
+  for (i = 0; i < len; i++)
+    tmp[i] = tmp[sizeof(tmp) - len + i];
+  return put(buf, size, tmp, len);
+}
+
+int
+gm_format_double(char *buf, size_t size, const char *fmt, double v)
+{
+  int precision = 6;
+
+  if (!fmt || fmt[0] != '%')
+    return -1;
+  fmt++;
+  if (*fmt == '.')
+    {
+      fmt++;
+      precision = 0;
+      if (*fmt >= '0' && *fmt <= '9')
+        precision = *fmt++ - '0';
+      if (*fmt >= '0' && *fmt <= '9')
+        precision = precision * 10 + (*fmt++ - '0');
+    }
+  if (fmt[0] == 'f' && !fmt[1])
+    return fixed(buf, size, v, precision);
+  if (fmt[0] == 'g' && !fmt[1])
+    return general(buf, size, v, precision);
+  return -1;
+}
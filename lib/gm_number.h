@@ -0,0 +1,28 @@
+#ifndef GM_NUMBER_H
+#define GM_NUMBER_H 1
+
+#include <stddef.h>
+
+/* Number conversions for metric values, which gmond and gmetad read and
+ * write millions of times a minute.  The common cases (short decimals,
+ * plain %d and %.Nf formats) are done here without the locale and
+ * varargs machinery of the C library, with the same results; anything
+ * else is left to the C library. */
+
+/* As strtod() in the C locale. */
+double gm_strtod(const char *s, char **end);
+
+/* As snprintf(buf, size, "%.*f", precision, v) and
+ * snprintf(buf, size, "%.*g", precision, v). */
+int gm_format_fixed(char *buf, size_t size, double v, int precision);
+int gm_format_general(char *buf, size_t size, double v, int precision);
+
+/* As snprintf(buf, size, fmt, v) for a metric format of a single
+ * conversion: %d, %i, %u, %hd or %hu for gm_format_int(), and %f, %.Nf,
+ * %g or %.Ng for gm_format_double().  Return -1 for any other format, or
+ * a value they leave to the C library, so the caller can use its own
+ * printf instead. */
+int gm_format_int(char *buf, size_t size, const char *fmt, int v);
+int gm_format_double(char *buf, size_t size, const char *fmt, double v);
+
+#endif /* GM_NUMBER_H */
@@ -51,6 +51,21 @@ struct Ganglia_metadatareq {
   struct Ganglia_metric_id metric_id;
 };
 
+/* Asks the gmond sending as host for the metadata of all of its
+** metrics at once, which it answers with gmetadata_bulk packets.
+*/
+struct Ganglia_metadatareq_host {
+  string host<>;
+};
+
+/* As many metadata definitions as fit in one datagram.  more is
+** false in the last packet of an answer to gmetadata_request_host.
+*/
+struct Ganglia_metadata_bulk {
+  bool more;
+  struct Ganglia_metadatadef defs<>;
+};
+
 struct Ganglia_gmetric_ushort {
   struct Ganglia_metric_id metric_id;
   string fmt<>;
@@ -108,7 +123,9 @@ enum Ganglia_msg_formats {
    gmetric_string,
    gmetric_float,
    gmetric_double,
-   gmetadata_request
+   gmetadata_request,
+   gmetadata_request_host,
+   gmetadata_bulk
 };
 
 union Ganglia_metadata_msg switch (Ganglia_msg_formats id) {
@@ -116,6 +133,10 @@ union Ganglia_metadata_msg switch (Ganglia_msg_formats id) {
     Ganglia_metadatadef gfull;
   case gmetadata_request:
     Ganglia_metadatareq grequest;
+  case gmetadata_request_host:
+    Ganglia_metadatareq_host grequest_host;
+  case gmetadata_bulk:
+    Ganglia_metadata_bulk gbulk;
 
   default:
     void;
@@ -0,0 +1,256 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <apr_hash.h>
+#include <apr_network_io.h>
+#include <apr_strings.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
+
+#include "gm_resolver.h"
+
+/* An address is queued, then done (resolved, waiting to be drained),
+ * then cached until it expires. */
+enum gm_resolver_state {
+  GM_RESOLVER_QUEUED,
+  GM_RESOLVER_DONE,
+  GM_RESOLVER_CACHED
+};
+
+typedef struct gm_resolver_entry gm_resolver_entry;
+struct gm_resolver_entry {
+  char *ip;
+  char *name;                   /* NULL if it did not resolve */
+  apr_time_t expires;
+  enum gm_resolver_state state;
+  gm_resolver_entry *next;      /* in the queue or the done list */
+};
+
+typedef struct {
+  gm_resolver_t *r;
+  apr_pool_t *pool;
+  apr_thread_t *thread;
+} gm_resolver_worker;
+
+struct gm_resolver {
+  apr_thread_mutex_t *mutex;
+  apr_thread_cond_t *cond;
+  apr_hash_t *cache;            /* ip -> gm_resolver_entry, malloc'ed */
+  gm_resolver_entry *head, *tail;
+  gm_resolver_entry *done;
+  gm_resolver_worker *workers;
+  int nworkers;
+  apr_interval_time_t ttl, negative_ttl;
+  apr_time_t next_prune;
+  gm_resolver_lookup_t lookup;
+  void *arg;
+  int stopping;
+};
+
+static int
+system_lookup(void *arg, const char *ip, char **name, apr_pool_t *pool)
+{
+  apr_sockaddr_t *sa;
+
+  if (apr_sockaddr_info_get(&sa, ip, APR_UNSPEC, 0, 0, pool) != APR_SUCCESS)
+    return -1;
+  /* With no flags this asks for a name (NI_NAMEREQD), never the
+   * address back */
+  return apr_getnameinfo(name, sa, 0) == APR_SUCCESS ? 0 : -1;
+}
+
+static void * APR_THREAD_FUNC
+resolver_thread(apr_thread_t *thd, void *data)
+{
+  gm_resolver_worker *w = data;
+  gm_resolver_t *r = w->r;
+  gm_resolver_entry *e;
+  char *name;
+  int rc;
+
+  apr_thread_mutex_lock(r->mutex);
+  for (;;)
+    {
+      while (!r->head && !r->stopping)
+        apr_thread_cond_wait(r->cond, r->mutex);
+      if (r->stopping)
+        break;
+      e = r->head;
+      r->head = e->next;
+      if (!r->head)
+        r->tail = NULL;
+      apr_thread_mutex_unlock(r->mutex);
+
+      /* The entry stays in the cache, queued, so nobody frees it */
+      name = NULL;
+      rc = r->lookup(r->arg, e->ip, &name, w->pool);
+      name = rc || !name || !strcmp(name, e->ip) ? NULL : strdup(name);
+      apr_pool_clear(w->pool);
+
+      apr_thread_mutex_lock(r->mutex);
+      e->name = name;
+      e->expires = apr_time_now() + (name ? r->ttl : r->negative_ttl);
+      e->state = GM_RESOLVER_DONE;
+      e->next = r->done;
+      r->done = e;
+    }
+  apr_thread_mutex_unlock(r->mutex);
+  apr_thread_exit(thd, APR_SUCCESS);
+  return NULL;
+}
+
+gm_resolver_t *
+gm_resolver_create(apr_pool_t *pool, int threads, int ttl, int negative_ttl,
+                   gm_resolver_lookup_t lookup, void *arg)
+{
+  gm_resolver_t *r;
+  int i;
+
+  if (threads < 1)
+    return NULL;
+  r = apr_pcalloc(pool, sizeof(*r));
+  if (apr_thread_mutex_create(&r->mutex, APR_THREAD_MUTEX_DEFAULT, pool) != APR_SUCCESS ||
+      apr_thread_cond_create(&r->cond, pool) != APR_SUCCESS)
+    return NULL;
+  r->cache = apr_hash_make(pool);
+  r->ttl = apr_time_from_sec(ttl);
+  r->negative_ttl = apr_time_from_sec(negative_ttl);
+  r->lookup = lookup ? lookup : system_lookup;
+  r->arg = arg;
+
+  /* The workers' pools are made here: pools are not thread safe, not
+   * even for making subpools */
+  r->workers = apr_pcalloc(pool, threads * sizeof(*r->workers));
+  for (i = 0; i < threads; i++)
+    {
+      gm_resolver_worker *w = &r->workers[i];
+
+      w->r = r;
+      if (apr_pool_create(&w->pool, pool) != APR_SUCCESS ||
+          apr_thread_create(&w->thread, NULL, resolver_thread, w, pool) != APR_SUCCESS)
+        {
+          gm_resolver_destroy(r);
+          return NULL;
+        }
+      r->nworkers++;
+    }
+  return r;
+}
+
+int
+gm_resolver_lookup(gm_resolver_t *r, const char *ip, char **name,
+                   apr_pool_t *pool)
+{
+  gm_resolver_entry *e;
+  int found = 0;
+
+  apr_thread_mutex_lock(r->mutex);
+  e = apr_hash_get(r->cache, ip, APR_HASH_KEY_STRING);
+  if (!e)
+    {
+      e = calloc(1, sizeof(*e));
+      if (!e || !(e->ip = strdup(ip)))
+        {
+          free(e);
+          apr_thread_mutex_unlock(r->mutex);
+          return 0;
+        }
+      apr_hash_set(r->cache, e->ip, APR_HASH_KEY_STRING, e);
+      e->state = GM_RESOLVER_CACHED;
+    }
+
+  if (e->state == GM_RESOLVER_CACHED && e->expires <= apr_time_now())
+    {
+      /* New, or time to ask again */
+      free(e->name);
+      e->name = NULL;
+      e->state = GM_RESOLVER_QUEUED;
+      e->next = NULL;
+      if (r->tail)
+        r->tail->next = e;
+      else
+        r->head = e;
+      r->tail = e;
+      apr_thread_cond_signal(r->cond);
+    }
+  else if (e->state != GM_RESOLVER_QUEUED && e->name)
+    {
+      *name = apr_pstrdup(pool, e->name);
+      found = 1;
+    }
+  apr_thread_mutex_unlock(r->mutex);
+  return found;
+}
+
+int
+gm_resolver_drain(gm_resolver_t *r, gm_resolver_result_t result, void *arg)
+{
+  gm_resolver_entry *e;
+  apr_hash_index_t *hi;
+  apr_time_t now = apr_time_now();
+  int n = 0;
+
+  apr_thread_mutex_lock(r->mutex);
+  for (e = r->done; e; e = e->next)
+    {
+      e->state = GM_RESOLVER_CACHED;
+      if (e->name)
+        {
+          result(arg, e->ip, e->name);
+          n++;
+        }
+    }
+  r->done = NULL;
+
+  if (now >= r->next_prune)
+    {
+      for (hi = apr_hash_first(NULL, r->cache); hi; hi = apr_hash_next(hi))
+        {
+          apr_hash_this(hi, NULL, NULL, (void **)&e);
+          if (e->state == GM_RESOLVER_CACHED && e->expires <= now)
+            {
+              /* Deleting the current entry is safe while iterating */
+              apr_hash_set(r->cache, e->ip, APR_HASH_KEY_STRING, NULL);
+              free(e->ip);
+              free(e->name);
+              free(e);
+            }
+        }
+      r->next_prune = now + (r->negative_ttl < r->ttl ? r->negative_ttl : r->ttl);
+    }
+  apr_thread_mutex_unlock(r->mutex);
+  return n;
+}
+
+void
+gm_resolver_destroy(gm_resolver_t *r)
+{
+  apr_hash_index_t *hi;
+  gm_resolver_entry *e;
+  apr_status_t rv;
+  int i;
+
+  if (!r)
+    return;
+  apr_thread_mutex_lock(r->mutex);
+  r->stopping = 1;
+  apr_thread_cond_broadcast(r->cond);
+  apr_thread_mutex_unlock(r->mutex);
+  for (i = 0; i < r->nworkers; i++)
+    apr_thread_join(&rv, r->workers[i].thread);
+
+  for (hi = apr_hash_first(NULL, r->cache); hi; hi = apr_hash_next(hi))
+    {
+      apr_hash_this(hi, NULL, NULL, (void **)&e);
+      apr_hash_set(r->cache, e->ip, APR_HASH_KEY_STRING, NULL);
+      free(e->ip);
+      free(e->name);
+      free(e);
+    }
+  r->head = r->tail = r->done = NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef GM_RESOLVER_H
+#define GM_RESOLVER_H 1
+
+#include <apr_pools.h>
+#include <apr_time.h>
+
+/* Reverse DNS off the caller's thread.  A lookup answers from the cache
+ * or queues the address for a pool of resolver threads and returns at
+ * once; the answers are collected later with gm_resolver_drain().  Both
+ * names and failures are kept for their TTL, so an address that does
+ * not resolve is not asked about again on every packet. */
+typedef struct gm_resolver gm_resolver_t;
+
+/* Finds the name of ip and allocates it in pool.  Returns 0 on success.
+ * Called on the resolver threads, so it must be thread safe. */
+typedef int (*gm_resolver_lookup_t)(void *arg, const char *ip, char **name,
+                                    apr_pool_t *pool);
+
+/* Receives an address that has resolved since the last drain. */
+typedef void (*gm_resolver_result_t)(void *arg, const char *ip,
+                                     const char *name);
+
+/* Starts threads resolver threads.  A NULL lookup uses the system
+ * resolver (apr_getnameinfo()); a test can pass its own.  ttl and
+ * negative_ttl are in seconds.  Returns NULL on failure. */
+gm_resolver_t *gm_resolver_create(apr_pool_t *pool, int threads, int ttl,
+                                  int negative_ttl, gm_resolver_lookup_t lookup,
+                                  void *arg);
+
+/* Copies the cached name of ip to pool and returns 1 if there is one.
+ * Otherwise returns 0 and, unless ip is already waiting or is known not
+ * to resolve, queues it. */
+int gm_resolver_lookup(gm_resolver_t *r, const char *ip, char **name,
+                       apr_pool_t *pool);
+
+/* Hands each name resolved since the last call to result, on the
+ * caller's thread, and forgets expired entries.  result is called with
+ * the resolver locked, so it must not look anything up.  Returns the
+ * number handed over. */
+int gm_resolver_drain(gm_resolver_t *r, gm_resolver_result_t result,
+                      void *arg);
+
+/* Stops the threads, dropping whatever is still queued. */
+void gm_resolver_destroy(gm_resolver_t *r);
+
+#endif /* GM_RESOLVER_H */
@@ -26,6 +26,12 @@ typedef enum ganglia_scoreboard_types ganglia_scoreboard_types;
 #define PKTS_SENT_VALUE "gmond_pkts_sent_value"
 #define PKTS_SENT_REQUEST "gmond_pkts_sent_request"
 #define PKTS_SENT_FAILED "gmond_pkts_sent_failed"
+#define PKTS_RECVD_BULK "gmond_pkts_recvd_bulk"
+#define PKTS_SENT_BULK "gmond_pkts_sent_bulk"
+#define PKTS_REQUEST_LIMITED "gmond_pkts_request_limited"
+#define HOSTS_METADATA_WANTED "gmond_hosts_metadata_wanted"
+#define METADATA_RECOVERY_SECS "gmond_metadata_recovery_secs"
+#define PKTS_SENT_RELAY "gmond_pkts_sent_relay"
 
 /* The scoreboard is only enabled when --enable-status is set on configure */
 #ifdef GSTATUS
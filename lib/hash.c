@@ -362,6 +362,73 @@ hash_lookup (datum_t *key, hash_t * hash)
   return NULL;
 }
 
+/* Copies the value stored under key into buf, or as much of it as fits
+ * in size bytes, for callers that would only copy a lookup's datum and
+ * free it.  Returns the size of the value, or -1 if key is not in the
+ * hash. */
+int
+hash_fetch (datum_t *key, hash_t * hash, void *buf, size_t size)
+{
+  size_t i;
+  int rval;
+  bucket_t *bucket;
+
+  i = hashval(key, hash);
+
+  READ_LOCK(hash, i);
+
+  for (bucket = hash->node[i]->bucket; bucket != NULL; bucket = bucket->next)
+    {
+      if ( key->size != bucket->key->size )
+         continue;
+
+      if (! hash_keycmp( hash, key, bucket->key))
+         {
+            rval = bucket->val->size;
+            memcpy(buf, bucket->val->data,
+                   bucket->val->size < size ? bucket->val->size : size);
+            READ_UNLOCK(hash, i);
+            return rval;
+         }
+    }
+
+  READ_UNLOCK(hash, i);
+  return -1;
+}
+
+/* Calls func on the value stored under key, in place and under the
+ * bucket's write lock, so a caller can change it without the copies of a
+ * lookup and an insert.  Returns what func returns, or -1 if key is not
+ * in the hash. */
+int
+hash_update (datum_t *key, hash_t * hash,
+             int (*func)(datum_t *key, datum_t *val, void *), void *arg)
+{
+  size_t i;
+  int rval;
+  bucket_t *bucket;
+
+  i = hashval(key, hash);
+
+  WRITE_LOCK(hash, i);
+
+  for (bucket = hash->node[i]->bucket; bucket != NULL; bucket = bucket->next)
+    {
+      if ( key->size != bucket->key->size )
+         continue;
+
+      if (! hash_keycmp( hash, key, bucket->key))
+         {
+            rval = func(bucket->key, bucket->val, arg);
+            WRITE_UNLOCK(hash, i);
+            return rval;
+         }
+    }
+
+  WRITE_UNLOCK(hash, i);
+  return -1;
+}
+
 datum_t *
 hash_delete (datum_t *key, hash_t * hash)
 {
@@ -55,6 +55,8 @@ datum_t *hash_insert (datum_t *key, datum_t *val, hash_t *hash);
 datum_t *hash_delete (datum_t *key, hash_t *hash);
 
 datum_t *hash_lookup (datum_t *key, hash_t *hash);
+int      hash_fetch  (datum_t *key, hash_t *hash, void *buf, size_t size);
+int hash_update (datum_t *key, hash_t *hash, int (*func)(datum_t *key, datum_t *val, void *), void *arg);
 int hash_foreach (hash_t *hash, int (*func)(datum_t *key, datum_t *val, void *), void *arg);
 int hash_walkfrom (hash_t *hash, size_t from, int (*func)(datum_t *key, datum_t *val, void *), void *arg);
 
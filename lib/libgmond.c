@@ -65,6 +65,15 @@ static cfg_opt_t globals_opts[] = {
   CFG_INT("cleanup_threshold", 300, CFGF_NONE),
   CFG_BOOL("gexec", 0, CFGF_NONE),
   CFG_INT("send_metadata_interval", 0, CFGF_NONE),
+  CFG_INT("collection_phase_spread", 0, CFGF_NONE),
+  CFG_BOOL("metadata_bulk", 0, CFGF_NONE),
+  CFG_INT("metadata_request_rate", 0, CFGF_NONE),
+  CFG_INT("metadata_response_rate", 100, CFGF_NONE),
+  CFG_INT("relay_interval", 0, CFGF_NONE),
+  CFG_INT("summary_interval", 0, CFGF_NONE),
+  CFG_INT("resolver_threads", 4, CFGF_NONE),
+  CFG_INT("resolver_ttl", 3600, CFGF_NONE),
+  CFG_INT("resolver_negative_ttl", 300, CFGF_NONE),
   CFG_STR("module_dir", NULL, CFGF_NONE),
   CFG_STR("override_hostname", NULL, CFGF_NONE),
   CFG_STR("override_ip", NULL, CFGF_NONE),
@@ -115,6 +124,29 @@ static cfg_opt_t tcp_accept_channel_opts[] = {
   CFG_SEC("acl", acl_opts, CFGF_NONE),
   CFG_INT("timeout", -1, CFGF_NONE),
   CFG_STR("family", "inet4", CFGF_NONE),
+  CFG_BOOL("compact_xml", 0, CFGF_NONE),
+  CFG_STR("compression", NULL, CFGF_NONE),
+  CFG_INT("compression_level", -1, CFGF_NONE),
+  CFG_END()
+};
+
+static cfg_opt_t tcp_send_channel_opts[] = {
+  CFG_STR("host", NULL, CFGF_NONE ),
+  CFG_INT("port", -1, CFGF_NONE ),
+  CFG_STR("bind", NULL, CFGF_NONE),
+  CFG_INT("queue", 1048576, CFGF_NONE),
+  CFG_STR("compression", NULL, CFGF_NONE),
+  CFG_INT("compression_level", -1, CFGF_NONE),
+  CFG_END()
+};
+
+static cfg_opt_t tcp_recv_channel_opts[] = {
+  CFG_STR("bind", NULL, CFGF_NONE ),
+  CFG_INT("port", -1, CFGF_NONE ),
+  CFG_STR("interface", NULL, CFGF_NONE),
+  CFG_SEC("acl", acl_opts, CFGF_NONE),
+  CFG_STR("family", "inet4", CFGF_NONE),
+  CFG_INT("max_connections", 1024, CFGF_NONE),
   CFG_END()
 };
 
@@ -184,6 +216,8 @@ static cfg_opt_t gmond_opts[] = {
   CFG_SEC("udp_send_channel", udp_send_channel_opts, CFGF_MULTI),
   CFG_SEC("udp_recv_channel", udp_recv_channel_opts, CFGF_MULTI),
   CFG_SEC("tcp_accept_channel", tcp_accept_channel_opts, CFGF_MULTI),
+  CFG_SEC("tcp_send_channel", tcp_send_channel_opts, CFGF_MULTI),
+  CFG_SEC("tcp_recv_channel", tcp_recv_channel_opts, CFGF_MULTI),
   CFG_SEC("collection_group",  collection_group_opts, CFGF_MULTI),
   CFG_FUNC("include", Ganglia_cfg_include),
   CFG_SEC("modules",  metric_modules_opts, CFGF_NONE),
@@ -259,8 +293,11 @@ Ganglia_pool_destroy( Ganglia_pool pool )
   apr_pool_destroy((apr_pool_t*)pool);
 }
 
-Ganglia_gmond_config
-Ganglia_gmond_config_create(char *path, int fallback_to_default)
+/* Parses the configuration file.  If fatal, a file that will not do
+ * ends the program as it always has; otherwise the error is reported and
+ * NULL returned. */
+static cfg_t *
+gmond_config_parse(char *path, int fallback_to_default, int fatal)
 {
   cfg_t *config = NULL;
   /* Make sure we process ~ in the filename if the shell doesn't */
@@ -275,7 +312,9 @@ Ganglia_gmond_config_create(char *path, int fallback_to_default)
       if(!fallback_to_default)
         {
           /* Don't fallback to the default configuration.. just exit. */
-          exit(1);
+          if(fatal)
+            exit(1);
+          goto error;
         }
       /* .. otherwise use our default configuration */
       if(cfg_parse_buf(config, default_gmond_configuration) == CFG_PARSE_ERROR)
@@ -286,7 +325,9 @@ Ganglia_gmond_config_create(char *path, int fallback_to_default)
       break;
     case CFG_PARSE_ERROR:
       err_msg("Parse error for '%s'\n", tilde_expanded );
-      exit(1);
+      if(fatal)
+        exit(1);
+      goto error;
     case CFG_SUCCESS:
       break;
     default:
@@ -296,6 +337,19 @@ Ganglia_gmond_config_create(char *path, int fallback_to_default)
 
   if(tilde_expanded)
     free(tilde_expanded);
+  return config;
+
+ error:
+  cfg_free(config);
+  if(tilde_expanded)
+    free(tilde_expanded);
+  return NULL;
+}
+
+Ganglia_gmond_config
+Ganglia_gmond_config_create(char *path, int fallback_to_default)
+{
+  cfg_t *config = gmond_config_parse(path, fallback_to_default, 1);
 
 #if 0
   atexit(cleanup_configuration_file);
@@ -303,8 +357,18 @@ Ganglia_gmond_config_create(char *path, int fallback_to_default)
   return (Ganglia_gmond_config)config;
 }
 
-Ganglia_udp_send_channels
-Ganglia_udp_send_channels_create( Ganglia_pool p, Ganglia_gmond_config config )
+/* For a gmond reading its configuration again, which goes on with the
+ * old one if the new one will not do */
+Ganglia_gmond_config
+Ganglia_gmond_config_reload(char *path, int fallback_to_default)
+{
+  return (Ganglia_gmond_config)gmond_config_parse(path, fallback_to_default, 0);
+}
+
+/* Opens the udp_send_channels.  If one will not open, exits if fatal
+ * is set, or else returns NULL, having said why. */
+static Ganglia_udp_send_channels
+udp_send_channels_open( Ganglia_pool p, Ganglia_gmond_config config, int fatal )
 {
   apr_array_header_t *send_channels = NULL;
   cfg_t *cfg=(cfg_t *)config;
@@ -346,7 +410,9 @@ Ganglia_udp_send_channels_create( Ganglia_pool p, Ganglia_gmond_config config )
       if(bind_address != NULL && bind_hostname == cfg_true)
         {
           err_msg("udp_send_channel: bind and bind_hostname are mutually exclusive, both parameters can't be specified for the same udp_send_channel\n");
-          exit(1);
+          if(fatal)
+            exit(1);
+          return NULL;
         }
 
       /* Create a subpool */
@@ -359,9 +425,11 @@ Ganglia_udp_send_channels_create( Ganglia_pool p, Ganglia_gmond_config config )
           socket = create_mcast_client(pool, mcast_join, port, ttl, mcast_if, bind_address, bind_hostname);
           if(!socket)
             {
-              err_msg("Unable to join multicast channel %s:%d. Exiting\n",
-                  mcast_join, port);
-              exit(1);
+              err_msg("Unable to join multicast channel %s:%d.%s\n",
+                  mcast_join, port, fatal ? " Exiting" : "");
+              if(fatal)
+                exit(1);
+              return NULL;
             }
         }
       else
@@ -370,9 +438,11 @@ Ganglia_udp_send_channels_create( Ganglia_pool p, Ganglia_gmond_config config )
           socket = create_udp_client( pool, host, port, mcast_if, bind_address, bind_hostname );
           if(!socket)
             {
-              err_msg("Unable to create UDP client for %s:%d. Exiting.\n",
-                      host? host: "NULL", port);
-              exit(1);
+              err_msg("Unable to create UDP client for %s:%d.%s\n",
+                      host? host: "NULL", port, fatal ? " Exiting." : "");
+              if(fatal)
+                exit(1);
+              return NULL;
             }
         }
 
@@ -383,6 +453,21 @@ Ganglia_udp_send_channels_create( Ganglia_pool p, Ganglia_gmond_config config )
   return (Ganglia_udp_send_channels)send_channels;
 }
 
+Ganglia_udp_send_channels
+Ganglia_udp_send_channels_create( Ganglia_pool p, Ganglia_gmond_config config )
+{
+  return udp_send_channels_open(p, config, 1);
+}
+
+/* For a gmond reading its configuration again: NULL if a channel will
+ * not open, as well as if there are none.  The sockets opened are left
+ * to the pool. */
+Ganglia_udp_send_channels
+Ganglia_udp_send_channels_reload( Ganglia_pool p, Ganglia_gmond_config config )
+{
+  return udp_send_channels_open(p, config, 0);
+}
+
 
 /* This function will send a datagram to every udp_send_channel specified */
 int
@@ -447,10 +532,32 @@ Ganglia_metadata_send( Ganglia_metric gmetric, Ganglia_udp_send_channels send_ch
 int
 Ganglia_metadata_send_real( Ganglia_metric gmetric, Ganglia_udp_send_channels send_channels, char *override_string )
 {
-  int len, i;
+  int len;
   XDR x;
   char gmetricmsg[GANGLIA_MAX_MESSAGE_LEN];
   Ganglia_metadata_msg msg;
+
+  msg.id = gmetadata_full;
+  Ganglia_metadata_def( gmetric, &(msg.Ganglia_metadata_msg_u.gfull), override_string );
+
+  /* Send the message */
+  xdrmem_create(&x, gmetricmsg, GANGLIA_MAX_MESSAGE_LEN, XDR_ENCODE);
+  if(!xdr_Ganglia_metadata_msg(&x, &msg))
+    {
+      return 1;
+    }
+  len = xdr_getpos(&x); 
+  /* Send the encoded data along...*/
+  return Ganglia_udp_send_message( send_channels, gmetricmsg, len);
+}
+
+/* Fills in the metadata definition of gmetric that gmetadata_full and
+ * gmetadata_bulk packets carry.  The strings are allocated from the
+ * metric's pool. */
+void
+Ganglia_metadata_def( Ganglia_metric gmetric, Ganglia_metadatadef *def, char *override_string )
+{
+  int i;
   const apr_array_header_t *arr;
   const apr_table_entry_t *elts;
   const char *spoof = SPOOF;
@@ -459,27 +566,26 @@ Ganglia_metadata_send_real( Ganglia_metric gmetric, Ganglia_udp_send_channels se
   if (myhost[0] == '\0') 
       apr_gethostname( (char*)myhost, APRMAXHOSTLEN+1, gm_pool);
 
-  msg.id = gmetadata_full;
-  memcpy( &(msg.Ganglia_metadata_msg_u.gfull.metric), gmetric->msg, sizeof(Ganglia_metadata_message));
-  msg.Ganglia_metadata_msg_u.gfull.metric_id.name = apr_pstrdup (gm_pool, gmetric->msg->name);
-  debug_msg("  msg.Ganglia_metadata_msg_u.gfull.metric_id.name: %s\n", msg.Ganglia_metadata_msg_u.gfull.metric_id.name);
+  memcpy( &(def->metric), gmetric->msg, sizeof(Ganglia_metadata_message));
+  def->metric_id.name = apr_pstrdup (gm_pool, gmetric->msg->name);
+  debug_msg("  def->metric_id.name: %s\n", def->metric_id.name);
   if ( override_string != NULL )
     {
-      msg.Ganglia_metadata_msg_u.gfull.metric_id.host = apr_pstrdup (gm_pool, (char*)override_string);
-      debug_msg("  msg.Ganglia_metadata_msg_u.gfull.metric_id.host: %s\n", msg.Ganglia_metadata_msg_u.gfull.metric_id.host);
-      msg.Ganglia_metadata_msg_u.gfull.metric_id.spoof = TRUE;
+      def->metric_id.host = apr_pstrdup (gm_pool, (char*)override_string);
+      debug_msg("  def->metric_id.host: %s\n", def->metric_id.host);
+      def->metric_id.spoof = TRUE;
     }
     else
     {
-      msg.Ganglia_metadata_msg_u.gfull.metric_id.host = apr_pstrdup (gm_pool, (char*)myhost);
-      debug_msg("  msg.Ganglia_metadata_msg_u.gfull.metric_id.host: %s\n", msg.Ganglia_metadata_msg_u.gfull.metric_id.host);
-      msg.Ganglia_metadata_msg_u.gfull.metric_id.spoof = FALSE;
+      def->metric_id.host = apr_pstrdup (gm_pool, (char*)myhost);
+      debug_msg("  def->metric_id.host: %s\n", def->metric_id.host);
+      def->metric_id.spoof = FALSE;
     }
 
   arr = apr_table_elts(gmetric->extra);
   elts = (const apr_table_entry_t *)arr->elts;
-  msg.Ganglia_metadata_msg_u.gfull.metric.metadata.metadata_len = arr->nelts;
-  msg.Ganglia_metadata_msg_u.gfull.metric.metadata.metadata_val = 
+  def->metric.metadata.metadata_len = arr->nelts;
+  def->metric.metadata.metadata_val = 
       (Ganglia_extra_data*)apr_pcalloc(gm_pool, sizeof(Ganglia_extra_data)*arr->nelts);
 
   /* add all of the metadata to the packet */
@@ -490,31 +596,21 @@ Ganglia_metadata_send_real( Ganglia_metric gmetric, Ganglia_udp_send_channels se
       /* Replace the host name with the spoof host if it exists in the metadata */
       if ((apr_toupper(elts[i].key[0]) == spoof[0]) && strcasecmp(SPOOF_HOST, elts[i].key) == 0) 
         {
-          msg.Ganglia_metadata_msg_u.gfull.metric_id.host = apr_pstrdup (gm_pool, elts[i].val);
-          msg.Ganglia_metadata_msg_u.gfull.metric_id.spoof = TRUE;
+          def->metric_id.host = apr_pstrdup (gm_pool, elts[i].val);
+          def->metric_id.spoof = TRUE;
         }
       if ((apr_toupper(elts[i].key[0]) == spoof[0]) && strcasecmp(SPOOF_HEARTBEAT, elts[i].key) == 0) 
         {
-          msg.Ganglia_metadata_msg_u.gfull.metric_id.name = apr_pstrdup (gm_pool, "heartbeat");
-          msg.Ganglia_metadata_msg_u.gfull.metric.name = msg.Ganglia_metadata_msg_u.gfull.metric_id.name;
-          msg.Ganglia_metadata_msg_u.gfull.metric_id.spoof = TRUE;
+          def->metric_id.name = apr_pstrdup (gm_pool, "heartbeat");
+          def->metric.name = def->metric_id.name;
+          def->metric_id.spoof = TRUE;
         }
 
-      msg.Ganglia_metadata_msg_u.gfull.metric.metadata.metadata_val[i].name = 
+      def->metric.metadata.metadata_val[i].name = 
           apr_pstrdup(gm_pool, elts[i].key);
-      msg.Ganglia_metadata_msg_u.gfull.metric.metadata.metadata_val[i].data = 
+      def->metric.metadata.metadata_val[i].data = 
           apr_pstrdup(gm_pool, elts[i].val);
   }
-
-  /* Send the message */
-  xdrmem_create(&x, gmetricmsg, GANGLIA_MAX_MESSAGE_LEN, XDR_ENCODE);
-  if(!xdr_Ganglia_metadata_msg(&x, &msg))
-    {
-      return 1;
-    }
-  len = xdr_getpos(&x); 
-  /* Send the encoded data along...*/
-  return Ganglia_udp_send_message( send_channels, gmetricmsg, len);
 }
 
 int
@@ -121,8 +121,8 @@ llist_print(llist_entry **llist)
 }
    
 
-int
-llist_sort(llist_entry *llist, int (*compare_function)(llist_entry *, llist_entry *))
+static void
+llist_sort_swap(llist_entry *llist, int (*compare_function)(llist_entry *, llist_entry *))
 {
     llist_entry     *lle1, *lle2;
     void            *tmp_val;
@@ -136,6 +136,62 @@ llist_sort(llist_entry *llist, int (*compare_function)(llist_entry *, llist_entr
             }
         }
     }
-    return 0;
 }
 
+/* llist_sort: orders the values of llist so that compare_function never
+ * returns 1 for an entry and one after it.  This is a bottom-up merge sort
+ * over an array of the entries, O(n log n) rather than the O(n^2) of
+ * swapping pairs; entries keep their place and their values move.  Falls
+ * back to the pairwise swap if the arrays cannot be allocated. */
+int
+llist_sort(llist_entry *llist, int (*compare_function)(llist_entry *, llist_entry *))
+{
+    llist_entry     *ei, **a, **b, **t;
+    void            **vals;
+    size_t          n, i, k, l, r, width, lo, mid, hi;
+
+    for (n = 0, ei = llist; ei != NULL; ei = ei->next)
+        n++;
+    if (n < 2)
+        return 0;
+
+    a = malloc(n * sizeof(*a));
+    b = malloc(n * sizeof(*b));
+    vals = malloc(n * sizeof(*vals));
+    if (a == NULL || b == NULL || vals == NULL) {
+        free(a);
+        free(b);
+        free(vals);
+        llist_sort_swap(llist, compare_function);
+        return 0;
+    }
+
+    for (i = 0, ei = llist; ei != NULL; ei = ei->next)
+        a[i++] = ei;
+
+    for (width = 1; width < n; width *= 2) {
+        for (lo = 0; lo < n; lo += 2 * width) {
+            mid = lo + width < n ? lo + width : n;
+            hi = lo + 2 * width < n ? lo + 2 * width : n;
+            for (k = l = lo, r = mid; k < hi; k++) {
+                if (l < mid && (r >= hi || compare_function(a[l], a[r]) != 1))
+                    b[k] = a[l++];
+                else
+                    b[k] = a[r++];
+            }
+        }
+        t = a;
+        a = b;
+        b = t;
+    }
+
+    for (i = 0; i < n; i++)
+        vals[i] = a[i]->val;
+    for (i = 0, ei = llist; ei != NULL; ei = ei->next)
+        ei->val = vals[i++];
+
+    free(a);
+    free(b);
+    free(vals);
+    return 0;
+}
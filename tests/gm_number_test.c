@@ -0,0 +1,290 @@
+/* Checks the number conversions of lib/gm_number.c against the C
+ * library they stand in for: each must give the same result, to the
+ * byte, for fixed and general formats, strtod() and the ties in
+ * between.  Then times both over the same inputs and reports how much
+ * faster ours are; the timings never fail the test, since they depend
+ * on the machine and what else it is doing. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "gm_number.h"
+
+static int failures;
+
+/* A fixed sequence, so a failure can be run again. */
+static uint64_t seed = 88172645463325252ULL;
+
+static uint64_t
+next_random(void)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return seed;
+}
+
+static void
+check_strtod(const char *s)
+{
+  char *end, *gm_end;
+  double want, got;
+
+  want = strtod(s, &end);
+  got = gm_strtod(s, &gm_end);
+  if (memcmp(&want, &got, sizeof(want)) || end != gm_end)
+    {
+      printf("gm_strtod(\"%s\") = %.17g, ends at %d; strtod gives %.17g, "
+             "ends at %d\n", s, got, (int) (gm_end - s), want,
+             (int) (end - s));
+      failures++;
+    }
+}
+
+static void
+check_fixed(double v, int precision)
+{
+  char want[512], got[512];
+  int want_len, got_len;
+
+  want_len = snprintf(want, sizeof(want), "%.*f", precision, v);
+  got_len = gm_format_fixed(got, sizeof(got), v, precision);
+  if (strcmp(want, got) || want_len != got_len)
+    {
+      printf("gm_format_fixed(%.17g, %d) = \"%s\"; snprintf gives \"%s\"\n",
+             v, precision, got, want);
+      failures++;
+    }
+}
+
+static void
+check_general(double v, int precision)
+{
+  char want[512], got[512];
+  int want_len, got_len;
+
+  want_len = snprintf(want, sizeof(want), "%.*g", precision, v);
+  got_len = gm_format_general(got, sizeof(got), v, precision);
+  if (strcmp(want, got) || want_len != got_len)
+    {
+      printf("gm_format_general(%.17g, %d) = \"%s\"; snprintf gives "
+             "\"%s\"\n", v, precision, got, want);
+      failures++;
+    }
+}
+
+static void
+check_format_int(const char *fmt, int v)
+{
+  char want[64], got[64];
+  int len;
+
+  snprintf(want, sizeof(want), fmt, v);
+  len = gm_format_int(got, sizeof(got), fmt, v);
+  if (len < 0 || strcmp(want, got) || len != (int) strlen(want))
+    {
+      printf("gm_format_int(\"%s\", %d) = \"%s\"; snprintf gives \"%s\"\n",
+             fmt, v, len < 0 ? "(refused)" : got, want);
+      failures++;
+    }
+}
+
+static void
+check_format_double(const char *fmt, double v)
+{
+  char want[512], got[512];
+  int len;
+
+  snprintf(want, sizeof(want), fmt, v);
+  len = gm_format_double(got, sizeof(got), fmt, v);
+  /* -1 leaves the value to the C library, which is always right. */
+  if (len >= 0 && (strcmp(want, got) || len != (int) strlen(want)))
+    {
+      printf("gm_format_double(\"%s\", %.17g) = \"%s\"; snprintf gives "
+             "\"%s\"\n", fmt, v, got, want);
+      failures++;
+    }
+}
+
+/* A short decimal, as gmond sends them. */
+static void
+random_decimal(char *buf, size_t size)
+{
+  uint64_t r = next_random();
+  int whole = r % 8, frac = (r >> 3) % 8, i;
+  char *p = buf;
+
+  if (r >> 6 & 1)
+    *p++ = '-';
+  for (i = 0; i <= whole; i++)
+    *p++ = '0' + (next_random() % 10);
+  if (frac)
+    {
+      *p++ = '.';
+      for (i = 0; i < frac; i++)
+        *p++ = '0' + (next_random() % 10);
+    }
+  if (!(r >> 7 & 7))
+    p += snprintf(p, size - (p - buf), "e%d", (int) ((r >> 10) % 61) - 30);
+  *p = '\0';
+}
+
+#define TIMED_INPUTS 10000
+#define TIMED_ROUNDS 20
+
+static char timed_strings[TIMED_INPUTS][64];
+static double timed_values[TIMED_INPUTS];
+static int timed_ints[TIMED_INPUTS];
+/* Keeps the compiler from dropping the conversions we time. */
+static volatile double sink;
+
+static double
+now_ns(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1e9 + tv.tv_usec * 1e3;
+}
+
+/* Runs expr for each input i, TIMED_ROUNDS times, and gives the mean
+ * time of one run in ns. */
+#define TIME_EACH(ns, expr) \
+  do \
+    { \
+      double start_ = now_ns(), sum_ = 0; \
+      int round_; \
+      for (round_ = 0; round_ < TIMED_ROUNDS; round_++) \
+        for (i = 0; i < TIMED_INPUTS; i++) \
+          sum_ += (expr); \
+      sink = sum_; \
+      ns = (now_ns() - start_) / ((double) TIMED_ROUNDS * TIMED_INPUTS); \
+    } \
+  while (0)
+
+static void
+report(const char *what, double libc_ns, double gm_ns)
+{
+  printf("%-28s libc %7.1f ns  gm %7.1f ns  %5.2fx\n", what, libc_ns, gm_ns,
+         gm_ns > 0 ? libc_ns / gm_ns : 0);
+}
+
+/* Times our conversions and the C library's over the same short
+ * decimals, as gmond sends them, and ints. */
+static void
+time_conversions(void)
+{
+  char out[512], *end;
+  double libc_ns, gm_ns;
+  int i;
+
+  for (i = 0; i < TIMED_INPUTS; i++)
+    {
+      random_decimal(timed_strings[i], sizeof(timed_strings[i]));
+      timed_values[i] = strtod(timed_strings[i], NULL);
+      timed_ints[i] = (int) (next_random() >> 40) - (1 << 23);
+    }
+
+  TIME_EACH(libc_ns, strtod(timed_strings[i], &end));
+  TIME_EACH(gm_ns, gm_strtod(timed_strings[i], &end));
+  report("gm_strtod", libc_ns, gm_ns);
+
+  TIME_EACH(libc_ns, snprintf(out, sizeof(out), "%.*f", 2, timed_values[i]));
+  TIME_EACH(gm_ns, gm_format_fixed(out, sizeof(out), timed_values[i], 2));
+  report("gm_format_fixed %.2f", libc_ns, gm_ns);
+
+  TIME_EACH(libc_ns, snprintf(out, sizeof(out), "%.*g", 6, timed_values[i]));
+  TIME_EACH(gm_ns, gm_format_general(out, sizeof(out), timed_values[i], 6));
+  report("gm_format_general %.6g", libc_ns, gm_ns);
+
+  TIME_EACH(libc_ns, snprintf(out, sizeof(out), "%d", timed_ints[i]));
+  TIME_EACH(gm_ns, gm_format_int(out, sizeof(out), "%d", timed_ints[i]));
+  report("gm_format_int %d", libc_ns, gm_ns);
+
+  TIME_EACH(libc_ns, snprintf(out, sizeof(out), "%.3f", timed_values[i]));
+  TIME_EACH(gm_ns, gm_format_double(out, sizeof(out), "%.3f", timed_values[i]));
+  report("gm_format_double %.3f", libc_ns, gm_ns);
+}
+
+int
+main(void)
+{
+  static const char *strings[] = {
+    "0", "-0", "1", "0.1", "0.5", "1.5", "100", "3.14159", "  42",
+    "+7.25", "1e3", "1E-3", "2.5e", "1e+", ".5", "5.", ".", "-", "",
+    "abc", "12abc", "0x1p3", "inf", "-nan", "123456789012345678",
+    "1234567890123456789", "12345678901234567890", "9007199254740993",
+    "0.000000000000000000001", "1e22", "1e23", "1e-22", "1e-23",
+    "179769313486231570000000000000000000000000000000000000000000000",
+    "4.9e-324", "2.2250738585072014e-308", "0.30000000000000004",
+    "00000000000000000000000001.5", "1.00000000000000000000000001"
+  };
+  /* Exact ties in binary, and values printf rounds from just either
+   * side of a decimal tie. */
+  static const double ties[] = {
+    0.5, 1.5, 2.5, 3.5, -0.5, -2.5, 0.125, 0.375, 2.675, 1.005, 0.15,
+    0.25, 0.35, 1.45, 1e15 + 0.5, 4503599627370495.5, 0.0, -0.0,
+    9.5, 99.5, 999.95, 0.0001, 0.00001, 123456.5, 1e-5, 9.9999995
+  };
+  static const char *int_formats[] = { "%d", "%i", "%u", "%hd", "%hu" };
+  static const char *double_formats[] = {
+    "%f", "%.0f", "%.1f", "%.2f", "%.3f", "%.10f", "%g", "%.1g", "%.3g",
+    "%.6g", "%.15g"
+  };
+  static const int ints[] = { 0, 1, -1, 42, -42, 32767, 32768, -32768,
+                              65535, 65536, 2147483647, -2147483647 - 1 };
+  char buf[64];
+  double v;
+  size_t i, j;
+  int k, p;
+
+  for (i = 0; i < sizeof(strings) / sizeof(strings[0]); i++)
+    check_strtod(strings[i]);
+  for (k = 0; k < 200000; k++)
+    {
+      random_decimal(buf, sizeof(buf));
+      check_strtod(buf);
+    }
+
+  for (i = 0; i < sizeof(ties) / sizeof(ties[0]); i++)
+    for (p = 0; p <= 17; p++)
+      {
+        check_fixed(ties[i], p);
+        check_general(ties[i], p);
+      }
+  for (k = 0; k < 200000; k++)
+    {
+      random_decimal(buf, sizeof(buf));
+      v = strtod(buf, NULL);
+      p = next_random() % 18;
+      check_fixed(v, p);
+      check_general(v, p);
+      /* Halfway between two values of two decimals. */
+      check_fixed(((int64_t) (v * 100) + 0.5) / 100, 2);
+    }
+
+  for (i = 0; i < sizeof(int_formats) / sizeof(int_formats[0]); i++)
+    for (j = 0; j < sizeof(ints) / sizeof(ints[0]); j++)
+      check_format_int(int_formats[i], ints[j]);
+  for (i = 0; i < sizeof(double_formats) / sizeof(double_formats[0]); i++)
+    {
+      for (j = 0; j < sizeof(ties) / sizeof(ties[0]); j++)
+        check_format_double(double_formats[i], ties[j]);
+      for (k = 0; k < 10000; k++)
+        {
+          random_decimal(buf, sizeof(buf));
+          check_format_double(double_formats[i], strtod(buf, NULL));
+        }
+    }
+
+  if (failures)
+    {
+      printf("%d failures\n", failures);
+      return 1;
+    }
+
+  time_conversions();
+  return 0;
+}
@@ -0,0 +1,207 @@
+/* Checks lib/gm_resolver.c with a stub in place of DNS: lookups of an
+ * address already on its way are not made twice, names and failures are
+ * cached for their TTLs, and drain hands over each name once and lets
+ * expired entries go. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <apr_general.h>
+#include <apr_pools.h>
+#include <apr_strings.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_mutex.h>
+#include <apr_time.h>
+
+#include "gm_resolver.h"
+
+#define ADDRESSES 32
+
+static apr_thread_mutex_t *mutex;
+static apr_thread_cond_t *cond;
+static int gate_open = 1;
+static int calls[ADDRESSES];
+static int drained[ADDRESSES];
+static int failures;
+
+#define CHECK(ok, ...) \
+  do \
+    { \
+      if (!(ok)) \
+        { \
+          printf("line %d: ", __LINE__); \
+          printf(__VA_ARGS__); \
+          printf("\n"); \
+          failures++; \
+        } \
+    } \
+  while (0)
+
+/* 10.0.0.n is hostn, except that those ending in 7 do not resolve and
+ * 10.0.0.9 gives its address back, which is no name either.  Holds
+ * every lookup while the gate is shut. */
+static int
+stub_lookup(void *arg, const char *ip, char **name, apr_pool_t *pool)
+{
+  int n = atoi(strrchr(ip, '.') + 1);
+
+  apr_thread_mutex_lock(mutex);
+  while (!gate_open)
+    apr_thread_cond_wait(cond, mutex);
+  calls[n]++;
+  apr_thread_mutex_unlock(mutex);
+
+  if (n % 10 == 7)
+    return -1;
+  *name = n == 9 ? apr_pstrdup(pool, ip) : apr_psprintf(pool, "host%d", n);
+  return 0;
+}
+
+static void
+gate(int open)
+{
+  apr_thread_mutex_lock(mutex);
+  gate_open = open;
+  apr_thread_cond_broadcast(cond);
+  apr_thread_mutex_unlock(mutex);
+}
+
+static int
+calls_of(int n)
+{
+  int c;
+
+  apr_thread_mutex_lock(mutex);
+  c = calls[n];
+  apr_thread_mutex_unlock(mutex);
+  return c;
+}
+
+static void
+result(void *arg, const char *ip, const char *name)
+{
+  int n = atoi(strrchr(ip, '.') + 1);
+  char want[32];
+
+  snprintf(want, sizeof(want), "host%d", n);
+  CHECK(!strcmp(name, want), "%s drained as %s", ip, name);
+  drained[n]++;
+}
+
+static int
+lookup(gm_resolver_t *r, int n, char **name, apr_pool_t *pool)
+{
+  char ip[32];
+
+  snprintf(ip, sizeof(ip), "10.0.0.%d", n);
+  return gm_resolver_lookup(r, ip, name, pool);
+}
+
+/* Waits up to five seconds for address n to have been looked up
+ * count times, then a little more for the answer, and drains. */
+static void
+settle(gm_resolver_t *r, int n, int count)
+{
+  int i;
+
+  for (i = 0; i < 5000 && calls_of(n) < count; i++)
+    apr_sleep(apr_time_from_msec(1));
+  apr_sleep(apr_time_from_msec(20));
+  gm_resolver_drain(r, result, NULL);
+}
+
+int
+main(void)
+{
+  apr_pool_t *pool;
+  gm_resolver_t *r;
+  char *name;
+  int i, hits;
+
+  apr_initialize();
+  apr_pool_create(&pool, NULL);
+  apr_thread_mutex_create(&mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+  apr_thread_cond_create(&cond, pool);
+
+  r = gm_resolver_create(pool, 4, 1, 1, stub_lookup, NULL);
+  if (!r)
+    {
+      printf("gm_resolver_create failed\n");
+      return 1;
+    }
+
+  /* An address asked for again while its lookup is on the way is not
+   * looked up again */
+  gate(0);
+  for (i = 0; i < 100; i++)
+    CHECK(!lookup(r, 1, &name, pool), "10.0.0.1 answered before it resolved");
+  CHECK(gm_resolver_drain(r, result, NULL) == 0, "drained a name still being looked up");
+  gate(1);
+  settle(r, 1, 1);
+  CHECK(calls_of(1) == 1, "10.0.0.1 looked up %d times", calls_of(1));
+  CHECK(drained[1] == 1, "10.0.0.1 drained %d times", drained[1]);
+
+  /* Then it answers from the cache */
+  name = NULL;
+  CHECK(lookup(r, 1, &name, pool) && name && !strcmp(name, "host1"),
+        "10.0.0.1 is not cached as host1");
+  CHECK(calls_of(1) == 1, "the cached 10.0.0.1 was looked up again");
+  CHECK(gm_resolver_drain(r, result, NULL) == 0, "10.0.0.1 was drained twice");
+
+  /* Failures are cached too, and never drained; an address for a name
+   * is a failure */
+  CHECK(!lookup(r, 7, &name, pool), "10.0.0.7 resolved");
+  CHECK(!lookup(r, 9, &name, pool), "10.0.0.9 resolved");
+  settle(r, 7, 1);
+  settle(r, 9, 1);
+  for (i = 0; i < 10; i++)
+    {
+      CHECK(!lookup(r, 7, &name, pool), "10.0.0.7 resolved");
+      CHECK(!lookup(r, 9, &name, pool), "10.0.0.9 resolved");
+    }
+  apr_sleep(apr_time_from_msec(50));
+  CHECK(calls_of(7) == 1, "10.0.0.7 looked up %d times within its negative TTL", calls_of(7));
+  CHECK(calls_of(9) == 1, "10.0.0.9 looked up %d times within its negative TTL", calls_of(9));
+  CHECK(!drained[7] && !drained[9], "a failure was drained");
+
+  /* Past the TTLs the drain forgets them all, and each is looked up
+   * again */
+  apr_sleep(apr_time_from_msec(1100));
+  gm_resolver_drain(r, result, NULL);
+  CHECK(!lookup(r, 1, &name, pool), "10.0.0.1 answered past its TTL");
+  CHECK(!lookup(r, 7, &name, pool), "10.0.0.7 resolved");
+  settle(r, 1, 2);
+  settle(r, 7, 2);
+  CHECK(calls_of(1) == 2, "10.0.0.1 looked up %d times after its TTL", calls_of(1));
+  CHECK(calls_of(7) == 2, "10.0.0.7 looked up %d times after its TTL", calls_of(7));
+  CHECK(drained[1] == 2, "10.0.0.1 drained %d times after its TTL", drained[1]);
+
+  /* Many at once: each resolves once and drains once */
+  for (hits = 0, i = 10; i < ADDRESSES; i++)
+    hits += lookup(r, i, &name, pool);
+  CHECK(!hits, "%d new addresses answered at once", hits);
+  settle(r, ADDRESSES - 1, 1);
+  for (i = 10; i < ADDRESSES; i++)
+    settle(r, i, 1);
+  for (i = 10; i < ADDRESSES; i++)
+    {
+      CHECK(calls_of(i) == 1, "10.0.0.%d looked up %d times", i, calls_of(i));
+      CHECK(drained[i] == (i % 10 != 7), "10.0.0.%d drained %d times", i, drained[i]);
+    }
+
+  /* Destroying drops what is still queued */
+  gate(0);
+  for (i = 0; i < 6; i++)
+    lookup(r, i + 2, &name, pool);
+  gate(1);
+  gm_resolver_destroy(r);
+
+  apr_pool_destroy(pool);
+  apr_terminate();
+  if (failures)
+    {
+      printf("%d failures\n", failures);
+      return 1;
+    }
+  return 0;
+}